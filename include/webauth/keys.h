@@ -86,6 +86,13 @@ struct webauth_keyring_entry {
  */
 struct webauth_keyring {
     WA_APR_ARRAY_HEADER_T *entries;
+
+    /*
+     * Internal index of the keys sorted by valid_after, maintained by the
+     * keyring functions.  Do not modify entries directly, or this index will
+     * become stale; use webauth_keyring_add and webauth_keyring_remove.
+     */
+    WA_APR_ARRAY_HEADER_T *sorted;
 };
 
 BEGIN_DECLS
@@ -64,6 +64,22 @@ enum webauth_token_type {
     WA_TOKEN_ANY = 255
 };
 
+/*
+ * The wire formats in which tokens can be encrypted.  WA_TOKEN_FORMAT_HINT is
+ * the original format, which starts with a timestamp hint used to guess the
+ * decryption key.  WA_TOKEN_FORMAT_KEY_ID starts with a short identifier of
+ * the encryption key instead, which allows the decryption key to be found
+ * without trial decryption.  WA_TOKEN_FORMAT_AES_GCM also uses a key
+ * identifier but encrypts and authenticates the token in one pass with
+ * AES-GCM instead of AES-CBC and HMAC-SHA1.  Tokens in any format can always
+ * be decrypted; the format only affects newly encrypted tokens.
+ */
+enum webauth_token_format {
+    WA_TOKEN_FORMAT_HINT = 0,
+    WA_TOKEN_FORMAT_KEY_ID,
+    WA_TOKEN_FORMAT_AES_GCM
+};
+
 /*
  * In the following token struct definitions, the "encode" comments are used
  * internally by the WebAuth code to generate encoding rules for the wire
@@ -325,8 +341,10 @@ int webauth_token_encode_raw(struct webauth_context *,
     __attribute__((__nonnull__));
 
 /*
- * Decrypts a token.  The best decryption key on the ring will be tried first,
- * and if that fails all the remaining keys will be tried.  Returns the
+ * Decrypts a token.  For tokens with a key identifier, only the keys on the
+ * ring with a matching identifier are tried.  Otherwise, the best decryption
+ * key on the ring will be tried first, and if that fails all the remaining
+ * keys will be tried.  Returns the
  * decrypted data in output and its length in output_len.
  *
  * Returns WA_ERR_NONE, WA_ERR_NO_MEM, WA_ERR_CORRUPT, WA_ERR_BAD_HMAC, or
@@ -351,6 +369,18 @@ int webauth_token_encrypt(struct webauth_context *, const void *input,
                           const struct webauth_keyring *)
     __attribute__((__nonnull__));
 
+/*
+ * Set the wire format used by webauth_token_encrypt, and therefore by
+ * webauth_token_encode, for subsequent tokens encrypted with this context.
+ * The default is WA_TOKEN_FORMAT_HINT, which older versions of WebAuth can
+ * decrypt.  Returns WA_ERR_INVALID if the format is not recognized, or
+ * WA_ERR_UNIMPLEMENTED if the format requires AES-GCM and the OpenSSL library
+ * does not support it.
+ */
+int webauth_token_set_format(struct webauth_context *,
+                             enum webauth_token_format)
+    __attribute__((__nonnull__));
+
 END_DECLS
 
 #endif /* !WEBAUTH_TOKENS_H */
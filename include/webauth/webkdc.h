@@ -336,6 +336,19 @@ int webauth_webkdc_login(struct webauth_context *,
                          const struct webauth_keyring *)
     __attribute__((__nonnull__));
 
+/*
+ * The same as webauth_webkdc_login, except that the caller has already
+ * decrypted and checked the webkdc-service token in the request with the
+ * same keyring and passes the result as service, so that it isn't decrypted
+ * again.
+ */
+int webauth_webkdc_login_service(struct webauth_context *,
+                                 const struct webauth_webkdc_login_request *,
+                                 const struct webauth_token_webkdc_service *,
+                                 struct webauth_webkdc_login_response **,
+                                 const struct webauth_keyring *)
+    __attribute__((__nonnull__));
+
 END_DECLS
 
 #endif /* !WEBAUTH_WEBKDC_H */
@@ -17,7 +17,6 @@
 #include <portable/apr.h>
 #include <portable/system.h>
 
-#include <apr_hash.h>
 #include <errno.h>
 #include <limits.h>
 #include <netinet/in.h>
@@ -28,13 +27,34 @@
 #include <webauth/tokens.h>
 
 /*
- * Stores metadata about a particular attribute in encoded data.  This is
- * stored as the value in a hash of attributes, with the key being the
- * attribute name.
+ * Stores an attribute found in encoded data.  The name and the value point
+ * into the copy of the encoded data, which is modified in place so that both
+ * are nul-terminated.
+ *
+ * When the attributes are matched against a set of rules, each attribute with
+ * a rule is recorded in the slot for that rule.  Attributes inside a repeated
+ * structure instead record which repeated rule (repeat) and which nested rule
+ * (rule) they belong to and the element number, and all other attributes are
+ * unknown, with a repeat and rule of -1.
  */
 struct value {
+    char *name;
+    size_t name_length;
     void *data;
     size_t length;
+    int repeat;
+    int rule;
+    unsigned long element;
+};
+
+/*
+ * The attributes found in encoded data.  slot holds the attribute for each
+ * top-level rule, or NULL if that attribute wasn't present.
+ */
+struct attrs {
+    struct value *values;
+    size_t count;
+    struct value *slot[WA_ENCODING_MAX];
 };
 
 /*
@@ -69,16 +89,16 @@ decode_error_set(struct webauth_context *ctx, int s, const char *desc,
 
 
 /*
- * Convert the attribute-encoded data to a hash table of attribute names to
- * values, where values are represented by struct value.  This destructively
- * modifies the encoded form in place to avoid having to make another copy of
- * the data.  Returns a WebAuth status code.
+ * Split attribute-encoded data into a list of attributes, stored in attrs.
+ * This destructively modifies the encoded form in place to avoid having to
+ * make another copy of the data.  Returns a WebAuth status code.  If the data
+ * is corrupt, the attributes before the corruption are still stored so that
+ * the caller can check for duplicates among them.
  */
 static int
 decode_attrs(struct webauth_context *ctx, void *data, size_t length,
-             apr_hash_t **output)
+             struct attrs *attrs)
 {
-    apr_hash_t *attrs;
     struct value *values;
     size_t i, n, offset;
     char *name, *value;
@@ -105,18 +125,16 @@ decode_attrs(struct webauth_context *ctx, void *data, size_t length,
         }
     }
 
-    /*
-     * We know roughly how many attributes there are.  Allocate data
-     * structures.
-     */
-    attrs = apr_hash_make(ctx->pool);
-    values = apr_pcalloc(ctx->pool, attr_count * sizeof(struct value));
+    /* We know roughly how many attributes there are.  Allocate storage. */
+    values = apr_palloc(ctx->pool, attr_count * sizeof(struct value));
+    attrs->values = values;
+    attrs->count = 0;
 
     /*
      * Now, do the decoding.  As we go, we'll make two transformations:
      * nul-terminate the attribute name by replacing the = with a nul
      * character, and rewrite the value to unescape any semicolons.  When we
-     * find the end of an attribute, we store it in the table.  This is where
+     * find the end of an attribute, we store it in the list.  This is where
      * we do all the syntax checking.
      */
     i = 0;
@@ -154,27 +172,20 @@ decode_attrs(struct webauth_context *ctx, void *data, size_t length,
         if (i >= length || in[i] != ';')
             goto corrupt;
 
-        /* Check whether we have a duplicate. */
-        if (apr_hash_get(attrs, name, strlen(name)) != NULL) {
-            wai_error_set(ctx, WA_ERR_CORRUPT, "duplicate attribute %s", name);
-            return WA_ERR_CORRUPT;
-        }
-
         /*
-         * We have a valid key/value pair.  Store it in the table and
+         * We have a valid key/value pair.  Store it in the list and
          * nul-terminate in case it's a number encoded as a string to save us
-         * some effort later.
+         * some effort later.  A nul in the name ends it, as it always has.
          */
         in[i - offset] = '\0';
+        values[n].name = name;
+        values[n].name_length = strlen(name);
         values[n].data = value;
         values[n].length = (in + i) - value - offset;
-        apr_hash_set(attrs, name, strlen(name), (const void *) &values[n]);
         n++;
+        attrs->count = n;
         i++;
     }
-
-    /* Success.  Store the table in our output variable and return. */
-    *output = attrs;
     return WA_ERR_NONE;
 
 corrupt:
@@ -182,6 +193,190 @@ corrupt:
 }
 
 
+/*
+ * Find the rule for an attribute name in a set of rules, returning its index
+ * or -1 if there is none.  Uses the lookup function in the terminating rule
+ * if there is one, and otherwise searches the rules.
+ */
+static int
+rule_index(const struct wai_encoding *rules, size_t count, const char *name,
+           size_t length)
+{
+    size_t i;
+
+    if (rules[count].lookup != NULL)
+        return rules[count].lookup(name, length);
+    for (i = 0; i < count; i++)
+        if (strlen(rules[i].attr) == length
+            && memcmp(rules[i].attr, name, length) == 0)
+            return (int) i;
+    return -1;
+}
+
+
+/*
+ * Return the number of rules in a set of rules, or WA_ENCODING_MAX + 1 if
+ * there are more than WA_ENCODING_MAX.
+ */
+static size_t
+rule_count(const struct wai_encoding *rules)
+{
+    size_t count;
+
+    for (count = 0; count <= WA_ENCODING_MAX; count++)
+        if (rules[count].attr == NULL)
+            break;
+    return count;
+}
+
+
+/*
+ * Given an attribute that isn't named by any top-level rule, check whether it
+ * is an attribute of an element of a repeated structure: the name of one of
+ * the nested rules followed by the element number in decimal.  If so, record
+ * the repeated rule, the nested rule, and the element in the value.
+ */
+static void
+match_repeat(const struct wai_encoding *rules, size_t count,
+             struct value *value)
+{
+    const struct wai_encoding *repeat;
+    const char *p;
+    size_t i, base;
+    unsigned long element;
+    int rule;
+
+    /* Find the element number at the end of the name. */
+    for (base = value->name_length; base > 0; base--)
+        if (value->name[base - 1] < '0' || value->name[base - 1] > '9')
+            break;
+    if (base == 0 || base == value->name_length)
+        return;
+
+    /*
+     * The encoder formats the element with %lu, so only accept that form.
+     * Anything else, such as a leading zero, is an unknown attribute.
+     */
+    p = value->name + base;
+    if (p[0] == '0' && p[1] != '\0')
+        return;
+    errno = 0;
+    element = strtoul(p, NULL, 10);
+    if (errno != 0)
+        return;
+
+    /* Find a repeated rule with a nested rule for the base name. */
+    for (i = 0; i < count; i++) {
+        if (rules[i].type != WA_TYPE_REPEAT)
+            continue;
+        repeat = rules[i].repeat;
+        rule = rule_index(repeat, rule_count(repeat), value->name, base);
+        if (rule >= 0) {
+            value->repeat = (int) i;
+            value->rule = rule;
+            value->element = element;
+            return;
+        }
+    }
+}
+
+
+/*
+ * Match the attributes against a set of rules, filling in the slots in attrs
+ * and the repeated structure information in each value.  This also checks
+ * for duplicate attributes.  Returns a WebAuth status code.
+ */
+static int
+match_rules(struct webauth_context *ctx, const struct wai_encoding *rules,
+            struct attrs *attrs)
+{
+    struct value *value, *other;
+    size_t count, i, j;
+    int rule;
+
+    count = rule_count(rules);
+    if (count > WA_ENCODING_MAX)
+        return wai_error_set(ctx, WA_ERR_INVALID, "too many encoding rules");
+    memset(attrs->slot, 0, sizeof(attrs->slot));
+    for (i = 0; i < attrs->count; i++) {
+        value = &attrs->values[i];
+        value->repeat = -1;
+        value->rule = rule_index(rules, count, value->name,
+                                 value->name_length);
+        if (value->rule >= 0) {
+            if (attrs->slot[value->rule] != NULL)
+                goto duplicate;
+            attrs->slot[value->rule] = value;
+            continue;
+        }
+
+        /*
+         * This is either an attribute of a repeated structure or unknown.
+         * Check for duplicates by comparing against the earlier attributes
+         * of the same kind, which are few in practice.
+         */
+        match_repeat(rules, count, value);
+        rule = value->rule;
+        for (j = 0; j < i; j++) {
+            other = &attrs->values[j];
+            if (other->repeat != value->repeat || other->rule != rule)
+                continue;
+            if (rule >= 0 && other->element == value->element)
+                goto duplicate;
+            if (rule < 0 && strcmp(other->name, value->name) == 0)
+                goto duplicate;
+        }
+    }
+    return WA_ERR_NONE;
+
+duplicate:
+    wai_error_set(ctx, WA_ERR_CORRUPT, "duplicate attribute %s", value->name);
+    return WA_ERR_CORRUPT;
+}
+
+
+/*
+ * Check a list of attributes for duplicates without any rules.  This is only
+ * used on error paths when the rules aren't known, so it doesn't need to be
+ * fast.  Returns a WebAuth status code.
+ */
+static int
+check_duplicates(struct webauth_context *ctx, const struct attrs *attrs)
+{
+    size_t i, j;
+    const char *name;
+
+    for (i = 1; i < attrs->count; i++) {
+        name = attrs->values[i].name;
+        for (j = 0; j < i; j++)
+            if (strcmp(attrs->values[j].name, name) == 0) {
+                wai_error_set(ctx, WA_ERR_CORRUPT, "duplicate attribute %s",
+                              name);
+                return WA_ERR_CORRUPT;
+            }
+    }
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Split encoded data into attributes and match them against a set of rules.
+ * A duplicate attribute before any syntax error is reported in preference to
+ * the syntax error, since that was the first problem in the data.  Returns a
+ * WebAuth status code.
+ */
+static int
+parse_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
+            void *data, size_t length, struct attrs *attrs)
+{
+    int s, status;
+
+    status = decode_attrs(ctx, data, length, attrs);
+    s = match_rules(ctx, rules, attrs);
+    return (s != WA_ERR_NONE) ? s : status;
+}
+
+
 /*
  * Decode attribute data, possibly hex-encoded.  Takes the WebAuth context,
  * the value, the memory location to which to write the data, the memory
@@ -261,23 +456,79 @@ corrupt:
 
 
 /*
- * Given an encoding specification, an attribute list, and a data structure,
- * decode attributes into that data structure.  Takes a separate pool to use
- * rather than using the normal WebAuth context pool.  Context is a string to
- * prepend to the description for error reporting.  If element is non-zero, we
- * are handling a repeated attribute encoding, and the element number is
- * appended to the attribute name when decoding it.
+ * Return true if every rule in a set of rules is optional.
+ */
+static bool
+all_optional(const struct wai_encoding *rules)
+{
+    const struct wai_encoding *rule;
+
+    for (rule = rules; rule->attr != NULL; rule++)
+        if (!rule->optional)
+            return false;
+    return true;
+}
+
+
+/*
+ * Build the table of attributes for the elements of a repeated structure.
+ * Takes the attributes, the index of the repeated rule, the number of rules
+ * in the nested structure, and the element count, and returns an array of
+ * attribute pointers with one row of nested rules per element, stored in
+ * table, and the number of rows, which may be less than the element count if
+ * the later elements have no attributes.
+ */
+static size_t
+repeat_table(struct webauth_context *ctx, const struct attrs *attrs,
+             int repeat, size_t count, unsigned long elements,
+             struct value ***table)
+{
+    const struct value *value;
+    size_t i, rows;
+
+    rows = 0;
+    for (i = 0; i < attrs->count; i++) {
+        value = &attrs->values[i];
+        if (value->repeat == repeat && value->element < elements
+            && value->element >= rows)
+            rows = value->element + 1;
+    }
+    if (rows == 0) {
+        *table = NULL;
+        return 0;
+    }
+    *table = apr_pcalloc(ctx->pool, rows * count * sizeof(struct value *));
+    for (i = 0; i < attrs->count; i++) {
+        value = &attrs->values[i];
+        if (value->repeat == repeat && value->element < elements)
+            (*table)[value->element * count + value->rule] = &attrs->values[i];
+    }
+    return rows;
+}
+
+
+/*
+ * Given an encoding specification, the attribute for each rule, and a data
+ * structure, decode attributes into that data structure.  Context is a string
+ * to prepend to the description for error reporting.  If element is non-zero,
+ * we are handling a repeated attribute encoding, and the element number is
+ * added to the description when reporting errors.  attrs is the full list of
+ * attributes, used to find the elements of repeated structures, and is NULL
+ * when decoding a repeated structure, since only one level of nesting is
+ * supported.
  *
  * This is an internal helper function used by wai_decode.
  */
 static int
 decode_by_rule(struct webauth_context *ctx, const struct wai_encoding *rules,
-               apr_hash_t *attrs, const void *result, const char *context,
-               unsigned long element)
+               struct value **slot, const struct attrs *attrs,
+               const void *result, const char *context, unsigned long element)
 {
     const struct wai_encoding *rule;
-    const char *attr;
     struct value *value;
+    struct value **table, **nested;
+    struct value *empty[WA_ENCODING_MAX];
+    size_t count, rows, size;
     unsigned long i;
     int s;
     void *data;
@@ -285,11 +536,7 @@ decode_by_rule(struct webauth_context *ctx, const struct wai_encoding *rules,
     uint32_t uint32;
 
     for (rule = rules; rule->attr != NULL; rule++) {
-        if (context == NULL)
-            attr = rule->attr;
-        else
-            attr = apr_psprintf(ctx->pool, "%s%lu", rule->attr, element);
-        value = apr_hash_get(attrs, attr, strlen(attr));
+        value = slot[rule - rules];
         s = WA_ERR_NONE;
 
         /* If this attribute isn't optional, missing data is an error. */
@@ -300,7 +547,7 @@ decode_by_rule(struct webauth_context *ctx, const struct wai_encoding *rules,
             decode_error_set(ctx, s, rule->desc, context, element);
             return s;
         }
-            
+
         /* Otherwise, interpret the value by data type. */
         switch (rule->type) {
         case WA_TYPE_DATA:
@@ -335,11 +582,32 @@ decode_by_rule(struct webauth_context *ctx, const struct wai_encoding *rules,
             if (s != WA_ERR_NONE)
                 break;
             *LOC_UINT32(result, rule->len_offset) = uint32;
+            count = rule_count(rule->repeat);
+            if (count > WA_ENCODING_MAX)
+                return wai_error_set(ctx, WA_ERR_INVALID,
+                                     "too many encoding rules");
+            rows = 0;
+            table = NULL;
+            if (attrs != NULL)
+                rows = repeat_table(ctx, attrs, (int) (rule - rules), count,
+                                    uint32, &table);
+
+            /*
+             * Unless every nested rule is optional, decoding will fail at the
+             * first element with no attributes, so don't allocate space for
+             * more elements than that based on a corrupt count.
+             */
+            size = uint32;
+            if (size > rows && !all_optional(rule->repeat))
+                size = rows + 1;
             repeat = LOC_DATA(result, rule->offset);
-            *repeat = apr_palloc(ctx->pool, rule->size * uint32);
+            *repeat = apr_palloc(ctx->pool, rule->size * size);
+            memset(empty, 0, sizeof(empty));
             for (i = 0; i < uint32; i++) {
                 data = (char *) *repeat + i * rule->size;
-                s = decode_by_rule(ctx, rule->repeat, attrs, data, attr, i);
+                nested = (i < rows) ? table + i * count : empty;
+                s = decode_by_rule(ctx, rule->repeat, nested, NULL, data,
+                                   rule->attr, i);
                 if (s != WA_ERR_NONE)
                     return s;
             }
@@ -361,15 +629,15 @@ int
 wai_decode(struct webauth_context *ctx, const struct wai_encoding *rules,
            const void *input, size_t length, void *data)
 {
-    apr_hash_t *attrs;
+    struct attrs attrs;
     int s;
     void *buf;
 
     buf = apr_pmemdup(ctx->pool, input, length);
-    s = decode_attrs(ctx, buf, length, &attrs);
+    s = parse_attrs(ctx, rules, buf, length, &attrs);
     if (s != WA_ERR_NONE)
         return s;
-    return decode_by_rule(ctx, rules, attrs, data, NULL, 0);
+    return decode_by_rule(ctx, rules, attrs.slot, &attrs, data, NULL, 0);
 }
 
 
@@ -383,8 +651,9 @@ int
 wai_decode_token(struct webauth_context *ctx, const void *input,
                  size_t length, struct webauth_token *token)
 {
-    apr_hash_t *attrs;
-    int s;
+    struct attrs attrs;
+    int s, status;
+    size_t i;
     void *buf, *data;
     struct value *value;
     char *type;
@@ -392,20 +661,37 @@ wai_decode_token(struct webauth_context *ctx, const void *input,
 
     memset(token, 0, sizeof(*token));
     buf = apr_pmemdup(ctx->pool, input, length);
-    s = decode_attrs(ctx, buf, length, &attrs);
-    if (s != WA_ERR_NONE)
-        return s;
-    value = apr_hash_get(attrs, "t", strlen("t"));
-    if (value == NULL)
+    status = decode_attrs(ctx, buf, length, &attrs);
+
+    /* Find the token type, which determines the rules. */
+    value = NULL;
+    for (i = 0; i < attrs.count; i++)
+        if (strcmp(attrs.values[i].name, "t") == 0) {
+            value = &attrs.values[i];
+            break;
+        }
+    if (status != WA_ERR_NONE || value == NULL) {
+        s = check_duplicates(ctx, &attrs);
+        if (s != WA_ERR_NONE)
+            return s;
+        if (status != WA_ERR_NONE)
+            return status;
         return wai_error_set(ctx, WA_ERR_CORRUPT, "no token type attribute");
+    }
     decode_string(ctx, value, &type);
     token->type = webauth_token_type_code(type);
     if (token->type == WA_TOKEN_UNKNOWN) {
+        s = check_duplicates(ctx, &attrs);
+        if (s != WA_ERR_NONE)
+            return s;
         wai_error_set(ctx, WA_ERR_CORRUPT, "unknown token type %s", type);
         return WA_ERR_CORRUPT;
     }
     s = wai_token_encoding(ctx, token, &rules, (const void **) &data);
     if (s != WA_ERR_NONE)
         return s;
-    return decode_by_rule(ctx, rules, attrs, data, NULL, 0);
+    s = match_rules(ctx, rules, &attrs);
+    if (s != WA_ERR_NONE)
+        return s;
+    return decode_by_rule(ctx, rules, attrs.slot, &attrs, data, NULL, 0);
 }
@@ -39,6 +39,20 @@
 #define LOC_ULONG(d, o)  (unsigned long *) (void *)((char *) (d) + (o))
 
 
+/*
+ * State for encoding attributes.  Encoding is done in two passes over the
+ * rules: the first, with output set to NULL, only totals the length of the
+ * encoding and checks the data, and the second writes the encoding into a
+ * buffer of exactly that length.  The time used for creation attributes is
+ * determined in the first pass so that both passes see the same value.
+ */
+struct encoder {
+    char *output;               /* Next byte to write, or NULL if sizing */
+    size_t length;              /* Length of the encoding so far */
+    time_t now;                 /* Creation time to use, or 0 if not set */
+};
+
+
 /*
  * Report an error while encoding an attribute.  Takes the WebAuth context,
  * status, description, context (for repeated elements), and element number
@@ -58,73 +72,135 @@ encode_error_set(struct webauth_context *ctx, int s, const char *desc,
 
 
 /*
- * Append an attribute and value to the output buffer.  Takes the output
- * buffer, the attribute key (as a string), the value and its length, and a
- * flag indicating whether to hex-encode the data.  Returns a WebAuth error
- * code.
+ * Format a number in decimal at the end of the provided buffer, which must
+ * be at least ULONG_DIGITS long, and return a pointer to the first digit.
+ * The number is not nul-terminated; its length is the distance from the
+ * returned pointer to the end of the buffer.
+ */
+#define ULONG_DIGITS (sizeof(unsigned long) * 3)
+
+static char *
+format_number(char *buffer, unsigned long value)
+{
+    char *p = buffer + ULONG_DIGITS;
+
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    return p;
+}
+
+
+/*
+ * Add bytes to the encoding without any escaping.
+ */
+static void
+encode_bytes(struct encoder *encoder, const void *data, size_t length)
+{
+    if (encoder->output != NULL) {
+        memcpy(encoder->output, data, length);
+        encoder->output += length;
+    }
+    encoder->length += length;
+}
+
+
+/*
+ * Add an attribute name and the following equal sign to the encoding.  If
+ * context is not NULL, this is an attribute of a repeated element, and the
+ * element number is appended to the name.
+ */
+static void
+encode_name(struct encoder *encoder, const char *attr, const char *context,
+            unsigned long element)
+{
+    char digits[ULONG_DIGITS];
+    char *number;
+
+    encode_bytes(encoder, attr, strlen(attr));
+    if (context != NULL) {
+        number = format_number(digits, element);
+        encode_bytes(encoder, number, digits + sizeof(digits) - number);
+    }
+    encode_bytes(encoder, "=", 1);
+}
+
+
+/*
+ * Add an attribute value and the terminating semicolon to the encoding.
+ * Takes the value and its length and a flag indicating whether to hex-encode
+ * the data.  Otherwise, any semicolons in the data are doubled.  Returns a
+ * WebAuth error code.
  */
 static int
-encode_data(struct wai_buffer *output, const char *attr, const void *data,
-            size_t length, bool ascii)
+encode_data(struct encoder *encoder, const void *data, size_t length,
+            bool ascii)
 {
     size_t hexlen, i, enclen;
     const char *in = data;
     char *p;
     int s;
 
-    wai_buffer_append_sprintf(output, "%s=", attr);
     if (ascii) {
         hexlen = wai_hex_encoded_length(length);
-        wai_buffer_resize(output, output->used + hexlen + 1);
-        s = wai_hex_encode(data, length, output->data + output->used,
-                           &hexlen, hexlen);
-        if (s != WA_ERR_NONE)
-            return s;
-        output->used += hexlen;
-        output->data[output->used] = ';';
-        output->used++;
-    } else {
-        for (i = 0, enclen = 0; i < length; i++, enclen++)
+        if (encoder->output != NULL) {
+            s = wai_hex_encode(data, length, encoder->output, &hexlen,
+                               hexlen);
+            if (s != WA_ERR_NONE)
+                return s;
+            encoder->output += hexlen;
+        }
+        encoder->length += hexlen;
+    } else if (encoder->output == NULL) {
+        for (i = 0, enclen = length; i < length; i++)
             if (in[i] == ';')
                 enclen++;
-        wai_buffer_resize(output, output->used + enclen + 1);
-        for (i = 0, p = output->data + output->used; i < length; i++, p++) {
+        encoder->length += enclen;
+    } else {
+        p = encoder->output;
+        for (i = 0; i < length; i++, p++) {
             *p = in[i];
             if (in[i] == ';') {
                 p++;
                 *p = ';';
             }
         }
-        *p = ';';
-        output->used += enclen + 1;
+        encoder->length += p - encoder->output;
+        encoder->output = p;
     }
+    encode_bytes(encoder, ";", 1);
     return WA_ERR_NONE;
 }
 
 
 /*
- * Encode an attribute and numeric value to the output buffer.  Takes the
- * output buffer, the attribute key (as a string), the value as an unsigned
- * integer, and a flag indicating whether to format the number as a string.
+ * Add a numeric attribute value and the terminating semicolon to the
+ * encoding.  Takes the value as an unsigned integer and a flag indicating
+ * whether to format the number as a string.
  */
 static void
-encode_number(struct wai_buffer *output, const char *attr, unsigned long value,
-              bool ascii)
+encode_number(struct encoder *encoder, unsigned long value, bool ascii)
 {
-    if (ascii)
-        wai_buffer_append_sprintf(output, "%s=%lu;", attr, value);
-    else {
-        uint32_t data = value;
+    char digits[ULONG_DIGITS];
+    char *number;
+    uint32_t data;
 
-        data = htonl(data);
-        encode_data(output, attr, &data, sizeof(data), false);
+    if (ascii) {
+        number = format_number(digits, value);
+        encode_bytes(encoder, number, digits + sizeof(digits) - number);
+        encode_bytes(encoder, ";", 1);
+    } else {
+        data = htonl(value);
+        encode_data(encoder, &data, sizeof(data), false);
     }
 }
 
 
 /*
- * Given an encoding specification, a data source, and a buffer, encode into
- * attribute form in the given buffer.  Context is a string to prepend to the
+ * Given an encoding specification, a data source, and an encoder, encode into
+ * attribute form, or only determine the length of that encoding if the
+ * encoder has no output buffer.  Context is a string to prepend to the
  * description for error reporting.  If context is non-NULL, we are handling a
  * repeated attribute encoding, and the element number is appended to the
  * attribute name when encoding it.
@@ -133,11 +209,10 @@ encode_number(struct wai_buffer *output, const char *attr, unsigned long value,
  */
 static int
 encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
-                const void *input, struct wai_buffer *output,
+                const void *input, struct encoder *encoder,
                 const char *context, unsigned long element)
 {
     const struct wai_encoding *rule;
-    const char *attr;
     unsigned long i;
     int s;
     void *data, *repeat;
@@ -149,10 +224,6 @@ encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
     unsigned long ulong;
 
     for (rule = rules; rule->attr != NULL; rule++) {
-        if (context == NULL)
-            attr = rule->attr;
-        else
-            attr = apr_psprintf(ctx->pool, "%s%lu", rule->attr, element);
         s = WA_ERR_NONE;
         switch (rule->type) {
         case WA_TYPE_DATA:
@@ -164,7 +235,8 @@ encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
                 break;
             }
             size = *LOC_SIZE(input, rule->len_offset);
-            s = encode_data(output, attr, data, size, rule->ascii);
+            encode_name(encoder, rule->attr, context, element);
+            s = encode_data(encoder, data, size, rule->ascii);
             break;
         case WA_TYPE_STRING:
             string = *LOC_STRING(input, rule->offset);
@@ -174,43 +246,52 @@ encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
                 s = WA_ERR_INVALID;
                 break;
             }
-            s = encode_data(output, attr, string, strlen(string), false);
+            encode_name(encoder, rule->attr, context, element);
+            s = encode_data(encoder, string, strlen(string), false);
             break;
         case WA_TYPE_INT32:
             int32 = *LOC_INT32(input, rule->offset);
             if (rule->optional && int32 == 0)
                 break;
-            encode_number(output, attr, int32, rule->ascii);
+            encode_name(encoder, rule->attr, context, element);
+            encode_number(encoder, int32, rule->ascii);
             break;
         case WA_TYPE_UINT32:
             uint32 = *LOC_UINT32(input, rule->offset);
             if (rule->optional && uint32 == 0)
                 break;
-            encode_number(output, attr, uint32, rule->ascii);
+            encode_name(encoder, rule->attr, context, element);
+            encode_number(encoder, uint32, rule->ascii);
             break;
         case WA_TYPE_ULONG:
             ulong = *LOC_ULONG(input, rule->offset);
             if (rule->optional && ulong == 0)
                 break;
-            encode_number(output, attr, ulong, rule->ascii);
+            encode_name(encoder, rule->attr, context, element);
+            encode_number(encoder, ulong, rule->ascii);
             break;
         case WA_TYPE_TIME:
             timev = *LOC_TIME(input, rule->offset);
-            if (rule->creation && timev == 0)
-                timev = time(NULL);
+            if (rule->creation && timev == 0) {
+                if (encoder->now == 0)
+                    encoder->now = time(NULL);
+                timev = encoder->now;
+            }
             if (rule->optional && timev == 0)
                 break;
-            encode_number(output, attr, timev, rule->ascii);
+            encode_name(encoder, rule->attr, context, element);
+            encode_number(encoder, timev, rule->ascii);
             break;
         case WA_TYPE_REPEAT:
             uint32 = *LOC_UINT32(input, rule->len_offset);
             if (rule->optional && uint32 == 0)
                 break;
-            encode_number(output, attr, uint32, rules->ascii);
+            encode_name(encoder, rule->attr, context, element);
+            encode_number(encoder, uint32, rules->ascii);
             for (i = 0; i < uint32; i++) {
                 repeat = *LOC_STRING(input, rule->offset) + rule->size * i;
-                s = encode_to_attrs(ctx, rule->repeat, repeat, output,
-                                    attr, i);
+                s = encode_to_attrs(ctx, rule->repeat, repeat, encoder,
+                                    rule->attr, i);
                 if (s != WA_ERR_NONE)
                     return s;
             }
@@ -228,22 +309,101 @@ encode_to_attrs(struct webauth_context *ctx, const struct wai_encoding *rules,
 /*
  * Given an encoding specification and a pointer to the data to encode, encode
  * into attributes and return the encoded string in newly-allocated pool
- * memory.  Takes a separate pool to use rather than using the normal WebAuth
- * context pool, since attribute encoding can churn a lot of memory.
+ * memory.  The length of the encoding is determined first so that the result
+ * is written directly into a single allocation.  The result is also
+ * nul-terminated, although the nul is not included in the length.
  */
 int
 wai_encode(struct webauth_context *ctx, const struct wai_encoding *rules,
            const void *data, void **output, size_t *length)
 {
-    struct wai_buffer *buffer;
+    struct encoder encoder = { NULL, 0, 0 };
+    char *buffer;
     int s;
 
-    buffer = wai_buffer_new(ctx->pool);
-    s = encode_to_attrs(ctx, rules, data, buffer, NULL, 0);
+    s = encode_to_attrs(ctx, rules, data, &encoder, NULL, 0);
+    if (s != WA_ERR_NONE)
+        return s;
+    buffer = apr_palloc(ctx->pool, encoder.length + 1);
+    *length = encoder.length;
+    encoder.output = buffer;
+    encoder.length = 0;
+    s = encode_to_attrs(ctx, rules, data, &encoder, NULL, 0);
     if (s != WA_ERR_NONE)
         return s;
-    *output = buffer->data;
-    *length = buffer->used;
+    buffer[*length] = '\0';
+    *output = buffer;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Encode a token with an encoder, starting with the token type.  This is the
+ * common code for both passes of token encoding.
+ */
+static int
+encode_token(struct webauth_context *ctx, const struct webauth_token *token,
+             struct encoder *encoder)
+{
+    const struct wai_encoding *rules;
+    const void *data;
+    const char *type;
+    int s;
+
+    s = wai_token_encoding(ctx, token, &rules, &data);
+    if (s != WA_ERR_NONE)
+        return s;
+    type = webauth_token_type_string(token->type);
+    encode_name(encoder, "t", NULL, 0);
+    encode_data(encoder, type, strlen(type), false);
+    return encode_to_attrs(ctx, rules, data, encoder, NULL, 0);
+}
+
+
+/*
+ * Determine the length of the attribute encoding of a token, including the
+ * token type, and store it and the information needed to write it in the
+ * provided struct.  This does not perform any sanity checking on the token
+ * data; that must be done by higher-level code.
+ */
+int
+wai_encode_token_size(struct webauth_context *ctx,
+                      const struct webauth_token *token,
+                      struct wai_encoded_token *encoded)
+{
+    struct encoder encoder = { NULL, 0, 0 };
+    int s;
+
+    s = encode_token(ctx, token, &encoder);
+    if (s != WA_ERR_NONE)
+        return s;
+    encoded->token = token;
+    encoded->now = encoder.now;
+    encoded->length = encoder.length;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Write the attribute encoding of a token sized by wai_encode_token_size into
+ * the provided buffer, which must have room for the length stored by that
+ * function.
+ */
+int
+wai_encode_token_write(struct webauth_context *ctx,
+                       const struct wai_encoded_token *encoded, void *output)
+{
+    struct encoder encoder = { NULL, 0, 0 };
+    int s;
+
+    encoder.output = output;
+    encoder.now = encoded->now;
+    s = encode_token(ctx, encoded->token, &encoder);
+    if (s != WA_ERR_NONE)
+        return s;
+    if (encoder.length != encoded->length)
+        return wai_error_set(ctx, WA_ERR_INVALID,
+                             "token changed while encoding");
     return WA_ERR_NONE;
 }
 
@@ -258,22 +418,19 @@ wai_encode_token(struct webauth_context *ctx,
                  const struct webauth_token *token, void **output,
                  size_t *length)
 {
-    struct wai_buffer *buffer;
+    struct wai_encoded_token encoded;
+    char *buffer;
     int s;
-    const char *type;
-    const struct wai_encoding *rules;
-    const void *data;
 
-    s = wai_token_encoding(ctx, token, &rules, &data);
+    s = wai_encode_token_size(ctx, token, &encoded);
     if (s != WA_ERR_NONE)
         return s;
-    buffer = wai_buffer_new(ctx->pool);
-    type = webauth_token_type_string(token->type);
-    wai_buffer_append_sprintf(buffer, "t=%s;", type);
-    s = encode_to_attrs(ctx, rules, data, buffer, NULL, 0);
+    buffer = apr_palloc(ctx->pool, encoded.length + 1);
+    s = wai_encode_token_write(ctx, &encoded, buffer);
     if (s != WA_ERR_NONE)
         return s;
-    *output = buffer->data;
-    *length = buffer->used;
+    buffer[encoded.length] = '\0';
+    *output = buffer;
+    *length = encoded.length;
     return WA_ERR_NONE;
 }
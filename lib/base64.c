@@ -0,0 +1,502 @@
+/*
+ * Base64 encoding and decoding.
+ *
+ * Tokens are base64-encoded in cookies, URLs, and XML, so every request to a
+ * WebAuth Application Server or to the WebKDC decodes at least one, and many
+ * encode a few.  This provides a portable implementation and implementations
+ * that handle 12 or 24 bytes of data at a time with SSSE3 or AVX2 on x86
+ * processors, chosen at runtime by what the processor supports.  The SIMD
+ * implementations stop at the first block they can't handle and leave the
+ * rest to the portable implementation, so all of them produce identical
+ * results.
+ *
+ * Decoding has the semantics of apr_base64_decode, which was used before:
+ * decoding stops at the first byte that isn't in the alphabet (including
+ * padding and nul), and a trailing partial group of two or three characters
+ * yields one or two bytes.
+ *
+ * The SIMD encoder splits each group of three bytes into six-bit indices
+ * with a byte shuffle and two multiplies, and turns the indices into digits
+ * with a shuffle of a small table of offsets.  The decoder classifies each
+ * character with range comparisons, which handles both alphabets with the
+ * same code, and packs the six-bit values back into bytes with two
+ * multiply-add instructions and a shuffle.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#ifdef HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
+
+#include <lib/internal.h>
+
+/* Value of each byte in the standard alphabet, or 64 if not in it. */
+static const unsigned char standard_values[256] = {
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 62, 64, 64, 64, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 64, 64, 64, 64, 64, 64,
+    64,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64, 64,
+    64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64
+};
+
+/* Value of each byte in the URL-safe alphabet, or 64 if not in it. */
+static const unsigned char url_values[256] = {
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 62, 64, 64,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 64, 64, 64, 64, 64, 64,
+    64,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 64, 64, 64, 64, 63,
+    64, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64,
+    64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64, 64
+};
+
+/* The alphabets, indexed by enum wai_base64_alphabet. */
+static const struct alphabet {
+    const char *digits;
+    const unsigned char *values;
+} alphabets[] = {
+    {
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/",
+        standard_values
+    },
+    {
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_",
+        url_values
+    }
+};
+
+
+/*
+ * Given the length of data, return the length of its base64 encoding.
+ */
+size_t
+wai_base64_encoded_length(size_t length)
+{
+    return (length + 2) / 3 * 4;
+}
+
+
+/*
+ * Given the length of base64-encoded data, return the space required to
+ * store the decoded data.
+ */
+size_t
+wai_base64_decoded_length(size_t length)
+{
+    return (length + 3) / 4 * 3;
+}
+
+
+/*
+ * Encode data with the portable implementation, nul-terminating the result.
+ * The output may overlap the input as long as it starts earlier, since each
+ * group of three input bytes is read before the four output bytes for it are
+ * written.  For a buffer with the input at its end, output byte 4i + 3 is
+ * before input byte 3i + 3 for every group i, so no unread input is
+ * overwritten.
+ */
+static void
+encode_portable(char *output, const unsigned char *input, size_t length,
+                const char *digits)
+{
+    unsigned long group;
+    size_t i;
+
+    for (i = 0; i + 2 < length; i += 3) {
+        group = ((unsigned long) input[i] << 16)
+            | ((unsigned long) input[i + 1] << 8) | input[i + 2];
+        *output++ = digits[(group >> 18) & 0x3f];
+        *output++ = digits[(group >> 12) & 0x3f];
+        *output++ = digits[(group >> 6) & 0x3f];
+        *output++ = digits[group & 0x3f];
+    }
+    if (i < length) {
+        group = (unsigned long) input[i] << 16;
+        if (i + 1 < length)
+            group |= (unsigned long) input[i + 1] << 8;
+        *output++ = digits[(group >> 18) & 0x3f];
+        *output++ = digits[(group >> 12) & 0x3f];
+        *output++ = (i + 1 < length) ? digits[(group >> 6) & 0x3f] : '=';
+        *output++ = '=';
+    }
+    *output = '\0';
+}
+
+
+/*
+ * Decode data with the portable implementation, stopping at the first byte
+ * that isn't in the alphabet.  Returns the length of the decoded data.
+ */
+static size_t
+decode_portable(unsigned char *output, const unsigned char *input,
+                size_t length, const unsigned char *values)
+{
+    unsigned char *start = output;
+    unsigned long group;
+    size_t i, n;
+
+    for (n = 0; n < length && values[input[n]] < 64; n++)
+        ;
+    for (i = 0; i + 4 <= n; i += 4) {
+        group = ((unsigned long) values[input[i]] << 18)
+            | ((unsigned long) values[input[i + 1]] << 12)
+            | ((unsigned long) values[input[i + 2]] << 6)
+            | values[input[i + 3]];
+        *output++ = (group >> 16) & 0xff;
+        *output++ = (group >> 8) & 0xff;
+        *output++ = group & 0xff;
+    }
+    if (n - i >= 2) {
+        group = ((unsigned long) values[input[i]] << 18)
+            | ((unsigned long) values[input[i + 1]] << 12);
+        if (n - i == 3)
+            group |= (unsigned long) values[input[i + 2]] << 6;
+        *output++ = (group >> 16) & 0xff;
+        if (n - i == 3)
+            *output++ = (group >> 8) & 0xff;
+    }
+    return output - start;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+/*
+ * Store the low 12 bytes of a vector, the decoding of one block of 16
+ * characters.
+ */
+__attribute__((__target__("sse2")))
+static void
+store12(unsigned char *output, __m128i data)
+{
+    uint32_t last;
+
+    _mm_storel_epi64((__m128i *) (void *) output, data);
+    last = (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(data, 8));
+    memcpy(output + 8, &last, sizeof(last));
+}
+
+
+/*
+ * Encode blocks of 12 bytes into 16 characters with SSSE3, as long as 16
+ * bytes can be read.  Returns the number of bytes encoded, a multiple of 12.
+ * Each block is loaded before its output is stored, so the same overlap of
+ * output and input as encode_portable is safe.
+ */
+__attribute__((__target__("ssse3")))
+static size_t
+encode_ssse3(char *output, const unsigned char *input, size_t length,
+             const char *digits)
+{
+    const __m128i spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+                                         7, 6, 8, 7, 10, 9, 11, 10);
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, digits[62] - 62, digits[63] - 63, 'A', 0, 0);
+    __m128i v, a, b, index, offset;
+    size_t i;
+
+    for (i = 0; i + 16 <= length; i += 12) {
+        v = _mm_loadu_si128((const __m128i *) (const void *) (input + i));
+
+        /* Split each group of three bytes into four six-bit indices. */
+        v = _mm_shuffle_epi8(v, spread);
+        a = _mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00));
+        a = _mm_mulhi_epu16(a, _mm_set1_epi32(0x04000040));
+        b = _mm_and_si128(v, _mm_set1_epi32(0x003f03f0));
+        b = _mm_mullo_epi16(b, _mm_set1_epi32(0x01000010));
+        index = _mm_or_si128(a, b);
+
+        /* Map each index to the offset that turns it into its digit. */
+        offset = _mm_subs_epu8(index, _mm_set1_epi8(51));
+        a = _mm_cmpgt_epi8(_mm_set1_epi8(26), index);
+        offset = _mm_or_si128(offset, _mm_and_si128(a, _mm_set1_epi8(13)));
+        offset = _mm_shuffle_epi8(shift, offset);
+        v = _mm_add_epi8(index, offset);
+
+        _mm_storeu_si128((__m128i *) (void *) output, v);
+        output += 16;
+    }
+    return i;
+}
+
+
+/*
+ * Encode blocks of 24 bytes into 32 characters with AVX2, as long as 28
+ * bytes can be read.  The same as encode_ssse3 except that each 128-bit lane
+ * handles half of the block.
+ */
+__attribute__((__target__("avx2")))
+static size_t
+encode_avx2(char *output, const unsigned char *input, size_t length,
+            const char *digits)
+{
+    const __m256i spread = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4,
+        7, 6, 8, 7, 10, 9, 11, 10, 1, 0, 2, 1, 4, 3, 5, 4,
+        7, 6, 8, 7, 10, 9, 11, 10);
+    const __m256i shift = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, digits[62] - 62, digits[63] - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, digits[62] - 62,
+        digits[63] - 63, 'A', 0, 0);
+    __m128i lo, hi;
+    __m256i v, a, b, index, offset;
+    size_t i;
+
+    for (i = 0; i + 28 <= length; i += 24) {
+        lo = _mm_loadu_si128((const __m128i *) (const void *) (input + i));
+        hi = _mm_loadu_si128((const __m128i *) (const void *)
+                             (input + i + 12));
+        v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+        /* Split each group of three bytes into four six-bit indices. */
+        v = _mm256_shuffle_epi8(v, spread);
+        a = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        a = _mm256_mulhi_epu16(a, _mm256_set1_epi32(0x04000040));
+        b = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        b = _mm256_mullo_epi16(b, _mm256_set1_epi32(0x01000010));
+        index = _mm256_or_si256(a, b);
+
+        /* Map each index to the offset that turns it into its digit. */
+        offset = _mm256_subs_epu8(index, _mm256_set1_epi8(51));
+        a = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), index);
+        offset = _mm256_or_si256(offset,
+                                 _mm256_and_si256(a, _mm256_set1_epi8(13)));
+        offset = _mm256_shuffle_epi8(shift, offset);
+        v = _mm256_add_epi8(index, offset);
+
+        _mm256_storeu_si256((__m256i *) (void *) output, v);
+        output += 32;
+    }
+    return i;
+}
+
+
+/*
+ * Decode blocks of 16 characters into 12 bytes with SSSE3, stopping at the
+ * first block containing a byte that isn't in the alphabet.  Returns the
+ * number of characters decoded, a multiple of 16.
+ *
+ * Bytes are classified with signed comparisons, so bytes with the high bit
+ * set are never in any of the ranges.  The value of each character is the
+ * character plus an offset that depends on its range.
+ */
+__attribute__((__target__("ssse3")))
+static size_t
+decode_ssse3(unsigned char *output, const unsigned char *input,
+             size_t length, const char *digits)
+{
+    const __m128i c62 = _mm_set1_epi8(digits[62]);
+    const __m128i c63 = _mm_set1_epi8(digits[63]);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                       14, 13, 12, -1, -1, -1, -1);
+    __m128i v, upper, lower, digit, e62, e63, valid, offset;
+    size_t i;
+
+    for (i = 0; i + 16 <= length; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (const void *) (input + i));
+
+        /* Classify each character and check that all are valid. */
+        upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                              _mm_cmpgt_epi8(_mm_set1_epi8('Z' + 1), v));
+        lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+                              _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), v));
+        digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                              _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v));
+        e62 = _mm_cmpeq_epi8(v, c62);
+        e63 = _mm_cmpeq_epi8(v, c63);
+        valid = _mm_or_si128(_mm_or_si128(upper, lower),
+                             _mm_or_si128(digit, _mm_or_si128(e62, e63)));
+        if (_mm_movemask_epi8(valid) != 0xffff)
+            break;
+
+        /* Turn each character into its six-bit value. */
+        offset = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+        offset = _mm_or_si128(offset,
+                     _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+        offset = _mm_or_si128(offset,
+                     _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+        offset = _mm_or_si128(offset,
+                     _mm_and_si128(e62, _mm_set1_epi8(62 - digits[62])));
+        offset = _mm_or_si128(offset,
+                     _mm_and_si128(e63, _mm_set1_epi8(63 - digits[63])));
+        v = _mm_add_epi8(v, offset);
+
+        /* Pack each four six-bit values into three bytes. */
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        v = _mm_shuffle_epi8(v, pack);
+        store12(output, v);
+        output += 12;
+    }
+    return i;
+}
+
+
+/*
+ * Decode blocks of 32 characters into 24 bytes with AVX2.  The same as
+ * decode_ssse3 except that each 128-bit lane handles half of the block.
+ */
+__attribute__((__target__("avx2")))
+static size_t
+decode_avx2(unsigned char *output, const unsigned char *input,
+            size_t length, const char *digits)
+{
+    const __m256i c62 = _mm256_set1_epi8(digits[62]);
+    const __m256i c63 = _mm256_set1_epi8(digits[63]);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+        14, 13, 12, -1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8,
+        14, 13, 12, -1, -1, -1, -1);
+    __m256i v, upper, lower, digit, e62, e63, valid, offset;
+    size_t i;
+
+    for (i = 0; i + 32 <= length; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (const void *) (input + i));
+
+        /* Classify each character and check that all are valid. */
+        upper = _mm256_and_si256(
+                    _mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+        lower = _mm256_and_si256(
+                    _mm256_cmpgt_epi8(v, _mm256_set1_epi8('a' - 1)),
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), v));
+        digit = _mm256_and_si256(
+                    _mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                    _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        e62 = _mm256_cmpeq_epi8(v, c62);
+        e63 = _mm256_cmpeq_epi8(v, c63);
+        valid = _mm256_or_si256(_mm256_or_si256(upper, lower),
+                    _mm256_or_si256(digit, _mm256_or_si256(e62, e63)));
+        if (_mm256_movemask_epi8(valid) != -1)
+            break;
+
+        /* Turn each character into its six-bit value. */
+        offset = _mm256_and_si256(upper, _mm256_set1_epi8(-'A'));
+        offset = _mm256_or_si256(offset,
+                     _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')));
+        offset = _mm256_or_si256(offset,
+                     _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+        offset = _mm256_or_si256(offset,
+                     _mm256_and_si256(e62, _mm256_set1_epi8(62 - digits[62])));
+        offset = _mm256_or_si256(offset,
+                     _mm256_and_si256(e63, _mm256_set1_epi8(63 - digits[63])));
+        v = _mm256_add_epi8(v, offset);
+
+        /* Pack each four six-bit values into three bytes. */
+        v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+        v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+        v = _mm256_shuffle_epi8(v, pack);
+        store12(output, _mm256_castsi256_si128(v));
+        store12(output + 12, _mm256_extracti128_si256(v, 1));
+        output += 24;
+    }
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+/*
+ * Base64-encode data using at most the given SIMD instruction set.  The SIMD
+ * implementations encode whole blocks from the start of the data and the
+ * portable implementation encodes the rest.
+ */
+void
+wai_base64_encode_simd(enum wai_simd simd, char *output, const void *input,
+                       size_t length, enum wai_base64_alphabet alphabet)
+{
+    const char *digits = alphabets[alphabet].digits;
+    const unsigned char *in = input;
+    size_t done = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (simd >= WAI_SIMD_AVX2)
+        done = encode_avx2(output, in, length, digits);
+    else if (simd >= WAI_SIMD_SSSE3)
+        done = encode_ssse3(output, in, length, digits);
+#else
+    (void) simd;
+#endif
+    encode_portable(output + done / 3 * 4, in + done, length - done, digits);
+}
+
+
+/*
+ * Base64-decode data using at most the given SIMD instruction set.  The SIMD
+ * implementations decode whole blocks of valid characters from the start of
+ * the data and the portable implementation decodes the rest.
+ */
+size_t
+wai_base64_decode_simd(enum wai_simd simd, void *output, const char *input,
+                       size_t length, enum wai_base64_alphabet alphabet)
+{
+    const struct alphabet *a = &alphabets[alphabet];
+    const unsigned char *in = (const unsigned char *) input;
+    unsigned char *out = output;
+    size_t done = 0;
+
+#ifdef HAVE_X86_SIMD
+    if (simd >= WAI_SIMD_AVX2)
+        done = decode_avx2(out, in, length, a->digits);
+    else if (simd >= WAI_SIMD_SSSE3)
+        done = decode_ssse3(out, in, length, a->digits);
+#else
+    (void) simd;
+#endif
+    out += done / 4 * 3;
+    return done / 4 * 3
+        + decode_portable(out, in + done, length - done, a->values);
+}
+
+
+/*
+ * Base64-encode data with the best implementation for this processor.
+ */
+void
+wai_base64_encode(char *output, const void *input, size_t length,
+                  enum wai_base64_alphabet alphabet)
+{
+    wai_base64_encode_simd(wai_simd_available(), output, input, length,
+                           alphabet);
+}
+
+
+/*
+ * Base64-decode data with the best implementation for this processor.
+ */
+size_t
+wai_base64_decode(void *output, const char *input, size_t length,
+                  enum wai_base64_alphabet alphabet)
+{
+    return wai_base64_decode_simd(wai_simd_available(), output, input,
+                                  length, alphabet);
+}
@@ -5,6 +5,13 @@
  * various ways, such as parsing and combining them and determining whether
  * one is a subset of another.  Those utility functions are collected here.
  *
+ * Factors are checked on every request by mod_webauth and several times for
+ * every login by the WebKDC, so the factors that WebAuth knows about are
+ * interned as bits in a mask and most set operations are done on the masks.
+ * Only unknown factors, such as OTP or X.509 subfactors beyond o9 and x9, are
+ * kept as strings.  The original order of the factors is preserved in a
+ * comma-separated string, since that's the form that goes into tokens.
+ *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2011, 2013, 2014
  *     The Board of Trustees of the Leland Stanford Junior University
@@ -21,77 +28,243 @@
 #include <webauth/basic.h>
 #include <webauth/factors.h>
 
+/*
+ * Bits for the interned factors.  The numbered OTP and X.509 subfactors o1
+ * through o9 and x1 through x9 follow FACTOR_O1 and FACTOR_X1 in order.
+ */
+#define FACTOR_COOKIE               (1UL << 0)
+#define FACTOR_DEVICE               (1UL << 1)
+#define FACTOR_HUMAN                (1UL << 2)
+#define FACTOR_KERBEROS             (1UL << 3)
+#define FACTOR_MOBILE_PUSH          (1UL << 4)
+#define FACTOR_MULTIFACTOR          (1UL << 5)
+#define FACTOR_OTP                  (1UL << 6)
+#define FACTOR_PASSWORD             (1UL << 7)
+#define FACTOR_RANDOM_MULTIFACTOR   (1UL << 8)
+#define FACTOR_UNKNOWN              (1UL << 9)
+#define FACTOR_VOICE                (1UL << 10)
+#define FACTOR_X509                 (1UL << 11)
+#define FACTOR_O1                   12
+#define FACTOR_X1                   21
+
+/* All of the OTP and all of the X.509 factors. */
+#define FACTOR_OTP_ALL  (FACTOR_OTP  | (0x1ffUL << FACTOR_O1))
+#define FACTOR_X509_ALL (FACTOR_X509 | (0x1ffUL << FACTOR_X1))
+
 /*
  * Stores a set of factors that we want to perform operations on.  This is a
- * list of authentication methods (like "p", "o1", etc.) plus flags for
- * multifactor and random multifactor.  Those flags are just optimizations
- * (and may be worth dropping).
+ * mask of the interned factors, an array of any other factors, and the
+ * comma-separated string of all factors in order.  The string is allocated
+ * with room for the synthesized multifactor factor.
  */
 struct webauth_factors {
-    int multifactor;                    /* "m" (two factors in use) */
-    int random;                         /* "rm" (random multifactor) */
-    apr_array_header_t *factors;        /* Array of char * factor codes. */
+    unsigned long mask;                 /* FACTOR_* bits. */
+    apr_array_header_t *extra;          /* Other factors (char *) or NULL. */
+    char *string;                       /* All factors, comma-separated. */
+    size_t length;                      /* Length of string. */
 };
 
 
+/*
+ * Given a factor and its length, return its bit in the mask or 0 if it's not
+ * an interned factor.
+ */
+static unsigned long
+factor_bit(const char *factor, size_t length)
+{
+    if (length == 1)
+        switch (factor[0]) {
+        case 'c': return FACTOR_COOKIE;
+        case 'd': return FACTOR_DEVICE;
+        case 'h': return FACTOR_HUMAN;
+        case 'k': return FACTOR_KERBEROS;
+        case 'm': return FACTOR_MULTIFACTOR;
+        case 'o': return FACTOR_OTP;
+        case 'p': return FACTOR_PASSWORD;
+        case 'u': return FACTOR_UNKNOWN;
+        case 'v': return FACTOR_VOICE;
+        case 'x': return FACTOR_X509;
+        default:  return 0;
+        }
+    if (length != 2)
+        return 0;
+    if (factor[1] >= '1' && factor[1] <= '9') {
+        if (factor[0] == 'o')
+            return 1UL << (FACTOR_O1 + factor[1] - '1');
+        if (factor[0] == 'x')
+            return 1UL << (FACTOR_X1 + factor[1] - '1');
+    }
+    if (factor[0] == 'm' && factor[1] == 'p')
+        return FACTOR_MOBILE_PUSH;
+    if (factor[0] == 'r' && factor[1] == 'm')
+        return FACTOR_RANDOM_MULTIFACTOR;
+    return 0;
+}
+
+
+/*
+ * Returns true if the set of factors is NULL or empty.
+ */
+static bool
+factors_empty(const struct webauth_factors *factors)
+{
+    return factors == NULL || factors->length == 0;
+}
+
+
+/*
+ * Returns true if the set of factors contains the given factor, which has
+ * the given length and need not be nul-terminated.
+ */
+static bool
+factors_contains(const struct webauth_factors *factors, const char *factor,
+                 size_t length)
+{
+    unsigned long bit;
+    const char *candidate;
+    int i;
+
+    if (factors_empty(factors))
+        return false;
+    bit = factor_bit(factor, length);
+    if (bit != 0)
+        return (factors->mask & bit) != 0;
+    if (factors->extra == NULL)
+        return false;
+    for (i = 0; i < factors->extra->nelts; i++) {
+        candidate = APR_ARRAY_IDX(factors->extra, i, const char *);
+        if (strncmp(candidate, factor, length) == 0
+            && candidate[length] == '\0')
+            return true;
+    }
+    return false;
+}
+
+
+/*
+ * Create a new, empty set of factors with room for a string of the given
+ * length plus a synthesized multifactor factor.
+ */
+static struct webauth_factors *
+factors_make(struct webauth_context *ctx, size_t size)
+{
+    struct webauth_factors *factors;
+
+    factors = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
+    factors->string = apr_palloc(ctx->pool, size + 3);
+    factors->string[0] = '\0';
+    return factors;
+}
+
+
+/*
+ * Add a factor with the given length, which need not be nul-terminated, to a
+ * set of factors.  The caller is responsible for ensuring that the string
+ * has room for it.  This does not check for duplicates.
+ */
+static void
+factors_add(struct webauth_context *ctx, struct webauth_factors *factors,
+            const char *factor, size_t length)
+{
+    unsigned long bit;
+
+    bit = factor_bit(factor, length);
+    if (bit != 0)
+        factors->mask |= bit;
+    else {
+        if (factors->extra == NULL)
+            factors->extra = apr_array_make(ctx->pool, 1, sizeof(char *));
+        APR_ARRAY_PUSH(factors->extra, char *)
+            = apr_pstrmemdup(ctx->pool, factor, length);
+    }
+    if (factors->length > 0)
+        factors->string[factors->length++] = ',';
+    memcpy(factors->string + factors->length, factor, length);
+    factors->length += length;
+    factors->string[factors->length] = '\0';
+}
+
+
+/*
+ * Add each factor in a comma-separated string to a set of factors unless
+ * it's already present.  Empty factors are ignored.
+ */
+static void
+factors_add_string(struct webauth_context *ctx,
+                   struct webauth_factors *factors, const char *string)
+{
+    const char *factor;
+    size_t length;
+
+    for (factor = string; *factor != '\0'; factor += length) {
+        length = strcspn(factor, ",");
+        if (length > 0 && !factors_contains(factors, factor, length))
+            factors_add(ctx, factors, factor, length);
+        if (factor[length] == ',')
+            length++;
+    }
+}
+
+
 /*
  * Scan a set of factors and add a synthesized multifactor factor if it
- * includes authentications from multiple factors.
+ * includes authentications from multiple factors.  Each class of factor is a
+ * set of bits, except for unknown OTP and X.509 factors, which are
+ * recognized by their first letter.
  */
 static void
-maybe_synthesize_multifactor(struct webauth_factors *factors)
+maybe_synthesize_multifactor(struct webauth_context *ctx,
+                             struct webauth_factors *factors)
 {
-    int types, i;
     const char *factor;
-    bool human    = false;
-    bool mobile   = false;
-    bool otp      = false;
-    bool password = false;
-    bool voice    = false;
-    bool x509     = false;
+    unsigned long mask;
+    int types, i;
+    bool otp, x509;
 
     /* If this set of factors already includes multifactor, do nothing. */
-    if (factors->multifactor)
+    if (factors->mask & FACTOR_MULTIFACTOR)
         return;
 
-    /* Scan the factors and count how many classes we have. */
-    for (i = 0; i < factors->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(factors->factors, i, const char *);
-        if      (strcmp(factor, WA_FA_HUMAN)       == 0) human    = true;
-        else if (strcmp(factor, WA_FA_MOBILE_PUSH) == 0) mobile   = true;
-        else if (strcmp(factor, WA_FA_PASSWORD)    == 0) password = true;
-        else if (strcmp(factor, WA_FA_VOICE)       == 0) voice    = true;
-        else if (factor[0] == 'o')                       otp      = true;
-        else if (factor[0] == 'x')                       x509     = true;
-    }
-    types = (int) human + mobile + password + otp + voice + x509;
+    /* Count how many classes we have. */
+    mask = factors->mask;
+    otp  = (mask & FACTOR_OTP_ALL) != 0;
+    x509 = (mask & FACTOR_X509_ALL) != 0;
+    if (factors->extra != NULL)
+        for (i = 0; i < factors->extra->nelts; i++) {
+            factor = APR_ARRAY_IDX(factors->extra, i, const char *);
+            if      (factor[0] == 'o') otp  = true;
+            else if (factor[0] == 'x') x509 = true;
+        }
+    types = (int) otp + x509;
+    types += (mask & FACTOR_HUMAN)       ? 1 : 0;
+    types += (mask & FACTOR_MOBILE_PUSH) ? 1 : 0;
+    types += (mask & FACTOR_PASSWORD)    ? 1 : 0;
+    types += (mask & FACTOR_VOICE)       ? 1 : 0;
 
     /* If we have factors from more than one class, synthesize multifactor. */
-    if (types >= 2) {
-        factors->multifactor = true;
-        APR_ARRAY_PUSH(factors->factors, const char *) = WA_FA_MULTIFACTOR;
-    }
+    if (types >= 2)
+        factors_add(ctx, factors, WA_FA_MULTIFACTOR, 1);
 }
 
 
 /*
- * Return a copy of a webauth_factors struct in newly-allocated pool memory.
- * This does not deep-copy the factor strings; eventually, webauth_factors
- * will be opaque so this won't be needed.
+ * Return a copy of a webauth_factors struct in newly-allocated pool memory
+ * with room to add the factors from a string of the given length.
  */
 static struct webauth_factors *
 factors_copy(struct webauth_context *ctx,
-             const struct webauth_factors *factors)
+             const struct webauth_factors *factors, size_t extra)
 {
     struct webauth_factors *copy;
 
-    if (factors == NULL) {
-        copy = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
-        copy->factors = apr_array_make(ctx->pool, 1, sizeof(const char *));
-    } else {
-        copy = apr_pmemdup(ctx->pool, factors, sizeof(*factors));
-        copy->factors = apr_array_copy(ctx->pool, factors->factors);
-    }
+    if (factors == NULL)
+        return factors_make(ctx, extra);
+    copy = factors_make(ctx, factors->length + 1 + extra);
+    copy->mask = factors->mask;
+    if (factors->extra != NULL)
+        copy->extra = apr_array_copy(ctx->pool, factors->extra);
+    memcpy(copy->string, factors->string, factors->length + 1);
+    copy->length = factors->length;
     return copy;
 }
 
@@ -102,21 +275,15 @@ factors_copy(struct webauth_context *ctx,
  * multifactor are always considered to satisfy random multifactor as well.
  */
 static bool
-factors_satisfies(const struct webauth_factors *factors, const char *factor)
+factors_satisfies(const struct webauth_factors *factors, const char *factor,
+                  size_t length)
 {
-    int i;
-    const char *candidate;
-
-    if (factors == NULL || apr_is_empty_array(factors->factors))
+    if (factors_empty(factors))
         return false;
-    if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0 && factors->multifactor)
-        return true;
-    for (i = 0; i < factors->factors->nelts; i++) {
-        candidate = APR_ARRAY_IDX(factors->factors, i, const char *);
-        if (strcmp(factor, candidate) == 0)
+    if (factor_bit(factor, length) == FACTOR_RANDOM_MULTIFACTOR)
+        if (factors->mask & FACTOR_MULTIFACTOR)
             return true;
-    }
-    return false;
+    return factors_contains(factors, factor, length);
 }
 
 
@@ -128,10 +295,21 @@ apr_array_header_t *
 webauth_factors_array(struct webauth_context *ctx,
                       const struct webauth_factors *factors)
 {
-    if (factors == NULL || apr_is_empty_array(factors->factors))
-        return apr_array_make(ctx->pool, 1, sizeof(const char *));
-    else
-        return apr_array_copy(ctx->pool, factors->factors);
+    apr_array_header_t *result;
+    const char *factor;
+    size_t length;
+
+    result = apr_array_make(ctx->pool, 2, sizeof(const char *));
+    if (factors_empty(factors))
+        return result;
+    for (factor = factors->string; *factor != '\0'; factor += length + 1) {
+        length = strcspn(factor, ",");
+        APR_ARRAY_PUSH(result, const char *)
+            = apr_pstrmemdup(ctx->pool, factor, length);
+        if (factor[length] == '\0')
+            break;
+    }
+    return result;
 }
 
 
@@ -145,17 +323,7 @@ webauth_factors_contains(struct webauth_context *ctx UNUSED,
                          const struct webauth_factors *factors,
                          const char *factor)
 {
-    int i;
-    const char *candidate;
-
-    if (factors == NULL || apr_is_empty_array(factors->factors))
-        return false;
-    for (i = 0; i < factors->factors->nelts; i++) {
-        candidate = APR_ARRAY_IDX(factors->factors, i, const char *);
-        if (strcmp(factor, candidate) == 0)
-            return true;
-    }
-    return false;
+    return factors_contains(factors, factor, strlen(factor));
 }
 
 
@@ -169,25 +337,19 @@ webauth_factors_new(struct webauth_context *ctx,
                     const apr_array_header_t *factors)
 {
     struct webauth_factors *result;
-    int i;
     const char *factor;
+    size_t size = 0;
+    int i;
 
-    /* Create the new webauth_factors struct and copy the factors. */
-    result = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
-    if (factors != NULL)
-        result->factors = apr_array_copy(ctx->pool, factors);
-    else
-        result->factors = apr_array_make(ctx->pool, 1, sizeof(const char *));
-
-    /* Fill out the multifactor and random multifactor data. */
-    for (i = 0; i < result->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(result->factors, i, const char *);
-        if (strcmp(factor, WA_FA_MULTIFACTOR) == 0)
-            result->multifactor = true;
-        else if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0)
-            result->random = true;
+    if (factors == NULL)
+        return factors_make(ctx, 0);
+    for (i = 0; i < factors->nelts; i++)
+        size += strlen(APR_ARRAY_IDX(factors, i, const char *)) + 1;
+    result = factors_make(ctx, size);
+    for (i = 0; i < factors->nelts; i++) {
+        factor = APR_ARRAY_IDX(factors, i, const char *);
+        factors_add(ctx, result, factor, strlen(factor));
     }
-
     return result;
 }
 
@@ -201,48 +363,21 @@ struct webauth_factors *
 webauth_factors_parse(struct webauth_context *ctx, const char *input)
 {
     struct webauth_factors *factors;
-    char *copy;
-    char *last = NULL;
-    const char *factor;
 
     /*
      * Create an empty webauth_factors struct and return it if the string is
      * NULL or empty.
      */
-    factors = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
-    factors->factors = apr_array_make(ctx->pool, 1, sizeof(const char *));
     if (input == NULL || input[0] == '\0')
-        return factors;
+        return factors_make(ctx, 0);
 
     /*
-     * Always duplicate the input string to isolate the newly-created
-     * webkdc_factors struct from the input.
+     * Add each factor, skipping duplicates, and then see if we should
+     * synthesize a multifactor factor.
      */
-    copy = apr_pstrdup(ctx->pool, input);
-
-    /*
-     * Walk through each factor and add it to the array.  In the process, set
-     * the booleans for multifactor and random multifactor if we see them.
-     */
-    for (factor = apr_strtok(copy, ",", &last); factor != NULL;
-         factor = apr_strtok(NULL, ",", &last)) {
-
-        /* Only add the factor if it's not a duplicate. */
-        if (webauth_factors_contains(ctx, factors, factor))
-            continue;
-
-        /* Add the factor and set the multifactor and random flags. */
-        APR_ARRAY_PUSH(factors->factors, const char *) = factor;
-        if (strcmp(factor, WA_FA_MULTIFACTOR) == 0)
-            factors->multifactor = true;
-        else if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0)
-            factors->random = true;
-    }
-
-    /* See if we should synthesize a multifactor factor. */
-    maybe_synthesize_multifactor(factors);
-
-    /* Return the result. */
+    factors = factors_make(ctx, strlen(input));
+    factors_add_string(ctx, factors, input);
+    maybe_synthesize_multifactor(ctx, factors);
     return factors;
 }
 
@@ -258,34 +393,19 @@ webauth_factors_union(struct webauth_context *ctx,
                       const struct webauth_factors *two)
 {
     struct webauth_factors *result;
-    int i;
-    const char *factor;
 
     /* Handle trivial cases. */
-    if (one == NULL || apr_is_empty_array(one->factors))
-        return factors_copy(ctx, two);
-    else if (two == NULL || apr_is_empty_array(two->factors))
-        return factors_copy(ctx, one);
+    if (factors_empty(one))
+        return factors_copy(ctx, two, 0);
+    else if (factors_empty(two))
+        return factors_copy(ctx, one, 0);
 
     /* We have to merge. */
-    result = factors_copy(ctx, one);
-    for (i = 0; i < two->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(two->factors, i, const char *);
-
-        /* Check whether the factor already exists in the result. */
-        if (webauth_factors_contains(ctx, result, factor))
-            continue;
-
-        /* Add the new factor to the result. */
-        APR_ARRAY_PUSH(result->factors, const char *) = factor;
-        if (strcmp(factor, WA_FA_MULTIFACTOR) == 0)
-            result->multifactor = true;
-        else if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0)
-            result->random = true;
-    }
+    result = factors_copy(ctx, one, two->length);
+    factors_add_string(ctx, result, two->string);
 
     /* See if we should synthesize a multifactor factor. */
-    maybe_synthesize_multifactor(result);
+    maybe_synthesize_multifactor(ctx, result);
 
     /* Return the result. */
     return result;
@@ -301,31 +421,40 @@ char *
 webauth_factors_string(struct webauth_context *ctx,
                        const struct webauth_factors *factors)
 {
-    if (factors == NULL || apr_is_empty_array(factors->factors))
+    if (factors_empty(factors))
         return NULL;
-    return apr_array_pstrcat(ctx->pool, factors->factors, ',');
+    return apr_pstrmemdup(ctx->pool, factors->string, factors->length);
 }
 
 
 /*
  * Given two sets of factors (struct webauth_factors), return true if the
- * first set satisfies the second set, false otherwise.
+ * first set satisfies the second set, false otherwise.  For the interned
+ * factors, this is just a comparison of masks, allowing multifactor to stand
+ * in for random multifactor.  Any other factors in the second set have to be
+ * checked individually.
  */
 int
 webauth_factors_satisfies(struct webauth_context *ctx UNUSED,
                           const struct webauth_factors *one,
                           const struct webauth_factors *two)
 {
+    unsigned long wanted;
     const char *factor;
     int i;
 
     if (two == NULL)
         return true;
-    if (!one->multifactor && two->multifactor)
+    wanted = two->mask;
+    if (one->mask & FACTOR_MULTIFACTOR)
+        wanted &= ~FACTOR_RANDOM_MULTIFACTOR;
+    if ((one->mask & wanted) != wanted)
         return false;
-    for (i = 0; i < two->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(two->factors, i, const char *);
-        if (!factors_satisfies(one, factor))
+    if (two->extra == NULL)
+        return true;
+    for (i = 0; i < two->extra->nelts; i++) {
+        factor = APR_ARRAY_IDX(two->extra, i, const char *);
+        if (!factors_contains(one, factor, strlen(factor)))
             return false;
     }
     return true;
@@ -344,34 +473,25 @@ webauth_factors_subtract(struct webauth_context *ctx,
 {
     struct webauth_factors *result;
     const char *factor;
-    int i;
+    size_t length;
 
     /* Handle some trivial cases. */
     if (one == NULL)
         return NULL;
-    if (two == NULL) {
-        result = apr_pmemdup(ctx->pool, one, sizeof(struct webauth_factors));
-        result->factors = apr_array_copy(ctx->pool, one->factors);
-        return result;
-    }
-
-    /* Create the new set of factors that we will return. */
-    result = apr_pcalloc(ctx->pool, sizeof(struct webauth_factors));
-    result->factors = apr_array_make(ctx->pool, 2, sizeof(const char *));
+    if (two == NULL)
+        return factors_copy(ctx, one, 0);
 
     /*
      * Walk the list of factors in one and, for each, check whether it's
-     * satisifed by two.  This is O(n^2), but factor lists tend to be small.
+     * satisifed by two, preserving the order of the factors in one.
      */
-    for (i = 0; i < one->factors->nelts; i++) {
-        factor = APR_ARRAY_IDX(one->factors, i, const char *);
-        if (!factors_satisfies(two, factor)) {
-            APR_ARRAY_PUSH(result->factors, const char *) = factor;
-            if (strcmp(factor, WA_FA_MULTIFACTOR) == 0)
-                result->multifactor = true;
-            if (strcmp(factor, WA_FA_RANDOM_MULTIFACTOR) == 0)
-                result->random = true;
-        }
+    result = factors_make(ctx, one->length);
+    for (factor = one->string; *factor != '\0'; factor += length) {
+        length = strcspn(factor, ",");
+        if (!factors_satisfies(two, factor, length))
+            factors_add(ctx, result, factor, length);
+        if (factor[length] == ',')
+            length++;
     }
     return result;
 }
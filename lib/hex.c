@@ -13,6 +13,9 @@
 
 #include <assert.h>
 #include <ctype.h>
+#ifdef HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
 
 #include <lib/internal.h>
 #include <webauth/basic.h>
@@ -58,15 +61,110 @@ wai_hex_decoded_length(size_t length, size_t *out_length)
 }
 
 
+#ifdef HAVE_X86_SIMD
+
+/*
+ * Hex-encode blocks of 16 bytes into 32 characters with SSE2, working
+ * backwards from the end of the input like wai_hex_encode_simd so that the
+ * output may start at the input.  Returns the number of bytes encoded, all
+ * of them from the end, leaving the rest at the start of the input.
+ */
+__attribute__((__target__("sse2")))
+static size_t
+hex_encode_sse2(const unsigned char *input, size_t length,
+                unsigned char *output)
+{
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letter = _mm_set1_epi8('a' - '0' - 10);
+    __m128i v, hi, lo, a, b;
+    size_t n;
+
+    for (n = length; n >= 16; n -= 16) {
+        v = _mm_loadu_si128((const __m128i *) (const void *) (input + n - 16));
+        hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        lo = _mm_and_si128(v, mask);
+        a = _mm_unpacklo_epi8(hi, lo);
+        b = _mm_unpackhi_epi8(hi, lo);
+        a = _mm_add_epi8(_mm_add_epi8(a, zero),
+                         _mm_and_si128(_mm_cmpgt_epi8(a, nine), letter));
+        b = _mm_add_epi8(_mm_add_epi8(b, zero),
+                         _mm_and_si128(_mm_cmpgt_epi8(b, nine), letter));
+        _mm_storeu_si128((__m128i *) (void *) (output + 2 * n - 32), a);
+        _mm_storeu_si128((__m128i *) (void *) (output + 2 * n - 16), b);
+    }
+    return length - n;
+}
+
+
+/*
+ * Hex-decode blocks of 32 characters into 16 bytes with SSE2.  Returns the
+ * number of characters decoded, a multiple of 32, or -1 if a character in
+ * one of the blocks isn't a hex digit.
+ */
+__attribute__((__target__("sse2")))
+static ssize_t
+hex_decode_sse2(const unsigned char *input, size_t length,
+                unsigned char *output)
+{
+    __m128i v[2], digit, upper, lower, valid, offset;
+    size_t i;
+    int j;
+
+    for (i = 0; i + 32 <= length; i += 32) {
+        for (j = 0; j < 2; j++) {
+            v[j] = _mm_loadu_si128((const __m128i *) (const void *)
+                                   (input + i + 16 * j));
+            digit = _mm_and_si128(
+                        _mm_cmpgt_epi8(v[j], _mm_set1_epi8('0' - 1)),
+                        _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), v[j]));
+            upper = _mm_and_si128(
+                        _mm_cmpgt_epi8(v[j], _mm_set1_epi8('A' - 1)),
+                        _mm_cmpgt_epi8(_mm_set1_epi8('F' + 1), v[j]));
+            lower = _mm_and_si128(
+                        _mm_cmpgt_epi8(v[j], _mm_set1_epi8('a' - 1)),
+                        _mm_cmpgt_epi8(_mm_set1_epi8('f' + 1), v[j]));
+            valid = _mm_or_si128(digit, _mm_or_si128(upper, lower));
+            if (_mm_movemask_epi8(valid) != 0xffff)
+                return -1;
+
+            /*
+             * Turn each digit into its value, and then each pair of values
+             * (the low and high bytes of a 16-bit word) into a byte.
+             */
+            offset = _mm_and_si128(digit, _mm_set1_epi8(-'0'));
+            offset = _mm_or_si128(offset,
+                         _mm_and_si128(upper, _mm_set1_epi8(10 - 'A')));
+            offset = _mm_or_si128(offset,
+                         _mm_and_si128(lower, _mm_set1_epi8(10 - 'a')));
+            v[j] = _mm_add_epi8(v[j], offset);
+            v[j] = _mm_or_si128(
+                       _mm_and_si128(_mm_slli_epi16(v[j], 4),
+                                     _mm_set1_epi16(0xf0)),
+                       _mm_srli_epi16(v[j], 8));
+        }
+        _mm_storeu_si128((__m128i *) (void *) (output + i / 2),
+                         _mm_packus_epi16(v[0], v[1]));
+    }
+    return i;
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
 /*
  * Given a buffer of data and its length, encode it into hex and store it in
- * the buffer pointed to by output.  Store the encoded length in output_len.
- * output must point to at least max_output_len bytes of space.  Returns a
- * WA_ERR code.
+ * the buffer pointed to by output, using at most the given SIMD instruction
+ * set.  Store the encoded length in output_len.  output must point to at
+ * least max_output_len bytes of space.  Returns a WA_ERR code.
+ *
+ * The data is encoded from the end backwards so that output may point to
+ * input.
  */
 int
-wai_hex_encode(const char *input, size_t input_len, char *output,
-               size_t *output_len, size_t max_output_len)
+wai_hex_encode_simd(enum wai_simd simd, const char *input, size_t input_len,
+                    char *output, size_t *output_len, size_t max_output_len)
 {
     size_t out_len;
     unsigned char *s;
@@ -74,12 +172,19 @@ wai_hex_encode(const char *input, size_t input_len, char *output,
 
     *output_len = 0;
     out_len = 2 * input_len;
-    s = (unsigned char *) input + input_len - 1;
-    d = (unsigned char *) output + out_len - 1;
 
     if (max_output_len < out_len)
         return WA_ERR_NO_ROOM;
 
+#ifdef HAVE_X86_SIMD
+    if (simd >= WAI_SIMD_SSE2)
+        input_len -= hex_encode_sse2((const unsigned char *) input,
+                                     input_len, (unsigned char *) output);
+#else
+    (void) simd;
+#endif
+    s = (unsigned char *) input + input_len - 1;
+    d = (unsigned char *) output + 2 * input_len - 1;
     while (input_len) {
         *d-- = hex[*s & 15];
         *d-- = hex[*s-- >> 4];
@@ -92,17 +197,33 @@ wai_hex_encode(const char *input, size_t input_len, char *output,
 
 
 /*
- * Given a hex-encded string in input of length input_len, decode it into the
- * buffer pointed to by output and store the decoded length in output_len.
- * max_output_len is the size of the buffer.  Returns a WA_ERR code.
+ * Hex-encode data with the best implementation for this processor.
  */
 int
-wai_hex_decode(char *input, size_t input_len, char *output,
+wai_hex_encode(const char *input, size_t input_len, char *output,
                size_t *output_len, size_t max_output_len)
+{
+    return wai_hex_encode_simd(wai_simd_available(), input, input_len,
+                               output, output_len, max_output_len);
+}
+
+
+/*
+ * Given a hex-encded string in input of length input_len, decode it into the
+ * buffer pointed to by output using at most the given SIMD instruction set,
+ * and store the decoded length in output_len.  max_output_len is the size of
+ * the buffer.  Returns a WA_ERR code.
+ */
+int
+wai_hex_decode_simd(enum wai_simd simd, char *input, size_t input_len,
+                    char *output, size_t *output_len, size_t max_output_len)
 {
     unsigned char *s = (unsigned char *) input;
     unsigned char *d = (unsigned char *) output;
     size_t n;
+#ifdef HAVE_X86_SIMD
+    ssize_t done;
+#endif
 
     assert(input != NULL);
     assert(output != NULL);
@@ -122,6 +243,18 @@ wai_hex_decode(char *input, size_t input_len, char *output,
         return WA_ERR_NO_ROOM;
 
     n = input_len;
+#ifdef HAVE_X86_SIMD
+    if (simd >= WAI_SIMD_SSE2) {
+        done = hex_decode_sse2(s, n, d);
+        if (done < 0)
+            return WA_ERR_CORRUPT;
+        s += done;
+        d += done / 2;
+        n -= done;
+    }
+#else
+    (void) simd;
+#endif
     while (n) {
         if (isxdigit(*s) && isxdigit(*(s + 1))) {
             *d++ = (unsigned char) ((HEX2INT(*s) << 4) + HEX2INT(*(s + 1)));
@@ -134,3 +267,15 @@ wai_hex_decode(char *input, size_t input_len, char *output,
 
     return WA_ERR_NONE;
 }
+
+
+/*
+ * Hex-decode data with the best implementation for this processor.
+ */
+int
+wai_hex_decode(char *input, size_t input_len, char *output,
+               size_t *output_len, size_t max_output_len)
+{
+    return wai_hex_decode_simd(wai_simd_available(), input, input_len,
+                               output, output_len, max_output_len);
+}
@@ -0,0 +1,356 @@
+/*
+ * Compiled index of the WebKDC identity ACL.
+ *
+ * The identity ACL says which alternate authorization identities a user may
+ * assert to which sites.  Rather than reading the file on every login, the
+ * file is parsed once into a hash keyed by the authenticated identity and
+ * the target site, and the parsed index is kept in a process-wide cache
+ * keyed by path.  Each lookup stats the file and reparses it if its inode,
+ * size, or modification time has changed.  The new index is built without
+ * holding the cache mutex and then replaces the old one, so other threads
+ * keep using the old index while the file is being reparsed.
+ *
+ * Syntax errors are recorded in the index with their line numbers and are
+ * reported only to lookups that the original line-by-line scan would have
+ * failed on: a line with no target for lookups by that authenticated
+ * identity, a line with no identity for lookups by that identity to that
+ * target, and a line that's too long or a read error for every lookup.  If
+ * a lookup would hit several errors, the one earliest in the file wins.
+ *
+ * Lookups copy the matching identities into the caller's pool while holding
+ * the cache mutex, so an index can be freed as soon as it's replaced.  Each
+ * index is allocated from its own unmanaged APR pool, and the cache itself
+ * survives apr_terminate and is never freed.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <apr_atomic.h>
+#include <apr_hash.h>
+#include <apr_lib.h>
+#include <apr_thread_mutex.h>
+#include <limits.h>
+
+#include <lib/internal.h>
+#include <util/macros.h>
+#include <webauth/basic.h>
+
+/* An error found while parsing the file. */
+struct id_acl_error {
+    unsigned long line;         /* Line number, or ULONG_MAX if none. */
+    int status;                 /* WebAuth status code. */
+    const char *message;        /* Error message. */
+};
+
+/* An entry in the index, for one authenticated identity and target. */
+struct id_acl_entry {
+    apr_array_header_t *identities;     /* Permitted identities. */
+    struct id_acl_error *error;         /* First error, or NULL. */
+};
+
+/* A parsed identity ACL. */
+struct id_acl {
+    apr_pool_t *pool;           /* Unmanaged pool for this index. */
+    apr_time_t mtime;           /* Modification time of the file. */
+    apr_off_t size;             /* Size of the file. */
+    apr_ino_t inode;            /* Inode of the file. */
+    apr_hash_t *entries;        /* Map of "authn target" to entries. */
+    apr_hash_t *errors;         /* Map of authn to errors without target. */
+    struct id_acl_error *error; /* Error affecting every lookup, or NULL. */
+};
+
+/* The process-wide cache of parsed identity ACLs. */
+struct id_acl_cache {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;  /* Protects acls and the indexes in it. */
+#endif
+    apr_hash_t *acls;           /* Map of paths to struct id_acl. */
+};
+static volatile void *id_acl_cache = NULL;
+
+
+/*
+ * Lock or unlock the cache.
+ */
+static void
+cache_lock(struct id_acl_cache *cache UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+}
+
+static void
+cache_unlock(struct id_acl_cache *cache UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
+
+
+/*
+ * Return the process-wide cache, creating it if this is the first use.  If
+ * two threads race to create it, the loser destroys its copy.  Returns NULL
+ * if the cache can't be created, in which case the file is parsed for each
+ * lookup.
+ */
+static struct id_acl_cache *
+cache_get(void)
+{
+    struct id_acl_cache *cache;
+    apr_pool_t *pool;
+
+    cache = apr_atomic_casptr(&id_acl_cache, NULL, NULL);
+    if (cache != NULL)
+        return cache;
+    if (apr_pool_create_unmanaged(&pool) != APR_SUCCESS)
+        return NULL;
+    cache = apr_pcalloc(pool, sizeof(struct id_acl_cache));
+    cache->pool = pool;
+    cache->acls = apr_hash_make(pool);
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, pool)
+        != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+#endif
+    if (apr_atomic_casptr(&id_acl_cache, cache, NULL) != NULL) {
+        apr_pool_destroy(pool);
+        cache = apr_atomic_casptr(&id_acl_cache, NULL, NULL);
+    }
+    return cache;
+}
+
+
+/*
+ * Create a parse error allocated from the pool of an index.
+ */
+static struct id_acl_error *
+error_new(struct id_acl *acl, unsigned long line, int status,
+          const char *format, ...)
+{
+    struct id_acl_error *error;
+    va_list args;
+
+    error = apr_palloc(acl->pool, sizeof(struct id_acl_error));
+    error->line = line;
+    error->status = status;
+    va_start(args, format);
+    error->message = apr_pvsprintf(acl->pool, format, args);
+    va_end(args);
+    return error;
+}
+
+
+/*
+ * Parse an identity ACL file into a new index.  The format of each line is:
+ *
+ *     <authn> <target> <authz>
+ *
+ * where <authn> is the user's actual authenticated identity, <target> is the
+ * identity of the site to which the user is going, and <authz> is an
+ * alternate authorization identity the user is allowed to express to that
+ * site.  The file information must include the modification time, size, and
+ * inode.  Returns an error code, and fails only if the file can't be opened.
+ */
+static int
+acl_parse(struct webauth_context *ctx, const char *path,
+          const apr_finfo_t *finfo, struct id_acl **result)
+{
+    struct id_acl *acl;
+    struct id_acl_entry *entry;
+    apr_pool_t *pool;
+    apr_file_t *file;
+    apr_int32_t flags;
+    apr_status_t code;
+    unsigned long line;
+    char buf[BUFSIZ];
+    char *p, *authn, *was, *authz, *key, *last;
+    int s;
+
+    /* Create the index and open the file. */
+    code = apr_pool_create_unmanaged(&pool);
+    if (code != APR_SUCCESS)
+        return wai_error_set_apr(ctx, WA_ERR_APR, code, "cannot create pool");
+    acl = apr_pcalloc(pool, sizeof(struct id_acl));
+    acl->pool = pool;
+    acl->mtime = finfo->mtime;
+    acl->size = finfo->size;
+    acl->inode = finfo->inode;
+    acl->entries = apr_hash_make(pool);
+    acl->errors = apr_hash_make(pool);
+    flags = APR_FOPEN_READ | APR_FOPEN_BUFFERED | APR_FOPEN_NOCLEANUP;
+    code = apr_file_open(&file, path, flags, APR_FPROT_OS_DEFAULT, pool);
+    if (code != APR_SUCCESS) {
+        s = WA_ERR_FILE_OPENREAD;
+        wai_error_set_apr(ctx, s, code, "identity ACL %s", path);
+        apr_pool_destroy(pool);
+        return s;
+    }
+
+    /* Read the file line by line and add each line to the index. */
+    line = 0;
+    while ((code = apr_file_gets(buf, sizeof(buf), file)) == APR_SUCCESS) {
+        line++;
+        if (buf[strlen(buf) - 1] != '\n') {
+            acl->error = error_new(acl, line, WA_ERR_FILE_READ,
+                                   "identity ACL %s line %lu too long", path,
+                                   line);
+            break;
+        }
+        p = buf;
+        while (apr_isspace(*p))
+            p++;
+        if (*p == '#' || *p == '\0')
+            continue;
+        authn = apr_strtok(p, " \t\r\n", &last);
+        if (authn == NULL)
+            continue;
+        was = apr_strtok(NULL, " \t\r\n", &last);
+        if (was == NULL) {
+            if (apr_hash_get(acl->errors, authn, APR_HASH_KEY_STRING) == NULL)
+                apr_hash_set(acl->errors, apr_pstrdup(pool, authn),
+                             APR_HASH_KEY_STRING,
+                             error_new(acl, line, WA_ERR_FILE_READ,
+                                       "missing target on identity ACL %s"
+                                       " line %lu", path, line));
+            continue;
+        }
+        key = apr_pstrcat(pool, authn, " ", was, (char *) 0);
+        entry = apr_hash_get(acl->entries, key, APR_HASH_KEY_STRING);
+        if (entry == NULL) {
+            entry = apr_pcalloc(pool, sizeof(struct id_acl_entry));
+            apr_hash_set(acl->entries, key, APR_HASH_KEY_STRING, entry);
+        }
+        authz = apr_strtok(NULL, " \t\r\n", &last);
+        if (authz == NULL) {
+            if (entry->error == NULL)
+                entry->error = error_new(acl, line, WA_ERR_FILE_READ,
+                                         "missing identity on identity ACL"
+                                         " %s line %lu", path, line);
+            continue;
+        }
+        if (entry->identities == NULL)
+            entry->identities = apr_array_make(pool, 1, sizeof(char *));
+        APR_ARRAY_PUSH(entry->identities, char *) = apr_pstrdup(pool, authz);
+    }
+    if (code != APR_SUCCESS && code != APR_EOF && acl->error == NULL) {
+        acl->error = error_new(acl, ULONG_MAX, WA_ERR_FILE_READ,
+                               "identity ACL %s: %s", path,
+                               apr_strerror(code, buf, sizeof(buf)));
+    }
+    apr_file_close(file);
+    *result = acl;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Look up the identities for an authenticated identity and target in an
+ * index, copying them into the pool of the WebAuth context.  Stores NULL if
+ * there are none.  Returns an error code.
+ */
+static int
+acl_lookup(struct webauth_context *ctx, const struct id_acl *acl,
+           const char *authn, const char *target,
+           const apr_array_header_t **result)
+{
+    const struct id_acl_entry *entry;
+    const struct id_acl_error *error, *candidate;
+    const char *key;
+
+    /* Find the earliest error, if any, that applies to this lookup. */
+    key = apr_pstrcat(ctx->pool, authn, " ", target, (char *) 0);
+    entry = apr_hash_get(acl->entries, key, APR_HASH_KEY_STRING);
+    error = acl->error;
+    candidate = apr_hash_get(acl->errors, authn, APR_HASH_KEY_STRING);
+    if (candidate != NULL && (error == NULL || candidate->line < error->line))
+        error = candidate;
+    if (entry != NULL && entry->error != NULL)
+        if (error == NULL || entry->error->line < error->line)
+            error = entry->error;
+    if (error != NULL)
+        return wai_error_set(ctx, error->status, "%s", error->message);
+
+    /* Copy the identities into the caller's pool. */
+    if (entry == NULL || entry->identities == NULL)
+        *result = NULL;
+    else
+        *result = apr_array_copy(ctx->pool, entry->identities);
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Given the path to the identity ACL file, the authenticated user, and the
+ * destination site, determine the permissible authentication identities for
+ * that destination site.  Stores that list in a newly-allocated array, which
+ * may be set to NULL if none of its entries apply to the current
+ * authentication.  Returns an error code.
+ */
+int
+wai_id_acl_lookup(struct webauth_context *ctx, const char *path,
+                  const char *authn, const char *target,
+                  const apr_array_header_t **result)
+{
+    struct id_acl_cache *cache;
+    struct id_acl *acl, *old;
+    apr_finfo_t finfo;
+    apr_int32_t wanted;
+    apr_status_t code;
+    int s;
+
+    /* Check the current state of the file. */
+    *result = NULL;
+    wanted = APR_FINFO_MTIME | APR_FINFO_SIZE | APR_FINFO_INODE;
+    code = apr_stat(&finfo, path, wanted, ctx->pool);
+    if (code != APR_SUCCESS && code != APR_INCOMPLETE) {
+        s = WA_ERR_FILE_OPENREAD;
+        return wai_error_set_apr(ctx, s, code, "identity ACL %s", path);
+    }
+
+    /* Use the cached index if it's still current. */
+    cache = cache_get();
+    if (cache != NULL) {
+        cache_lock(cache);
+        acl = apr_hash_get(cache->acls, path, APR_HASH_KEY_STRING);
+        if (acl != NULL && acl->mtime == finfo.mtime
+            && acl->size == finfo.size && acl->inode == finfo.inode) {
+            s = acl_lookup(ctx, acl, authn, target, result);
+            cache_unlock(cache);
+            return s;
+        }
+        cache_unlock(cache);
+    }
+
+    /* Parse the file and replace the cached index. */
+    s = acl_parse(ctx, path, &finfo, &acl);
+    if (s != WA_ERR_NONE)
+        return s;
+    if (cache == NULL) {
+        s = acl_lookup(ctx, acl, authn, target, result);
+        apr_pool_destroy(acl->pool);
+        return s;
+    }
+    cache_lock(cache);
+    old = apr_hash_get(cache->acls, path, APR_HASH_KEY_STRING);
+    if (old == NULL)
+        path = apr_pstrdup(cache->pool, path);
+    apr_hash_set(cache->acls, path, APR_HASH_KEY_STRING, acl);
+    s = acl_lookup(ctx, acl, authn, target, result);
+    cache_unlock(cache);
+    if (old != NULL)
+        apr_pool_destroy(old->pool);
+    return s;
+}
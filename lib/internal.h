@@ -20,8 +20,10 @@
 #include <apr_tables.h>         /* apr_array_header_t */
 #include <apr_xml.h>            /* apr_xml_elem */
 #include <webauth/basic.h>      /* enum webauth_log_level, webauth_log_func */
+#include <webauth/keys.h>       /* enum webauth_key_usage */
+#include <webauth/tokens.h>     /* enum webauth_token_format */
 
-struct webauth_keyring;
+struct wai_key_schedule;
 struct webauth_token;
 struct webauth_token_request;
 struct webauth_user_info;
@@ -54,6 +56,9 @@ struct webauth_context {
     struct wai_log_callback info;
     struct wai_log_callback trace;
 
+    /* Wire format for newly encrypted tokens. */
+    enum webauth_token_format token_format;
+
     /* The below are used only for the WebKDC functions. */
 
     /* General WebKDC configuration. */
@@ -76,6 +81,23 @@ struct wai_buffer {
     char *data;
 };
 
+/* The base64 alphabets, the standard one and the URL-safe one of RFC 4648. */
+enum wai_base64_alphabet {
+    WAI_BASE64_STANDARD,
+    WAI_BASE64_URL
+};
+
+/*
+ * SIMD instruction sets the base64 and hex codecs can use, in increasing
+ * order.  Each implies the ones before it.
+ */
+enum wai_simd {
+    WAI_SIMD_NONE,
+    WAI_SIMD_SSE2,
+    WAI_SIMD_SSSE3,
+    WAI_SIMD_AVX2
+};
+
 /*
  * The types of data that can be encoded.  WA_TYPE_REPEAT is special and
  * indicates a part of the encoding that is repeated some number of times.
@@ -106,6 +128,12 @@ enum wai_encoding_type {
  * inside the repeated structure.
  *
  * Only one level of nesting of WA_TYPE_REPEAT is supported.
+ *
+ * The terminating entry may also set lookup to a function that maps an
+ * attribute name and its length to the index of its rule, or -1 if no rule
+ * uses that name.  The lib/encoding-rules script generates one for each set
+ * of rules so that the decoder can find rules without a hash table.  Without
+ * one, the decoder searches the rules in order.
  */
 struct wai_encoding {
     const char *attr;                   /* Attribute name in encoding */
@@ -118,10 +146,29 @@ struct wai_encoding {
     size_t len_offset;                  /* Offset of data value length */
     size_t size;                        /* Size of nested structure */
     const struct wai_encoding *repeat;  /* Rules for nested structure */
+    int (*lookup)(const char *, size_t); /* Rule lookup, terminator only */
 };
 
 /* Used as the terminator for an encoding specification. */
-#define WA_ENCODING_END { NULL, NULL, 0, false, false, false, 0, 0, 0, NULL }
+#define WA_ENCODING_END \
+    { NULL, NULL, 0, false, false, false, 0, 0, 0, NULL, NULL }
+
+/* Used as the terminator for an encoding specification with a lookup. */
+#define WA_ENCODING_END_LOOKUP(f) \
+    { NULL, NULL, 0, false, false, false, 0, 0, 0, NULL, (f) }
+
+/* The maximum number of rules in a single encoding specification. */
+#define WA_ENCODING_MAX 32
+
+/*
+ * A token whose attribute encoding has been sized by wai_encode_token_size,
+ * holding what wai_encode_token_write needs to write the same encoding.
+ */
+struct wai_encoded_token {
+    const struct webauth_token *token;  /* Token being encoded */
+    time_t now;                         /* Time used for creation times */
+    size_t length;                      /* Length of attribute encoding */
+};
 
 /*
  * Encoding rules.  These are defined in the lib/rules-*.c files, which in
@@ -208,6 +255,23 @@ struct wai_keyring {
     struct wai_keyring_entry *entry;
 };
 
+/*
+ * An element of the sorted index of a keyring.  The index is kept sorted by
+ * valid_after, with keys with the same valid_after kept in the order in which
+ * they were added, so that the best key for a given time can be found with a
+ * binary search.  The key identifier is a short digest of the key used to
+ * select the decryption key for tokens that carry one, and the schedule holds
+ * the precomputed cipher and HMAC state for the key so that it doesn't have
+ * to be set up for each token.  The schedule may be NULL if it could not be
+ * computed, in which case the error is reported when the key is used.
+ */
+struct wai_keyring_index {
+    time_t valid_after;
+    uint32_t key_id;
+    const struct webauth_key *key;
+    struct wai_key_schedule *schedule;
+};
+
 /*
  * Internal state for the WebKDC login process.  This is used to hold
  * information from a webauth_webkdc_login_request and information that will
@@ -215,7 +279,7 @@ struct wai_keyring {
  * parameters passed around internally.
  */
 struct wai_webkdc_login_state {
-    struct webauth_token_webkdc_service *service;
+    const struct webauth_token_webkdc_service *service;
     struct webauth_token_request *request;
 
     /* Arrays of pointers to webauth_token_* structs from the request. */
@@ -271,6 +335,54 @@ BEGIN_DECLS
 /* Default to a hidden visibility for all internal functions. */
 #pragma GCC visibility push(hidden)
 
+/*
+ * Returns the amount of space required to base64-encode data of the given
+ * length.  Returned length does NOT include room for a nul-termination.
+ */
+size_t wai_base64_encoded_length(size_t length)
+    __attribute__((__const__));
+
+/*
+ * Returns the amount of space required to decode base64-encoded data of the
+ * given length.
+ */
+size_t wai_base64_decoded_length(size_t length)
+    __attribute__((__const__));
+
+/*
+ * Base64-encodes the given data with padding and nul-terminates the result.
+ * output must have room for wai_base64_encoded_length(length) + 1 bytes.
+ * output may overlap input as long as it starts earlier, as when the input
+ * is at the end of the output buffer.
+ */
+void wai_base64_encode(char *output, const void *input, size_t length,
+                       enum wai_base64_alphabet)
+    __attribute__((__nonnull__));
+
+/*
+ * Base64-decodes length bytes of input and returns the length of the decoded
+ * data.  Like apr_base64_decode, decoding stops at the first byte that isn't
+ * in the alphabet, including padding, so invalid data is never an error.
+ * Does NOT nul-terminate.  output must have room for
+ * wai_base64_decoded_length(length) bytes.
+ */
+size_t wai_base64_decode(void *output, const char *input, size_t length,
+                         enum wai_base64_alphabet)
+    __attribute__((__nonnull__));
+
+/*
+ * The same as wai_base64_encode and wai_base64_decode, but using at most the
+ * given SIMD instruction set, which must be no higher than what
+ * wai_simd_available returns.  Used by the test suite and benchmarks to
+ * check and time each implementation.
+ */
+void wai_base64_encode_simd(enum wai_simd, char *output, const void *input,
+                            size_t length, enum wai_base64_alphabet)
+    __attribute__((__nonnull__));
+size_t wai_base64_decode_simd(enum wai_simd, void *output, const char *input,
+                              size_t length, enum wai_base64_alphabet)
+    __attribute__((__nonnull__));
+
 /* Allocate a new buffer and initialize its contents. */
 struct wai_buffer *wai_buffer_new(apr_pool_t *)
     __attribute__((__nonnull__));
@@ -340,6 +452,20 @@ int wai_encode_token(struct webauth_context *,
                      const struct webauth_token *, void **, size_t *)
     __attribute__((__nonnull__));
 
+/*
+ * The two halves of wai_encode_token, for callers that want to place the
+ * encoding inside a larger buffer.  wai_encode_token_size determines the
+ * length of the encoding and wai_encode_token_write then writes exactly that
+ * many bytes to the provided buffer.
+ */
+int wai_encode_token_size(struct webauth_context *,
+                          const struct webauth_token *,
+                          struct wai_encoded_token *)
+    __attribute__((__nonnull__));
+int wai_encode_token_write(struct webauth_context *,
+                           const struct wai_encoded_token *, void *)
+    __attribute__((__nonnull__));
+
 /* Change the status code for the current error, keeping the message. */
 int wai_error_change(struct webauth_context *, int old, int s)
     __attribute__((__nonnull__));
@@ -438,6 +564,57 @@ int wai_hex_decode(char *input, size_t input_len, char *output,
                    size_t *output_length, size_t max_output_len)
     __attribute__((__nonnull__));
 
+/* The same, but using at most the given SIMD instruction set. */
+int wai_hex_encode_simd(enum wai_simd, const char *input, size_t input_len,
+                        char *output, size_t *output_len,
+                        size_t max_output_len)
+    __attribute__((__nonnull__));
+int wai_hex_decode_simd(enum wai_simd, char *input, size_t input_len,
+                        char *output, size_t *output_length,
+                        size_t max_output_len)
+    __attribute__((__nonnull__));
+
+/*
+ * Given the path to the identity ACL file, the authenticated identity, and
+ * the identity of the destination site, store the list of alternate
+ * identities the user may assert to that site in a newly-allocated array, or
+ * NULL if there are none.  The file is parsed into an index that is cached
+ * and shared by all threads until the file changes.
+ */
+int wai_id_acl_lookup(struct webauth_context *, const char *path,
+                      const char *authn, const char *target,
+                      const apr_array_header_t **)
+    __attribute__((__nonnull__));
+
+/*
+ * Return the key identifier for a key, used to find the decryption key for
+ * tokens in the key identifier format without trial decryption.  This is the
+ * first four bytes of an HMAC of a constant string in the key, in the byte
+ * order in which they are stored in the token.
+ */
+uint32_t wai_key_id(const struct webauth_key *)
+    __attribute__((__nonnull__));
+
+/*
+ * Create the schedule holding the cipher and HMAC state used for token
+ * encryption and decryption with a key.  The state is set up on first use.
+ * Returns NULL if the key can't be used for tokens.
+ */
+struct wai_key_schedule *wai_key_schedule_new(struct webauth_context *,
+                                              const struct webauth_key *)
+    __attribute__((__nonnull__));
+
+/*
+ * The same as webauth_keyring_best_key, but stores a pointer to the index
+ * entry for the key rather than the key itself, so that the caller has
+ * access to the key identifier and schedule.
+ */
+int wai_keyring_best_index(struct webauth_context *,
+                           const struct webauth_keyring *,
+                           enum webauth_key_usage, time_t hint,
+                           const struct wai_keyring_index **)
+    __attribute__((__nonnull__));
+
 /*
  * Log a message at various possible log levels.  This is controlled by the
  * configured callback.  If the callback is NULL, the message will be silently
@@ -462,6 +639,13 @@ void wai_log_error(struct webauth_context *, enum webauth_log_level, int,
                    const char *format, ...)
     __attribute__((__nonnull__(1), __format__(printf, 4, 5)));
 
+/*
+ * Returns the highest SIMD instruction set usable by the base64 and hex
+ * codecs on this processor, or WAI_SIMD_NONE if the library was built
+ * without SIMD support.
+ */
+enum wai_simd wai_simd_available(void);
+
 /*
  * Map a token type code to the corresponding encoding rule set and data
  * pointer.  Takes the token struct (which must have the type filled out), and
@@ -474,6 +658,22 @@ int wai_token_encoding(struct webauth_context *, const struct webauth_token *,
                        const struct wai_encoding **, const void **)
     __attribute__((__nonnull__));
 
+/*
+ * Encrypt a token in place, for callers that write the attributes directly
+ * into the buffer for the encrypted token.  wai_token_encrypted_length takes
+ * the length of the attributes and stores the length of the encrypted token
+ * in the current token format and the offset in it at which the attributes
+ * must be placed.  wai_token_encrypt_buffer then encrypts a buffer of that
+ * length, with the attributes at that offset, with the best key on the
+ * keyring.  Both return a WA_ERR code.
+ */
+int wai_token_encrypted_length(struct webauth_context *, size_t,
+                               size_t *length, size_t *offset)
+    __attribute__((__nonnull__));
+int wai_token_encrypt_buffer(struct webauth_context *, void *, size_t,
+                             const struct webauth_keyring *)
+    __attribute__((__nonnull__));
+
 /*
  * Merge an array of webkdc-factor tokens into a single token.  Takes the
  * context, the array of webkdc-factor tokens, and a place to store the newly
@@ -38,15 +38,45 @@ webauth_keyring_new(struct webauth_context *ctx, size_t capacity)
         capacity = 1;
     ring = apr_palloc(ctx->pool, sizeof(struct webauth_keyring));
     ring->entries = apr_array_make(ctx->pool, capacity, size);
+    size = sizeof(struct wai_keyring_index);
+    ring->sorted = apr_array_make(ctx->pool, capacity, size);
     return ring;
 }
 
 
+/*
+ * Find the position in the sorted index of a keyring of the first key whose
+ * valid_after time is greater than the given time.  All keys before that
+ * position are valid at that time.
+ */
+static size_t
+index_upper_bound(const struct webauth_keyring *ring, time_t when)
+{
+    size_t low, high, mid;
+    const struct wai_keyring_index *sorted;
+
+    sorted = (const struct wai_keyring_index *) ring->sorted->elts;
+    low = 0;
+    high = ring->sorted->nelts;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (sorted[mid].valid_after <= when)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+
 /*
  * Add a key to a keyring.  Takes the ring, the creation time, the time at
  * which the key becomes valid, and the key.  Either of the times may be zero,
  * in which case the current time is used.  Makes a copy of the key when
  * inserting it.
+ *
+ * The key is also inserted into the sorted index after any keys with the
+ * same valid_after time, so that ties are broken in order of addition.
  */
 void
 webauth_keyring_add(struct webauth_context *ctx, struct webauth_keyring *ring,
@@ -54,11 +84,24 @@ webauth_keyring_add(struct webauth_context *ctx, struct webauth_keyring *ring,
                     const struct webauth_key *key)
 {
     struct webauth_keyring_entry entry;
+    struct wai_keyring_index *sorted;
+    size_t n, i;
 
     entry.creation = creation;
     entry.valid_after = valid_after;
     entry.key = webauth_key_copy(ctx, key);
     APR_ARRAY_PUSH(ring->entries, struct webauth_keyring_entry) = entry;
+
+    /* Insert the new key into the sorted index. */
+    n = index_upper_bound(ring, valid_after);
+    apr_array_push(ring->sorted);
+    sorted = (struct wai_keyring_index *) ring->sorted->elts;
+    for (i = ring->sorted->nelts - 1; i > n; i--)
+        sorted[i] = sorted[i - 1];
+    sorted[n].valid_after = valid_after;
+    sorted[n].key_id = wai_key_id(entry.key);
+    sorted[n].key = entry.key;
+    sorted[n].schedule = wai_key_schedule_new(ctx, entry.key);
 }
 
 
@@ -89,17 +132,29 @@ webauth_keyring_remove(struct webauth_context *ctx,
     size_t i;
     apr_array_header_t *entries = ring->entries;
     struct webauth_keyring_entry *entry;
+    struct wai_keyring_index *sorted;
+    const struct webauth_key *key;
 
     if (n >= (size_t) entries->nelts) {
         wai_error_set(ctx, WA_ERR_NOT_FOUND, "keyring index %lu out of range",
                       (unsigned long) n);
         return WA_ERR_NOT_FOUND;
     }
+    key = APR_ARRAY_IDX(entries, n, struct webauth_keyring_entry).key;
     for (i = n + 1; i < (size_t) entries->nelts; i++) {
         entry = &APR_ARRAY_IDX(entries, i, struct webauth_keyring_entry);
         APR_ARRAY_IDX(entries, i - 1, struct webauth_keyring_entry) = *entry;
     }
     apr_array_pop(entries);
+
+    /* Remove the same key from the sorted index. */
+    sorted = (struct wai_keyring_index *) ring->sorted->elts;
+    for (i = 0; i < (size_t) ring->sorted->nelts; i++)
+        if (sorted[i].key == key)
+            break;
+    for (i++; i < (size_t) ring->sorted->nelts; i++)
+        sorted[i - 1] = sorted[i];
+    apr_array_pop(ring->sorted);
     return WA_ERR_NONE;
 }
 
@@ -113,10 +168,46 @@ webauth_keyring_remove(struct webauth_context *ctx,
  * If it is WA_KEY_ENCRYPT, the hint time is ignored and instead we pick the
  * valid key that will expire the farthest in the future.
  *
- * A pointer to the key is stored in the key argument, and the function
- * returns a WebAuth status code.  This will be WA_ERR_NOT_FOUND if the
- * keyring is empty, has no valid keys, or (for decryption) has no keys with a
- * valid_after time prior to or equal to the hint.
+ * Both searches are a binary search of the sorted index.  For encryption, we
+ * want the first-added of the keys with the most recent valid_after time not
+ * in the future; for decryption, the last-added of the keys with the most
+ * recent valid_after time not after either the hint or the current time.
+ *
+ * A pointer to the index entry for the key is stored in the output argument,
+ * and the function returns a WebAuth status code.  This will be
+ * WA_ERR_NOT_FOUND if the keyring is empty, has no valid keys, or (for
+ * decryption) has no keys with a valid_after time prior to or equal to the
+ * hint.
+ */
+int
+wai_keyring_best_index(struct webauth_context *ctx,
+                       const struct webauth_keyring *ring,
+                       enum webauth_key_usage usage, time_t hint,
+                       const struct wai_keyring_index **output)
+{
+    size_t n;
+    time_t now;
+    const struct wai_keyring_index *sorted;
+
+    *output = NULL;
+    now = time(NULL);
+    if (usage == WA_KEY_DECRYPT && hint < now)
+        now = hint;
+    n = index_upper_bound(ring, now);
+    if (n == 0)
+        return wai_error_set(ctx, WA_ERR_NOT_FOUND, "no valid keys");
+    sorted = (const struct wai_keyring_index *) ring->sorted->elts;
+    n--;
+    if (usage == WA_KEY_ENCRYPT)
+        while (n > 0 && sorted[n - 1].valid_after == sorted[n].valid_after)
+            n--;
+    *output = &sorted[n];
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * The public interface to finding the best key, which returns only the key.
  */
 int
 webauth_keyring_best_key(struct webauth_context *ctx,
@@ -124,32 +215,14 @@ webauth_keyring_best_key(struct webauth_context *ctx,
                          enum webauth_key_usage usage, time_t hint,
                          const struct webauth_key **output)
 {
-    size_t i;
-    time_t now, valid;
-    struct webauth_keyring_entry *best, *entry;
+    const struct wai_keyring_index *best;
+    int s;
 
     *output = NULL;
-    now = time(NULL);
-    best = NULL;
-    for (i = 0; i < (size_t) ring->entries->nelts; i++) {
-        entry = &APR_ARRAY_IDX(ring->entries, i, struct webauth_keyring_entry);
-        valid = entry->valid_after;
-        if (valid > now)
-            continue;
-        if (usage == WA_KEY_ENCRYPT) {
-            if (best == NULL || valid > best->valid_after)
-                best = entry;
-        } else {
-            if (hint >= valid && (best == NULL || valid >= best->valid_after))
-                best = entry;
-        }
-    }
-    if (best == NULL)
-        return wai_error_set(ctx, WA_ERR_NOT_FOUND, "no valid keys");
-    else {
+    s = wai_keyring_best_index(ctx, ring, usage, hint, &best);
+    if (s == WA_ERR_NONE)
         *output = best->key;
-        return WA_ERR_NONE;
-    }
+    return s;
 }
 
 
@@ -13,12 +13,17 @@
 #include <portable/system.h>
 
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 
 #include <lib/internal.h>
 #include <webauth/basic.h>
 #include <webauth/keys.h>
 
+/* The constant string whose HMAC in a key forms its key identifier. */
+#define KEY_ID_DATA "WebAuth key identifier"
+
 
 /*
  * Construct a new WebAuth key.  Takes the key type and key size and optional
@@ -93,3 +98,25 @@ webauth_key_copy(struct webauth_context *ctx, const struct webauth_key *key)
     memcpy(copy->data, key->data, key->length);
     return copy;
 }
+
+
+/*
+ * Return the identifier of a key.  This is the first four bytes of the
+ * HMAC-SHA1 of a fixed string using the key, so it reveals nothing useful
+ * about the key but is very unlikely to collide for the handful of keys on
+ * a single keyring.  A collision only costs a wasted trial decryption.
+ */
+uint32_t
+wai_key_id(const struct webauth_key *key)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length;
+    uint32_t id;
+
+    if (HMAC(EVP_sha1(), key->data, key->length,
+             (const unsigned char *) KEY_ID_DATA, strlen(KEY_ID_DATA),
+             digest, &length) == NULL)
+        return 0;
+    memcpy(&id, digest, sizeof(id));
+    return id;
+}
@@ -30,6 +30,10 @@
 #include <portable/krb5.h>
 #include <portable/system.h>
 
+#include <apr_atomic.h>
+#include <apr_thread_mutex.h>
+#include <sys/stat.h>
+#include <time.h>
 #ifdef HAVE_REMCTL
 # include <remctl.h>
 #endif
@@ -47,12 +51,53 @@
 struct webauth_krb5 {
     apr_pool_t *pool;
     krb5_context ctx;
+    unsigned long generation;   /* Context pool generation of ctx. */
     krb5_ccache cc;
     krb5_principal princ;
     const char *fast_armor_path;
     struct webauth_krb5_change_config change;
 };
 
+/*
+ * The process-wide pool of idle Kerberos library contexts.
+ *
+ * krb5_init_context reads and parses krb5.conf every time it's called, which
+ * is a noticeable part of the cost of a WebKDC login.  Instead, contexts are
+ * returned to this pool when a webauth_krb5 context is freed and handed out
+ * again by webauth_krb5_new.  Everything webauth_krb5 stores per use (the
+ * ticket cache and principal) is kept in struct webauth_krb5 rather than in
+ * the library context, so returning a context only has to clear the error
+ * message and the cached default ticket cache name.
+ *
+ * Each context records the generation of the pool when it was created.  At
+ * most once a second, webauth_krb5_new checks the Kerberos configuration
+ * files named by KRB5_CONFIG (or the default) and, if the value of
+ * KRB5_CONFIG or the inode, size, or modification time of any of those files
+ * has changed, frees all idle contexts and starts a new generation.  Contexts
+ * from an older generation are freed rather than returned.  Files included
+ * from krb5.conf are not checked.
+ *
+ * The pool is allocated from an unmanaged APR pool so that it survives
+ * apr_terminate and is never freed.  It is created on first use and
+ * published with an atomic compare-and-swap.
+ */
+#define CONTEXT_POOL_MAX 16
+#ifndef KRB5_DEFAULT_CONFIG
+# define KRB5_DEFAULT_CONFIG "/etc/krb5.conf"
+#endif
+struct context_pool {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;  /* Protects the rest of the struct. */
+#endif
+    krb5_context idle[CONTEXT_POOL_MAX];
+    size_t count;               /* Number of idle contexts. */
+    unsigned long generation;   /* Incremented when the config changes. */
+    char *stamp;                /* Configuration stamp for this generation. */
+    time_t checked;             /* When the configuration was last checked. */
+};
+static volatile void *context_pool = NULL;
+
 /*
  * Forward declarations for the functions that have to be used by the MIT- and
  * Heimdal-specific code.
@@ -235,11 +280,184 @@ fail:
 }
 
 
+/*
+ * Lock or unlock the context pool.
+ */
+static void
+pool_lock(struct context_pool *pool UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(pool->mutex);
+#endif
+}
+
+static void
+pool_unlock(struct context_pool *pool UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(pool->mutex);
+#endif
+}
+
+
+/*
+ * Return the process-wide context pool, creating it if this is the first
+ * use.  If two threads race to create it, the loser destroys its copy.
+ * Returns NULL if the pool can't be created, in which case contexts are just
+ * not pooled.
+ */
+static struct context_pool *
+context_pool_get(void)
+{
+    struct context_pool *cpool;
+    apr_pool_t *pool;
+
+    cpool = apr_atomic_casptr(&context_pool, NULL, NULL);
+    if (cpool != NULL)
+        return cpool;
+    if (apr_pool_create_unmanaged(&pool) != APR_SUCCESS)
+        return NULL;
+    cpool = apr_pcalloc(pool, sizeof(struct context_pool));
+    cpool->pool = pool;
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&cpool->mutex, APR_THREAD_MUTEX_DEFAULT, pool)
+        != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+#endif
+    if (apr_atomic_casptr(&context_pool, cpool, NULL) != NULL) {
+        apr_pool_destroy(pool);
+        cpool = apr_atomic_casptr(&context_pool, NULL, NULL);
+    }
+    return cpool;
+}
+
+
+/*
+ * Build a string that changes whenever the Kerberos configuration might have
+ * changed: the list of configuration files followed by the inode, size, and
+ * modification time of each, allocated from the given pool.
+ */
+static char *
+config_stamp(apr_pool_t *pool)
+{
+    const char *files;
+    char *copy, *file, *last;
+    char *stamp;
+    struct stat st;
+
+    files = getenv("KRB5_CONFIG");
+    if (files == NULL)
+        files = KRB5_DEFAULT_CONFIG;
+    stamp = apr_pstrdup(pool, files);
+    copy = apr_pstrdup(pool, files);
+    for (file = apr_strtok(copy, ":", &last); file != NULL;
+         file = apr_strtok(NULL, ":", &last)) {
+        if (stat(file, &st) < 0)
+            stamp = apr_pstrcat(pool, stamp, " -", (char *) 0);
+        else
+            stamp = apr_psprintf(pool, "%s %lu:%lu:%lu", stamp,
+                                 (unsigned long) st.st_ino,
+                                 (unsigned long) st.st_size,
+                                 (unsigned long) st.st_mtime);
+    }
+    return stamp;
+}
+
+
+/*
+ * Start a new generation of the context pool if the Kerberos configuration
+ * has changed since it was last checked, freeing all idle contexts.  Only
+ * checks once a second.  Temporary memory is allocated from the given pool.
+ * Must be called with the pool mutex held.
+ */
+static void
+context_pool_refresh(struct context_pool *cpool, apr_pool_t *pool)
+{
+    time_t now;
+    char *stamp;
+    size_t length;
+
+    now = time(NULL);
+    if (cpool->stamp != NULL && cpool->checked == now)
+        return;
+    cpool->checked = now;
+    stamp = config_stamp(pool);
+    if (cpool->stamp != NULL && strcmp(stamp, cpool->stamp) == 0)
+        return;
+    while (cpool->count > 0)
+        krb5_free_context(cpool->idle[--cpool->count]);
+    cpool->generation++;
+    free(cpool->stamp);
+    length = strlen(stamp) + 1;
+    cpool->stamp = malloc(length);
+    if (cpool->stamp != NULL)
+        memcpy(cpool->stamp, stamp, length);
+}
+
+
+/*
+ * Get a Kerberos library context for a new webauth_krb5 context, taking an
+ * idle one from the pool if possible and otherwise creating a new one.
+ * Temporary memory is allocated from the pool of the webauth_krb5 context.
+ * Returns a Kerberos error code.
+ */
+static krb5_error_code
+context_checkout(struct webauth_krb5 *kc)
+{
+    struct context_pool *cpool;
+
+    cpool = context_pool_get();
+    if (cpool == NULL)
+        return krb5_init_context(&kc->ctx);
+    pool_lock(cpool);
+    context_pool_refresh(cpool, kc->pool);
+    kc->generation = cpool->generation;
+    if (cpool->count > 0)
+        kc->ctx = cpool->idle[--cpool->count];
+    pool_unlock(cpool);
+    if (kc->ctx != NULL)
+        return 0;
+    return krb5_init_context(&kc->ctx);
+}
+
+
+/*
+ * Return a Kerberos library context to the pool, clearing the state left
+ * over from its last use.  The context is freed instead if it's from an
+ * older generation or the pool is full.
+ */
+static void
+context_checkin(krb5_context ctx, unsigned long generation)
+{
+    struct context_pool *cpool;
+
+    cpool = context_pool_get();
+    if (cpool != NULL) {
+#ifdef HAVE_KRB5_CLEAR_ERROR_MESSAGE
+        krb5_clear_error_message(ctx);
+#endif
+        krb5_cc_set_default_name(ctx, NULL);
+        pool_lock(cpool);
+        if (generation == cpool->generation
+            && cpool->count < CONTEXT_POOL_MAX) {
+            cpool->idle[cpool->count++] = ctx;
+            ctx = NULL;
+        }
+        pool_unlock(cpool);
+    }
+    if (ctx != NULL)
+        krb5_free_context(ctx);
+}
+
+
 /*
  * Free the contents of the webauth_krb5 context that hold separately
  * allocated memory.  Don't free anything pool-allocated, since that will be
- * taken care of by pool cleanup.  This function is registered as an APR pool
- * cleanup function.
+ * taken care of by pool cleanup.  The Kerberos library context is returned
+ * to the context pool.  This function is registered as an APR pool cleanup
+ * function.
  */
 static apr_status_t
 cleanup(void *data)
@@ -251,7 +469,7 @@ cleanup(void *data)
     if (kc->princ != NULL)
         krb5_free_principal(kc->ctx, kc->princ);
     if (kc->ctx != NULL)
-        krb5_free_context(kc->ctx);
+        context_checkin(kc->ctx, kc->generation);
     return APR_SUCCESS;
 }
 
@@ -265,6 +483,9 @@ cleanup(void *data)
  * We additionally register webauth_krb5_free as a cleanup handler called by
  * APR when the pool is destroyed so that everything is properly freed when
  * the pool is deleted and no explicit free is required.
+ *
+ * The Kerberos library context is taken from the process-wide context pool
+ * and returned to it when the webauth_krb5 context is freed.
  */
 int
 webauth_krb5_new(struct webauth_context *ctx, struct webauth_krb5 **kc)
@@ -280,7 +501,7 @@ webauth_krb5_new(struct webauth_context *ctx, struct webauth_krb5 **kc)
     }
     *kc = apr_pcalloc(pool, sizeof(struct webauth_krb5));
     (*kc)->pool = pool;
-    code = krb5_init_context(&(*kc)->ctx);
+    code = context_checkout(*kc);
     if (code != 0)
         return error_set(ctx, NULL, code, "cannot create Kerberos context");
     apr_pool_cleanup_register(pool, *kc, cleanup, apr_pool_cleanup_null);
@@ -0,0 +1,41 @@
+/*
+ * Detection of the SIMD instruction sets the processor supports.
+ *
+ * The base64 and hex codecs have implementations using x86 SIMD instructions
+ * that are compiled for those instruction sets with the target function
+ * attribute, regardless of what the rest of the library is built for.  Which
+ * of them to use is decided here at runtime, so that one build of the
+ * library runs on any processor.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <lib/internal.h>
+
+
+/*
+ * Return the highest SIMD instruction set that the processor supports.  The
+ * compiler runtime checks the processor once at startup, including whether
+ * the operating system saves the AVX registers, so this is cheap enough to
+ * call for every encoding or decoding.
+ */
+enum wai_simd
+wai_simd_available(void)
+{
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        return WAI_SIMD_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return WAI_SIMD_SSSE3;
+    if (__builtin_cpu_supports("sse2"))
+        return WAI_SIMD_SSE2;
+#endif
+    return WAI_SIMD_NONE;
+}
@@ -18,9 +18,10 @@
 #include <portable/apr.h>
 #include <portable/system.h>
 
+#include <apr_atomic.h>
 #include <apr_pools.h>
+#include <limits.h>
 #include <netinet/in.h>
-#include <openssl/aes.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
@@ -34,33 +35,113 @@
 #include <webauth/keys.h>
 #include <webauth/tokens.h>
 
+/* The AES block size, to which tokens in the CBC formats are padded. */
+#define AES_BLOCK_S 16
+
 /*
- * An IV to pass to the AES encryption function.  Since the first block of any
- * token is a random nonce, this is uninteresting and therefore always set to
- * all zeroes.  The random nonce will randomize the rest of the CBC mode
+ * The IV to pass to the AES encryption function.  Since the first block of
+ * any token is a random nonce, this is uninteresting and therefore always set
+ * to all zeroes.  The random nonce will randomize the rest of the CBC mode
  * encryption.
  */
-static unsigned char aes_ivec[AES_BLOCK_SIZE] = {
+static const unsigned char aes_ivec[AES_BLOCK_S] = {
     0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
+/* The block size of SHA-1, used to construct the HMAC pads. */
+#define HMAC_BLOCK_S 64
+
+/*
+ * The constant string whose HMAC-SHA256 in a key forms the key used for the
+ * AEAD token format.  A separate key is derived so that the same key is never
+ * used with two different cipher modes.
+ */
+#define AEAD_KEY_DATA "WebAuth AEAD token key"
+
+/* The OpenSSL cipher contexts kept in a key schedule. */
+enum schedule_cipher {
+    CIPHER_CBC_ENCRYPT = 0,
+    CIPHER_CBC_DECRYPT,
+    CIPHER_GCM_ENCRYPT,
+    CIPHER_GCM_DECRYPT,
+    CIPHER_MAX
+};
+
+/* SHA-1 digest contexts after hashing the HMAC inner and outer pads. */
+struct hmac_pads {
+    EVP_MD_CTX *inner;
+    EVP_MD_CTX *outer;
+};
+
+/*
+ * The precomputed state for encrypting and decrypting tokens with a key.
+ * This holds cipher contexts with the key already set up for each direction
+ * and format, and the HMAC pad digest contexts.  Setting up an OpenSSL
+ * context is expensive compared to processing a token, and a keyring built
+ * for a single request may only ever use one of them, so each is created on
+ * first use and then published with an atomic compare-and-swap.  Once
+ * published, a context is never modified, so the schedule can be shared
+ * between threads; each token operation copies the contexts it needs.
+ *
+ * The OpenSSL contexts are freed by a cleanup on the pool from which the
+ * schedule was allocated, which is the pool of the keyring.
+ */
+struct wai_key_schedule {
+    const struct webauth_key *key;
+    volatile void *cipher[CIPHER_MAX];  /* EVP_CIPHER_CTX */
+    volatile void *hmac;                /* struct hmac_pads */
+};
+
 /*
  * Define some macros for offsets (_O) and sizes (_S) in tokens.  The token
  * form is:
  *
- *     {key-hint}{nonce}{hmac}{attr}{padding}
+ *     {header}{nonce}{hmac}{attr}{padding}
+ *
+ * where everything after the header is encrypted.  In the original format,
+ * the header is a four-byte key hint (the time at which the token was
+ * encrypted in network byte order).  In the key identifier format, the header
+ * is:
+ *
+ *     {zero}{version}{key-id}
+ *
+ * where zero is a zero byte, which can never start a key hint produced since
+ * 1970, version is the token format version, and key-id is the key
+ * identifier from wai_key_id.  The offsets of the encrypted portion are
+ * relative to the end of the header.
+ *
+ * The AEAD format uses the same header as the key identifier format, but the
+ * rest of the token is:
+ *
+ *     {nonce}{attr}{tag}
+ *
+ * where the nonce is the AES-GCM IV, attr is encrypted, and tag is the GCM
+ * authentication tag over the header and the encrypted attributes.  There is
+ * no padding and no separate HMAC.
  *
  * The SHA digest length for the HMAC comes from OpenSSL.
  */
 #define T_HINT_S   4
+#define T_KEY_ID_S 4
 #define T_NONCE_S 16
 #define T_HMAC_S  (SHA_DIGEST_LENGTH)
 
-#define T_HINT_O  0
-#define T_NONCE_O (T_HINT_O  + T_HINT_S)
+#define T_HINT_O    0
+#define T_VERSION_O 1
+#define T_KEY_ID_O  2
+#define T_KEY_ID_HEADER_S (T_KEY_ID_O + T_KEY_ID_S)
+
+#define T_NONCE_O 0
 #define T_HMAC_O  (T_NONCE_O + T_NONCE_S)
 #define T_ATTR_O  (T_HMAC_O  + T_HMAC_S)
 
+#define T_AEAD_NONCE_S 12
+#define T_AEAD_TAG_S   16
+
+/* The format version bytes of tokens with a key identifier header. */
+#define T_VERSION_KEY_ID 2
+#define T_VERSION_AEAD   3
+
 
 /*
  * Set the internal error for an OpenSSL error.  Takes the WebAuth context to
@@ -94,11 +175,309 @@ openssl_error(struct webauth_context *ctx, int s, const char *format, ...)
 
 
 /*
- * Given the length of the encoded attributes, calculate the encoded binary
- * length.  The length of the padding needed is stored in plen.
+ * Return the AES cipher in CBC or GCM mode for a given key length, or NULL if
+ * the key length isn't supported.  GCM is only available if OpenSSL supports
+ * it.
+ */
+static const EVP_CIPHER *
+cipher_cbc(size_t length)
+{
+    switch (length) {
+    case WA_AES_128: return EVP_aes_128_cbc();
+    case WA_AES_192: return EVP_aes_192_cbc();
+    case WA_AES_256: return EVP_aes_256_cbc();
+    default:         return NULL;
+    }
+}
+
+static const EVP_CIPHER *
+cipher_gcm(size_t length UNUSED)
+{
+#ifdef HAVE_EVP_AES_128_GCM
+    switch (length) {
+    case WA_AES_128: return EVP_aes_128_gcm();
+    case WA_AES_192: return EVP_aes_192_gcm();
+    case WA_AES_256: return EVP_aes_256_gcm();
+    default:         return NULL;
+    }
+#else
+    return NULL;
+#endif
+}
+
+
+/*
+ * Create a cipher context with the key set up for encryption (if encrypt is
+ * 1) or decryption (if it is 0), to be used as a template for copying.
+ * Returns NULL on failure.
+ */
+static EVP_CIPHER_CTX *
+cipher_new(const EVP_CIPHER *cipher, const unsigned char *key, int encrypt)
+{
+    EVP_CIPHER_CTX *cctx;
+
+    cctx = EVP_CIPHER_CTX_new();
+    if (cctx == NULL)
+        return NULL;
+    if (EVP_CipherInit_ex(cctx, cipher, NULL, key, NULL, encrypt) != 1) {
+        EVP_CIPHER_CTX_free(cctx);
+        return NULL;
+    }
+    EVP_CIPHER_CTX_set_padding(cctx, 0);
+    return cctx;
+}
+
+
+/*
+ * Create a SHA-1 digest context that has already hashed the key XORed with
+ * the given HMAC pad byte.  The HMAC key is the AES key, which is always
+ * shorter than the SHA-1 block size, so it's just padded with zeroes before
+ * being combined with the pad.  Returns NULL on failure.
+ */
+static EVP_MD_CTX *
+hmac_pad_new(const struct webauth_key *key, unsigned char byte)
+{
+    EVP_MD_CTX *md;
+    unsigned char pad[HMAC_BLOCK_S];
+    size_t i;
+
+    memset(pad, byte, sizeof(pad));
+    for (i = 0; i < (size_t) key->length; i++)
+        pad[i] ^= key->data[i];
+    md = EVP_MD_CTX_create();
+    if (md == NULL)
+        return NULL;
+    if (EVP_DigestInit_ex(md, EVP_sha1(), NULL) != 1
+        || EVP_DigestUpdate(md, pad, sizeof(pad)) != 1) {
+        EVP_MD_CTX_destroy(md);
+        md = NULL;
+    }
+    memset(pad, 0, sizeof(pad));
+    return md;
+}
+
+
+/*
+ * Free a set of HMAC pad contexts.
+ */
+static void
+hmac_pads_free(struct hmac_pads *pads)
+{
+    if (pads->inner != NULL)
+        EVP_MD_CTX_destroy(pads->inner);
+    if (pads->outer != NULL)
+        EVP_MD_CTX_destroy(pads->outer);
+    free(pads);
+}
+
+
+/*
+ * Free the OpenSSL contexts in a key schedule.  Registered as a pool cleanup
+ * for the pool from which the schedule was allocated.
+ */
+static apr_status_t
+schedule_free(void *data)
+{
+    struct wai_key_schedule *schedule = data;
+    size_t i;
+
+    for (i = 0; i < CIPHER_MAX; i++)
+        if (schedule->cipher[i] != NULL)
+            EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *) schedule->cipher[i]);
+    if (schedule->hmac != NULL)
+        hmac_pads_free((struct hmac_pads *) schedule->hmac);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create the key schedule for a key.  This only records the key; the OpenSSL
+ * contexts are created when first needed.  Returns NULL if the key can't be
+ * used for tokens.
+ */
+struct wai_key_schedule *
+wai_key_schedule_new(struct webauth_context *ctx,
+                     const struct webauth_key *key)
+{
+    struct wai_key_schedule *schedule;
+
+    if (cipher_cbc(key->length) == NULL || key->length > HMAC_BLOCK_S)
+        return NULL;
+    schedule = apr_pcalloc(ctx->pool, sizeof(struct wai_key_schedule));
+    schedule->key = key;
+    apr_pool_cleanup_register(ctx->pool, schedule, schedule_free,
+                              apr_pool_cleanup_null);
+    return schedule;
+}
+
+
+/*
+ * Get one of the cipher contexts of a key schedule, creating it if this is
+ * the first use.  If two threads race to create the same context, the loser
+ * frees its copy and uses the winner's.  The AEAD contexts use a key derived
+ * from the AES key.  Returns a WA_ERR code.
+ */
+static int
+schedule_cipher(struct webauth_context *ctx, struct wai_key_schedule *schedule,
+                enum schedule_cipher which, const EVP_CIPHER_CTX **result)
+{
+    const struct webauth_key *key = schedule->key;
+    EVP_CIPHER_CTX *cctx;
+    const EVP_CIPHER *cipher;
+    unsigned char aead_key[EVP_MAX_MD_SIZE];
+    unsigned int length;
+    void *old;
+
+    *result = apr_atomic_casptr(&schedule->cipher[which], NULL, NULL);
+    if (*result != NULL)
+        return WA_ERR_NONE;
+    cctx = NULL;
+    switch (which) {
+    case CIPHER_CBC_ENCRYPT:
+    case CIPHER_CBC_DECRYPT:
+        cipher = cipher_cbc(key->length);
+        cctx = cipher_new(cipher, key->data, which == CIPHER_CBC_ENCRYPT);
+        break;
+    case CIPHER_GCM_ENCRYPT:
+    case CIPHER_GCM_DECRYPT:
+    case CIPHER_MAX:
+    default:
+        cipher = cipher_gcm(key->length);
+        if (cipher == NULL)
+            return wai_error_set(ctx, WA_ERR_UNIMPLEMENTED,
+                                 "AES-GCM not supported for this key");
+        if (HMAC(EVP_sha256(), key->data, key->length,
+                 (const unsigned char *) AEAD_KEY_DATA, strlen(AEAD_KEY_DATA),
+                 aead_key, &length) == NULL
+            || length < (unsigned int) key->length)
+            break;
+        cctx = cipher_new(cipher, aead_key, which == CIPHER_GCM_ENCRYPT);
+        memset(aead_key, 0, sizeof(aead_key));
+        break;
+    }
+    if (cctx == NULL)
+        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot set encryption key");
+    old = apr_atomic_casptr(&schedule->cipher[which], cctx, NULL);
+    if (old != NULL) {
+        EVP_CIPHER_CTX_free(cctx);
+        cctx = old;
+    }
+    *result = cctx;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Get the HMAC pad contexts of a key schedule, creating them if this is the
+ * first use, in the same way as schedule_cipher.  Returns a WA_ERR code.
+ */
+static int
+schedule_hmac_pads(struct webauth_context *ctx,
+                   struct wai_key_schedule *schedule,
+                   const struct hmac_pads **result)
+{
+    struct hmac_pads *pads;
+    void *old;
+
+    *result = apr_atomic_casptr(&schedule->hmac, NULL, NULL);
+    if (*result != NULL)
+        return WA_ERR_NONE;
+    pads = calloc(1, sizeof(struct hmac_pads));
+    if (pads == NULL)
+        return wai_error_set_system(ctx, WA_ERR_NO_MEM, errno,
+                                    "cannot allocate HMAC state");
+    pads->inner = hmac_pad_new(schedule->key, 0x36);
+    pads->outer = hmac_pad_new(schedule->key, 0x5c);
+    if (pads->inner == NULL || pads->outer == NULL) {
+        hmac_pads_free(pads);
+        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot set up HMAC");
+    }
+    old = apr_atomic_casptr(&schedule->hmac, pads, NULL);
+    if (old != NULL) {
+        hmac_pads_free(pads);
+        pads = old;
+    }
+    *result = pads;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Compute the HMAC of some data using the precomputed pad states from a key
+ * schedule, storing the result in the provided buffer, which must be at least
+ * SHA_DIGEST_LENGTH bytes long.  This produces the same result as the one-shot
+ * HMAC function without hashing the pads for each token.  Returns a WA_ERR
+ * code.
+ */
+static int
+schedule_hmac(struct webauth_context *ctx, struct wai_key_schedule *schedule,
+              const unsigned char *data, size_t length, unsigned char *hmac)
+{
+    const struct hmac_pads *pads;
+    EVP_MD_CTX *md;
+    unsigned char inner[EVP_MAX_MD_SIZE];
+    unsigned int inner_len, hmac_len;
+    int s, okay;
+
+    s = schedule_hmac_pads(ctx, schedule, &pads);
+    if (s != WA_ERR_NONE)
+        return s;
+    md = EVP_MD_CTX_create();
+    if (md == NULL)
+        return openssl_error(ctx, WA_ERR_NO_MEM, "cannot compute HMAC");
+    okay = EVP_MD_CTX_copy_ex(md, pads->inner) == 1
+        && EVP_DigestUpdate(md, data, length) == 1
+        && EVP_DigestFinal_ex(md, inner, &inner_len) == 1
+        && EVP_MD_CTX_copy_ex(md, pads->outer) == 1
+        && EVP_DigestUpdate(md, inner, inner_len) == 1
+        && EVP_DigestFinal_ex(md, hmac, &hmac_len) == 1;
+    EVP_MD_CTX_destroy(md);
+    if (!okay)
+        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot compute HMAC");
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Run AES-CBC over a buffer with the zero IV, using a copy of one of the CBC
+ * cipher contexts from a key schedule.  The input and output may be the same
+ * buffer.  The length must be a multiple of the AES block size.  Returns a
+ * WA_ERR code.
+ */
+static int
+cbc_crypt(struct webauth_context *ctx, struct wai_key_schedule *schedule,
+          enum schedule_cipher which, const unsigned char *input,
+          unsigned char *output, size_t length)
+{
+    const EVP_CIPHER_CTX *template;
+    EVP_CIPHER_CTX *cctx;
+    int s, okay, out_len, final_len;
+
+    s = schedule_cipher(ctx, schedule, which, &template);
+    if (s != WA_ERR_NONE)
+        return s;
+    cctx = EVP_CIPHER_CTX_new();
+    if (cctx == NULL)
+        return openssl_error(ctx, WA_ERR_NO_MEM, "cannot create cipher");
+    okay = EVP_CIPHER_CTX_copy(cctx, template) == 1
+        && EVP_CipherInit_ex(cctx, NULL, NULL, NULL, aes_ivec, -1) == 1
+        && EVP_CIPHER_CTX_set_padding(cctx, 0) == 1
+        && EVP_CipherUpdate(cctx, output, &out_len, input, length) == 1
+        && EVP_CipherFinal_ex(cctx, output + out_len, &final_len) == 1;
+    EVP_CIPHER_CTX_free(cctx);
+    if (!okay)
+        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot run AES-CBC");
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Given the length of the encoded attributes and the length of the token
+ * header, calculate the encoded binary length.  The length of the padding
+ * needed is stored in plen.
  */
 static size_t
-encoded_length(size_t alen, size_t *plen)
+encoded_length(size_t alen, size_t hlen, size_t *plen)
 {
     size_t elen, modulo;
 
@@ -110,77 +489,90 @@ encoded_length(size_t alen, size_t *plen)
      * We always add padding, so if the token is exactly the block size, we
      * add padding equal to the block size.
      */
-    modulo = elen % AES_BLOCK_SIZE;
+    modulo = elen % AES_BLOCK_S;
     if (modulo != 0)
-        *plen = AES_BLOCK_SIZE - modulo;
+        *plen = AES_BLOCK_S - modulo;
     else
-        *plen = AES_BLOCK_SIZE;
+        *plen = AES_BLOCK_S;
     elen += *plen;
 
-    /* Add in the hint length. */
-    elen += T_HINT_S;
+    /* Add in the header length. */
+    elen += hlen;
 
     return elen;
 }
 
 
 /*
- * A wrapper around webauth_token_create_with_key that first finds the best
- * key from the given keyring and then encodes with that key, returning the
- * results in the same way that webauth_token_create_with_key does.
+ * Set the format for newly encrypted tokens.  Returns WA_ERR_INVALID if the
+ * format is not one we know about, or WA_ERR_UNIMPLEMENTED if it is an AEAD
+ * format and OpenSSL doesn't support it.
  */
 int
-webauth_token_encrypt(struct webauth_context *ctx, const void *input,
-                      size_t len, void **output, size_t *output_len,
-                      const struct webauth_keyring *ring)
+webauth_token_set_format(struct webauth_context *ctx,
+                         enum webauth_token_format format)
 {
-    const struct webauth_key *key;
-    size_t elen, plen, i;
-    int s;
-    unsigned char *result, *p, *hmac;
-    AES_KEY aes_key;
-    uint32_t hint;
-
-    /* Clear our output paramters in case of error. */
-    *output = NULL;
-    *output_len = 0;
+    switch (format) {
+    case WA_TOKEN_FORMAT_HINT:
+    case WA_TOKEN_FORMAT_KEY_ID:
+        ctx->token_format = format;
+        return WA_ERR_NONE;
+    case WA_TOKEN_FORMAT_AES_GCM:
+        if (cipher_gcm(WA_AES_128) == NULL)
+            return wai_error_set(ctx, WA_ERR_UNIMPLEMENTED,
+                                 "AES-GCM not supported by OpenSSL");
+        ctx->token_format = format;
+        return WA_ERR_NONE;
+    }
+    return wai_error_set(ctx, WA_ERR_INVALID, "unknown token format %d",
+                         (int) format);
+}
 
-    /* Find the encryption key to use. */
-    s = webauth_keyring_best_key(ctx, ring, WA_KEY_ENCRYPT, 0, &key);
-    if (s != WA_ERR_NONE)
-        return s;
 
-    /* Create our encryption key. */
-    s = AES_set_encrypt_key(key->data, key->length * 8, &aes_key);
-    if (s != 0) {
-        s = WA_ERR_BAD_KEY;
-        return openssl_error(ctx, s, "cannot set encryption key");
-    }
+/*
+ * Encrypt a token in one of the AES-CBC formats, with either a key hint or a
+ * key identifier header depending on the context token format.  Takes a
+ * buffer of the encrypted length with the attributes already in place and
+ * the keyring index entry of the key to use.  Returns a WA_ERR code.
+ */
+static int
+encrypt_cbc(struct webauth_context *ctx, unsigned char *result, size_t len,
+            const struct wai_keyring_index *best)
+{
+    size_t elen, plen, hlen, i;
+    int s;
+    unsigned char *p, *body;
+    uint32_t hint;
 
-    /* {key-hint}{nonce}{hmac}{attr}{padding} */
-    elen = encoded_length(len, &plen);
-    result = apr_palloc(ctx->pool, elen);
+    /* {header}{nonce}{hmac}{attr}{padding} */
+    if (ctx->token_format == WA_TOKEN_FORMAT_KEY_ID)
+        hlen = T_KEY_ID_HEADER_S;
+    else
+        hlen = T_HINT_S;
+    elen = encoded_length(len, hlen, &plen);
     p = result;
 
-    /* {key-hint} */
-    hint = htonl(time(NULL));
-    memcpy(p, &hint, T_HINT_S);
-    p += T_HINT_S;
+    /* {header} */
+    if (ctx->token_format == WA_TOKEN_FORMAT_KEY_ID) {
+        p[T_HINT_O] = 0;
+        p[T_VERSION_O] = T_VERSION_KEY_ID;
+        memcpy(p + T_KEY_ID_O, &best->key_id, T_KEY_ID_S);
+    } else {
+        hint = htonl(time(NULL));
+        memcpy(p + T_HINT_O, &hint, T_HINT_S);
+    }
+    p += hlen;
+    body = p;
 
     /* {nonce} */
-    s = RAND_pseudo_bytes(p, T_NONCE_S);
-    if (s < 0) {
+    if (RAND_bytes(p, T_NONCE_S) != 1) {
         s = WA_ERR_RAND_FAILURE;
         return openssl_error(ctx, s, "cannot generate random nonce");
     }
     p += T_NONCE_S;
 
-    /* Leave room for HMAC, which we'll add later. */
-    p += T_HMAC_S;
-
-    /* {attr} */
-    memcpy(p, input, len);
-    p += len;
+    /* Leave room for HMAC, which we'll add later, and skip the {attr}. */
+    p += T_HMAC_S + len;
 
     /* {padding} */
     for (i = 0; i < plen; i++)
@@ -190,20 +582,169 @@ webauth_token_encrypt(struct webauth_context *ctx, const void *input,
      * Calculate the HMAC over the data and padding.  We should use something
      * better than this for the HMAC key.
      */
-    hmac = HMAC(EVP_sha1(), key->data, key->length,
-                result + T_ATTR_O, len + plen,         /* data, len */
-                result + T_HMAC_O, NULL);              /* hmac, len */
-    if (hmac == NULL)
-        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot compute HMAC");
+    s = schedule_hmac(ctx, best->schedule, body + T_ATTR_O, len + plen,
+                      body + T_HMAC_O);
+    if (s != WA_ERR_NONE)
+        return s;
+
+    /* Now AES-encrypt in place everything but the header at the front. */
+    return cbc_crypt(ctx, best->schedule, CIPHER_CBC_ENCRYPT, body, body,
+                     elen - hlen);
+}
+
+
+/*
+ * Encrypt a token in the AEAD format.  Takes a buffer of the encrypted length
+ * with the attributes already in place and the keyring index entry of the
+ * key to use.  Returns a WA_ERR code.
+ */
+static int
+encrypt_aead(struct webauth_context *ctx, unsigned char *result, size_t len,
+             const struct wai_keyring_index *best)
+{
+    const EVP_CIPHER_CTX *template;
+    EVP_CIPHER_CTX *cctx;
+    unsigned char *nonce, *attr, *tag;
+    int s, okay, out_len, final_len;
+
+    s = schedule_cipher(ctx, best->schedule, CIPHER_GCM_ENCRYPT, &template);
+    if (s != WA_ERR_NONE)
+        return s;
+
+    /* {zero}{version}{key-id}{nonce}{attr}{tag} */
+    result[T_HINT_O] = 0;
+    result[T_VERSION_O] = T_VERSION_AEAD;
+    memcpy(result + T_KEY_ID_O, &best->key_id, T_KEY_ID_S);
+    nonce = result + T_KEY_ID_HEADER_S;
+    attr = nonce + T_AEAD_NONCE_S;
+    tag = attr + len;
 
     /*
-     * Now AES-encrypt in place everything but the time at the front.
-     * AES_cbc_encrypt doesn't return anything.
+     * The nonce must never repeat for the same key, so use real random bytes.
+     * With a 96-bit random nonce, the chance of a collision is negligible for
+     * far more tokens than will ever be encrypted with one key before it is
+     * rotated.
      */
-    AES_cbc_encrypt(result + T_NONCE_O, result + T_NONCE_O, elen - T_HINT_S,
-                    &aes_key, aes_ivec, AES_ENCRYPT);
+    if (RAND_bytes(nonce, T_AEAD_NONCE_S) != 1) {
+        s = WA_ERR_RAND_FAILURE;
+        return openssl_error(ctx, s, "cannot generate random nonce");
+    }
+
+    /*
+     * Encrypt in place, authenticating the header as additional data.  GCM is
+     * a stream mode, so the ciphertext can overwrite the plaintext.
+     */
+    cctx = EVP_CIPHER_CTX_new();
+    if (cctx == NULL)
+        return openssl_error(ctx, WA_ERR_NO_MEM, "cannot create cipher");
+    okay = EVP_CIPHER_CTX_copy(cctx, template) == 1
+        && EVP_EncryptInit_ex(cctx, NULL, NULL, NULL, nonce) == 1
+        && EVP_EncryptUpdate(cctx, NULL, &out_len, result,
+                             T_KEY_ID_HEADER_S) == 1
+        && EVP_EncryptUpdate(cctx, attr, &out_len, attr, len) == 1
+        && EVP_EncryptFinal_ex(cctx, attr + out_len, &final_len) == 1
+        && EVP_CIPHER_CTX_ctrl(cctx, EVP_CTRL_GCM_GET_TAG, T_AEAD_TAG_S,
+                               tag) == 1;
+    EVP_CIPHER_CTX_free(cctx);
+    if (!okay)
+        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot run AES-GCM");
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Given the length of the attributes to encrypt, store the length of the
+ * encrypted token in the token format selected for the context and the
+ * offset within it at which the attributes go.  Returns WA_ERR_INVALID if
+ * the attributes are too long to encrypt.
+ */
+int
+wai_token_encrypted_length(struct webauth_context *ctx, size_t len,
+                           size_t *length, size_t *offset)
+{
+    size_t plen;
+
+    /* OpenSSL takes lengths as int. */
+    if (len > INT_MAX - T_NONCE_S - T_HMAC_S - 2 * AES_BLOCK_S)
+        return wai_error_set(ctx, WA_ERR_INVALID, "token data too long");
 
-    /* All done.  Return the result. */
+    switch (ctx->token_format) {
+    case WA_TOKEN_FORMAT_AES_GCM:
+        *offset = T_KEY_ID_HEADER_S + T_AEAD_NONCE_S;
+        *length = *offset + len + T_AEAD_TAG_S;
+        break;
+    case WA_TOKEN_FORMAT_KEY_ID:
+        *offset = T_KEY_ID_HEADER_S + T_ATTR_O;
+        *length = encoded_length(len, T_KEY_ID_HEADER_S, &plen);
+        break;
+    case WA_TOKEN_FORMAT_HINT:
+    default:
+        *offset = T_HINT_S + T_ATTR_O;
+        *length = encoded_length(len, T_HINT_S, &plen);
+        break;
+    }
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Encrypt in place a buffer laid out by wai_token_encrypted_length, with len
+ * bytes of attributes at the offset that function returned, using the best
+ * key on the keyring in the token format selected for the context.
+ */
+int
+wai_token_encrypt_buffer(struct webauth_context *ctx, void *buffer,
+                         size_t len, const struct webauth_keyring *ring)
+{
+    const struct wai_keyring_index *best;
+    int s;
+
+    /* Find the encryption key to use and its precomputed schedule. */
+    s = wai_keyring_best_index(ctx, ring, WA_KEY_ENCRYPT, 0, &best);
+    if (s != WA_ERR_NONE)
+        return s;
+    if (best->schedule == NULL) {
+        s = WA_ERR_BAD_KEY;
+        return openssl_error(ctx, s, "cannot set encryption key");
+    }
+
+    /* Encrypt in the selected format. */
+    if (ctx->token_format == WA_TOKEN_FORMAT_AES_GCM)
+        return encrypt_aead(ctx, buffer, len, best);
+    else
+        return encrypt_cbc(ctx, buffer, len, best);
+}
+
+
+/*
+ * Encrypt the input with the best key on the keyring in the token format
+ * selected for the context, storing the result in newly pool-allocated
+ * memory.
+ */
+int
+webauth_token_encrypt(struct webauth_context *ctx, const void *input,
+                      size_t len, void **output, size_t *output_len,
+                      const struct webauth_keyring *ring)
+{
+    unsigned char *result;
+    size_t elen, offset;
+    int s;
+
+    /* Clear our output paramters in case of error. */
+    *output = NULL;
+    *output_len = 0;
+
+    /* Lay out the token and copy in the attributes. */
+    s = wai_token_encrypted_length(ctx, len, &elen, &offset);
+    if (s != WA_ERR_NONE)
+        return s;
+    result = apr_palloc(ctx->pool, elen);
+    memcpy(result + offset, input, len);
+
+    /* Encrypt and return the result. */
+    s = wai_token_encrypt_buffer(ctx, result, len, ring);
+    if (s != WA_ERR_NONE)
+        return s;
     *output = result;
     *output_len = elen;
     return WA_ERR_NONE;
@@ -212,57 +753,65 @@ webauth_token_encrypt(struct webauth_context *ctx, const void *input,
 
 /*
  * Given a token and its length, decrypt it into the provided output buffer
- * with the length stored in output_len.  The output buffer must be at least
- * as large as the input length.  Uses the provided decryption key.
+ * with the length stored in output_len.  hlen is the length of the
+ * unencrypted header at the start of the token.  The output buffer must be at
+ * least as large as the input length.  Uses the precomputed schedule of the
+ * provided keyring index entry.
  *
  * Returns a WA_ERR code.
  */
 static int
 decrypt_token(struct webauth_context *ctx, const unsigned char *input,
-              size_t length, unsigned char *output, size_t *output_len,
-              const struct webauth_key *key)
+              size_t length, size_t hlen, unsigned char *output,
+              size_t *output_len, const struct wai_keyring_index *entry)
 {
     unsigned char computed_hmac[T_HMAC_S];
     size_t needed, plen, i;
     int s;
-    unsigned char *hmac;
-    AES_KEY aes_key;
 
     /* Basic sanity check. */
-    needed = T_HINT_S + T_NONCE_S + T_HMAC_S;
-    if (length < needed + needed % AES_BLOCK_SIZE)
+    needed = hlen + T_NONCE_S + T_HMAC_S;
+    if (length < needed + needed % AES_BLOCK_S)
         return wai_error_set(ctx, WA_ERR_CORRUPT, "token too short");
 
-    /* Create our decryption key. */
-    s = AES_set_decrypt_key(key->data, key->length * 8, &aes_key);
-    if (s != 0)
+    /*
+     * A length that isn't a multiple of the block size can't be a valid
+     * token.  Report it as an HMAC failure, as we did when we decrypted such
+     * tokens and let the HMAC check reject them.
+     */
+    if ((length - hlen) % AES_BLOCK_S != 0)
+        return wai_error_set(ctx, WA_ERR_BAD_HMAC, "token length invalid");
+
+    /* Make sure we have a decryption key. */
+    if (entry->schedule == NULL)
         return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot set encryption key");
 
     /*
-     * Decrypt everything except the time at the front.  We intentionally skip
-     * the same number of bytes at the start of the output buffer as we skip
-     * at the start of the input buffer to make the offsets line up and be
-     * less annoying.
-     *
-     * AES_cbc_encrypt doesn't return anything useful.
+     * Decrypt everything except the header at the front.  From here on, we
+     * work only with the encrypted portion, so skip past the header and
+     * adjust the length accordingly.
      */
-    AES_cbc_encrypt(input + T_NONCE_O, output + T_NONCE_O, length - T_HINT_S,
-                    &aes_key, aes_ivec, AES_DECRYPT);
+    input += hlen;
+    length -= hlen;
+    s = cbc_crypt(ctx, entry->schedule, CIPHER_CBC_DECRYPT, input, output,
+                  length);
+    if (s != WA_ERR_NONE)
+        return s;
 
     /*
      * We now need to compute the HMAC over data and padding to see if
      * decryption succeeded.
      */
-    hmac = HMAC(EVP_sha1(), key->data, key->length, output + T_ATTR_O,
-                length - T_ATTR_O, computed_hmac, NULL);
-    if (hmac == NULL)
-        return openssl_error(ctx, WA_ERR_CORRUPT, "cannot compute HMAC");
+    s = schedule_hmac(ctx, entry->schedule, output + T_ATTR_O,
+                      length - T_ATTR_O, computed_hmac);
+    if (s != WA_ERR_NONE)
+        return s;
     if (memcmp(output + T_HMAC_O, computed_hmac, T_HMAC_S) != 0)
         return wai_error_set(ctx, WA_ERR_BAD_HMAC, NULL);
 
     /* Check padding length and data validity. */
     plen = output[length - 1];
-    if (plen > AES_BLOCK_SIZE || plen > length)
+    if (plen > AES_BLOCK_S || plen > length)
         return wai_error_set(ctx, WA_ERR_CORRUPT, "token padding corrupt");
     for (i = length - plen; i < length - 1; i++)
         if (output[i] != plen)
@@ -278,6 +827,159 @@ decrypt_token(struct webauth_context *ctx, const unsigned char *input,
 }
 
 
+/*
+ * Decrypt and authenticate a token in the AEAD format into the provided
+ * output buffer, which must be at least as large as the input length, using
+ * the provided keyring index entry.  Returns WA_ERR_BAD_HMAC if the token
+ * fails authentication.
+ */
+static int
+decrypt_aead(struct webauth_context *ctx, const unsigned char *input,
+             size_t length, unsigned char *output, size_t *output_len,
+             const struct wai_keyring_index *entry)
+{
+    const EVP_CIPHER_CTX *template;
+    EVP_CIPHER_CTX *cctx;
+    const unsigned char *nonce, *attr, *tag;
+    size_t alen;
+    int s, okay, out_len, final_len;
+
+    /* Basic sanity check. */
+    if (length < T_KEY_ID_HEADER_S + T_AEAD_NONCE_S + T_AEAD_TAG_S)
+        return wai_error_set(ctx, WA_ERR_CORRUPT, "token too short");
+    if (entry->schedule == NULL)
+        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot set encryption key");
+    s = schedule_cipher(ctx, entry->schedule, CIPHER_GCM_DECRYPT, &template);
+    if (s != WA_ERR_NONE)
+        return s;
+    nonce = input + T_KEY_ID_HEADER_S;
+    attr = nonce + T_AEAD_NONCE_S;
+    alen = length - T_KEY_ID_HEADER_S - T_AEAD_NONCE_S - T_AEAD_TAG_S;
+    tag = attr + alen;
+
+    /* Decrypt, checking the header as additional data. */
+    cctx = EVP_CIPHER_CTX_new();
+    if (cctx == NULL)
+        return openssl_error(ctx, WA_ERR_NO_MEM, "cannot create cipher");
+    okay = EVP_CIPHER_CTX_copy(cctx, template) == 1
+        && EVP_DecryptInit_ex(cctx, NULL, NULL, NULL, nonce) == 1
+        && EVP_DecryptUpdate(cctx, NULL, &out_len, input,
+                             T_KEY_ID_HEADER_S) == 1
+        && EVP_DecryptUpdate(cctx, output, &out_len, attr, alen) == 1
+        && EVP_CIPHER_CTX_ctrl(cctx, EVP_CTRL_GCM_SET_TAG, T_AEAD_TAG_S,
+                               (void *) tag) == 1;
+    if (!okay) {
+        EVP_CIPHER_CTX_free(cctx);
+        return openssl_error(ctx, WA_ERR_BAD_KEY, "cannot run AES-GCM");
+    }
+
+    /* The final step checks the authentication tag. */
+    okay = EVP_DecryptFinal_ex(cctx, output + out_len, &final_len) == 1;
+    EVP_CIPHER_CTX_free(cctx);
+    if (!okay) {
+        ERR_clear_error();
+        return wai_error_set(ctx, WA_ERR_BAD_HMAC, NULL);
+    }
+    *output_len = alen;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Decrypt a token in one of the formats with a key identifier header.  Only
+ * keys whose identifier matches the one in the token are tried, newest first,
+ * so a token encrypted in a key we don't have is rejected without any
+ * decryption.  Returns a WA_ERR code.
+ */
+static int
+decrypt_key_id(struct webauth_context *ctx, const unsigned char *input,
+               size_t length, unsigned char *output, size_t *output_len,
+               const struct webauth_keyring *ring)
+{
+    const struct wai_keyring_index *sorted;
+    uint32_t key_id;
+    size_t i;
+    int s, version;
+
+    if (length < T_KEY_ID_HEADER_S)
+        return wai_error_set(ctx, WA_ERR_CORRUPT, "token too short");
+    version = input[T_VERSION_O];
+    if (version != T_VERSION_KEY_ID && version != T_VERSION_AEAD)
+        return wai_error_set(ctx, WA_ERR_CORRUPT, "unknown token version %d",
+                             version);
+    memcpy(&key_id, input + T_KEY_ID_O, T_KEY_ID_S);
+    sorted = (const struct wai_keyring_index *) ring->sorted->elts;
+    for (i = ring->sorted->nelts; i > 0; i--) {
+        if (sorted[i - 1].key_id != key_id)
+            continue;
+        if (version == T_VERSION_AEAD)
+            s = decrypt_aead(ctx, input, length, output, output_len,
+                             &sorted[i - 1]);
+        else
+            s = decrypt_token(ctx, input, length, T_KEY_ID_HEADER_S, output,
+                              output_len, &sorted[i - 1]);
+        if (s != WA_ERR_BAD_HMAC)
+            return s;
+    }
+    return wai_error_set(ctx, WA_ERR_BAD_HMAC, "no key matches token");
+}
+
+
+/*
+ * Decrypt a token in the original key hint format.  The hinted key is tried
+ * first, and then the remaining keys in the keyring.  Returns a WA_ERR code.
+ */
+static int
+decrypt_hint(struct webauth_context *ctx, const unsigned char *input,
+             size_t length, unsigned char *output, size_t *output_len,
+             const struct webauth_keyring *ring)
+{
+    const struct wai_keyring_index *sorted, *best;
+    uint32_t hint_buf;
+    time_t hint;
+    size_t i;
+    int s;
+
+    /*
+     * If there's only one entry in the keyring, this is easy: we use that
+     * key.  Otherwise, we try the hinted key.  Failing that, we try all keys.
+     */
+    sorted = (const struct wai_keyring_index *) ring->sorted->elts;
+    if (ring->sorted->nelts == 1)
+        return decrypt_token(ctx, input, length, T_HINT_S, output, output_len,
+                             &sorted[0]);
+
+    /* First, try the hint. */
+    if (length < T_HINT_S)
+        return wai_error_set(ctx, WA_ERR_CORRUPT, "token too short");
+    memcpy(&hint_buf, input + T_HINT_O, sizeof(hint_buf));
+    hint = ntohl(hint_buf);
+    s = wai_keyring_best_index(ctx, ring, WA_KEY_DECRYPT, hint, &best);
+    if (s == WA_ERR_NONE)
+        s = decrypt_token(ctx, input, length, T_HINT_S, output, output_len,
+                          best);
+    else {
+        best = NULL;
+        s = WA_ERR_BAD_HMAC;
+    }
+
+    /*
+     * Now, as long as we didn't decode successfully, try each key in the
+     * keyring in turn, newest first.
+     */
+    if (s == WA_ERR_BAD_HMAC)
+        for (i = ring->sorted->nelts; i > 0; i--) {
+            if (&sorted[i - 1] == best)
+                continue;
+            s = decrypt_token(ctx, input, length, T_HINT_S, output,
+                              output_len, &sorted[i - 1]);
+            if (s != WA_ERR_BAD_HMAC)
+                break;
+        }
+    return s;
+}
+
+
 /*
  * Decrypts a token into new pool-allocated memory, given the token as input
  * and its length as input_len, and stores the results in output and
@@ -288,68 +990,34 @@ webauth_token_decrypt(struct webauth_context *ctx, const void *input,
                       size_t input_len, void **output, size_t *output_len,
                       const struct webauth_keyring *ring)
 {
-    size_t dlen, i;
+    size_t dlen;
     int s;
-    const struct webauth_key *key;
     const unsigned char *inbuf = input;
     unsigned char *outbuf;
-    const struct webauth_keyring_entry *entry;
 
     /* Clear our output parameters in case of an error. */
     *output = NULL;
     *output_len = 0;
 
-    /* Sanity-check our keyring. */
+    /* Sanity-check our keyring and the input. */
     if (ring->entries->nelts == 0)
         return wai_error_set(ctx, WA_ERR_BAD_KEY, "empty keyring");
+    if (input_len > INT_MAX)
+        return wai_error_set(ctx, WA_ERR_CORRUPT, "token too long");
 
     /*
-     * Create a buffer to hold the decrypted output.  We don't need to include
-     * the hint in this buffer, but keeping the same offsets in the input and
-     * output buffer during decryption makes the code much easier to read.
+     * Create a buffer to hold the decrypted output.  This is slightly larger
+     * than necessary, since it doesn't need to hold the header, but it's
+     * simpler to always allocate the input length.
      */
     dlen = input_len;
     outbuf = apr_palloc(ctx->pool, dlen);
 
-    /*
-     * Find the decryption key.  If there's only one entry in the keyring,
-     * this is easy: we use that key.  Otherwise, we try the hinted key.
-     * Failing that, we try all keys.
-     */
-    if (ring->entries->nelts == 1) {
-        entry = &APR_ARRAY_IDX(ring->entries, 0, struct webauth_keyring_entry);
-        key = entry->key;
-        s = decrypt_token(ctx, inbuf, input_len, outbuf, &dlen, key);
-    } else {
-        uint32_t hint_buf;
-        time_t h;
-
-        /* First, try the hint. */
-        memcpy(&hint_buf, inbuf, sizeof(hint_buf));
-        h = ntohl(hint_buf);
-        s = webauth_keyring_best_key(ctx, ring, WA_KEY_DECRYPT, h, &key);
-        if (s == WA_ERR_NONE)
-            s = decrypt_token(ctx, inbuf, input_len, outbuf, &dlen, key);
-        else
-            s = WA_ERR_BAD_HMAC;
-
-        /*
-         * Now, as long as we didn't decode successfully, try each key in the
-         * keyring in turn.  If the input is dirty, we have to replace the
-         * input with our temporary buffer and try again.
-         */
-        if (s == WA_ERR_BAD_HMAC)
-            for (i = 0; i < (size_t) ring->entries->nelts; i++) {
-                entry = &APR_ARRAY_IDX(ring->entries, i,
-                                       struct webauth_keyring_entry);
-                if (entry->key == key)
-                    continue;
-                s = decrypt_token(ctx, inbuf, input_len, outbuf, &dlen,
-                                  entry->key);
-                if (s != WA_ERR_BAD_HMAC)
-                    break;
-            }
-    }
+    /* Dispatch on the token format. */
+    if (input_len > 0 && inbuf[0] == 0)
+        s = decrypt_key_id(ctx, inbuf, input_len, outbuf, &dlen, ring);
+    else
+        s = decrypt_hint(ctx, inbuf, input_len, outbuf, &dlen, ring);
     if (s == WA_ERR_NONE) {
         *output = outbuf;
         *output_len = dlen;
@@ -15,7 +15,6 @@
 #include <portable/apr.h>
 #include <portable/system.h>
 
-#include <apr_base64.h>
 #include <apr_lib.h>
 #include <apr_uri.h>
 #include <time.h>
@@ -657,29 +656,31 @@ webauth_token_decode(struct webauth_context *ctx,
 
     if (token == NULL)
         return wai_error_set(ctx, WA_ERR_INVALID, "token is NULL");
-    length = apr_base64_decode_len(token);
-    input = apr_palloc(ctx->pool, length);
-    length = apr_base64_decode(input, token);
+    length = strlen(token);
+    input = apr_palloc(ctx->pool, wai_base64_decoded_length(length));
+    length = wai_base64_decode(input, token, length, WAI_BASE64_STANDARD);
     return webauth_token_decode_raw(ctx, type, input, length, ring, decoded);
 }
 
 
 /*
- * Encode a raw token (one that is not base64-encoded.  Takes a token struct
- * and a keyring to use for encryption, and stores in the token argument the
- * newly created token (in pool-allocated memory), with the length stored in
- * length.  On error, the token argument is set to NULL and an error code is
- * returned.
+ * Encode and encrypt a token into a single newly allocated buffer.  The
+ * length of the attribute encoding is determined first, and then the
+ * attributes are written directly into the buffer at the place where the
+ * token encryption expects them and encrypted in place.  If base64 is true,
+ * the buffer is sized for the base64 encoding of the token, with the
+ * encrypted token at its end so that it can be encoded in place.  Stores the
+ * buffer, the start of the encrypted token, and its length.
  */
-int
-webauth_token_encode_raw(struct webauth_context *ctx,
-                         const struct webauth_token *data,
-                         const struct webauth_keyring *ring,
-                         const void **token, size_t *length)
+static int
+encode_token(struct webauth_context *ctx, const struct webauth_token *data,
+             const struct webauth_keyring *ring, bool base64, char **buffer,
+             unsigned char **token, size_t *length)
 {
+    struct wai_encoded_token encoded;
     const char *type;
-    void *attrs, *output;
-    size_t alen;
+    size_t elen, offset, size;
+    unsigned char *raw;
     int s;
 
     /* Get the token type for error context reporting. */
@@ -697,14 +698,26 @@ webauth_token_encode_raw(struct webauth_context *ctx,
     if (s != WA_ERR_NONE)
         goto fail;
 
-    /* Encode and encrypt the token. */
-    s = wai_encode_token(ctx, data, &attrs, &alen);
+    /* Determine the layout of the result and allocate it. */
+    s = wai_encode_token_size(ctx, data, &encoded);
+    if (s != WA_ERR_NONE)
+        goto fail;
+    s = wai_token_encrypted_length(ctx, encoded.length, &elen, &offset);
+    if (s != WA_ERR_NONE)
+        goto fail;
+    size = base64 ? wai_base64_encoded_length(elen) + 1 : elen;
+    *buffer = apr_palloc(ctx->pool, size);
+    raw = (unsigned char *) *buffer + size - elen;
+
+    /* Encode and encrypt the token in place. */
+    s = wai_encode_token_write(ctx, &encoded, raw + offset);
     if (s != WA_ERR_NONE)
         goto fail;
-    s = webauth_token_encrypt(ctx, attrs, alen, &output, length, ring);
+    s = wai_token_encrypt_buffer(ctx, raw, encoded.length, ring);
     if (s != WA_ERR_NONE)
         goto fail;
-    *token = output;
+    *token = raw;
+    *length = elen;
     return WA_ERR_NONE;
 
 fail:
@@ -713,6 +726,32 @@ fail:
 }
 
 
+/*
+ * Encode a raw token (one that is not base64-encoded.  Takes a token struct
+ * and a keyring to use for encryption, and stores in the token argument the
+ * newly created token (in pool-allocated memory), with the length stored in
+ * length.  On error, the token argument is set to NULL and an error code is
+ * returned.
+ */
+int
+webauth_token_encode_raw(struct webauth_context *ctx,
+                         const struct webauth_token *data,
+                         const struct webauth_keyring *ring,
+                         const void **token, size_t *length)
+{
+    char *buffer;
+    unsigned char *raw;
+    int s;
+
+    *token = NULL;
+    s = encode_token(ctx, data, ring, false, &buffer, &raw, length);
+    if (s != WA_ERR_NONE)
+        return s;
+    *token = raw;
+    return WA_ERR_NONE;
+}
+
+
 /*
  * Encode a token.  Takes a token struct and a keyring to use for encryption,
  * and stores in the token argument the newly created token (in pool-allocated
@@ -724,23 +763,21 @@ webauth_token_encode(struct webauth_context *ctx,
                      const struct webauth_token *data,
                      const struct webauth_keyring *ring, const char **token)
 {
-    int s;
-    const void *raw;
-    char *btoken;
+    char *buffer;
+    unsigned char *raw;
     size_t length;
+    int s;
 
     /*
-     * First, we encode the binary form into newly allocated memory, and then
-     * we allocate an additional block of memory for the base64-encoded form.
-     * The first block is temporary memory that we could reclaim faster if it
-     * ever looks worthwhile.
+     * The token is encoded and encrypted at the end of a buffer large enough
+     * for its base64 encoding, which is then done in place, so the whole
+     * token is built in one allocation.
      */
     *token = NULL;
-    s = webauth_token_encode_raw(ctx, data, ring, &raw, &length);
+    s = encode_token(ctx, data, ring, true, &buffer, &raw, &length);
     if (s != WA_ERR_NONE)
         return s;
-    btoken = apr_palloc(ctx->pool, apr_base64_encode_len(length));
-    apr_base64_encode(btoken, raw, length);
-    *token = btoken;
+    wai_base64_encode(buffer, raw, length, WAI_BASE64_STANDARD);
+    *token = buffer;
     return WA_ERR_NONE;
 }
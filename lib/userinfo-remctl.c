@@ -2,7 +2,8 @@
  * Generic user information service remctl call support.
  *
  * Implements generic support for making a remctl call to the user information
- * service and returning the reply in a buffer.
+ * service and returning the reply in a buffer.  Credentials and connections
+ * are cached and reused between calls.
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Copyright 2011, 2012, 2013, 2014
@@ -15,7 +16,11 @@
 #include <portable/apr.h>
 #include <portable/system.h>
 
+#include <apr_atomic.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
 #include <errno.h>
+#include <time.h>
 #ifdef HAVE_REMCTL
 # include <remctl.h>
 #endif
@@ -53,26 +58,316 @@ wai_user_remctl(struct webauth_context *ctx, const char **command UNUSED,
 #else /* HAVE_REMCTL */
 
 /*
- * Issue a remctl command to the user information service.  Takes the
- * argv-style vector of the command to execute and a timeout (which may be 0
- * to use no timeout), and stores the resulting output in the provided
- * argument.  On any error, including remote failure to execute the command,
- * sets the WebAuth error and returns a status code.
+ * Process-wide state shared by all calls to the user information service.
+ *
+ * Getting credentials from the keytab is an AS exchange with the KDC, and
+ * opening a remctl connection is a TCP connection plus a GSS-API handshake
+ * that needs a service ticket from the KDC.  To avoid both on every call,
+ * we keep the TGT obtained from the keytab until shortly before it expires,
+ * importing it into a new memory ticket cache for each call that needs
+ * credentials, and keep a small number of idle authenticated connections
+ * that later calls can reuse.  A connection that has been idle too long is
+ * closed rather than reused, since the server will have closed its end.
+ *
+ * Both the TGT and the connections are tagged with a key built from the
+ * configuration they were obtained with and are only used for calls with
+ * the same configuration.  We also keep the time the most recent keytab
+ * authentication and connection took, which is reported as the latency
+ * saved when they're avoided.
+ *
+ * The state is allocated from an unmanaged APR pool so that it survives
+ * apr_terminate.  It is created on first use and published with an atomic
+ * compare-and-swap.
  */
-int
-wai_user_remctl(struct webauth_context *ctx, const char **command,
-                struct wai_buffer *output)
+#define REMCTL_IDLE_MAX     4   /* Maximum idle connections. */
+#define REMCTL_IDLE_TIMEOUT 30  /* Seconds before an idle connection closes. */
+#define TGT_MARGIN          300 /* Get a new TGT this long before expiry. */
+
+struct idle_connection {
+    struct remctl *r;
+    char *key;                  /* Configuration key, malloc'd. */
+    time_t last_used;
+};
+
+struct remctl_state {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;  /* Protects the rest of the struct. */
+#endif
+
+    /* The cached TGT, all malloc'd. */
+    char *tgt_key;
+    void *tgt;
+    size_t tgt_length;
+    time_t tgt_expires;
+
+    /* Idle connections. */
+    struct idle_connection idle[REMCTL_IDLE_MAX];
+    size_t count;
+
+    /* Most recent cost of authentication and connection. */
+    apr_interval_time_t kinit_time;
+    apr_interval_time_t open_time;
+};
+static volatile void *remctl_state = NULL;
+
+
+/*
+ * Lock or unlock the shared state.
+ */
+static void
+state_lock(struct remctl_state *state UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(state->mutex);
+#endif
+}
+
+static void
+state_unlock(struct remctl_state *state UNUSED)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(state->mutex);
+#endif
+}
+
+
+/*
+ * Return the shared state, creating it if this is the first use.  If two
+ * threads race to create it, the loser destroys its copy.  Returns NULL if
+ * the state can't be created, in which case nothing is cached.
+ */
+static struct remctl_state *
+state_get(void)
+{
+    struct remctl_state *state;
+    apr_pool_t *pool;
+
+    state = apr_atomic_casptr(&remctl_state, NULL, NULL);
+    if (state != NULL)
+        return state;
+    if (apr_pool_create_unmanaged(&pool) != APR_SUCCESS)
+        return NULL;
+    state = apr_pcalloc(pool, sizeof(struct remctl_state));
+    state->pool = pool;
+#if APR_HAS_THREADS
+    if (apr_thread_mutex_create(&state->mutex, APR_THREAD_MUTEX_DEFAULT, pool)
+        != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return NULL;
+    }
+#endif
+    if (apr_atomic_casptr(&remctl_state, state, NULL) != NULL) {
+        apr_pool_destroy(pool);
+        state = apr_atomic_casptr(&remctl_state, NULL, NULL);
+    }
+    return state;
+}
+
+
+/*
+ * Copy a string into newly malloc'd memory, returning NULL on failure.
+ */
+static char *
+copy_string(const char *string)
+{
+    size_t length;
+    char *copy;
+
+    length = strlen(string) + 1;
+    copy = malloc(length);
+    if (copy != NULL)
+        memcpy(copy, string, length);
+    return copy;
+}
+
+
+/*
+ * Take an idle connection for the given configuration key from the shared
+ * state, closing any idle connections that have timed out.  Returns NULL if
+ * there is no usable idle connection.
+ */
+static struct remctl *
+connection_checkout(struct remctl_state *state, const char *key)
 {
+    struct idle_connection expired[REMCTL_IDLE_MAX];
     struct remctl *r = NULL;
-    struct remctl_output *out;
-    size_t offset;
-    struct wai_buffer *errors, *buffer;
+    size_t i, nexpired;
+    time_t now;
+
+    if (state == NULL)
+        return NULL;
+    now = time(NULL);
+    nexpired = 0;
+    state_lock(state);
+    i = state->count;
+    while (i-- > 0) {
+        if (state->idle[i].last_used + REMCTL_IDLE_TIMEOUT > now
+            && r == NULL && strcmp(state->idle[i].key, key) == 0) {
+            r = state->idle[i].r;
+            free(state->idle[i].key);
+        } else if (state->idle[i].last_used + REMCTL_IDLE_TIMEOUT <= now)
+            expired[nexpired++] = state->idle[i];
+        else
+            continue;
+        state->idle[i] = state->idle[--state->count];
+    }
+    state_unlock(state);
+    for (i = 0; i < nexpired; i++) {
+        remctl_close(expired[i].r);
+        free(expired[i].key);
+    }
+    return r;
+}
+
+
+/*
+ * Return a connection to the shared state after a successful command so that
+ * it can be reused, or close it if there's no room for it.
+ */
+static void
+connection_checkin(struct remctl_state *state, const char *key,
+                   struct remctl *r)
+{
+    char *copy = NULL;
+
+    if (state != NULL)
+        copy = copy_string(key);
+    if (copy != NULL) {
+        state_lock(state);
+        if (state->count < REMCTL_IDLE_MAX) {
+            state->idle[state->count].r = r;
+            state->idle[state->count].key = copy;
+            state->idle[state->count].last_used = time(NULL);
+            state->count++;
+            r = NULL;
+        }
+        state_unlock(state);
+    }
+    if (r != NULL) {
+        free(copy);
+        remctl_close(r);
+    }
+}
+
+
+/*
+ * Obtain credentials for the configured principal, using the cached TGT if
+ * there is one for this configuration that isn't close to expiring and
+ * otherwise authenticating with the keytab and caching the resulting TGT.
+ * Sets reused to true if the cached TGT was used.  Returns a WebAuth status.
+ */
+static int
+get_credentials(struct webauth_context *ctx, struct remctl_state *state,
+                const char *key, struct webauth_krb5 **kc, bool *reused)
+{
+    struct webauth_user_config *c = ctx->user;
+    void *tgt = NULL;
+    size_t length = 0;
+    time_t expires;
+    apr_time_t start;
+    apr_interval_time_t elapsed;
+    int s;
+
+    *reused = false;
+    s = webauth_krb5_new(ctx, kc);
+    if (s != WA_ERR_NONE)
+        return s;
+
+    /* Try the cached TGT first. */
+    if (state != NULL) {
+        state_lock(state);
+        if (state->tgt != NULL && strcmp(state->tgt_key, key) == 0
+            && state->tgt_expires > time(NULL) + TGT_MARGIN) {
+            tgt = apr_pmemdup(ctx->pool, state->tgt, state->tgt_length);
+            length = state->tgt_length;
+        }
+        state_unlock(state);
+        if (tgt != NULL) {
+            s = webauth_krb5_import_cred(ctx, *kc, tgt, length, NULL);
+            if (s == WA_ERR_NONE) {
+                *reused = true;
+                return WA_ERR_NONE;
+            }
+
+            /* Fall back on the keytab with a fresh context. */
+            webauth_krb5_free(ctx, *kc);
+            s = webauth_krb5_new(ctx, kc);
+            if (s != WA_ERR_NONE)
+                return s;
+        }
+    }
+
+    /* Authenticate with the keytab and cache the TGT. */
+    start = apr_time_now();
+    s = webauth_krb5_init_via_keytab(ctx, *kc, c->keytab, c->principal, NULL);
+    if (s != WA_ERR_NONE)
+        return s;
+    elapsed = apr_time_now() - start;
+    if (state == NULL)
+        return WA_ERR_NONE;
+    if (webauth_krb5_export_cred(ctx, *kc, NULL, &tgt, &length, &expires)
+        != WA_ERR_NONE)
+        return WA_ERR_NONE;
+    state_lock(state);
+    state->kinit_time = elapsed;
+    free(state->tgt);
+    free(state->tgt_key);
+    state->tgt = malloc(length);
+    state->tgt_key = copy_string(key);
+    if (state->tgt == NULL || state->tgt_key == NULL) {
+        free(state->tgt);
+        free(state->tgt_key);
+        state->tgt = NULL;
+        state->tgt_key = NULL;
+    } else {
+        memcpy(state->tgt, tgt, length);
+        state->tgt_length = length;
+        state->tgt_expires = expires;
+    }
+    state_unlock(state);
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Set the WebAuth error from the remctl error message, distinguishing between
+ * timeouts and other failures.  Returns the WebAuth status.
+ */
+static int
+remctl_error_set(struct webauth_context *ctx, struct remctl *r,
+                 const char *message)
+{
+    int s;
+
+    if (strstr(remctl_error(r), "timed out") != NULL)
+        s = WA_ERR_REMOTE_TIMEOUT;
+    else
+        s = WA_ERR_REMOTE_FAILURE;
+    return wai_error_set(ctx, s, "%s", message);
+}
+
+
+/*
+ * Open a new authenticated connection to the user information service.
+ * Stores the connection in result and sets saved to the latency saved by
+ * using a cached TGT, if one was used.  Returns a WebAuth status.
+ */
+static int
+open_connection(struct webauth_context *ctx, struct remctl_state *state,
+                const char *key, struct remctl **result,
+                apr_interval_time_t *saved)
+{
+    struct remctl *r;
     struct webauth_user_config *c = ctx->user;
     struct webauth_krb5 *kc = NULL;
     char *cache;
+    bool reused;
+    apr_time_t start;
     int s;
 
     /* Initialize the remctl context. */
+    *result = NULL;
     r = remctl_new();
     if (r == NULL) {
         s = WA_ERR_NO_MEM;
@@ -81,7 +376,7 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
 
     /*
      * Obtain authentication credentials from the configured keytab and
-     * principal.
+     * principal, or from the cached TGT.
      *
      * This changes the global GSS-API state to point to our ticket cache.
      * Unfortunately, the GSS-API doesn't currently provide any way to avoid
@@ -90,12 +385,14 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
      * If remctl_set_ccache fails or doesn't exist, we fall back on just
      * whacking the global KRB5CCNAME variable.
      */
-    s = webauth_krb5_new(ctx, &kc);
-    if (s != WA_ERR_NONE)
-        goto fail;
-    s = webauth_krb5_init_via_keytab(ctx, kc, c->keytab, c->principal, NULL);
+    s = get_credentials(ctx, state, key, &kc, &reused);
     if (s != WA_ERR_NONE)
         goto fail;
+    if (reused && state != NULL) {
+        state_lock(state);
+        *saved += state->kinit_time;
+        state_unlock(state);
+    }
     s = webauth_krb5_get_cache(ctx, kc, &cache);
     if (s != WA_ERR_NONE)
         goto fail;
@@ -108,26 +405,47 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
         }
     }
 
-    /* Set a timeout if one was given. */
+    /* Set a timeout if one was given and open the connection. */
     if (c->timeout > 0)
         remctl_set_timeout(r, c->timeout);
-
-    /* Set up and execute the command. */
+    start = apr_time_now();
     if (!remctl_open(r, c->host, c->port, c->identity)) {
-        if (strstr(remctl_error(r), "timed out") != NULL)
-            s = WA_ERR_REMOTE_TIMEOUT;
-        else
-            s = WA_ERR_REMOTE_FAILURE;
-        wai_error_set(ctx, s, "%s", remctl_error(r));
+        s = remctl_error_set(ctx, r, remctl_error(r));
         goto fail;
     }
+    if (state != NULL) {
+        state_lock(state);
+        state->open_time = apr_time_now() - start;
+        state_unlock(state);
+    }
+    *result = r;
+    return WA_ERR_NONE;
+
+fail:
+    remctl_close(r);
+    return s;
+}
+
+
+/*
+ * Run a command over an open connection and accumulate the output in the
+ * provided buffer.  On any error, including remote failure to execute the
+ * command, sets the WebAuth error and returns a status code.  If the error
+ * was in talking to the server rather than a failure of the command, also
+ * sets failed to true, since the connection can no longer be used.
+ */
+static int
+run_command(struct webauth_context *ctx, struct remctl *r,
+            const char **command, struct wai_buffer *output, bool *failed)
+{
+    struct remctl_output *out;
+    size_t offset;
+    struct wai_buffer *errors, *buffer;
+
+    *failed = false;
     if (!remctl_command(r, command)) {
-        if (strstr(remctl_error(r), "timed out") != NULL)
-            s = WA_ERR_REMOTE_TIMEOUT;
-        else
-            s = WA_ERR_REMOTE_FAILURE;
-        wai_error_set(ctx, s, "%s", remctl_error(r));
-        goto fail;
+        *failed = true;
+        return remctl_error_set(ctx, r, remctl_error(r));
     }
 
     /*
@@ -139,12 +457,8 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
     do {
         out = remctl_output(r);
         if (out == NULL) {
-            if (strstr(remctl_error(r), "timed out") != NULL)
-                s = WA_ERR_REMOTE_TIMEOUT;
-            else
-                s = WA_ERR_REMOTE_FAILURE;
-            wai_error_set(ctx, s, "%s", remctl_error(r));
-            goto fail;
+            *failed = true;
+            return remctl_error_set(ctx, r, remctl_error(r));
         }
         switch (out->type) {
         case REMCTL_OUT_OUTPUT:
@@ -152,13 +466,8 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
             wai_buffer_append(buffer, out->data, out->length);
             break;
         case REMCTL_OUT_ERROR:
-            if (strstr(remctl_error(r), "timed out") != NULL)
-                s = WA_ERR_REMOTE_TIMEOUT;
-            else
-                s = WA_ERR_REMOTE_FAILURE;
             wai_buffer_set(errors, out->data, out->length);
-            wai_error_set(ctx, s, "%s", errors->data);
-            goto fail;
+            return remctl_error_set(ctx, r, errors->data);
         case REMCTL_OUT_STATUS:
             if (out->status != 0) {
                 if (errors->data == NULL)
@@ -167,26 +476,88 @@ wai_user_remctl(struct webauth_context *ctx, const char **command,
                                               out->status);
                 if (wai_buffer_find_string(errors, "\n", 0, &offset))
                     errors->data[offset] = '\0';
-                if (strstr(remctl_error(r), "timed out") != NULL)
-                    s = WA_ERR_REMOTE_TIMEOUT;
-                else
-                    s = WA_ERR_REMOTE_FAILURE;
-                wai_error_set(ctx, s, "%s", errors->data);
-                goto fail;
+                return remctl_error_set(ctx, r, errors->data);
             }
         case REMCTL_OUT_DONE:
         default:
             break;
         }
     } while (out->type == REMCTL_OUT_OUTPUT);
-    remctl_close(r);
-    r = NULL;
     return WA_ERR_NONE;
+}
 
-fail:
-    if (r != NULL)
+
+/*
+ * Issue a remctl command to the user information service.  Takes the
+ * argv-style vector of the command to execute and a timeout (which may be 0
+ * to use no timeout), and stores the resulting output in the provided
+ * argument.  On any error, including remote failure to execute the command,
+ * sets the WebAuth error and returns a status code.
+ *
+ * An idle connection is reused if one is available.  If the command fails
+ * on a reused connection for any reason other than a timeout, the server
+ * may have closed the connection, so the command is retried once on a new
+ * connection.  The connection is kept for reuse only if the command
+ * succeeded.
+ */
+int
+wai_user_remctl(struct webauth_context *ctx, const char **command,
+                struct wai_buffer *output)
+{
+    struct remctl_state *state;
+    struct remctl *r;
+    struct webauth_user_config *c = ctx->user;
+    apr_interval_time_t saved = 0;
+    bool reused, failed;
+    const char *key;
+    int s;
+
+    /* Build the key for the configuration. */
+    key = apr_psprintf(ctx->pool, "%s %u %s %s %s", c->host,
+                       (unsigned int) c->port,
+                       c->identity == NULL ? "" : c->identity,
+                       c->keytab, c->principal == NULL ? "" : c->principal);
+
+    /* Get a connection, reusing one if possible. */
+    state = state_get();
+    r = connection_checkout(state, key);
+    reused = (r != NULL);
+    if (r == NULL) {
+        s = open_connection(ctx, state, key, &r, &saved);
+        if (s != WA_ERR_NONE)
+            return s;
+    } else if (c->timeout > 0)
+        remctl_set_timeout(r, c->timeout);
+
+    /* Run the command, retrying on a new connection if appropriate. */
+    s = run_command(ctx, r, command, output, &failed);
+    if (failed && reused && s != WA_ERR_REMOTE_TIMEOUT) {
         remctl_close(r);
-    return s;
+        reused = false;
+        output->used = 0;
+        s = open_connection(ctx, state, key, &r, &saved);
+        if (s != WA_ERR_NONE)
+            return s;
+        s = run_command(ctx, r, command, output, &failed);
+    }
+    if (s != WA_ERR_NONE) {
+        remctl_close(r);
+        return s;
+    }
+    connection_checkin(state, key, r);
+
+    /* Report the time saved by the cached TGT and connection. */
+    if (reused && state != NULL) {
+        state_lock(state);
+        saved = state->kinit_time + state->open_time;
+        state_unlock(state);
+    }
+    if (saved > 0)
+        wai_log_info(ctx, "user information service call %s, saving"
+                     " about %lu ms", reused ? "reused a connection"
+                     : "reused a cached TGT",
+                     (unsigned long) apr_time_as_msec(saved));
+    return WA_ERR_NONE;
 }
 
 #endif /* HAVE_REMCTL */
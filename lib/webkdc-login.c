@@ -214,10 +214,13 @@ parse_token_webkdc_proxies(struct webauth_context *ctx,
 /*
  * Decrypt the webkdc-service token and store it in the login state.  This is
  * a wrapper around webauth_token_decode that does some additional checks,
- * keyring management, and return status mapping.
+ * keyring management, and return status mapping.  If the caller already
+ * decoded the token and passed it as service, use that instead of decrypting
+ * the token again.
  */
 static int
 parse_token_webkdc_service(struct webauth_context *ctx, const char *data,
+                           const struct webauth_token_webkdc_service *service,
                            struct wai_webkdc_login_state *state,
                            const struct webauth_keyring *ring)
 {
@@ -232,12 +235,17 @@ parse_token_webkdc_service(struct webauth_context *ctx, const char *data,
         wai_error_set(ctx, WA_ERR_INVALID, "incomplete login request data");
         return WA_ERR_INVALID;
     }
-    s = webauth_token_decode(ctx, WA_TOKEN_WEBKDC_SERVICE, data, ring, &token);
-    if (s == WA_ERR_TOKEN_EXPIRED)
-        return wai_error_change(ctx, s, WA_PEC_SERVICE_TOKEN_EXPIRED);
-    else if (s != WA_ERR_NONE)
-        return wai_error_change(ctx, s, WA_PEC_SERVICE_TOKEN_INVALID);
-    state->service = &token->token.webkdc_service;
+    if (service != NULL)
+        state->service = service;
+    else {
+        s = webauth_token_decode(ctx, WA_TOKEN_WEBKDC_SERVICE, data, ring,
+                                 &token);
+        if (s == WA_ERR_TOKEN_EXPIRED)
+            return wai_error_change(ctx, s, WA_PEC_SERVICE_TOKEN_EXPIRED);
+        else if (s != WA_ERR_NONE)
+            return wai_error_change(ctx, s, WA_PEC_SERVICE_TOKEN_INVALID);
+        state->service = &token->token.webkdc_service;
+    }
 
     /*
      * Several tokens, such as the login cancel token and the result token,
@@ -267,13 +275,15 @@ parse_token_webkdc_service(struct webauth_context *ctx, const char *data,
 static int
 parse_request(struct webauth_context *ctx,
               const struct webauth_webkdc_login_request *request,
+              const struct webauth_token_webkdc_service *service,
               struct wai_webkdc_login_state *state,
               const struct webauth_keyring *ring)
 {
     int s;
 
     /* Decrypt the webkdc-service token and set up the session keyring. */
-    s = parse_token_webkdc_service(ctx, request->service, state, ring);
+    s = parse_token_webkdc_service(ctx, request->service, service, state,
+                                   ring);
     if (s != WA_ERR_NONE)
         return s;
 
@@ -1173,105 +1183,6 @@ check_forced_auth(struct webauth_context *ctx,
 }
 
 
-/*
- * Given the authenticated user and the destination site, determine the
- * permissible authentication identities for that destination site.  Stores
- * that list in a newly-allocated array, which may be set to NULL if there is
- * no identity ACL or if none of its entries apply to the current
- * authentication.  Returns an error code.
- */
-static int
-build_identity_list(struct webauth_context *ctx, const char *subject,
-                    const char *target, const apr_array_header_t **result)
-{
-    int s;
-    unsigned long line;
-    apr_file_t *acl;
-    apr_int32_t flags;
-    apr_status_t code;
-    char buf[BUFSIZ];
-    const char *path;
-    char *p, *authn, *was, *authz, *last;
-    apr_array_header_t *identities = NULL;
-
-    /* If there is no identity ACL file, there is a NULL array. */
-    *result = NULL;
-    path = ctx->webkdc->id_acl_path;
-    if (path == NULL)
-        return WA_ERR_NONE;
-
-    /* Open the identity ACL file. */
-    flags = APR_FOPEN_READ | APR_FOPEN_BUFFERED | APR_FOPEN_NOCLEANUP;
-    code = apr_file_open(&acl, path, flags, APR_FPROT_OS_DEFAULT, ctx->pool);
-    if (code != APR_SUCCESS) {
-        s = WA_ERR_FILE_OPENREAD;
-        return wai_error_set_apr(ctx, s, code, "identity ACL %s", path);
-    }
-
-    /*
-     * Read the file line by line, and store the relevant potential
-     * identities.  The format is:
-     *
-     *     <authn> <target> <authz>
-     *
-     * where <authn> is the user's actual authenticated identity, <target> is
-     * the identity of the site to which the user is going, and <authz> is an
-     * alternate authorization identity the user is allowed to express to that
-     * site.
-     */
-    line = 0;
-    while ((code = apr_file_gets(buf, sizeof(buf), acl)) == APR_SUCCESS) {
-        line++;
-        if (buf[strlen(buf) - 1] != '\n') {
-            s = WA_ERR_FILE_READ;
-            wai_error_set(ctx, s, "identity ACL %s line %lu too long", path,
-                          line);
-            goto done;
-        }
-        p = buf;
-        while (apr_isspace(*p))
-            p++;
-        if (*p == '#' || *p == '\0')
-            continue;
-        authn = apr_strtok(p, " \t\r\n", &last);
-        if (authn == NULL)
-            continue;
-        if (strcmp(subject, authn) != 0)
-            continue;
-        was = apr_strtok(NULL, " \t\r\n", &last);
-        if (was == NULL) {
-            s = WA_ERR_FILE_READ;
-            wai_error_set(ctx, s, "missing target on identity ACL %s line %lu",
-                          path, line);
-            goto done;
-        }
-        if (strcmp(target, was) != 0)
-            continue;
-        authz = apr_strtok(NULL, " \t\r\n", &last);
-        if (authz == NULL) {
-            s = WA_ERR_FILE_READ;
-            wai_error_set(ctx, s, "missing identity on identity ACL %s"
-                          " line %lu", path, line);
-            goto done;
-        }
-        if (identities == NULL)
-            identities = apr_array_make(ctx->pool, 1, sizeof(char *));
-        APR_ARRAY_PUSH(identities, char *) = apr_pstrdup(ctx->pool, authz);
-    }
-    if (code != APR_SUCCESS && code != APR_EOF) {
-        s = WA_ERR_FILE_READ;
-        wai_error_set_apr(ctx, s, code, "identity ACL %s", path);
-        goto done;
-    }
-    *result = identities;
-    s = WA_ERR_NONE;
-
-done:
-    apr_file_close(acl);
-    return s;
-}
-
-
 /*
  * If the user attempts to assert an alternate identity, see if that's
  * allowed.  If the requested authorization subject matches the actual
@@ -1288,10 +1199,17 @@ check_authz_identity(struct webauth_context *ctx,
     bool okay;
     int i, s;
 
-    /* Obtain the list of identities the user is allowed to assert. */
-    s = build_identity_list(ctx, subject, state->service->subject, &permitted);
-    if (s != WA_ERR_NONE)
-        return s;
+    /*
+     * Obtain the list of identities the user is allowed to assert.  If there
+     * is no identity ACL file, the list is NULL.
+     */
+    permitted = NULL;
+    if (ctx->webkdc->id_acl_path != NULL) {
+        s = wai_id_acl_lookup(ctx, ctx->webkdc->id_acl_path, subject,
+                              state->service->subject, &permitted);
+        if (s != WA_ERR_NONE)
+            return s;
+    }
     state->permitted_authz = permitted;
 
     /* Check whether the user tried to assert a different identity. */
@@ -1667,14 +1585,16 @@ encode_response(struct webauth_context *ctx,
 /*
  * Given the data from a <requestTokenRequest> login attempt, process that
  * attempted login and return the information for a <requestTokenResponse> in
- * a newly-allocated struct from pool memory.  Returns a protocol-compatible
- * WebAuth status code.
+ * a newly-allocated struct from pool memory.  service is the decoded
+ * webkdc-service token if the caller already has it, or NULL to decode it
+ * from the request.  Returns a protocol-compatible WebAuth status code.
  */
-int
-webauth_webkdc_login(struct webauth_context *ctx,
-                     const struct webauth_webkdc_login_request *request,
-                     struct webauth_webkdc_login_response **response,
-                     const struct webauth_keyring *ring)
+static int
+login(struct webauth_context *ctx,
+      const struct webauth_webkdc_login_request *request,
+      const struct webauth_token_webkdc_service *service,
+      struct webauth_webkdc_login_response **response,
+      const struct webauth_keyring *ring)
 {
     struct wai_webkdc_login_state state;
     struct webauth_user_info *info = NULL;
@@ -1686,7 +1606,7 @@ webauth_webkdc_login(struct webauth_context *ctx,
     memset(&state, 0, sizeof(state));
 
     /* Parse the request into our login state.  This does token decryption. */
-    s = parse_request(ctx, request, &state, ring);
+    s = parse_request(ctx, request, service, &state, ring);
     if (s != WA_ERR_NONE)
         goto done;
 
@@ -1819,3 +1739,33 @@ done:
     wai_webkdc_log_login(ctx, &state, result, *response);
     return result;
 }
+
+
+/*
+ * Process a <requestTokenRequest> login attempt.  This is a wrapper around
+ * login that decodes the webkdc-service token from the request.
+ */
+int
+webauth_webkdc_login(struct webauth_context *ctx,
+                     const struct webauth_webkdc_login_request *request,
+                     struct webauth_webkdc_login_response **response,
+                     const struct webauth_keyring *ring)
+{
+    return login(ctx, request, NULL, response, ring);
+}
+
+
+/*
+ * Process a <requestTokenRequest> login attempt using a webkdc-service token
+ * that the caller has already decoded.
+ */
+int
+webauth_webkdc_login_service(
+    struct webauth_context *ctx,
+    const struct webauth_webkdc_login_request *request,
+    const struct webauth_token_webkdc_service *service,
+    struct webauth_webkdc_login_response **response,
+    const struct webauth_keyring *ring)
+{
+    return login(ctx, request, service, response, ring);
+}
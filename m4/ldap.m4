@@ -10,13 +10,17 @@ dnl RRA_LIB_LDAP_SWITCH to set CPPFLAGS, LDFLAGS, and LIBS to include the LDAP
 dnl libraries, saving the current values first, and RRA_LIB_LDAP_RESTORE to
 dnl restore those settings to before the last RRA_LIB_LDAP_SWITCH.
 dnl
+dnl The thread-safe ldap_r library is used in preference to the ldap library
+dnl if it exists, since older versions of OpenLDAP only support using LDAP
+dnl connections from multiple threads with ldap_r.
+dnl
 dnl Depends on RRA_SET_LDFLAGS and RRA_ENABLE_REDUCED_DEPENDS.
 dnl
 dnl The canonical version of this file is maintained in the rra-c-util
 dnl package, available at <http://www.eyrie.org/~eagle/software/rra-c-util/>.
 dnl
 dnl Written by Russ Allbery <eagle@eyrie.org>
-dnl Copyright 2010
+dnl Copyright 2010, 2026
 dnl     The Board of Trustees of the Leland Stanford Junior University
 dnl
 dnl This file is free software; the authors give unlimited permission to copy
@@ -87,7 +91,9 @@ AC_DEFUN([RRA_LIB_LDAP],
  RRA_LIB_LDAP_SWITCH
  AS_IF([test x"$rra_reduced_depends" != xtrue],
     [AC_CHECK_LIB([lber], [ber_dump], [LDAP_LIBS=-llber])])
- AC_CHECK_LIB([ldap], [ldap_open], [LDAP_LIBS="-lldap $LDAP_LIBS"],
-    [AC_MSG_ERROR([cannot find usable LDAP library])],
+ AC_CHECK_LIB([ldap_r], [ldap_open], [LDAP_LIBS="-lldap_r $LDAP_LIBS"],
+    [AC_CHECK_LIB([ldap], [ldap_open], [LDAP_LIBS="-lldap $LDAP_LIBS"],
+        [AC_MSG_ERROR([cannot find usable LDAP library])],
+        [$LDAP_LIBS])],
     [$LDAP_LIBS])
  RRA_LIB_LDAP_RESTORE])
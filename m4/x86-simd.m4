@@ -0,0 +1,67 @@
+dnl Check whether the compiler can build x86 SIMD code chosen at runtime.
+dnl
+dnl Provides RRA_C_X86_SIMD, which checks whether the compiler supports the
+dnl target function attribute for SSE2, SSSE3, and AVX2 code with the
+dnl intrinsics from <immintrin.h> (without enabling those instruction sets
+dnl for the rest of the program), along with __builtin_cpu_supports to
+dnl check at runtime which of them the processor supports.  This is true of
+dnl GCC 4.9 and later on i386 and x86_64.  Defines HAVE_X86_SIMD if so.
+dnl
+dnl Written by agent <agent@local>
+dnl Copyright 2026
+dnl     The Board of Trustees of the Leland Stanford Junior University
+dnl
+dnl This file is free software; the authors give unlimited permission to copy
+dnl and/or distribute it, with or without modifications, as long as this
+dnl notice is preserved.
+
+AC_DEFUN([_RRA_C_X86_SIMD_SOURCE], [[
+#include <immintrin.h>
+
+__attribute__((__target__("sse2")))
+static int
+sse2(int x)
+{
+    __m128i v = _mm_set1_epi8((char) x);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v, v));
+}
+
+__attribute__((__target__("ssse3")))
+static int
+ssse3(int x)
+{
+    __m128i v = _mm_set1_epi8((char) x);
+    return _mm_movemask_epi8(_mm_shuffle_epi8(v, v));
+}
+
+__attribute__((__target__("avx2")))
+static int
+avx2(int x)
+{
+    __m256i v = _mm256_set1_epi8((char) x);
+    return _mm256_movemask_epi8(_mm256_shuffle_epi8(v, v));
+}
+
+int
+main(void)
+{
+    int n = 0;
+
+    if (__builtin_cpu_supports("avx2"))
+        n += avx2(1);
+    if (__builtin_cpu_supports("ssse3"))
+        n += ssse3(1);
+    if (__builtin_cpu_supports("sse2"))
+        n += sse2(1);
+    return n < 0;
+}
+]])
+
+AC_DEFUN([RRA_C_X86_SIMD],
+[AC_CACHE_CHECK([for x86 SIMD with runtime dispatch], [rra_cv_c_x86_simd],
+    [AC_LINK_IFELSE([AC_LANG_SOURCE([_RRA_C_X86_SIMD_SOURCE])],
+        [rra_cv_c_x86_simd=yes],
+        [rra_cv_c_x86_simd=no])])
+ AS_IF([test x"$rra_cv_c_x86_simd" = xyes],
+    [AC_DEFINE([HAVE_X86_SIMD], 1,
+        [Define if the compiler can build x86 SIMD code chosen at runtime.])])])
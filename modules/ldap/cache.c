@@ -0,0 +1,208 @@
+/*
+ * Cache of LDAP results for the Apache WebAuth LDAP module.
+ *
+ * Search results and privgroup comparisons for a user rarely change from one
+ * request to the next, so they are kept in a process-wide cache for a
+ * configurable lifetime and shared by all requests handled by the process.
+ * The cache only stores opaque blobs of data under string keys; formatting
+ * the results into a blob and parsing them back out is left to the caller.
+ *
+ * Each entry is a single block of malloc'd memory holding the key and data,
+ * so that entries can be replaced and expired without growing an APR pool.
+ * Lookups copy the data into the caller's pool while holding the cache mutex,
+ * so the entry may be replaced as soon as the lookup returns.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+
+#include <apr_hash.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
+#include <ldap.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <modules/ldap/mod_webauthldap.h>
+
+/* A cache entry.  The key and then the data follow the struct in memory. */
+struct mwl_cache_entry {
+    apr_time_t expires;         /* When this entry is no longer valid. */
+    size_t length;              /* Length of the data. */
+    const char *key;            /* Key, pointing into the same allocation. */
+    void *data;                 /* Data, pointing into the same allocation. */
+};
+
+/* The cache. */
+struct mwl_cache {
+    apr_thread_mutex_t *mutex;  /* Protects the rest of the struct. */
+    apr_hash_t *entries;        /* Map of keys to struct mwl_cache_entry. */
+    size_t max;                 /* Maximum number of entries. */
+    unsigned long hits;         /* Number of successful lookups. */
+    unsigned long misses;       /* Number of failed or expired lookups. */
+};
+
+
+/*
+ * Free all the entries in the cache.  This is registered as a cleanup for the
+ * pool from which the cache was allocated so that the entries don't leak
+ * when Apache is restarted.
+ */
+static apr_status_t
+cache_free(void *data)
+{
+    struct mwl_cache *cache = data;
+    apr_hash_index_t *hi;
+    void *entry;
+
+    for (hi = apr_hash_first(NULL, cache->entries); hi != NULL;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &entry);
+        free(entry);
+    }
+    apr_hash_clear(cache->entries);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Make space for at least one more entry in a full cache.  First remove
+ * any expired entries.  If that doesn't free enough space, remove entries in
+ * hash order, which is effectively random, until the cache is three quarters
+ * full.  Must be called with the cache mutex held.
+ */
+static void
+cache_prune(struct mwl_cache *cache, apr_time_t now)
+{
+    apr_hash_index_t *hi;
+    const void *key;
+    void *data;
+    struct mwl_cache_entry *entry;
+
+    for (hi = apr_hash_first(NULL, cache->entries); hi != NULL;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, &data);
+        entry = data;
+        if (entry->expires <= now) {
+            apr_hash_set(cache->entries, key, APR_HASH_KEY_STRING, NULL);
+            free(entry);
+        }
+    }
+    for (hi = apr_hash_first(NULL, cache->entries); hi != NULL;
+         hi = apr_hash_next(hi)) {
+        if (apr_hash_count(cache->entries) <= cache->max / 4 * 3)
+            break;
+        apr_hash_this(hi, &key, NULL, &data);
+        apr_hash_set(cache->entries, key, APR_HASH_KEY_STRING, NULL);
+        free(data);
+    }
+}
+
+
+/*
+ * Create a new cache that holds at most max entries, allocated from the
+ * given APR pool.  Returns an APR status.
+ */
+apr_status_t
+mwl_cache_create(struct mwl_cache **result, size_t max, apr_pool_t *p)
+{
+    struct mwl_cache *cache;
+    apr_status_t status;
+
+    cache = apr_pcalloc(p, sizeof(struct mwl_cache));
+    cache->entries = apr_hash_make(p);
+    cache->max = max;
+    status = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                     p);
+    if (status != APR_SUCCESS)
+        return status;
+    apr_pool_cleanup_register(p, cache, cache_free, apr_pool_cleanup_null);
+    *result = cache;
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Look up a key in the cache.  If there is an unexpired entry for it, return
+ * a copy of its data allocated from the given pool, nul-terminated for the
+ * convenience of callers that store strings, and store its length in length.
+ * Otherwise, return NULL.
+ */
+void *
+mwl_cache_get(struct mwl_cache *cache, const char *key, apr_pool_t *p,
+              size_t *length)
+{
+    struct mwl_cache_entry *entry;
+    char *data = NULL;
+
+    apr_thread_mutex_lock(cache->mutex);
+    entry = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+    if (entry != NULL && entry->expires > apr_time_now()) {
+        data = apr_palloc(p, entry->length + 1);
+        memcpy(data, entry->data, entry->length);
+        data[entry->length] = '\0';
+        *length = entry->length;
+        cache->hits++;
+    } else
+        cache->misses++;
+    apr_thread_mutex_unlock(cache->mutex);
+    return data;
+}
+
+
+/*
+ * Store data under a key in the cache for the given number of seconds,
+ * replacing any existing entry for that key.  If memory for the entry cannot
+ * be allocated, the data is silently not cached.
+ */
+void
+mwl_cache_set(struct mwl_cache *cache, const char *key, const void *data,
+              size_t length, unsigned long lifetime)
+{
+    struct mwl_cache_entry *entry, *old;
+    size_t keylen;
+    apr_time_t now;
+
+    keylen = strlen(key) + 1;
+    entry = malloc(sizeof(struct mwl_cache_entry) + keylen + length);
+    if (entry == NULL)
+        return;
+    entry->key = (char *) (entry + 1);
+    memcpy((char *) (entry + 1), key, keylen);
+    entry->data = (char *) (entry + 1) + keylen;
+    memcpy(entry->data, data, length);
+    entry->length = length;
+    now = apr_time_now();
+    entry->expires = now + apr_time_from_sec(lifetime);
+
+    apr_thread_mutex_lock(cache->mutex);
+    old = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+    if (old != NULL)
+        apr_hash_set(cache->entries, key, APR_HASH_KEY_STRING, NULL);
+    else if (apr_hash_count(cache->entries) >= cache->max)
+        cache_prune(cache, now);
+    apr_hash_set(cache->entries, entry->key, APR_HASH_KEY_STRING, entry);
+    apr_thread_mutex_unlock(cache->mutex);
+    free(old);
+}
+
+
+/*
+ * Return the number of entries in the cache and the number of hits and
+ * misses since the cache was created.
+ */
+void
+mwl_cache_stats(struct mwl_cache *cache, struct mwl_cache_stats *stats)
+{
+    apr_thread_mutex_lock(cache->mutex);
+    stats->entries = apr_hash_count(cache->entries);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    apr_thread_mutex_unlock(cache->mutex);
+}
@@ -6,7 +6,7 @@
  *
  * Written by Russ Allbery <eagle@eyrie.org>
  * Based on original code by Anton Ushakov
- * Copyright 2003, 2004, 2006, 2008, 2009, 2010, 2011, 2012, 2013
+ * Copyright 2003, 2004, 2006, 2008, 2009, 2010, 2011, 2012, 2013, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -51,6 +51,8 @@ DIRD(Authrule,               "whether to display the authorization rule",
      bool, true)
 DIRN(Base,                   "search base for LDAP lookups")
 DIRN(BindDN,                 "bind DN for the LDAP connection")
+DIRN(CacheNegativeTTL,       "seconds to cache failed lookups")
+DIRN(CacheTTL,               "seconds to cache LDAP results")
 DIRN(Debug,                  "whether to log debug messages")
 DIRD(Filter,                 "LDAP search filer to use",
      const char * const, "uid=USER")
@@ -69,6 +71,8 @@ enum {
     E_Authrule,
     E_Base,
     E_BindDN,
+    E_CacheNegativeTTL,
+    E_CacheTTL,
     E_Debug,
     E_Filter,
     E_Host,
@@ -170,6 +174,8 @@ mwl_server_config_merge(apr_pool_t *pool, void *basev, void *overv)
     MERGE_SET(authrule);
     MERGE_PTR(base);
     MERGE_PTR(binddn);
+    MERGE_SET(cache_negative_ttl);
+    MERGE_SET(cache_ttl);
     MERGE_SET(debug);
     MERGE_SET(filter);
     MERGE_PTR(host);
@@ -243,6 +249,7 @@ mwl_config_init(server_rec *server, struct server_config *bconf UNUSED,
                 apr_pool_t *p)
 {
     struct server_config *sconf;
+    apr_status_t status;
 
     sconf = ap_get_module_config(server->module_config, &webauthldap_module);
     CHECK_DIRECTIVE(auth_attr,    AuthorizationAttribute, NULL);
@@ -255,17 +262,36 @@ mwl_config_init(server_rec *server, struct server_config *bconf UNUSED,
     sconf->ldapversion = LDAP_VERSION3;
     sconf->scope = LDAP_SCOPE_SUBTREE;
 
-    /* Mutexes for protecting our array of LDAP connections. */
-    if (sconf->ldmutex == NULL)
-        apr_thread_mutex_create(&sconf->ldmutex, APR_THREAD_MUTEX_DEFAULT, p);
-    if (sconf->totalmutex == NULL)
-        apr_thread_mutex_create(&sconf->totalmutex, APR_THREAD_MUTEX_DEFAULT,
+    /* Mutex for serializing binds and Kerberos ticket refreshes. */
+    if (sconf->bindmutex == NULL)
+        apr_thread_mutex_create(&sconf->bindmutex, APR_THREAD_MUTEX_DEFAULT,
                                 p);
 
-    /* Initialize our array of LDAP connections. */
-    if (sconf->ldarray == NULL) {
-        sconf->ldcount = 0;
-        sconf->ldarray = apr_array_make(p, 10, sizeof(LDAP *));
+    /* Initialize our pool of LDAP connections. */
+    if (sconf->ldpool == NULL) {
+        status = mwl_pool_create(&sconf->ldpool, MAX_LDAP_CONN, p);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, status, server,
+                         "mod_webauthldap: cannot create connection pool");
+            exit(1);
+        }
+    }
+
+    /*
+     * Create the cache of LDAP results if either positive or negative
+     * results are cached.  Negative results are cached for the same time as
+     * positive results unless configured otherwise.
+     */
+    if (!sconf->cache_negative_ttl_set)
+        sconf->cache_negative_ttl = sconf->cache_ttl;
+    if (sconf->cache == NULL
+        && (sconf->cache_ttl > 0 || sconf->cache_negative_ttl > 0)) {
+        status = mwl_cache_create(&sconf->cache, MAX_CACHE_ENTRIES, p);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, status, server,
+                         "mod_webauthldap: cannot create result cache");
+            exit(1);
+        }
     }
 }
 
@@ -336,6 +362,14 @@ cfg_str(cmd_parms *cmd, void *mconf, const char *arg)
     case E_BindDN:
         sconf->binddn = apr_pstrdup(cmd->pool, arg);
         break;
+    case E_CacheNegativeTTL:
+        err = parse_number(cmd, arg, &sconf->cache_negative_ttl);
+        sconf->cache_negative_ttl_set = true;
+        break;
+    case E_CacheTTL:
+        err = parse_number(cmd, arg, &sconf->cache_ttl);
+        sconf->cache_ttl_set = true;
+        break;
     case E_Filter:
         sconf->filter = apr_pstrdup(cmd->pool, arg);
         sconf->filter_set = true;
@@ -467,6 +501,8 @@ const command_rec webauthldap_cmds[] = {
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,  Authrule),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,  Base),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,  BindDN),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,  CacheNegativeTTL),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,  CacheTTL),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,  Debug),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,  Filter),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,  Host),
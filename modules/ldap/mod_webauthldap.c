@@ -2,8 +2,8 @@
  * Core WebAuth LDAP Apache module code.
  *
  * Written by Anton Ushakov
- * Copyright 2003, 2004, 2005, 2006, 2007, 2008, 2009, 2010, 2011, 2012, 2013
- *     The Board of Trustees of the Leland Stanford Junior University
+ * Copyright 2003, 2004, 2005, 2006, 2007, 2008, 2009, 2010, 2011, 2012, 2013,
+ *     2026 The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
  */
@@ -546,64 +546,129 @@ webauthldap_managedbind(MWAL_LDAP_CTXT* lc)
 
 
 /**
- * This function gets a cached ldap connection from the array that stores them
+ * This unbinds the connection, if any, after an error and frees its place in
+ * the pool so that another request can open a new one.
+ * @param lc main context struct for this module, for passing things around
+ */
+static void
+webauthldap_closeconn(MWAL_LDAP_CTXT* lc)
+{
+    if (lc->ld != NULL)
+        ldap_unbind_ext(lc->ld, NULL, NULL);
+    lc->ld = NULL;
+    mwl_pool_checkin(lc->sconf->ldpool, NULL, NULL);
+}
+
+/**
+ * This function checks out an ldap connection from the pool, binding a new
+ * one if there are no idle connections.  If the maximum number of
+ * connections are in use by other threads, this waits for one to be
+ * returned.  Binds are serialized by bindmutex, since they may need to
+ * replace the shared Kerberos ticket cache.  Every successful call must be
+ * matched by webauthldap_returnconn or webauthldap_closeconn.
  * @param lc main context struct for this module, for passing things around
  * @return zero if OK, managedbind's result if not
  */
 static int
 webauthldap_getcachedconn(MWAL_LDAP_CTXT* lc)
 {
+    int rc;
+    size_t count;
 
-    LDAP** newld;
-
-    lc->ld = NULL;
-    apr_thread_mutex_lock(lc->sconf->ldmutex); /****** LOCKING! ************/
-
-    if (!apr_is_empty_array(lc->sconf->ldarray)) {
-        newld = (LDAP**) apr_array_pop(lc->sconf->ldarray);
-        lc->ld = *newld;
-        lc->sconf->ldcount--;
+    lc->ld = mwl_pool_checkout(lc->sconf->ldpool, &count);
+    if (lc->ld != NULL) {
         if (lc->sconf->debug)
             ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
-                     "webauthldap(%s): got cached conn - cache size %d",
-                     lc->r->user, lc->sconf->ldcount);
+                         "webauthldap(%s): got cached conn - cache size %lu",
+                         lc->r->user, (unsigned long) count);
+        return 0;
     }
 
-    apr_thread_mutex_unlock(lc->sconf->ldmutex); /****** UNLOCKING! ********/
-
-    return (lc->ld != NULL) ? 0 : webauthldap_managedbind(lc);
-
+    apr_thread_mutex_lock(lc->sconf->bindmutex); /****** LOCKING! *********/
+    rc = webauthldap_managedbind(lc);
+    apr_thread_mutex_unlock(lc->sconf->bindmutex); /****** UNLOCKING! *****/
+    if (rc != 0)
+        webauthldap_closeconn(lc);
+    return rc;
 }
 
 /**
- * This puts the connection back into the array. If no more spaces on the
- * storage array, it unbinds it.
+ * This puts the connection back into the pool for use by other requests.
+ * Does nothing if no connection is checked out, which happens when all
+ * results came from the cache.
  * @param lc main context struct for this module, for passing things around
  */
 static void
 webauthldap_returnconn(MWAL_LDAP_CTXT* lc)
 {
+    size_t count;
 
-    LDAP** newld = NULL;
+    if (lc->ld == NULL)
+        return;
+    mwl_pool_checkin(lc->sconf->ldpool, lc->ld, &count);
+    lc->ld = NULL;
+    if (lc->sconf->debug)
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
+                     "webauthldap(%s): cached this conn - cache size %lu",
+                     lc->r->user, (unsigned long) count);
+}
 
-    apr_thread_mutex_lock(lc->sconf->ldmutex); /****** LOCKING! ************/
+/**
+ * This replaces a checked out connection that the server has closed with a
+ * newly bound one.  The unbind and rebind are done under bindmutex, which
+ * also keeps threads from racing to change and restore the SIGPIPE handler.
+ * On failure, the connection has been closed and must not be returned.
+ * @param lc main context struct for this module, for passing things around
+ * @return zero if OK, nonzero if not
+ */
+static int
+webauthldap_reconnect(MWAL_LDAP_CTXT* lc)
+{
+    int rc;
+#ifdef SIGPIPE
+#if APR_HAVE_SIGACTION
+    apr_sigfunc_t *old_signal;
+#else
+    void *old_signal;
+#endif
+#endif
 
-    if (lc->sconf->ldarray->nelts < MAX_LDAP_CONN) {
-        newld = apr_array_push(lc->sconf->ldarray);
-        *newld = lc->ld;
-        lc->sconf->ldcount++;
-        if (lc->sconf->debug)
-            ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
-                     "webauthldap(%s): cached this conn - cache size %d",
-                     lc->r->user, lc->sconf->ldcount);
-    }
+    if (lc->sconf->debug)
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
+                     "webauthldap(%s): this connection expired",
+                     lc->r->user);
 
-    apr_thread_mutex_unlock(lc->sconf->ldmutex); /****** UNLOCKING! ********/
+    apr_thread_mutex_lock(lc->sconf->bindmutex); /****** LOCKING! *********/
 
-    if (newld == NULL) {
-        ldap_unbind_ext(lc->ld, NULL, NULL);
+    /* Set this to ignore Broken Pipes that always happen when unbinding
+       expired ldap connections. */
+#ifdef SIGPIPE
+    old_signal = apr_signal(SIGPIPE, SIG_IGN);
+    if (old_signal == SIG_ERR) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, lc->r->server,
+                     "webauthldap(%s): can't set SIGPIPE signals to"
+                     " SIG_IGN: %s (%d)", lc->r->user, strerror(errno),
+                     errno);
+        apr_thread_mutex_unlock(lc->sconf->bindmutex); /* ERR UNLOCKING! */
+        webauthldap_closeconn(lc);
+        return -1;
     }
+#endif
+    if (lc->sconf->debug)
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
+                     "webauthldap(%s): unbinding the expired connection",
+                     lc->r->user);
+    ldap_unbind_ext(lc->ld, NULL, NULL);
+    lc->ld = NULL;
+#ifdef SIGPIPE
+    apr_signal(SIGPIPE, old_signal);
+#endif
 
+    rc = webauthldap_managedbind(lc);
+    apr_thread_mutex_unlock(lc->sconf->bindmutex); /****** UNLOCKING! *****/
+    if (rc != 0)
+        webauthldap_closeconn(lc);
+    return rc;
 }
 
 /**
@@ -746,14 +811,157 @@ webauthldap_dosearch(MWAL_LDAP_CTXT* lc)
 }
 
 
+/**
+ * This stores the results of the last search in the cross-request cache, if
+ * there is one, under the given key.  The entries are stored as a sequence
+ * of nul-terminated attribute names and values, with an empty attribute name
+ * marking the end of each entry.  Searches that found no entries are cached
+ * for the negative cache lifetime.
+ * @param lc main context struct for this module, for passing things around
+ * @param key the cache key for the search
+ */
+static void
+webauthldap_cache_search(MWAL_LDAP_CTXT* lc, const char *key)
+{
+    const apr_array_header_t *fields;
+    const apr_table_entry_t *field;
+    unsigned long lifetime;
+    size_t i, length, size;
+    char *data, *p;
+    int j;
+
+    if (lc->sconf->cache == NULL)
+        return;
+    if (lc->numEntries > 0)
+        lifetime = lc->sconf->cache_ttl;
+    else
+        lifetime = lc->sconf->cache_negative_ttl;
+    if (lifetime == 0)
+        return;
+
+    /* Determine the size of the data, and then copy it in. */
+    length = 0;
+    for (i = 0; i < lc->numEntries; i++) {
+        fields = apr_table_elts(lc->entries[i]);
+        field = (const apr_table_entry_t *) fields->elts;
+        for (j = 0; j < fields->nelts; j++)
+            length += strlen(field[j].key) + strlen(field[j].val) + 2;
+        length++;
+    }
+    data = apr_palloc(lc->r->pool, length + 1);
+    p = data;
+    for (i = 0; i < lc->numEntries; i++) {
+        fields = apr_table_elts(lc->entries[i]);
+        field = (const apr_table_entry_t *) fields->elts;
+        for (j = 0; j < fields->nelts; j++) {
+            size = strlen(field[j].key) + 1;
+            memcpy(p, field[j].key, size);
+            p += size;
+            size = strlen(field[j].val) + 1;
+            memcpy(p, field[j].val, size);
+            p += size;
+        }
+        *p++ = '\0';
+    }
+    mwl_cache_set(lc->sconf->cache, key, data, length, lifetime);
+}
+
+/**
+ * This looks for the results of a search in the cross-request cache and, if
+ * found, stores them in the context struct as if the search had been done.
+ * As with webauthldap_parse_entry, values of the authorization attribute are
+ * saved in privgroup_cache.
+ * @param lc main context struct for this module, for passing things around
+ * @param key the cache key for the search
+ * @return true if the results were found in the cache, false otherwise
+ */
+static bool
+webauthldap_cached_search(MWAL_LDAP_CTXT* lc, const char *key)
+{
+    apr_array_header_t *entries;
+    apr_table_t *entry;
+    char *data, *end, *p, *attr;
+    size_t length;
+
+    if (lc->sconf->cache == NULL)
+        return false;
+    data = mwl_cache_get(lc->sconf->cache, key, lc->r->pool, &length);
+    if (data == NULL)
+        return false;
+
+    entries = apr_array_make(lc->r->pool, 1, sizeof(apr_table_t *));
+    end = data + length;
+    for (p = data; p < end; p++) {
+        entry = apr_table_make(lc->r->pool, 50);
+        while (*p != '\0') {
+            attr = p;
+            p += strlen(p) + 1;
+            apr_table_addn(entry, attr, p);
+            if (strcasecmp(attr, lc->sconf->auth_attr) == 0)
+                apr_table_setn(lc->privgroup_cache, p, "TRUE");
+            p += strlen(p) + 1;
+        }
+        APR_ARRAY_PUSH(entries, apr_table_t *) = entry;
+    }
+    lc->entries = (apr_table_t **) entries->elts;
+    lc->numEntries = entries->nelts;
+
+    if (lc->sconf->debug)
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
+                     "webauthldap(%s): cached search returned %lu entries",
+                     lc->r->user, (unsigned long) lc->numEntries);
+    return true;
+}
+
+/**
+ * This does a search for the user's entry, first checking the cross-request
+ * cache.  If the results aren't cached, a connection is checked out from the
+ * pool if the request doesn't already have one, and we rebind and try again
+ * once if the server has closed the connection.  On failure, the connection
+ * has been closed and must not be returned.
+ * @param lc main context struct for this module, for passing things around
+ * @return zero if OK, HTTP_INTERNAL_SERVER_ERROR if not
+ */
+static int
+webauthldap_search(MWAL_LDAP_CTXT* lc)
+{
+    const char *key;
+    size_t i;
+    int rc;
+
+    key = apr_pstrcat(lc->r->pool, "search\n", lc->filter, NULL);
+    if (lc->attrs != NULL)
+        for (i = 0; lc->attrs[i] != NULL; i++)
+            key = apr_pstrcat(lc->r->pool, key, "\n", lc->attrs[i], NULL);
+    if (webauthldap_cached_search(lc, key))
+        return 0;
+
+    if (lc->ld == NULL && webauthldap_getcachedconn(lc) != 0)
+        return HTTP_INTERNAL_SERVER_ERROR;
+    rc = webauthldap_dosearch(lc);
+    if (rc == HTTP_SERVICE_UNAVAILABLE) {
+        if (webauthldap_reconnect(lc) != 0)
+            return HTTP_INTERNAL_SERVER_ERROR;
+        rc = webauthldap_dosearch(lc);
+    }
+    if (rc != 0) {
+        webauthldap_closeconn(lc);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    webauthldap_cache_search(lc, key);
+    return 0;
+}
+
+
 static int
 webauthldap_docompare(MWAL_LDAP_CTXT* lc, const char* value)
 {
     int rc;
-    size_t i;
+    size_t i, length;
     char *dn;
-    const char *attr, *cached;
+    const char *attr, *cached, *key;
     struct berval bvalue = { 0, NULL };
+    bool failed = false;
 
     attr = lc->sconf->auth_attr;
 
@@ -766,6 +974,28 @@ webauthldap_docompare(MWAL_LDAP_CTXT* lc, const char* value)
         return strcmp(cached, "TRUE") ? LDAP_COMPARE_FALSE : LDAP_COMPARE_TRUE;
     }
 
+    /* Otherwise, check whether another request has done it recently. */
+    key = apr_pstrcat(lc->r->pool, "compare\n", lc->filter, "\n", value,
+                      NULL);
+    if (lc->sconf->cache != NULL) {
+        cached = mwl_cache_get(lc->sconf->cache, key, lc->r->pool, &length);
+        if (cached != NULL) {
+            if (lc->sconf->debug)
+                ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
+                             "webauthldap(%s): cross-request cached %s"
+                             " comparing %s=%s", lc->r->user, cached, attr,
+                             value);
+            apr_table_set(lc->privgroup_cache, value, cached);
+            return strcmp(cached, "TRUE") ? LDAP_COMPARE_FALSE
+                                          : LDAP_COMPARE_TRUE;
+        }
+    }
+
+    /* The search may have come from the cache, leaving us no connection. */
+    if (lc->numEntries > 0 && lc->ld == NULL)
+        if (webauthldap_getcachedconn(lc) != 0)
+            return LDAP_COMPARE_FALSE;
+
     bvalue.bv_val = (char *) value;
     bvalue.bv_len = strlen(bvalue.bv_val);
 
@@ -779,6 +1009,9 @@ webauthldap_docompare(MWAL_LDAP_CTXT* lc, const char* value)
                          "webauthldap(%s): SUCCEEDED comparing %s=%s in %s",
                          lc->r->user, attr, value, dn);
             apr_table_set(lc->privgroup_cache, value, "TRUE");
+            if (lc->sconf->cache != NULL && lc->sconf->cache_ttl > 0)
+                mwl_cache_set(lc->sconf->cache, key, "TRUE", 4,
+                              lc->sconf->cache_ttl);
             return rc;
         } else if (rc == LDAP_COMPARE_FALSE) {
             if (lc->sconf->debug) {
@@ -788,6 +1021,7 @@ webauthldap_docompare(MWAL_LDAP_CTXT* lc, const char* value)
             }
             apr_table_set(lc->privgroup_cache, value, "FALSE");
         } else {
+            failed = true;
             if (lc->sconf->debug) {
                 ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
                              "webauthldap(%s): %s(%d) comparing %s=%s in %s",
@@ -797,6 +1031,11 @@ webauthldap_docompare(MWAL_LDAP_CTXT* lc, const char* value)
         }
     }
 
+    /* Only cache a negative result if every comparison succeeded. */
+    if (!failed && lc->sconf->cache != NULL
+        && lc->sconf->cache_negative_ttl > 0)
+        mwl_cache_set(lc->sconf->cache, key, "FALSE", 5,
+                      lc->sconf->cache_negative_ttl);
     return LDAP_COMPARE_FALSE;
 }
 
@@ -1152,13 +1391,6 @@ auth_checker_hook(request_rec * r)
     char *w;
     int m = r->method_number;
     int needs_further_handling;
-#ifdef SIGPIPE
-#if APR_HAVE_SIGACTION
-    apr_sigfunc_t *old_signal;
-#else
-    void *old_signal;
-#endif
-#endif
 
 #ifndef NO_STANFORD_SUPPORT
     if (!apr_table_get(r->subprocess_env, "SU_AUTH_USER") &&
@@ -1232,62 +1464,12 @@ auth_checker_hook(request_rec * r)
     /* So there is something for us to do. Let's init, get a connection,
        and search. */
 
-    apr_thread_mutex_lock(lc->sconf->totalmutex); /****** LOCKING! ************/
-
     webauthldap_init(lc);
 
-    /* This will get an available connection from the pool, or bind a new one
-       if needed. */
-    if (webauthldap_getcachedconn(lc) != 0) {
-        apr_thread_mutex_unlock(lc->sconf->totalmutex); /*** ERR UNLOCKING! ***/
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
-
-    rc = webauthldap_dosearch(lc);
-
-    if (rc == HTTP_SERVICE_UNAVAILABLE) {
-
-        if (lc->sconf->debug)
-            ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
-                  "webauthldap(%s): this connection expired",
-                     lc->r->user);
-
-        /* Set this to ignore Broken Pipes that always happen when unbinding
-           expired ldap connections. */
-#ifdef SIGPIPE
-        old_signal = apr_signal(SIGPIPE, SIG_IGN);
-        if (old_signal == SIG_ERR) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, lc->r->server,
-                         "webauthldap(%s): %s %s (%d)",
-                         "can't set SIGPIPE signals to SIG_IGN: ",
-                         lc->r->user, strerror(errno), errno);
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-#endif
-        if (lc->sconf->debug)
-            ap_log_error(APLOG_MARK, APLOG_INFO, 0, lc->r->server,
-                         "webauthldap(%s): unbinding the expired connection",
-                             lc->r->user);
-        ldap_unbind_ext(lc->ld, NULL, NULL);
-        lc->ld = NULL;
-#ifdef SIGPIPE
-        apr_signal(SIGPIPE, old_signal);
-#endif
-
-        if (webauthldap_managedbind(lc) != 0) {
-            apr_thread_mutex_unlock(lc->sconf->totalmutex); /* ERR UNLOCKING! */
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-
-        if (webauthldap_dosearch(lc) != 0) {
-            apr_thread_mutex_unlock(lc->sconf->totalmutex); /* ERR UNLOCKING! */
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
-
-    } else if (rc != 0) {
-        apr_thread_mutex_unlock(lc->sconf->totalmutex); /** ERR UNLOCKING! ****/
+    /* This will use cached results if possible, and otherwise get an
+       available connection from the pool, or bind a new one if needed. */
+    if (webauthldap_search(lc) != 0)
         return HTTP_INTERNAL_SERVER_ERROR;
-    }
 
 
     /* Validate privgroups. */
@@ -1296,7 +1478,6 @@ auth_checker_hook(request_rec * r)
     if ((rc = webauthldap_validate_privgroups(lc, reqs_arr,
                                               &needs_further_handling)) != 0){
         webauthldap_returnconn(lc);
-        apr_thread_mutex_unlock(lc->sconf->totalmutex); /***ERR UNLOCKING! ****/
         return rc; /* means not authorized, or error */
     }
 
@@ -1330,10 +1511,8 @@ auth_checker_hook(request_rec * r)
         lc->attrs[0] = LDAP_ALL_OPERATIONAL_ATTRIBUTES;
         lc->attrs[1] = NULL;
 
-        if (webauthldap_dosearch(lc) != 0) {
-            apr_thread_mutex_unlock(lc->sconf->totalmutex); /* error: unlock */
+        if (webauthldap_search(lc) != 0)
             return DECLINED;
-        }
 
         /* Cool, we got the oper attrs, now set the envvars */
         for (i = 0; i<  lc->numEntries; i++)
@@ -1346,7 +1525,6 @@ auth_checker_hook(request_rec * r)
      }
 
     webauthldap_returnconn(lc);
-    apr_thread_mutex_unlock(lc->sconf->totalmutex); /**** FINAL UNLOCKING! ****/
 
     if (lc->sconf->debug) {
         if (needs_further_handling)
@@ -1387,13 +1565,6 @@ privgroup_check_authorization(request_rec *r, const char *line,
 {
     MWAL_LDAP_CTXT *lc;
     int rc;
-#ifdef SIGPIPE
-# if APR_HAVE_SIGACTION
-    apr_sigfunc_t *old_signal;
-# else
-    void *old_signal;
-# endif
-#endif
 
     /* Decline to authorize anyone who didn't use WebAuth. */
     if (r->user == NULL)
@@ -1413,63 +1584,17 @@ privgroup_check_authorization(request_rec *r, const char *line,
         ap_set_module_config(r->request_config, &webauthldap_module, lc);
     }
 
-    /* Initialize, get a connection, and search. */
-    apr_thread_mutex_lock(lc->sconf->totalmutex); /****** LOCKING! ***********/
+    /*
+     * Initialize and search, using cached results if possible and otherwise
+     * getting an available connection from the pool or binding a new one.
+     */
     webauthldap_init(lc);
-
-    /* Get an available connection from the pool or bind a new one. */
-    if (webauthldap_getcachedconn(lc) != 0) {
-        apr_thread_mutex_unlock(lc->sconf->totalmutex); /*** ERR UNLOCKING! **/
-        return AUTHZ_GENERAL_ERROR;
-    }
-    rc = webauthldap_dosearch(lc);
-
-    /* Handle errors on our search.  We may have to rebind and try again. */
-    if (rc == HTTP_SERVICE_UNAVAILABLE) {
-        if (lc->sconf->debug)
-            ap_log_error(APLOG_MARK, APLOG_INFO, 0, r->server,
-                         "webauthldap(%s): this connection expired",
-                         lc->r->user);
-
-        /*
-         * Set this to ignore broken pipes that always happen when unbinding
-         * expired ldap connections.
-         */
-#ifdef SIGPIPE
-        old_signal = apr_signal(SIGPIPE, SIG_IGN);
-        if (old_signal == SIG_ERR) {
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, r->server,
-                         "webauthldap(%s): can't set SIGPIPE signals to"
-                         " SIG_IGN: %s (%d)", r->user, strerror(errno), errno);
-            return AUTHZ_GENERAL_ERROR;
-        }
-#endif
-        if (lc->sconf->debug)
-            ap_log_error(APLOG_MARK, APLOG_INFO, 0, r->server,
-                         "webauthldap(%s): unbinding the expired connection",
-                         r->user);
-        ldap_unbind_ext(lc->ld, NULL, NULL);
-        lc->ld = NULL;
-#ifdef SIGPIPE
-        apr_signal(SIGPIPE, old_signal);
-#endif
-        if (webauthldap_managedbind(lc) != 0) {
-            apr_thread_mutex_unlock(lc->sconf->totalmutex); /* ERR UNLOCKING */
-            return AUTHZ_GENERAL_ERROR;
-        }
-        if (webauthldap_dosearch(lc) != 0) {
-            apr_thread_mutex_unlock(lc->sconf->totalmutex); /* ERR UNLOCKING */
-            return AUTHZ_GENERAL_ERROR;
-        }
-    } else if (rc != 0) {
-        apr_thread_mutex_unlock(lc->sconf->totalmutex); /** ERR UNLOCKING! ***/
+    if (webauthldap_search(lc) != 0)
         return AUTHZ_GENERAL_ERROR;
-    }
 
     /* Validate privgroups. */
     rc = webauthldap_check_privgroups(lc, line);
     webauthldap_returnconn(lc);
-    apr_thread_mutex_unlock(lc->sconf->totalmutex); /**** FINAL UNLOCKING! ****/
     ap_log_error(APLOG_MARK, APLOG_INFO, 0, r->server,
                  "webauthldap(%s): returning %d", r->user, rc);
     return rc;
@@ -1512,17 +1637,9 @@ fixups_hook(request_rec *r)
         lc->sconf = ap_get_module_config(r->server->module_config,
                                          &webauthldap_module);
         webauthldap_init(lc);
-        apr_thread_mutex_lock(lc->sconf->totalmutex); /****** LOCKING! *******/
-        if (webauthldap_getcachedconn(lc) != 0) {
-            apr_thread_mutex_unlock(lc->sconf->totalmutex); /* ERR UNLOCKING */
-            return DECLINED;
-        }
-        if (webauthldap_dosearch(lc) != 0) {
-            apr_thread_mutex_unlock(lc->sconf->totalmutex); /* ERR UNLOCKING */
+        if (webauthldap_search(lc) != 0)
             return DECLINED;
-        }
         webauthldap_returnconn(lc);
-        apr_thread_mutex_unlock(lc->sconf->totalmutex); /** FINAL UNLOCKING! */
         ap_set_module_config(r->request_config, &webauthldap_module, lc);
     }
 
@@ -1537,18 +1654,14 @@ fixups_hook(request_rec *r)
     apr_table_do(webauthldap_attribnotfound, lc, lc->envvars, NULL);
 
     /*
-     * If configured to perform additional privgroup checks, get our
-     * connection again and do those queries.  We ideally should retry our
-     * connection here if we get a failure, but we just did that validation
-     * while processing the main require directive.
+     * If configured to perform additional privgroup checks, do those
+     * queries.  webauthldap_docompare gets a connection again if any of them
+     * aren't cached.  We ideally should retry our connection here if we get
+     * a failure, but we just did that validation while processing the main
+     * require directive.
      *
      * FIXME: Retry handling should be in webauthldap_getcachedconn.
      */
-    apr_thread_mutex_lock(lc->sconf->totalmutex); /****** LOCKING! ***********/
-    if (webauthldap_getcachedconn(lc) != 0) {
-        apr_thread_mutex_unlock(lc->sconf->totalmutex); /*** ERR UNLOCKING! **/
-        return DECLINED;
-    }
     apr_table_do(webauthldap_exportprivgroup, lc, lc->privgroups, NULL);
 
     /*
@@ -1564,10 +1677,8 @@ fixups_hook(request_rec *r)
         lc->attrs[0] = (char *) LDAP_ALL_OPERATIONAL_ATTRIBUTES;
         lc->attrs[1] = NULL;
 
-        if (webauthldap_dosearch(lc) != 0) {
-            apr_thread_mutex_unlock(lc->sconf->totalmutex); /* error: unlock */
+        if (webauthldap_search(lc) != 0)
             return DECLINED;
-        }
 
         /* Cool, we got the oper attrs, now set the envvars */
         for (i = 0; i<  lc->numEntries; i++)
@@ -1576,7 +1687,6 @@ fixups_hook(request_rec *r)
      }
 
     webauthldap_returnconn(lc);
-    apr_thread_mutex_unlock(lc->sconf->totalmutex); /**** FINAL UNLOCKING! ****/
 
     /* All done. */
     if (lc->sconf->debug)
@@ -1596,6 +1706,46 @@ static const authz_provider authz_privgroup_provider = {
 #endif /* HAVE_DECL_AP_REGISTER_AUTH_PROVIDER */
 
 
+/*
+ * The content handler, which reports statistics for the cache of LDAP
+ * results for the virtual host if debugging is enabled.  The output is plain
+ * text so that it can easily be collected by monitoring.
+ */
+static int
+handler_hook(request_rec *r)
+{
+    struct server_config *sconf;
+    struct mwl_cache_stats stats;
+
+    if (strcmp(r->handler, "webauthldap") != 0)
+        return DECLINED;
+    r->allowed |= (AP_METHOD_BIT << M_GET);
+    if (r->method_number != M_GET)
+        return DECLINED;
+
+    sconf = ap_get_module_config(r->server->module_config,
+                                 &webauthldap_module);
+    r->content_type = "text/plain";
+    if (!sconf->debug) {
+        ap_rputs("WebAuthLdapDebug must be on to enable this information\n",
+                 r);
+        return OK;
+    }
+    if (sconf->cache == NULL) {
+        ap_rputs("CacheEnabled: no\n", r);
+        return OK;
+    }
+    mwl_cache_stats(sconf->cache, &stats);
+    ap_rputs("CacheEnabled: yes\n", r);
+    ap_rprintf(r, "CacheTTL: %lu\n", sconf->cache_ttl);
+    ap_rprintf(r, "CacheNegativeTTL: %lu\n", sconf->cache_negative_ttl);
+    ap_rprintf(r, "CacheEntries: %lu\n", (unsigned long) stats.entries);
+    ap_rprintf(r, "CacheHits: %lu\n", stats.hits);
+    ap_rprintf(r, "CacheMisses: %lu\n", stats.misses);
+    return OK;
+}
+
+
 /**
  * Standard hook registration function
  */
@@ -1615,6 +1765,7 @@ webauthldap_register_hooks(apr_pool_t *p UNUSED)
     ap_hook_fixups(fixups_hook, NULL, NULL, APR_HOOK_MIDDLE);
 #endif
     ap_hook_post_config(post_config_hook, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(handler_hook, NULL, NULL, APR_HOOK_MIDDLE);
 }
 
 
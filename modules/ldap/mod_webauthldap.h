@@ -2,7 +2,7 @@
  * Internal definitions and prototypes for Apache WebAuth LDAP module.
  *
  * Written by Anton Ushakov
- * Copyright 2003, 2005, 2006, 2007, 2009, 2010, 2012, 2013
+ * Copyright 2003, 2005, 2006, 2007, 2009, 2010, 2012, 2013, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -24,6 +24,19 @@
 #include <apr_thread_mutex.h>
 #include <httpd.h>              /* server_rec, request_rec, command_rec */
 
+/* Pool of LDAP connections, defined in pool.c. */
+struct mwl_pool;
+
+/* Cache of LDAP results, defined in cache.c. */
+struct mwl_cache;
+
+/* Statistics about the cache of LDAP results. */
+struct mwl_cache_stats {
+    size_t entries;             /* Number of entries in the cache. */
+    unsigned long hits;         /* Number of lookups that found an entry. */
+    unsigned long misses;       /* Number of lookups that did not. */
+};
+
 /* Command table provided by the configuration handling code. */
 extern const command_rec webauthldap_cmds[];
 
@@ -32,6 +45,7 @@ extern const command_rec webauthldap_cmds[];
 #define PRIVGROUP_DIRECTIVE "privgroup"
 #define DN_ATTRIBUTE "dn"
 #define MAX_LDAP_CONN 16
+#define MAX_CACHE_ENTRIES 16384
 #define FILTER_MATCH "USER"
 
 /* environment variables */
@@ -56,6 +70,8 @@ struct server_config {
     bool authrule;
     const char *base;
     const char *binddn;
+    unsigned long cache_negative_ttl;
+    unsigned long cache_ttl;
     bool debug;
     const char *filter;
     const char *host;
@@ -68,6 +84,8 @@ struct server_config {
 
     /* Only used during configuration merging. */
     bool authrule_set;
+    bool cache_negative_ttl_set;
+    bool cache_ttl_set;
     bool debug_set;
     bool filter_set;
     bool ssl_set;
@@ -79,10 +97,9 @@ struct server_config {
      */
     int ldapversion;
     int scope;
-    int ldcount;
-    apr_array_header_t *ldarray;
-    apr_thread_mutex_t *ldmutex;
-    apr_thread_mutex_t *totalmutex;
+    struct mwl_pool *ldpool;            /* Pool of LDAP connections */
+    apr_thread_mutex_t *bindmutex;      /* Serializes binds and tickets */
+    struct mwl_cache *cache;            /* Cache of results, or NULL */
 };
 
 /* The same, but for the directory configuration. */
@@ -136,4 +153,43 @@ void *mwl_server_config_merge(apr_pool_t *, void *, void *);
 /* Perform final checks on the configuration (called from post_config hook). */
 void mwl_config_init(server_rec *, struct server_config *, apr_pool_t *);
 
+/* cache.c */
+
+/* Create a cache holding at most the given number of entries. */
+apr_status_t mwl_cache_create(struct mwl_cache **, size_t max, apr_pool_t *);
+
+/*
+ * Look up a key in the cache.  Returns a nul-terminated copy of the data
+ * allocated from the pool and stores its length in length, or returns NULL
+ * if the key is not cached or its entry has expired.
+ */
+void *mwl_cache_get(struct mwl_cache *, const char *key, apr_pool_t *,
+                    size_t *length);
+
+/* Store data in the cache under a key for lifetime seconds. */
+void mwl_cache_set(struct mwl_cache *, const char *key, const void *data,
+                   size_t length, unsigned long lifetime);
+
+/* Return the number of entries and the hit and miss counts. */
+void mwl_cache_stats(struct mwl_cache *, struct mwl_cache_stats *);
+
+/* pool.c */
+
+/* Create a pool of at most the given number of LDAP connections. */
+apr_status_t mwl_pool_create(struct mwl_pool **, size_t max, apr_pool_t *);
+
+/*
+ * Check out a connection, waiting if the maximum number are checked out.
+ * Returns NULL if the caller should open a new connection.  Stores the
+ * number of idle connections remaining in count if it is not NULL.
+ */
+LDAP *mwl_pool_checkout(struct mwl_pool *, size_t *count);
+
+/*
+ * Return a checked out connection, or NULL if the caller's connection was
+ * closed or never opened.  Stores the number of idle connections in count if
+ * it is not NULL.
+ */
+void mwl_pool_checkin(struct mwl_pool *, LDAP *, size_t *count);
+
 #endif
@@ -0,0 +1,122 @@
+/*
+ * Pool of LDAP connections for the Apache WebAuth LDAP module.
+ *
+ * Each request that needs to talk to the directory checks out a bound LDAP
+ * connection from this pool for its own exclusive use and returns it when
+ * done, so requests in different threads can search the directory at the
+ * same time.  The number of connections is bounded; once that many are
+ * checked out, further requests wait for one to be returned rather than
+ * opening more connections to the directory server.
+ *
+ * The pool only keeps track of connections.  Opening and binding a new
+ * connection is left to the caller, which is told that it needs to do so by
+ * getting NULL back from mwl_pool_checkout.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+
+#include <apr_pools.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <ldap.h>
+
+#include <modules/ldap/mod_webauthldap.h>
+
+/*
+ * The pool.  Idle connections are kept on a stack so that the most recently
+ * used one, which is the least likely to have been timed out by the server,
+ * is reused first.  The idle connections plus the ones checked out never
+ * exceed max.
+ */
+struct mwl_pool {
+    apr_thread_mutex_t *mutex;  /* Protects the rest of the struct. */
+    apr_thread_cond_t *cond;    /* Signaled when a connection is returned. */
+    LDAP **idle;                /* Stack of idle connections. */
+    size_t idle_count;          /* Number of idle connections. */
+    size_t active;              /* Number of connections checked out. */
+    size_t max;                 /* Maximum total connections. */
+};
+
+
+/*
+ * Create a new connection pool that allows at most max connections, idle or
+ * in use, allocated from the given APR pool.  Returns an APR status.
+ */
+apr_status_t
+mwl_pool_create(struct mwl_pool **result, size_t max, apr_pool_t *p)
+{
+    struct mwl_pool *pool;
+    apr_status_t status;
+
+    pool = apr_pcalloc(p, sizeof(struct mwl_pool));
+    pool->idle = apr_pcalloc(p, max * sizeof(LDAP *));
+    pool->max = max;
+    status = apr_thread_mutex_create(&pool->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                     p);
+    if (status != APR_SUCCESS)
+        return status;
+    status = apr_thread_cond_create(&pool->cond, p);
+    if (status != APR_SUCCESS)
+        return status;
+    *result = pool;
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Check out a connection.  If there is an idle connection, return it.
+ * Otherwise, if fewer than the maximum number of connections exist, return
+ * NULL, in which case the caller should open a new connection and return it
+ * to the pool when done (or return NULL if it couldn't open one).  If the
+ * maximum number of connections are all checked out, wait for one to be
+ * returned.
+ *
+ * If count is not NULL, it is set to the number of idle connections left.
+ */
+LDAP *
+mwl_pool_checkout(struct mwl_pool *pool, size_t *count)
+{
+    LDAP *ld = NULL;
+
+    apr_thread_mutex_lock(pool->mutex);
+    while (pool->idle_count == 0 && pool->active >= pool->max)
+        apr_thread_cond_wait(pool->cond, pool->mutex);
+    pool->active++;
+    if (pool->idle_count > 0) {
+        pool->idle_count--;
+        ld = pool->idle[pool->idle_count];
+    }
+    if (count != NULL)
+        *count = pool->idle_count;
+    apr_thread_mutex_unlock(pool->mutex);
+    return ld;
+}
+
+
+/*
+ * Return a connection that was checked out, making it available for other
+ * requests.  If ld is NULL, the caller has closed its connection or couldn't
+ * open one, and its place in the pool is freed for a new connection.
+ *
+ * If count is not NULL, it is set to the number of idle connections.
+ */
+void
+mwl_pool_checkin(struct mwl_pool *pool, LDAP *ld, size_t *count)
+{
+    apr_thread_mutex_lock(pool->mutex);
+    pool->active--;
+    if (ld != NULL) {
+        pool->idle[pool->idle_count] = ld;
+        pool->idle_count++;
+    }
+    if (count != NULL)
+        *count = pool->idle_count;
+    apr_thread_cond_signal(pool->cond);
+    apr_thread_mutex_unlock(pool->mutex);
+}
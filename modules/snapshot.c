@@ -0,0 +1,199 @@
+/*
+ * Reference-counted snapshots shared by the WebAuth Apache modules.
+ *
+ * A snapshot is published by atomically swapping the pointer in its slot,
+ * and a reader takes a reference by reading that pointer and incrementing
+ * the snapshot's reference count.  Between those two steps, the publisher
+ * could drop the last reference to the snapshot the reader is about to use,
+ * so readers count themselves in the slot while in that window and the
+ * publisher waits for that count to drop to zero before releasing the old
+ * snapshot.  The window is only a few instructions long.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_atomic.h>
+#include <apr_tables.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#include <time.h>
+
+#include <modules/snapshot.h>
+#include <webauth/keys.h>
+
+/* The file information used to tell whether a file has changed. */
+#define FINFO_WANTED (APR_FINFO_MTIME | APR_FINFO_INODE)
+
+
+/*
+ * Release a reference to a snapshot, freeing it if this was the last
+ * reference.  Used as a pool cleanup by mod_snapshot_acquire.
+ */
+static apr_status_t
+snapshot_release(void *data)
+{
+    struct mod_snapshot *snapshot = data;
+
+    if (apr_atomic_dec32(&snapshot->refcount) == 0)
+        apr_pool_destroy(snapshot->pool);
+    return APR_SUCCESS;
+}
+
+
+void
+mod_snapshot_init(struct mod_snapshot *snapshot, apr_pool_t *pool,
+                  const char *path)
+{
+    apr_finfo_t finfo;
+
+    snapshot->pool = pool;
+    snapshot->refcount = 1;
+    snapshot->mtime = 0;
+    snapshot->inode = 0;
+    if (path == NULL)
+        return;
+    if (apr_stat(&finfo, path, FINFO_WANTED, pool) != APR_SUCCESS)
+        return;
+    snapshot->mtime = finfo.mtime;
+    if (finfo.valid & APR_FINFO_INODE)
+        snapshot->inode = finfo.inode;
+}
+
+
+void *
+mod_snapshot_acquire(struct mod_snapshot_slot *slot, apr_pool_t *pool)
+{
+    struct mod_snapshot *snapshot;
+
+    apr_atomic_inc32(&slot->readers);
+    snapshot = apr_atomic_casptr(&slot->current, NULL, NULL);
+    if (snapshot != NULL)
+        apr_atomic_inc32(&snapshot->refcount);
+    apr_atomic_dec32(&slot->readers);
+    if (snapshot != NULL)
+        apr_pool_cleanup_register(pool, snapshot, snapshot_release,
+                                  apr_pool_cleanup_null);
+    return snapshot;
+}
+
+
+void *
+mod_snapshot_current(struct mod_snapshot_slot *slot)
+{
+    return apr_atomic_casptr(&slot->current, NULL, NULL);
+}
+
+
+void
+mod_snapshot_publish(struct mod_snapshot_slot *slot,
+                     struct mod_snapshot *snapshot, unsigned long interval)
+{
+    struct mod_snapshot *old;
+
+    old = apr_atomic_xchgptr(&slot->current, snapshot);
+    apr_atomic_set32(&slot->next_check,
+                     (apr_uint32_t) (time(NULL) + interval));
+    if (old == NULL)
+        return;
+    while (apr_atomic_read32(&slot->readers) > 0)
+        apr_thread_yield();
+    snapshot_release(old);
+}
+
+
+bool
+mod_snapshot_check_due(struct mod_snapshot_slot *slot, unsigned long interval)
+{
+    apr_uint32_t now, next;
+
+    now = (apr_uint32_t) time(NULL);
+    next = apr_atomic_read32(&slot->next_check);
+    if (now < next)
+        return false;
+    return apr_atomic_cas32(&slot->next_check, now + interval, next) == next;
+}
+
+
+bool
+mod_snapshot_renew_begin(struct mod_snapshot_slot *slot)
+{
+    return apr_atomic_cas32(&slot->renewing, 1, 0) == 0;
+}
+
+
+bool
+mod_snapshot_renewing(struct mod_snapshot_slot *slot)
+{
+    return apr_atomic_read32(&slot->renewing) != 0;
+}
+
+
+void
+mod_snapshot_renew_end(struct mod_snapshot_slot *slot,
+                       apr_thread_mutex_t *mutex, apr_thread_cond_t *cond)
+{
+    apr_thread_mutex_lock(mutex);
+    apr_atomic_set32(&slot->renewing, 0);
+    apr_thread_cond_broadcast(cond);
+    apr_thread_mutex_unlock(mutex);
+}
+
+
+void
+mod_snapshot_renew_wait(struct mod_snapshot_slot *slot,
+                        apr_thread_mutex_t *mutex, apr_thread_cond_t *cond)
+{
+    apr_thread_mutex_lock(mutex);
+    while (apr_atomic_read32(&slot->renewing) != 0)
+        apr_thread_cond_wait(cond, mutex);
+    apr_thread_mutex_unlock(mutex);
+}
+
+
+bool
+mod_snapshot_changed(const struct mod_snapshot *snapshot,
+                     const apr_finfo_t *finfo)
+{
+    if (finfo->mtime != snapshot->mtime)
+        return true;
+    if (finfo->valid & APR_FINFO_INODE)
+        return finfo->inode != snapshot->inode;
+    return false;
+}
+
+
+bool
+mod_keyring_changed(const struct mod_snapshot *snapshot,
+                    const struct webauth_keyring *ring, const char *path,
+                    unsigned long lifetime, apr_pool_t *pool)
+{
+    apr_finfo_t finfo;
+    struct webauth_keyring_entry *entry;
+    time_t now;
+    int i;
+
+    if (apr_stat(&finfo, path, FINFO_WANTED, pool) != APR_SUCCESS)
+        return false;
+    if (mod_snapshot_changed(snapshot, &finfo))
+        return true;
+    if (lifetime == 0)
+        return false;
+
+    /* This mirrors the check done by webauth_keyring_auto_update. */
+    now = time(NULL);
+    for (i = 0; i < ring->entries->nelts; i++) {
+        entry = &APR_ARRAY_IDX(ring->entries, i, struct webauth_keyring_entry);
+        if (entry->valid_after + (time_t) lifetime > now)
+            return false;
+    }
+    return true;
+}
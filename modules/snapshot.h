@@ -0,0 +1,150 @@
+/*
+ * Reference-counted snapshots shared by the WebAuth Apache modules.
+ *
+ * Data that every request reads but that changes only rarely, such as a
+ * keyring or an ACL, is published in the server configuration as an
+ * immutable snapshot.  Requests take a reference to the current snapshot
+ * without locking and keep using it until the request pool is cleared, even
+ * if a new snapshot is published in the meantime.  Each snapshot has its own
+ * pool, which is destroyed when the last reference is released.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#ifndef MODULES_SNAPSHOT_H
+#define MODULES_SNAPSHOT_H 1
+
+#include <config-mod.h>
+#include <portable/stdbool.h>
+
+#include <apr_file_info.h>
+#include <apr_pools.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+
+struct webauth_keyring;
+
+/*
+ * The common part of every snapshot, which must be the first member of the
+ * struct for each kind of snapshot.  mtime and inode are those of the file
+ * the snapshot was loaded from, if any, so that changes can be noticed.
+ */
+struct mod_snapshot {
+    apr_pool_t *pool;                   /* Pool holding the snapshot. */
+    volatile apr_uint32_t refcount;     /* Includes the published reference. */
+    apr_time_t mtime;                   /* mtime of the file when loaded. */
+    apr_ino_t inode;                    /* inode of the file when loaded. */
+};
+
+/*
+ * Where a snapshot is published.  current is read and replaced only with
+ * atomic operations, and readers counts the threads in the middle of taking
+ * a reference to it.  next_check is the time (in seconds) after which the
+ * next request should check whether the snapshot is out of date, and
+ * renewing is set while one thread is building a replacement.  Use the
+ * functions below rather than accessing these directly.
+ */
+struct mod_snapshot_slot {
+    volatile void *current;
+    volatile apr_uint32_t readers;
+    volatile apr_uint32_t next_check;
+    volatile apr_uint32_t renewing;
+};
+
+/*
+ * Initialize the common part of a new snapshot allocated from pool, which
+ * must be a pool of its own that isn't a child of any request or server
+ * pool.  If path is not NULL, record the mtime and inode of that file, or
+ * zero if it can't be stat'd, which forces a reload at the next check.
+ */
+void
+mod_snapshot_init(struct mod_snapshot *, apr_pool_t *pool, const char *path);
+
+/*
+ * Take a reference to the current snapshot, released when the given pool is
+ * cleared.  This never blocks.  Returns NULL if nothing has been published.
+ */
+void *
+mod_snapshot_acquire(struct mod_snapshot_slot *, apr_pool_t *pool);
+
+/*
+ * Return the current snapshot without taking a reference, only for comparing
+ * against a snapshot already held.
+ */
+void *
+mod_snapshot_current(struct mod_snapshot_slot *);
+
+/*
+ * Publish a new snapshot, drop the published reference to the previous one,
+ * and set the next check interval seconds from now.  The snapshot may be
+ * NULL to just drop the previous one.  Callers serialize publication with a
+ * mutex of their own or with mod_snapshot_renew_begin.
+ */
+void
+mod_snapshot_publish(struct mod_snapshot_slot *, struct mod_snapshot *,
+                     unsigned long interval);
+
+/*
+ * Claim the check of whether the snapshot is out of date.  Returns true for
+ * only one caller once the next check time has passed, and moves the next
+ * check time interval seconds into the future.
+ */
+bool
+mod_snapshot_check_due(struct mod_snapshot_slot *, unsigned long interval);
+
+/*
+ * Claim the renewal of a snapshot that takes long enough to build, such as a
+ * service token obtained from the WebKDC, that only one thread should build
+ * it at a time.  Returns true for only one caller, which must then call
+ * mod_snapshot_renew_end whether or not it publishes a new snapshot.
+ */
+bool
+mod_snapshot_renew_begin(struct mod_snapshot_slot *);
+
+/* Return true if some thread has claimed the renewal of the snapshot. */
+bool
+mod_snapshot_renewing(struct mod_snapshot_slot *);
+
+/*
+ * Release the renewal claim and wake up any threads waiting for it in
+ * mod_snapshot_renew_wait.  The mutex is only held briefly to avoid losing
+ * the wakeup.
+ */
+void
+mod_snapshot_renew_end(struct mod_snapshot_slot *, apr_thread_mutex_t *,
+                       apr_thread_cond_t *);
+
+/*
+ * Wait for a renewal in progress, if any, to finish.  Only for threads that
+ * have nothing usable in the meantime, since everyone else can keep using
+ * the current snapshot.
+ */
+void
+mod_snapshot_renew_wait(struct mod_snapshot_slot *, apr_thread_mutex_t *,
+                        apr_thread_cond_t *);
+
+/*
+ * Return true if the file described by finfo is not the one the snapshot was
+ * loaded from, judging by mtime and inode.
+ */
+bool
+mod_snapshot_changed(const struct mod_snapshot *, const apr_finfo_t *);
+
+/*
+ * Return true if a keyring snapshot should be reloaded from path: either the
+ * file has changed or, if lifetime is nonzero, none of the keys in ring will
+ * still be current after lifetime seconds, meaning that the library would
+ * add a new key when automatically updating the keyring.  If the file can't
+ * be stat'd, returns false.  It's probably in the middle of being replaced,
+ * so the current keyring should be kept.
+ */
+bool
+mod_keyring_changed(const struct mod_snapshot *,
+                    const struct webauth_keyring *ring, const char *path,
+                    unsigned long lifetime, apr_pool_t *pool);
+
+#endif /* !MODULES_SNAPSHOT_H */
@@ -0,0 +1,277 @@
+/*
+ * Cache of decoded app tokens for the Apache WebAuth module.
+ *
+ * Browsers send the same app token cookie with every request for the life of
+ * a session, and decoding it means base64 decoding, decrypting, checking the
+ * HMAC, and decoding the attributes each time.  This cache maps the cookie
+ * value to the already validated token so that repeat requests skip all of
+ * that.  Entries are never used after the token's own expiration.
+ *
+ * A cache belongs to a keyring snapshot and is created empty with each new
+ * snapshot, so nothing decoded with an old keyring survives a keyring change.
+ * The cache is keyed by a digest of the token rather than the token itself so
+ * that the cache doesn't hold copies of the cookies, and the digest is keyed
+ * with a random secret so that the keys can't be predicted from outside.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+
+#include <apr_general.h>
+#include <apr_hash.h>
+#include <apr_sha1.h>
+#include <apr_thread_mutex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <modules/webauth/mod_webauth.h>
+#include <webauth/tokens.h>
+
+/* Size of the random secret that keys the digests. */
+#define SECRET_SIZE 32
+
+/*
+ * A cache entry.  The strings and session key of the app token follow the
+ * struct in memory, so the entry is a single allocation.
+ */
+struct mwa_token_cache_entry {
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    struct webauth_token_app app;
+};
+
+/* The cache. */
+struct mwa_token_cache {
+    apr_thread_mutex_t *mutex;  /* Protects entries. */
+    apr_hash_t *entries;        /* Map of digests to cache entries. */
+    size_t max;                 /* Maximum number of entries. */
+    unsigned char secret[SECRET_SIZE];
+};
+
+
+/*
+ * Compute the keyed digest of a token.
+ */
+static void
+token_digest(struct mwa_token_cache *cache, const char *token,
+             unsigned char digest[APR_SHA1_DIGESTSIZE])
+{
+    apr_sha1_ctx_t sha;
+
+    apr_sha1_init(&sha);
+    apr_sha1_update_binary(&sha, cache->secret, sizeof(cache->secret));
+    apr_sha1_update(&sha, token, strlen(token));
+    apr_sha1_final(digest, &sha);
+}
+
+
+/*
+ * Free all the entries in the cache.  This is registered as a cleanup for the
+ * pool from which the cache was allocated, which is the pool of the keyring
+ * snapshot.
+ */
+static apr_status_t
+cache_free(void *data)
+{
+    struct mwa_token_cache *cache = data;
+    apr_hash_index_t *hi;
+    void *entry;
+
+    for (hi = apr_hash_first(NULL, cache->entries); hi != NULL;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &entry);
+        free(entry);
+    }
+    apr_hash_clear(cache->entries);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Make space for at least one more entry in a full cache.  First remove
+ * expired entries, and then, if that doesn't free enough space, remove
+ * entries in hash order, which is effectively random, until the cache is
+ * three quarters full.  Must be called with the cache mutex held.
+ */
+static void
+cache_prune(struct mwa_token_cache *cache, time_t now)
+{
+    apr_hash_index_t *hi;
+    const void *key;
+    void *data;
+    struct mwa_token_cache_entry *entry;
+
+    for (hi = apr_hash_first(NULL, cache->entries); hi != NULL;
+         hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, &data);
+        entry = data;
+        if (entry->app.expiration < now) {
+            apr_hash_set(cache->entries, key, APR_SHA1_DIGESTSIZE, NULL);
+            free(entry);
+        }
+    }
+    for (hi = apr_hash_first(NULL, cache->entries); hi != NULL;
+         hi = apr_hash_next(hi)) {
+        if (apr_hash_count(cache->entries) <= cache->max / 4 * 3)
+            break;
+        apr_hash_this(hi, &key, NULL, &data);
+        apr_hash_set(cache->entries, key, APR_SHA1_DIGESTSIZE, NULL);
+        free(data);
+    }
+}
+
+
+/*
+ * Copy a string into the memory following a cache entry, advancing the
+ * pointer to that memory.  Returns the copy, or NULL if the string is NULL.
+ */
+static const char *
+copy_string(char **p, const char *string)
+{
+    size_t length;
+    char *copy = *p;
+
+    if (string == NULL)
+        return NULL;
+    length = strlen(string) + 1;
+    memcpy(copy, string, length);
+    *p += length;
+    return copy;
+}
+
+
+/*
+ * Create a new, empty cache that holds at most max tokens, allocated from
+ * the given pool.  Returns an APR status.
+ */
+apr_status_t
+mwa_token_cache_create(struct mwa_token_cache **result, size_t max,
+                       apr_pool_t *p)
+{
+    struct mwa_token_cache *cache;
+    apr_status_t status;
+
+    cache = apr_pcalloc(p, sizeof(struct mwa_token_cache));
+    cache->entries = apr_hash_make(p);
+    cache->max = max;
+#if APR_HAS_RANDOM
+    status = apr_generate_random_bytes(cache->secret, sizeof(cache->secret));
+    if (status != APR_SUCCESS)
+        return status;
+#else
+    return APR_ENOTIMPL;
+#endif
+    status = apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                     p);
+    if (status != APR_SUCCESS)
+        return status;
+    apr_pool_cleanup_register(p, cache, cache_free, apr_pool_cleanup_null);
+    *result = cache;
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Look up a token in the cache.  If it's there and hasn't expired, return a
+ * copy of the decoded app token allocated from the given pool, which the
+ * caller may modify.  Otherwise, return NULL.
+ */
+struct webauth_token_app *
+mwa_token_cache_get(struct mwa_token_cache *cache, const char *token,
+                    apr_pool_t *pool)
+{
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    struct mwa_token_cache_entry *entry;
+    struct webauth_token_app *app = NULL;
+
+    token_digest(cache, token, digest);
+    apr_thread_mutex_lock(cache->mutex);
+    entry = apr_hash_get(cache->entries, digest, sizeof(digest));
+    if (entry != NULL && entry->app.expiration >= time(NULL)) {
+        app = apr_pmemdup(pool, &entry->app, sizeof(*app));
+        app->subject = apr_pstrdup(pool, entry->app.subject);
+        app->authz_subject = apr_pstrdup(pool, entry->app.authz_subject);
+        app->initial_factors = apr_pstrdup(pool, entry->app.initial_factors);
+        app->session_factors = apr_pstrdup(pool, entry->app.session_factors);
+        if (entry->app.session_key != NULL)
+            app->session_key = apr_pmemdup(pool, entry->app.session_key,
+                                           entry->app.session_key_len);
+    }
+    apr_thread_mutex_unlock(cache->mutex);
+    return app;
+}
+
+
+/*
+ * Store a decoded and validated app token in the cache under the token
+ * string, replacing any existing entry.  If memory for the entry cannot be
+ * allocated, the token is silently not cached.
+ */
+void
+mwa_token_cache_set(struct mwa_token_cache *cache, const char *token,
+                    const struct webauth_token_app *app)
+{
+    struct mwa_token_cache_entry *entry, *old;
+    size_t size;
+    char *p;
+
+    /* Allocate a single block for the entry and everything it points to. */
+    size = sizeof(struct mwa_token_cache_entry) + app->session_key_len;
+    if (app->subject != NULL)
+        size += strlen(app->subject) + 1;
+    if (app->authz_subject != NULL)
+        size += strlen(app->authz_subject) + 1;
+    if (app->initial_factors != NULL)
+        size += strlen(app->initial_factors) + 1;
+    if (app->session_factors != NULL)
+        size += strlen(app->session_factors) + 1;
+    entry = malloc(size);
+    if (entry == NULL)
+        return;
+
+    /* Copy the token into the entry. */
+    token_digest(cache, token, entry->digest);
+    entry->app = *app;
+    p = (char *) (entry + 1);
+    if (app->session_key != NULL) {
+        memcpy(p, app->session_key, app->session_key_len);
+        entry->app.session_key = p;
+        p += app->session_key_len;
+    }
+    entry->app.subject = copy_string(&p, app->subject);
+    entry->app.authz_subject = copy_string(&p, app->authz_subject);
+    entry->app.initial_factors = copy_string(&p, app->initial_factors);
+    entry->app.session_factors = copy_string(&p, app->session_factors);
+
+    /* Add it to the cache. */
+    apr_thread_mutex_lock(cache->mutex);
+    old = apr_hash_get(cache->entries, entry->digest, APR_SHA1_DIGESTSIZE);
+    if (old != NULL)
+        apr_hash_set(cache->entries, old->digest, APR_SHA1_DIGESTSIZE, NULL);
+    else if (apr_hash_count(cache->entries) >= cache->max)
+        cache_prune(cache, time(NULL));
+    apr_hash_set(cache->entries, entry->digest, APR_SHA1_DIGESTSIZE, entry);
+    apr_thread_mutex_unlock(cache->mutex);
+    free(old);
+}
+
+
+/*
+ * Return the number of tokens in the cache.
+ */
+size_t
+mwa_token_cache_count(struct mwa_token_cache *cache)
+{
+    size_t count;
+
+    apr_thread_mutex_lock(cache->mutex);
+    count = apr_hash_count(cache->entries);
+    apr_thread_mutex_unlock(cache->mutex);
+    return count;
+}
@@ -23,6 +23,7 @@
 #include <modules/webauth/mod_webauth.h>
 #include <util/macros.h>
 #include <webauth/basic.h>
+#include <webauth/factors.h>
 #include <webauth/util.h>
 
 APLOG_USE_MODULE(webauth);
@@ -79,6 +80,7 @@ DIRD(SSLRedirectPort,    "SSL port for SSL redirects", int, 443)
 DIRN(SSLReturn,          "whether to force the return URL to be https")
 DIRD(StripURL,           "whether to strip tokens in internal URL", bool, true)
 DIRD(SubjectAuthType,    "requested subject authenticator", char *, "webkdc")
+DIRN(TokenCacheSize,     "maximum number of decoded app tokens to cache")
 DIRD(TokenMaxTTL,        "maximum lifetime of recent tokens", int, 300)
 DIRN(TrustAuthzIdentity, "whether to trust asserted authorization identities")
 DIRN(WebKdcPrincipal,    "WebKDC Kerberos principal name")
@@ -146,6 +148,7 @@ enum {
     E_ServiceTokenCache,
     E_StripURL,
     E_SubjectAuthType,
+    E_TokenCacheSize,
     E_TokenMaxTTL,
     E_TrustAuthzIdentity,
     E_UseCreds,
@@ -272,6 +275,7 @@ mwa_server_config_merge(apr_pool_t *pool, void *basev, void *overv)
     MERGE_PTR(webkdc_cert_file);
     MERGE_PTR(webkdc_principal);
     MERGE_PTR(webkdc_url);
+    MERGE_SET(token_cache_size);
     MERGE_SET(token_max_ttl);
     return conf;
 }
@@ -302,6 +306,7 @@ mwa_dir_config_merge(apr_pool_t *pool, void *basev, void *overv)
     MERGE_SET(force_login);
     MERGE_INT(inactive_expire);
     MERGE_PTR(initial_factors);
+    MERGE_PTR_OTHER(initial_wanted, initial_factors);
     MERGE_INT(last_use_update_interval);
     MERGE_SET(loa);
     MERGE_PTR(login_canceled_url);
@@ -309,6 +314,7 @@ mwa_dir_config_merge(apr_pool_t *pool, void *basev, void *overv)
     MERGE_PTR(post_return_url);
     MERGE_PTR(return_url);
     MERGE_PTR(session_factors);
+    MERGE_PTR_OTHER(session_wanted, session_factors);
     MERGE_SET(ssl_return);
     MERGE_SET(trust_authz_identity);
     MERGE_SET(use_creds);
@@ -386,9 +392,22 @@ mwa_config_init(server_rec *server, struct server_config *bconf UNUSED,
         exit(1);
     }
 
-    /* Initialize the mutex. */
+    /* Initialize the mutex and the service token refresh condition. */
     if (sconf->mutex == NULL)
         apr_thread_mutex_create(&sconf->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (sconf->service_token_cond == NULL)
+        apr_thread_cond_create(&sconf->service_token_cond, p);
+
+    /* Create the pool of cURL handles for talking to the WebKDC. */
+    if (sconf->curl_pool == NULL) {
+        status = mwa_curl_pool_create(&sconf->curl_pool, p);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, status, server,
+                         "mod_webauth: cannot create cURL handle pool");
+            fprintf(stderr, "mod_webauth: cannot create cURL handle pool\n");
+            exit(1);
+        }
+    }
 
     /* Unlink any existing service token cache so that we'll get a new one. */
     if (unlink(sconf->st_cache_path) < 0 && errno != ENOENT)
@@ -435,6 +454,29 @@ parse_number(cmd_parms *cmd, const char *arg, unsigned long *value)
 }
 
 
+/*
+ * Utility function for compiling the list of required factors for a
+ * directive into a webauth_factors struct, so that checking factors in each
+ * request doesn't have to parse them.  Returns an error string or NULL on
+ * success.
+ */
+static const char *
+compile_factors(cmd_parms *cmd, const apr_array_header_t *factors,
+                struct webauth_factors **result)
+{
+    struct webauth_context *ctx;
+    int status;
+
+    status = webauth_context_init_apr(&ctx, cmd->pool);
+    if (status != WA_ERR_NONE)
+        return apr_psprintf(cmd->pool, "Cannot compile factors for %s: %s",
+                            cmd->directive->directive,
+                            webauth_error_message(NULL, status));
+    *result = webauth_factors_new(ctx, factors);
+    return NULL;
+}
+
+
 /*
  * Return the error message for an internal error parsing a configuration
  * directive.  This happens when the wrong configuration handling routine is
@@ -508,6 +550,11 @@ cfg_str(cmd_parms *cmd, void *mconf, const char *arg)
             err = apr_psprintf(cmd->pool, "Invalid value %s for directive %s",
                                arg, cmd->directive->directive);
         break;
+    case E_TokenCacheSize:
+        err = parse_number(cmd, arg, &sconf->token_cache_size);
+        if (err == NULL)
+            sconf->token_cache_size_set = true;
+        break;
     case E_TokenMaxTTL:
         err = parse_interval(cmd, arg, &sconf->token_max_ttl);
         if (err == NULL)
@@ -551,6 +598,8 @@ cfg_str(cmd_parms *cmd, void *mconf, const char *arg)
                 = apr_array_make(cmd->pool, 1, sizeof(const char *));
         factor = apr_array_push(dconf->initial_factors);
         *factor = apr_pstrdup(cmd->pool, arg);
+        err = compile_factors(cmd, dconf->initial_factors,
+                              &dconf->initial_wanted);
         break;
     case E_RequireLOA:
         err = parse_number(cmd, arg, &dconf->loa);
@@ -563,6 +612,8 @@ cfg_str(cmd_parms *cmd, void *mconf, const char *arg)
                 = apr_array_make(cmd->pool, 1, sizeof(const char *));
         factor = apr_array_push(dconf->session_factors);
         *factor = apr_pstrdup(cmd->pool, arg);
+        err = compile_factors(cmd, dconf->session_factors,
+                              &dconf->session_wanted);
         break;
     case E_ReturnURL:
         dconf->return_url = apr_pstrdup(cmd->pool, arg);
@@ -785,6 +836,7 @@ const command_rec webauth_cmds[] = {
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   SSLRedirectPort),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,   StripURL),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   SubjectAuthType),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   TokenCacheSize),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   TokenMaxTTL),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   RSRC_CONF,   WebKdcPrincipal),
     DIRECTIVE(AP_INIT_FLAG,    cfg_flag,  RSRC_CONF,   WebKdcSSLCertCheck),
@@ -0,0 +1,218 @@
+/*
+ * Pool of cURL handles for requests to the WebKDC.
+ *
+ * Each request to the WebKDC checks out a cURL handle from this pool and
+ * returns it when done.  Since cURL keeps the connection open in the handle,
+ * reusing handles lets later requests reuse the existing keep-alive HTTPS
+ * connection to the WebKDC instead of paying for a new TCP connection and
+ * TLS handshake each time.  All handles share one cURL share object for the
+ * DNS cache and TLS sessions, so a handle that does have to connect can
+ * usually resume a TLS session.
+ *
+ * The pool isn't bounded.  A handle is only created when every existing
+ * handle is checked out, so the pool grows to the number of threads that
+ * talk to the WebKDC at the same time and no further.  The pool is created
+ * in the parent process before any handles exist, so each child process
+ * ends up with its own handles and connections.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_thread_mutex.h>
+#include <curl/curl.h>
+
+#include <modules/webauth/mod_webauth.h>
+#include <util/macros.h>
+
+/* The pool. */
+struct mwa_curl_pool {
+    apr_thread_mutex_t *mutex;  /* Protects idle and the statistics. */
+    apr_array_header_t *idle;   /* Stack of idle handles (CURL *). */
+    CURLSH *share;              /* DNS cache and TLS sessions, or NULL. */
+
+    /* cURL locks the shared data by type, so we need a mutex per type. */
+    apr_thread_mutex_t *locks[CURL_LOCK_DATA_LAST];
+
+    /* Statistics, protected by mutex. */
+    unsigned long handles;      /* Number of handles created. */
+    unsigned long connects;     /* Requests that opened a new connection. */
+    unsigned long reuses;       /* Requests that reused a connection. */
+};
+
+
+/*
+ * Lock and unlock callbacks for the share object.  The access argument says
+ * whether the lock is for reading or writing, but we don't bother with
+ * read/write locks since the critical sections are short.
+ */
+static void
+share_lock(CURL *curl UNUSED, curl_lock_data data,
+           curl_lock_access access UNUSED, void *userp)
+{
+    struct mwa_curl_pool *pool = userp;
+
+    apr_thread_mutex_lock(pool->locks[data]);
+}
+
+static void
+share_unlock(CURL *curl UNUSED, curl_lock_data data, void *userp)
+{
+    struct mwa_curl_pool *pool = userp;
+
+    apr_thread_mutex_unlock(pool->locks[data]);
+}
+
+
+/*
+ * Free all the idle handles and the share object.  This is registered as a
+ * cleanup for the pool from which the handle pool was allocated, since none
+ * of the cURL data is allocated from APR pools.
+ */
+static apr_status_t
+pool_cleanup(void *data)
+{
+    struct mwa_curl_pool *pool = data;
+    CURL **curl;
+
+    while ((curl = apr_array_pop(pool->idle)) != NULL)
+        curl_easy_cleanup(*curl);
+    if (pool->share != NULL)
+        curl_share_cleanup(pool->share);
+    pool->share = NULL;
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create a new, empty pool of cURL handles allocated from the given APR
+ * pool.  If the share object can't be created, handles just won't share
+ * their caches.  Returns an APR status.
+ */
+apr_status_t
+mwa_curl_pool_create(struct mwa_curl_pool **result, apr_pool_t *p)
+{
+    struct mwa_curl_pool *pool;
+    apr_status_t status;
+    size_t i;
+
+    pool = apr_pcalloc(p, sizeof(struct mwa_curl_pool));
+    pool->idle = apr_array_make(p, 4, sizeof(CURL *));
+    status = apr_thread_mutex_create(&pool->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                     p);
+    if (status != APR_SUCCESS)
+        return status;
+    for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+        status = apr_thread_mutex_create(&pool->locks[i],
+                                         APR_THREAD_MUTEX_DEFAULT, p);
+        if (status != APR_SUCCESS)
+            return status;
+    }
+    pool->share = curl_share_init();
+    if (pool->share != NULL) {
+        curl_share_setopt(pool->share, CURLSHOPT_LOCKFUNC, share_lock);
+        curl_share_setopt(pool->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+        curl_share_setopt(pool->share, CURLSHOPT_USERDATA, pool);
+        curl_share_setopt(pool->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(pool->share, CURLSHOPT_SHARE,
+                          CURL_LOCK_DATA_SSL_SESSION);
+    }
+    apr_pool_cleanup_register(p, pool, pool_cleanup, apr_pool_cleanup_null);
+    *result = pool;
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Check out a handle, creating a new one if none are idle.  The handle has
+ * the options common to all WebKDC requests set; the caller sets the rest.
+ * Returns NULL if a new handle could not be created.
+ */
+CURL *
+mwa_curl_checkout(struct mwa_curl_pool *pool)
+{
+    CURL *curl = NULL;
+    CURL **idle;
+
+    apr_thread_mutex_lock(pool->mutex);
+    idle = apr_array_pop(pool->idle);
+    if (idle != NULL)
+        curl = *idle;
+    apr_thread_mutex_unlock(pool->mutex);
+    if (curl == NULL) {
+        curl = curl_easy_init();
+        if (curl == NULL)
+            return NULL;
+        apr_thread_mutex_lock(pool->mutex);
+        pool->handles++;
+        apr_thread_mutex_unlock(pool->mutex);
+    }
+
+    /* Set the options shared by every request. */
+    if (pool->share != NULL)
+        curl_easy_setopt(curl, CURLOPT_SHARE, pool->share);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
+
+    /*
+     * The CURLOPT_* names are enum constants, not macros, so they can't be
+     * tested with #ifdef.  CURLOPT_TCP_KEEPALIVE was added in cURL 7.25.0.
+     */
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+    /* FIXME: probably need directives for these */
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 45);
+#if LIBCURL_VERSION_NUM >= 0x071900
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1);
+#endif
+    return curl;
+}
+
+
+/*
+ * Return a handle to the pool.  If the request succeeded, record whether it
+ * needed a new connection and keep the handle, resetting its options so that
+ * it doesn't keep pointers into the caller's memory.  If the request failed,
+ * the connection may be in an unknown state, so discard the handle.
+ */
+void
+mwa_curl_checkin(struct mwa_curl_pool *pool, CURL *curl, bool success)
+{
+    long connects = 0;
+    CURLcode code;
+
+    if (!success) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+    code = curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_reset(curl);
+    apr_thread_mutex_lock(pool->mutex);
+    if (code == CURLE_OK && connects == 0)
+        pool->reuses++;
+    else
+        pool->connects++;
+    APR_ARRAY_PUSH(pool->idle, CURL *) = curl;
+    apr_thread_mutex_unlock(pool->mutex);
+}
+
+
+/*
+ * Return statistics about the pool.
+ */
+void
+mwa_curl_stats(struct mwa_curl_pool *pool, struct mwa_curl_stats *stats)
+{
+    apr_thread_mutex_lock(pool->mutex);
+    stats->handles = pool->handles;
+    stats->idle = pool->idle->nelts;
+    stats->connects = pool->connects;
+    stats->reuses = pool->reuses;
+    apr_thread_mutex_unlock(pool->mutex);
+}
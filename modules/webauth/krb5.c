@@ -2,7 +2,7 @@
  * Kerberos-related functions for the WebAuth Apache module.
  *
  * Written by Roland Schemers
- * Copyright 2003, 2006, 2009, 2010, 2011, 2012, 2013
+ * Copyright 2003, 2006, 2009, 2010, 2011, 2012, 2013, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -13,10 +13,16 @@
 #include <portable/apr.h>
 #include <portable/stdbool.h>
 
+#include <apr_atomic.h>
 #include <apr_base64.h>
+#include <apr_file_info.h>
+#include <apr_sha1.h>
 #ifdef HAVE_LIBKEYUTILS
 # include <keyutils.h>
 #endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <modules/webauth/mod_webauth.h>
@@ -92,45 +98,146 @@ krb5_validate_sad(MWA_REQ_CTXT *rc, const void *sad, size_t sad_len)
 }
 
 
+/*
+ * Comparison function for sorting SHA-1 digests with qsort.
+ */
 static int
-krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
+compare_digests(const void *a, const void *b)
 {
-    const char *mwa_func="krb5_prepare_file_creds";
+    return memcmp(a, b, APR_SHA1_DIGESTSIZE);
+}
+
+
+/*
+ * Return the key for the credential cache for a set of credentials, which is
+ * the hex-encoded SHA-1 digest of the digests of the subject, service, and
+ * data of each of the Kerberos credentials in sorted order, so that the key
+ * doesn't depend on the order in which the credentials were gathered.  Also
+ * return the earliest expiration of those credentials.  Returns NULL if
+ * there are no Kerberos credentials.
+ */
+static const char *
+cred_cache_key(MWA_REQ_CTXT *rc, apr_array_header_t *creds,
+               time_t *expiration)
+{
+    struct webauth_token_cred *cred;
+    apr_sha1_ctx_t sha;
+    unsigned char *digests;
+    unsigned char digest[APR_SHA1_DIGESTSIZE];
+    char *key;
+    size_t i, count = 0;
+
+    *expiration = 0;
+    digests = apr_palloc(rc->r->pool, creds->nelts * APR_SHA1_DIGESTSIZE + 1);
+    for (i = 0; i < (size_t) creds->nelts; i++) {
+        cred = APR_ARRAY_IDX(creds, i, struct webauth_token_cred *);
+        if (strcmp(cred->type, "krb5") != 0)
+            continue;
+        apr_sha1_init(&sha);
+        apr_sha1_update(&sha, cred->subject, strlen(cred->subject) + 1);
+        apr_sha1_update(&sha, cred->service, strlen(cred->service) + 1);
+        apr_sha1_update_binary(&sha, cred->data, cred->data_len);
+        apr_sha1_final(digests + count * APR_SHA1_DIGESTSIZE, &sha);
+        if (*expiration == 0 || cred->expiration < *expiration)
+            *expiration = cred->expiration;
+        count++;
+    }
+    if (count == 0)
+        return NULL;
+    qsort(digests, count, APR_SHA1_DIGESTSIZE, compare_digests);
+    apr_sha1_init(&sha);
+    apr_sha1_update_binary(&sha, digests, count * APR_SHA1_DIGESTSIZE);
+    apr_sha1_final(digest, &sha);
+    key = apr_palloc(rc->r->pool, APR_SHA1_DIGESTSIZE * 2 + 1);
+    for (i = 0; i < APR_SHA1_DIGESTSIZE; i++)
+        sprintf(key + i * 2, "%02x", digest[i]);
+    return key;
+}
+
+
+/*
+ * Remove credential caches that expired more than CRED_CACHE_GRACE seconds
+ * ago, and temporary files left behind that are older than that, from the
+ * credential cache directory.  This is registered as a cleanup on the pool
+ * of the request that claimed the reap, so it runs after the response has
+ * been sent.  It has its own pool since the request pool is being cleared.
+ */
+static apr_status_t
+cred_cache_reap(void *data)
+{
+    struct server_config *sconf = data;
+    apr_pool_t *pool;
+    apr_dir_t *dir;
+    apr_finfo_t entry, finfo;
+    apr_int32_t wanted = APR_FINFO_LINK | APR_FINFO_MTIME | APR_FINFO_TYPE;
+    apr_time_t cutoff;
+    char *path;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        return APR_SUCCESS;
+    if (apr_dir_open(&dir, sconf->cred_cache_dir, pool) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return APR_SUCCESS;
+    }
+    cutoff = apr_time_now() - apr_time_from_sec(CRED_CACHE_GRACE);
+    while (apr_dir_read(&entry, APR_FINFO_NAME, dir) == APR_SUCCESS) {
+        if (strncmp(entry.name, CRED_CACHE_PREFIX,
+                    strlen(CRED_CACHE_PREFIX)) != 0
+            && strncmp(entry.name, CRED_CACHE_TEMP,
+                       strlen(CRED_CACHE_TEMP)) != 0)
+            continue;
+        path = apr_pstrcat(pool, sconf->cred_cache_dir, "/", entry.name,
+                           NULL);
+        if (apr_stat(&finfo, path, wanted, pool) != APR_SUCCESS)
+            continue;
+        if (finfo.filetype == APR_REG && finfo.mtime < cutoff)
+            apr_file_remove(path, pool);
+    }
+    apr_dir_close(dir);
+    apr_pool_destroy(pool);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Write the Kerberos credentials to a new credential cache at the given path.
+ * The cache is written to a temporary file in the same directory, whose
+ * modification time is then set to the earliest credential expiration, and
+ * renamed into place, so that other requests using the same cache never see
+ * a partial cache.  If any credential can't be imported, the temporary file
+ * is removed and nothing is published, since the cache is shared with every
+ * other request with the same credentials.  Returns true on success and
+ * false on failure.
+ */
+static bool
+cred_cache_create(MWA_REQ_CTXT *rc, apr_array_header_t *creds,
+                  const char *path, time_t expiration)
+{
+    const char *mwa_func = "krb5_prepare_file_creds";
     struct webauth_krb5 *kc;
-    size_t i;
-    int status;
+    struct webauth_token_cred *cred;
     char *temp_cred_file;
     apr_file_t *fp;
     apr_int32_t flags;
     apr_status_t astatus;
+    size_t i;
+    int status;
 
-    astatus = apr_filepath_merge(&temp_cred_file,
-                                 rc->sconf->cred_cache_dir,
-                                 "temp.krb5.XXXXXX",
-                                 0,
-                                 rc->r->pool);
-    if (astatus != APR_SUCCESS) {
-        mwa_log_apr_error(rc->r->server, astatus, mwa_func,
-                          "apr_filepath_merge", rc->sconf->cred_cache_dir,
-                          "temp.krb5.XXXXX");
-        return 0;
-    }
-
+    temp_cred_file = apr_pstrcat(rc->r->pool, rc->sconf->cred_cache_dir, "/",
+                                 CRED_CACHE_TEMP "XXXXXX", NULL);
     flags = (APR_FOPEN_CREATE | APR_FOPEN_READ | APR_FOPEN_WRITE
              | APR_FOPEN_EXCL);
     astatus = apr_file_mktemp(&fp, temp_cred_file, flags, rc->r->pool);
     if (astatus != APR_SUCCESS) {
         mwa_log_apr_error(rc->r->server, astatus, mwa_func,
                           "apr_file_mktemp", temp_cred_file, NULL);
-        return 0;
+        return false;
     }
-
-    /* we close it here, and register a pool cleanup handler */
     astatus = apr_file_close(fp);
     if (astatus != APR_SUCCESS) {
         mwa_log_apr_error(rc->r->server, astatus, mwa_func,
                           "apr_file_close", temp_cred_file, NULL);
-        return 0;
+        goto fail;
     }
 
     if (rc->sconf->debug)
@@ -140,11 +247,9 @@ krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
 
     kc = get_webauth_krb5_ctxt(rc->ctx, rc->r->server, mwa_func);
     if (kc == NULL)
-        return 0;
+        goto fail;
 
     for (i = 0; i < (size_t) creds->nelts; i++) {
-        struct webauth_token_cred *cred;
-
         cred = APR_ARRAY_IDX(creds, i, struct webauth_token_cred *);
         if (strcmp(cred->type, "krb5") == 0) {
             if (rc->sconf->debug)
@@ -153,15 +258,104 @@ krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
                              mwa_func, cred->service, cred->subject);
             status = webauth_krb5_import_cred(rc->ctx, kc, cred->data,
                                               cred->data_len, temp_cred_file);
-            if (status != WA_ERR_NONE)
+            if (status != WA_ERR_NONE) {
                 log_webauth_error(rc->ctx, rc->r->server,
                                   status, mwa_func,
                                   "webauth_krb5_import_cred", NULL);
+                goto fail;
+            }
         }
     }
 
+    /* Mark the expiration and move the new cache into place. */
+    astatus = apr_file_mtime_set(temp_cred_file, apr_time_from_sec(expiration),
+                                 rc->r->pool);
+    if (astatus != APR_SUCCESS) {
+        mwa_log_apr_error(rc->r->server, astatus, mwa_func,
+                          "apr_file_mtime_set", temp_cred_file, NULL);
+        goto fail;
+    }
+    astatus = apr_file_rename(temp_cred_file, path, rc->r->pool);
+    if (astatus != APR_SUCCESS) {
+        mwa_log_apr_error(rc->r->server, astatus, mwa_func,
+                          "apr_file_rename", temp_cred_file, path);
+        goto fail;
+    }
+    return true;
+
+fail:
+    apr_file_remove(temp_cred_file, rc->r->pool);
+    return false;
+}
+
+
+/*
+ * Prepare a file credential cache for the credentials and point KRB5CCNAME
+ * at it.
+ *
+ * Credential caches are named by a digest of the subject and the credentials
+ * and are reused by later requests with the same credentials, so a busy
+ * server doesn't create and write a new file for every request.  The
+ * modification time of each cache is set to the earliest expiration of its
+ * credentials.  A cache is only reused if it is a regular file with exactly
+ * that modification time, so a cache that has been changed or removed by a
+ * CGI script is replaced rather than reused.  Once every
+ * CRED_CACHE_REAP_INTERVAL seconds, one request also removes expired caches
+ * after it finishes.
+ */
+static int
+krb5_prepare_file_creds(MWA_REQ_CTXT *rc, apr_array_header_t *creds)
+{
+    const char *mwa_func="krb5_prepare_file_creds";
+    struct server_config *sconf = rc->sconf;
+    const char *key;
+    char *path;
+    apr_finfo_t finfo;
+    apr_int32_t wanted = APR_FINFO_LINK | APR_FINFO_MTIME | APR_FINFO_TYPE;
+    apr_status_t astatus;
+    apr_uint32_t now, next;
+    time_t expiration;
+
+    /* Claim the next reap of the cache directory if it's time. */
+    now = (apr_uint32_t) time(NULL);
+    next = apr_atomic_read32(&sconf->cred_cache_next_reap);
+    if (now >= next)
+        if (apr_atomic_cas32(&sconf->cred_cache_next_reap,
+                             now + CRED_CACHE_REAP_INTERVAL, next) == next)
+            apr_pool_cleanup_register(rc->r->pool, sconf, cred_cache_reap,
+                                      apr_pool_cleanup_null);
+
+    key = cred_cache_key(rc, creds, &expiration);
+    if (key == NULL)
+        return 1;
+    astatus = apr_filepath_merge(&path, sconf->cred_cache_dir,
+                                 apr_pstrcat(rc->r->pool, CRED_CACHE_PREFIX,
+                                             key, NULL),
+                                 0, rc->r->pool);
+    if (astatus != APR_SUCCESS) {
+        mwa_log_apr_error(rc->r->server, astatus, mwa_func,
+                          "apr_filepath_merge", sconf->cred_cache_dir, key);
+        return 0;
+    }
+
+    /* Reuse an existing cache if it's still intact, else create it. */
+    astatus = apr_stat(&finfo, path, wanted, rc->r->pool);
+    if (astatus == APR_SUCCESS && finfo.filetype == APR_REG
+        && finfo.mtime == apr_time_from_sec(expiration)
+        && expiration > (time_t) now) {
+        apr_atomic_inc32(&sconf->cred_cache_reuses);
+        if (sconf->debug)
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+                         "mod_webauth: %s: reusing credential cache %s",
+                         mwa_func, path);
+    } else {
+        if (!cred_cache_create(rc, creds, path, expiration))
+            return 0;
+        apr_atomic_inc32(&sconf->cred_cache_creates);
+    }
+
     /* set environment variable */
-    apr_table_setn(rc->r->subprocess_env, ENV_KRB5CCNAME, temp_cred_file);
+    apr_table_setn(rc->r->subprocess_env, ENV_KRB5CCNAME, path);
     return 1;
 }
 
@@ -13,6 +13,7 @@
 #include <portable/apr.h>
 #include <portable/stdbool.h>
 
+#include <apr_atomic.h>
 #include <unistd.h>
 
 #include <modules/webauth/mod_webauth.h>
@@ -31,23 +32,33 @@ APLOG_USE_MODULE(webauth);
 
 /*
  * Called at any entry point where we may be doing WebAuth operations that
- * need a keyring.  Do lazy initialization of the in-memory keyring from the
- * disk file and store it in the virtual host context.  Returns true if the
- * keyring could be loaded correctly and false otherwise.
+ * need a keyring.  Take a reference to the current keyring snapshot for the
+ * rest of the request and store the keyring in rc->ring, doing lazy
+ * initialization of the in-memory keyring from the disk file if it hasn't
+ * been loaded yet.  Only that initial load takes the mutex.  Returns true if
+ * the keyring could be loaded correctly and false otherwise.
  */
 static bool
 ensure_keyring_loaded(MWA_REQ_CTXT *rc)
 {
-    int s;
+    struct mwa_keyring_snapshot *snapshot;
 
-    apr_thread_mutex_lock(rc->sconf->mutex);
-    if (rc->sconf->ring != NULL) {
-        apr_thread_mutex_unlock(rc->sconf->mutex);
+    if (rc->ring != NULL)
         return true;
+    mwa_keyring_check(rc->r->server, rc->sconf, rc->r->pool);
+    snapshot = mwa_keyring_acquire(rc->sconf, rc->r->pool);
+    if (snapshot == NULL) {
+        apr_thread_mutex_lock(rc->sconf->mutex);
+        if (mod_snapshot_current(&rc->sconf->keyring) == NULL)
+            mwa_cache_keyring(rc->r->server, rc->sconf);
+        apr_thread_mutex_unlock(rc->sconf->mutex);
+        snapshot = mwa_keyring_acquire(rc->sconf, rc->r->pool);
+        if (snapshot == NULL)
+            return false;
     }
-    s = mwa_cache_keyring(rc->r->server, rc->sconf);
-    apr_thread_mutex_unlock(rc->sconf->mutex);
-    return (s == WA_ERR_NONE && rc->sconf->ring != NULL);
+    rc->ring = snapshot->ring;
+    rc->tokens = snapshot->tokens;
+    return true;
 }
 
 
@@ -471,9 +482,8 @@ mod_webauth_cleanup(void *data)
         /* service_token is currently never set in the parent,
          * add it here in case we change caching strategy.
          */
-        if (tconf->service_token) {
-            apr_pool_destroy(tconf->service_token->pool);
-            tconf->service_token = NULL;
+        if (mod_snapshot_current(&tconf->service_token) != NULL) {
+            mod_snapshot_publish(&tconf->service_token, NULL, 0);
             if (sconf->debug) {
                 ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
                              "mod_webauth: cleanup service_token: %s",
@@ -508,6 +518,12 @@ mod_webauth_init(apr_pool_t *pconf, apr_pool_t *plog UNUSED,
                               mod_webauth_cleanup,
                               apr_pool_cleanup_null);
 
+    /*
+     * Initialize cURL before any handles are created.  This isn't thread-safe,
+     * so it has to happen here rather than lazily on the first request.
+     */
+    curl_global_init(CURL_GLOBAL_ALL);
+
     for (scheck=s; scheck; scheck=scheck->next) {
         mwa_config_init(scheck, sconf, pconf);
     }
@@ -632,6 +648,7 @@ handler_hook(request_rec *r)
     struct server_config *sconf;
     MWA_REQ_CTXT *rc;
     MWA_SERVICE_TOKEN *st;
+    struct mwa_curl_stats curl_stats;
     apr_int32_t flags;
 
     if (strcmp(r->handler, "webauth")) {
@@ -711,6 +728,8 @@ handler_hook(request_rec *r)
         dd_dir_str("WebAuthSSLRedirectPort",
                    apr_psprintf(r->pool, "%lu", sconf->ssl_redirect_port), r);
     }
+    dd_dir_str("WebAuthTokenCacheSize",
+               apr_psprintf(r->pool, "%lu", sconf->token_cache_size), r);
     dd_dir_str("WebAuthTokenMaxTTL",
                apr_psprintf(r->pool, "%lus", sconf->token_max_ttl), r);
     dd_dir_str("WebAuthWebKdcPrincipal", sconf->webkdc_principal, r);
@@ -726,8 +745,11 @@ handler_hook(request_rec *r)
     dt_str("Keyring read check",
            status_check_access(sconf->keyring_path, APR_FOPEN_READ, r), r);
     ap_rputs("<dt><strong>Keyring info:</strong></dt>\n", r);
+    dd_dir_str("reloads",
+               apr_psprintf(r->pool, "%lu", (unsigned long)
+                            apr_atomic_read32(&sconf->keyring_reloads)), r);
 
-    if (sconf->ring == NULL) {
+    if (rc->ring == NULL) {
         ap_rputs("<dd>"
                  "keyring is NULL. This usually indicates a permissions "
                  "problem with the keyring file."
@@ -736,9 +758,9 @@ handler_hook(request_rec *r)
         int i;
         struct webauth_keyring_entry *entry;
 
-        dd_dir_int("num_entries", sconf->ring->entries->nelts, r);
-        for (i = 0; i < sconf->ring->entries->nelts; i++) {
-            entry = &APR_ARRAY_IDX(sconf->ring->entries, i,
+        dd_dir_int("num_entries", rc->ring->entries->nelts, r);
+        for (i = 0; i < rc->ring->entries->nelts; i++) {
+            entry = &APR_ARRAY_IDX(rc->ring->entries, i,
                                    struct webauth_keyring_entry);
             dd_dir_time(apr_psprintf(r->pool, "entry %d creation time", i),
                         entry->creation, r);
@@ -778,6 +800,47 @@ handler_hook(request_rec *r)
         if (st->last_renewal_attempt != 0)
             dd_dir_time("last_renewal_attempt", st->last_renewal_attempt, r);
     }
+    dd_dir_str("refreshes",
+               apr_psprintf(r->pool, "%lu", (unsigned long)
+                            apr_atomic_read32(&sconf->service_token_renewals)),
+               r);
+
+    ap_rputs("<dt><strong>App token cache:</strong></dt>\n", r);
+    if (rc->tokens == NULL)
+        ap_rputs("<dd>disabled</dd>", r);
+    else {
+        dd_dir_str("entries",
+                   apr_psprintf(r->pool, "%lu", (unsigned long)
+                                mwa_token_cache_count(rc->tokens)), r);
+        dd_dir_str("hits",
+                   apr_psprintf(r->pool, "%lu", (unsigned long)
+                                apr_atomic_read32(&sconf->token_cache_hits)),
+                   r);
+        dd_dir_str("misses",
+                   apr_psprintf(r->pool, "%lu", (unsigned long)
+                                apr_atomic_read32(&sconf->token_cache_misses)),
+                   r);
+    }
+
+    ap_rputs("<dt><strong>Credential caches:</strong></dt>\n", r);
+    dd_dir_str("created",
+               apr_psprintf(r->pool, "%lu", (unsigned long)
+                            apr_atomic_read32(&sconf->cred_cache_creates)),
+               r);
+    dd_dir_str("reused",
+               apr_psprintf(r->pool, "%lu", (unsigned long)
+                            apr_atomic_read32(&sconf->cred_cache_reuses)),
+               r);
+
+    mwa_curl_stats(sconf->curl_pool, &curl_stats);
+    ap_rputs("<dt><strong>WebKDC connections:</strong></dt>\n", r);
+    dd_dir_str("handles",
+               apr_psprintf(r->pool, "%lu", curl_stats.handles), r);
+    dd_dir_str("idle", apr_psprintf(r->pool, "%lu", curl_stats.idle), r);
+    dd_dir_str("new",
+               apr_psprintf(r->pool, "%lu", curl_stats.connects), r);
+    dd_dir_str("reused",
+               apr_psprintf(r->pool, "%lu", curl_stats.reuses), r);
 
     ap_rputs("</dl>", r);
     ap_rputs("<hr/>", r);
@@ -870,7 +933,7 @@ make_proxy_cookie(const char *proxy_type,
     pt->session_factors = apr_pstrdup(rc->r->pool, session_factors);
     pt->loa = loa;
     pt->expiration = expiration_time;
-    status = webauth_token_encode(rc->ctx, data, rc->sconf->ring, &token);
+    status = webauth_token_encode(rc->ctx, data, rc->ring, &token);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func,
                               "webauth_token_encode_proxy", subject);
@@ -898,7 +961,7 @@ make_cred_cookie(struct webauth_token_cred *ct, MWA_REQ_CTXT *rc)
         return 0;
     data.type = WA_TOKEN_CRED;
     data.token.cred = *ct;
-    status = webauth_token_encode(rc->ctx, &data, rc->sconf->ring, &token);
+    status = webauth_token_encode(rc->ctx, &data, rc->ring, &token);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func,
                               "webauth_token_encode_cred", ct->subject);
@@ -955,7 +1018,7 @@ make_app_cookie(const char *subject,
     app->loa = loa;
     app->creation = creation_time;
     app->expiration = expiration_time;
-    status = webauth_token_encode(rc->ctx, data, rc->sconf->ring, &token);
+    status = webauth_token_encode(rc->ctx, data, rc->ring, &token);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func,
                               "webauth_token_encode_app", subject);
@@ -1019,32 +1082,64 @@ app_token_maint(MWA_REQ_CTXT *rc)
 
 
 /*
- * parse an app-token, store in rc->at.
- * return 0 on failure, 1 on success
+ * decode an app-token with the current keyring.
+ * return the token on success, NULL on failure.
  */
-static int
-parse_app_token(char *token, MWA_REQ_CTXT *rc)
+static struct webauth_token_app *
+decode_app_token(const char *token, MWA_REQ_CTXT *rc)
 {
     const char *mwa_func = "parse_app_token";
     int status;
     struct webauth_token *app;
 
-    if (!ensure_keyring_loaded(rc))
-        return 0;
-    ap_unescape_url(token);
     status = webauth_token_decode(rc->ctx, WA_TOKEN_APP, token,
-                                  rc->sconf->ring, &app);
+                                  rc->ring, &app);
     if (status == WA_ERR_TOKEN_EXPIRED) {
         ap_log_error(APLOG_MARK, APLOG_INFO, 0, rc->r->server,
                      "mod_webauth: user credentials (from %s cookie) have"
                      " expired", app_cookie_name());
-        return 0;
+        return NULL;
     } else if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func, "webauth_token_decode",
                               NULL);
+        return NULL;
+    }
+    return &app->token.app;
+}
+
+
+/*
+ * parse an app-token, store in rc->at.
+ * return 0 on failure, 1 on success
+ */
+static int
+parse_app_token(char *token, MWA_REQ_CTXT *rc)
+{
+    int status;
+
+    if (!ensure_keyring_loaded(rc))
         return 0;
+    ap_unescape_url(token);
+
+    /*
+     * If we've already decoded this token with the current keyring, use that
+     * copy.  Otherwise, decode it and remember the result.
+     */
+    rc->at = NULL;
+    if (rc->tokens != NULL) {
+        rc->at = mwa_token_cache_get(rc->tokens, token, rc->r->pool);
+        if (rc->at != NULL)
+            apr_atomic_inc32(&rc->sconf->token_cache_hits);
+        else
+            apr_atomic_inc32(&rc->sconf->token_cache_misses);
+    }
+    if (rc->at == NULL) {
+        rc->at = decode_app_token(token, rc);
+        if (rc->at == NULL)
+            return 0;
+        if (rc->tokens != NULL)
+            mwa_token_cache_set(rc->tokens, token, rc->at);
     }
-    rc->at = &app->token.app;
 
     /*
      * Update last-use-time and check inactivity.  If we can't use the app
@@ -1101,7 +1196,7 @@ parse_proxy_token(char *token, MWA_REQ_CTXT *rc)
         return 0;
     ap_unescape_url(token);
     status = webauth_token_decode(rc->ctx, WA_TOKEN_PROXY, token,
-                                  rc->sconf->ring, &pt);
+                                  rc->ring, &pt);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func, "webauth_token_decode",
                               NULL);
@@ -1157,7 +1252,7 @@ get_session_key(char *token, MWA_REQ_CTXT *rc)
     if (!ensure_keyring_loaded(rc))
         return NULL;
     status = webauth_token_decode(rc->ctx, WA_TOKEN_APP, token,
-                                  rc->sconf->ring, &data);
+                                  rc->ring, &data);
     if (status != WA_ERR_NONE) {
         mwa_log_webauth_error(rc, status, mwa_func, "webauth_token_decode",
                               NULL);
@@ -1683,7 +1778,7 @@ parse_cred_token_cookie(MWA_REQ_CTXT *rc, MWA_WACRED *cred)
     if (cval == NULL)
         return 0;
 
-    ct =  mwa_parse_cred_token(cval, rc->sconf->ring, NULL, rc);
+    ct =  mwa_parse_cred_token(cval, rc->ring, NULL, rc);
 
     if (ct == NULL) {
         /* we coudn't use the cookie, lets set it up to be nuked */
@@ -1741,38 +1836,50 @@ prepare_creds(MWA_REQ_CTXT *rc, char *proxy_type, apr_array_header_t *creds)
 
 
 /*
- * acquire all the creds of the specified proxy_type. this
- * means making requests to the webkdc. If we don't have
- * the specified proxy_type, we'll need to do a redirect to
- * get it.
+ * acquire all the creds of the specified proxy types. this
+ * means making requests to the webkdc, one per proxy type, all
+ * sent at once. If we don't have one of the proxy types, we'll
+ * need to do a redirect to get it, so check for all of them
+ * before talking to the webkdc.
  */
 static int
-acquire_creds(MWA_REQ_CTXT *rc, char *proxy_type,
+acquire_creds(MWA_REQ_CTXT *rc, apr_array_header_t *proxy_types,
               apr_array_header_t *needed_creds,
               apr_array_header_t **acquired_creds)
 {
     const char *mwa_func = "acquire_creds";
-    struct webauth_token_proxy *pt = NULL;
+    struct webauth_token_proxy *pt, **npt;
+    apr_array_header_t *proxies; /* (webauth_token_proxy *) */
+    char *proxy_type;
+    int i;
 
-    if (rc->sconf->debug) {
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
-                     "mod_webauth: %s: need this proxy type: (%s)",
-                     mwa_func, proxy_type);
-    }
+    proxies = apr_array_make(rc->r->pool, proxy_types->nelts,
+                             sizeof(struct webauth_token_proxy *));
+    for (i = 0; i < proxy_types->nelts; i++) {
+        proxy_type = APR_ARRAY_IDX(proxy_types, i, char *);
+        if (rc->sconf->debug) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+                         "mod_webauth: %s: need this proxy type: (%s)",
+                         mwa_func, proxy_type);
+        }
 
-    if (rc->pt && strcmp(rc->pt->type, proxy_type) == 0) {
-        pt = rc->pt;
-    } else {
-        pt = parse_proxy_token_cookie(rc, proxy_type);
-    }
+        if (rc->pt && strcmp(rc->pt->type, proxy_type) == 0) {
+            pt = rc->pt;
+        } else {
+            pt = parse_proxy_token_cookie(rc, proxy_type);
+        }
 
-    /* if we don't have the proxy type then redirect! */
-    if (pt == NULL) {
-        rc->needed_proxy_type = proxy_type;
-        return redirect_request_token(rc);
+        /* if we don't have the proxy type then redirect! */
+        if (pt == NULL) {
+            rc->needed_proxy_type = proxy_type;
+            return redirect_request_token(rc);
+        }
+        npt = apr_array_push(proxies);
+        *npt = pt;
     }
 
-    if (!mwa_get_creds_from_webkdc(rc, pt, needed_creds, acquired_creds)) {
+    if (!mwa_get_creds_from_webkdc(rc, proxies, needed_creds,
+                                   acquired_creds)) {
 
         /* FIXME: what do we want to do here? mwa_get_creds_from_webkdc
            will log any errors. We could either cause a failure_redirect
@@ -1786,17 +1893,18 @@ acquire_creds(MWA_REQ_CTXT *rc, char *proxy_type,
                          "mod_webauth: %s: mwa_get_creds_from_webkdc failed!",
                          mwa_func);
         }
-    } else {
-        /* need to construct new cookies for newly gathered creds */
-        if (*acquired_creds != NULL) {
-            struct webauth_token_cred *cred;
-            size_t i;
-
-            for (i = 0; i < (size_t) (*acquired_creds)->nelts; i++) {
-                cred = APR_ARRAY_IDX(*acquired_creds, i,
-                                     struct webauth_token_cred *);
-                make_cred_cookie(cred, rc);
-            }
+    }
+
+    /* need to construct new cookies for newly gathered creds, including
+       any we got from the requests that succeeded if some failed */
+    if (*acquired_creds != NULL) {
+        struct webauth_token_cred *cred;
+        size_t j;
+
+        for (j = 0; j < (size_t) (*acquired_creds)->nelts; j++) {
+            cred = APR_ARRAY_IDX(*acquired_creds, j,
+                                 struct webauth_token_cred *);
+            make_cred_cookie(cred, rc);
         }
     }
 
@@ -1856,18 +1964,13 @@ gather_creds(MWA_REQ_CTXT *rc)
         }
     }
 
-    /* now, for each proxy type that has needed credentials,
-       try and acquire them from the webkdc. */
+    /* now try and acquire the needed credentials of all the proxy
+       types from the webkdc at once. */
     if (needed_proxy_types != NULL) {
-        char *proxy;
-
-        /* foreach proxy type, attempt to acquire the needed creds */
-        for (i = 0; i < needed_proxy_types->nelts; i++) {
-            proxy = APR_ARRAY_IDX(needed_proxy_types, i, char *);
-            code = acquire_creds(rc, proxy, needed_creds, &acquired_creds);
-            if (code != OK)
-                return code;
-        }
+        code = acquire_creds(rc, needed_proxy_types, needed_creds,
+                             &acquired_creds);
+        if (code != OK)
+            return code;
     }
 
     if (gathered_creds != NULL || acquired_creds != NULL) {
@@ -1957,8 +2060,8 @@ gather_tokens(MWA_REQ_CTXT *rc)
                       " %lu, want %lu)", rc->at->loa, rc->dconf->loa);
         return redirect_request_token(rc);
     }
-    if (rc->dconf->initial_factors != NULL) {
-        want = webauth_factors_new(rc->ctx, rc->dconf->initial_factors);
+    if (rc->dconf->initial_wanted != NULL) {
+        want = rc->dconf->initial_wanted;
         if (rc->at->initial_factors == NULL) {
             ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, rc->r,
                           "mod_webauth: initial authentication factors"
@@ -1976,8 +2079,8 @@ gather_tokens(MWA_REQ_CTXT *rc)
             return redirect_request_token(rc);
         }
     }
-    if (rc->dconf->session_factors != NULL) {
-        want = webauth_factors_new(rc->ctx, rc->dconf->session_factors);
+    if (rc->dconf->session_wanted != NULL) {
+        want = rc->dconf->session_wanted;
         if (rc->at->session_factors == NULL) {
             ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, rc->r,
                           "mod_webauth: session authentication factors"
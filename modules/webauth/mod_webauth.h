@@ -14,22 +14,54 @@
 #include <config-mod.h>
 #include <portable/stdbool.h>
 
+#include <apr_atomic.h>         /* apr_uint32_t */
 #include <apr_pools.h>          /* apr_pool_t */
 #include <apr_tables.h>         /* apr_array_header_t */
+#include <apr_thread_cond.h>    /* apr_thread_cond_t */
+#include <apr_thread_mutex.h>   /* apr_thread_mutex_t */
+#include <curl/curl.h>          /* CURL */
 #include <httpd.h>              /* server_rec and request_rec */
 #include <sys/types.h>          /* size_t, etc. */
 
+#include <modules/snapshot.h>
 #include <webauth/keys.h>
 #include <webauth/tokens.h>
 
 /* Command table provided by the configuration handling code. */
 extern const command_rec webauth_cmds[];
 
+/* Pool of cURL handles for talking to the WebKDC, defined in curl.c. */
+struct mwa_curl_pool;
+
+/* Cache of decoded app tokens, defined in cache.c. */
+struct mwa_token_cache;
+
+/* Statistics about the pool of cURL handles. */
+struct mwa_curl_stats {
+    unsigned long handles;      /* Number of handles created. */
+    unsigned long idle;         /* Number of handles not in use. */
+    unsigned long connects;     /* Requests that opened a new connection. */
+    unsigned long reuses;       /* Requests that reused a connection. */
+};
+
 /* how long to wait between trying for a new token when
  * a renewal attempt fails
  */
 #define TOKEN_RETRY_INTERVAL 600
 
+/* how often to check whether the keyring file has changed on disk */
+#define KEYRING_CHECK_INTERVAL 60
+
+/*
+ * Prefix for the names of reusable credential caches and of temporary files
+ * in WebAuthCredCacheDir, how often to remove expired credential caches, and
+ * how long after expiration (or creation, for temporary files) to keep them.
+ */
+#define CRED_CACHE_PREFIX "krb5cc_webauth_"
+#define CRED_CACHE_TEMP "temp.krb5."
+#define CRED_CACHE_REAP_INTERVAL 300
+#define CRED_CACHE_GRACE 3600
+
 /*
  * how long into the tokens lifetime do we attempt our first revnewal
  */
@@ -75,6 +107,27 @@ typedef struct {
     size_t app_state_len;
 } MWA_SERVICE_TOKEN;
 
+/*
+ * The current service token, published in the server configuration as a
+ * snapshot (see modules/snapshot.h) so that requests can use it without
+ * locking.  The token is allocated from the snapshot pool and is never
+ * modified after publication.
+ */
+struct mwa_service_token_snapshot {
+    struct mod_snapshot snapshot;
+    MWA_SERVICE_TOKEN *token;
+};
+
+/*
+ * A loaded keyring, published in the server configuration as a snapshot (see
+ * modules/snapshot.h) and never modified after publication.
+ */
+struct mwa_keyring_snapshot {
+    struct mod_snapshot snapshot;
+    struct webauth_keyring *ring;
+    struct mwa_token_cache *tokens;     /* App tokens decoded with ring. */
+};
+
 /*
  * Server configuration.  For parameters where there's no obvious designated
  * value for when the directive hasn't been set, there's a corresponding _set
@@ -98,6 +151,7 @@ struct server_config {
     unsigned long ssl_redirect_port;
     bool strip_url;
     const char *subject_auth_type;
+    unsigned long token_cache_size;
     unsigned long token_max_ttl;
     bool trust_authz_identity;
     bool webkdc_cert_check;
@@ -116,6 +170,7 @@ struct server_config {
     bool ssl_redirect_port_set;
     bool strip_url_set;
     bool subject_auth_type_set;
+    bool token_cache_size_set;
     bool token_max_ttl_set;
     bool trust_authz_identity_set;
     bool webkdc_cert_check_set;
@@ -126,8 +181,44 @@ struct server_config {
      * to be reset when the module is reloaded, so we store them here.
      */
     struct webauth_context *ctx;
-    struct webauth_keyring *ring;
-    MWA_SERVICE_TOKEN *service_token;
+
+    /*
+     * The current keyring (struct mwa_keyring_snapshot) and the number of
+     * times the keyring has been reloaded since it was first loaded, which is
+     * updated atomically.
+     */
+    struct mod_snapshot_slot keyring;
+    volatile apr_uint32_t keyring_reloads;
+
+    /*
+     * Number of app token cookies found in and missing from the app token
+     * cache of the current keyring snapshot.  Updated atomically.
+     */
+    volatile apr_uint32_t token_cache_hits;
+    volatile apr_uint32_t token_cache_misses;
+
+    /*
+     * The current service token (struct mwa_service_token_snapshot).  Only
+     * one thread at a time refreshes it from the cache file or the WebKDC,
+     * and threads with no usable service token wait on the condition
+     * variable, with mutex, for that refresh to finish.  The number of
+     * refreshes is updated atomically.
+     */
+    struct mod_snapshot_slot service_token;
+    apr_thread_cond_t *service_token_cond;
+    volatile apr_uint32_t service_token_renewals;
+
+    /*
+     * Time (in seconds) after which the next request using credentials
+     * should remove expired credential caches, and the number of credential
+     * caches created and reused.  Updated atomically.
+     */
+    volatile apr_uint32_t cred_cache_next_reap;
+    volatile apr_uint32_t cred_cache_creates;
+    volatile apr_uint32_t cred_cache_reuses;
+
+    /* Reusable cURL handles, and their connections, for the WebKDC. */
+    struct mwa_curl_pool *curl_pool;
 
     /* Mutex to hold when modifying the server configuration. */
     apr_thread_mutex_t *mutex;
@@ -156,6 +247,8 @@ struct dir_config {
     apr_array_header_t *creds;           /* Array of MWA_WACRED */
     apr_array_header_t *initial_factors; /* Array of const char * */
     apr_array_header_t *session_factors; /* Array of const char * */
+    struct webauth_factors *initial_wanted;  /* Compiled initial_factors */
+    struct webauth_factors *session_wanted;  /* Compiled session_factors */
 
 #ifndef NO_STANFORD_SUPPORT
     char *su_authgroups;
@@ -185,6 +278,8 @@ typedef struct {
     struct server_config *sconf;
     struct dir_config *dconf;
     struct webauth_context *ctx;
+    struct webauth_keyring *ring; /* set by ensure_keyring_loaded */
+    struct mwa_token_cache *tokens; /* set by ensure_keyring_loaded */
     struct webauth_token_app *at;
     char *needed_proxy_type; /* set if we are redirecting for a proxy-token */
     struct webauth_token_proxy *pt; /* proxy-token that came from URL */
@@ -223,6 +318,28 @@ typedef struct {
 } MWA_CRED_INTERFACE;
 
 
+/* cache.c */
+
+/* Create an empty cache of at most the given number of app tokens. */
+apr_status_t mwa_token_cache_create(struct mwa_token_cache **, size_t max,
+                                    apr_pool_t *);
+
+/*
+ * Look up an app token by its encoded form, returning a copy of the decoded
+ * token allocated from the pool, or NULL if it isn't cached or has expired.
+ */
+struct webauth_token_app *mwa_token_cache_get(struct mwa_token_cache *,
+                                              const char *token,
+                                              apr_pool_t *);
+
+/* Store a decoded and validated app token under its encoded form. */
+void mwa_token_cache_set(struct mwa_token_cache *, const char *token,
+                         const struct webauth_token_app *);
+
+/* Return the number of tokens in the cache. */
+size_t mwa_token_cache_count(struct mwa_token_cache *);
+
+
 /* config.c */
 
 /* Create a new server or directory configuration, used in the module hooks. */
@@ -237,6 +354,27 @@ void *mwa_server_config_merge(apr_pool_t *, void *, void *);
 void mwa_config_init(server_rec *, struct server_config *, apr_pool_t *);
 
 
+/* curl.c */
+
+/* Create an empty pool of cURL handles. */
+apr_status_t mwa_curl_pool_create(struct mwa_curl_pool **, apr_pool_t *);
+
+/*
+ * Check out a cURL handle with the options common to all WebKDC requests
+ * set, creating one if necessary.  Returns NULL on failure.
+ */
+CURL *mwa_curl_checkout(struct mwa_curl_pool *);
+
+/*
+ * Return a cURL handle to the pool after a request, keeping it and its
+ * connection for reuse only if the request succeeded.
+ */
+void mwa_curl_checkin(struct mwa_curl_pool *, CURL *, bool success);
+
+/* Return statistics about connection reuse by the pool. */
+void mwa_curl_stats(struct mwa_curl_pool *, struct mwa_curl_stats *);
+
+
 /* webkdc.c */
 
 MWA_SERVICE_TOKEN *
@@ -247,7 +385,7 @@ mwa_get_service_token(server_rec *server,
 
 int
 mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
-                          struct webauth_token_proxy *pt,
+                          apr_array_header_t *proxies,
                           apr_array_header_t *needed_creds,
                           apr_array_header_t **acquired_creds);
 
@@ -294,11 +432,31 @@ mwa_log_webauth_error(MWA_REQ_CTXT *rc, int status, const char *mwa_func,
                       const char *func, const char *extra);
 
 /*
- * this should only be called in the ensure_keyring_loaded routine
+ * Load the keyring from disk, updating it if configured to do so, and publish
+ * it as the current keyring snapshot.  Must be called with sconf->mutex held
+ * so that only one thread loads the keyring at a time.
  */
 int
 mwa_cache_keyring(server_rec *serv, struct server_config *sconf);
 
+/*
+ * Return the current keyring snapshot without locking, holding a reference
+ * to it that is released when the given pool is cleared or destroyed.
+ * Returns NULL if no keyring has been loaded yet.
+ */
+struct mwa_keyring_snapshot *
+mwa_keyring_acquire(struct server_config *sconf, apr_pool_t *pool);
+
+/*
+ * Reload the keyring if the file has changed on disk since it was loaded, or
+ * if it needs a new key and automatic updates are enabled.  Only one request
+ * every KEYRING_CHECK_INTERVAL seconds does the check; for all others this
+ * returns immediately without a system call or lock.
+ */
+void
+mwa_keyring_check(server_rec *serv, struct server_config *sconf,
+                  apr_pool_t *pool);
+
 /*
  * get all cookies that start with webauth_
  */
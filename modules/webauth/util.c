@@ -13,6 +13,8 @@
 #include <portable/apr.h>
 #include <portable/stdbool.h>
 
+#include <apr_atomic.h>
+
 #include <modules/webauth/mod_webauth.h>
 #include <webauth/basic.h>
 #include <webauth/keys.h>
@@ -160,27 +162,93 @@ mwa_log_webauth_error(MWA_REQ_CTXT *rc, int status, const char *mwa_func,
 }
 
 
+/*
+ * Take a reference to the current keyring snapshot.  This never blocks.
+ */
+struct mwa_keyring_snapshot *
+mwa_keyring_acquire(struct server_config *sconf, apr_pool_t *pool)
+{
+    return mod_snapshot_acquire(&sconf->keyring, pool);
+}
+
+
+/*
+ * Check whether the keyring needs to be reloaded.  Only one thread per
+ * interval does the check, and the mutex is only taken if a reload is
+ * actually needed.  Other threads keep using the current snapshot while we
+ * reload.
+ */
+void
+mwa_keyring_check(server_rec *serv, struct server_config *sconf,
+                  apr_pool_t *pool)
+{
+    struct mwa_keyring_snapshot *snapshot;
+    unsigned long lifetime;
+
+    if (!mod_snapshot_check_due(&sconf->keyring, KEYRING_CHECK_INTERVAL))
+        return;
+    snapshot = mwa_keyring_acquire(sconf, pool);
+    if (snapshot == NULL)
+        return;
+    lifetime = sconf->keyring_auto_update ? sconf->keyring_key_lifetime : 0;
+    if (!mod_keyring_changed(&snapshot->snapshot, snapshot->ring,
+                             sconf->keyring_path, lifetime, pool))
+        return;
+
+    apr_thread_mutex_lock(sconf->mutex);
+    if (mwa_cache_keyring(serv, sconf) == WA_ERR_NONE) {
+        apr_atomic_inc32(&sconf->keyring_reloads);
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, serv,
+                     "mod_webauth: reloaded changed key ring: %s",
+                     sconf->keyring_path);
+    }
+    apr_thread_mutex_unlock(sconf->mutex);
+}
+
+
 int
 mwa_cache_keyring(server_rec *serv, struct server_config *sconf)
 {
     int status;
     enum webauth_kau_status kau_status;
     int update_status;
+    apr_pool_t *pool;
+    struct webauth_context *ctx;
+    struct webauth_keyring *ring;
+    struct mwa_keyring_snapshot *snapshot;
+
+    /*
+     * Each snapshot gets its own pool, not a child of any request or server
+     * pool, so that it can be freed when the last request using it is done.
+     */
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        return WA_ERR_APR;
+    status = webauth_context_init_apr(&ctx, pool);
+    if (status != WA_ERR_NONE) {
+        apr_pool_destroy(pool);
+        return status;
+    }
 
-    status = webauth_keyring_auto_update(sconf->ctx, sconf->keyring_path,
+    /*
+     * Stat the file before reading it so that if it changes while we're
+     * reading it, the next check will notice.
+     */
+    snapshot = apr_pcalloc(pool, sizeof(struct mwa_keyring_snapshot));
+    mod_snapshot_init(&snapshot->snapshot, pool, sconf->keyring_path);
+    status = webauth_keyring_auto_update(ctx, sconf->keyring_path,
                  sconf->keyring_auto_update,
                  sconf->keyring_auto_update ? sconf->keyring_key_lifetime : 0,
-                 &sconf->ring, &kau_status, &update_status);
+                 &ring, &kau_status, &update_status);
     if (status != WA_ERR_NONE)
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, serv,
                      "mod_webauth: opening keyring %s failed: %s",
                      sconf->keyring_path,
-                     webauth_error_message(sconf->ctx, status));
+                     webauth_error_message(ctx, status));
     if (kau_status == WA_KAU_UPDATE && update_status != WA_ERR_NONE)
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, serv,
                      "mod_webauth: updating keyring %s failed: %s",
                      sconf->keyring_path,
-                     webauth_error_message(sconf->ctx, update_status));
+                     webauth_error_message(ctx, update_status));
 
     if (sconf->debug) {
         const char *msg;
@@ -197,6 +265,33 @@ mwa_cache_keyring(server_rec *serv, struct server_config *sconf)
                      "mod_webauth: %s key ring: %s", msg, sconf->keyring_path);
     }
 
+    /* Publish the new keyring, or throw it away on failure. */
+    if (status != WA_ERR_NONE) {
+        apr_pool_destroy(pool);
+        return status;
+    }
+    snapshot->ring = ring;
+    if (kau_status != WA_KAU_NONE)
+        mod_snapshot_init(&snapshot->snapshot, pool, sconf->keyring_path);
+
+    /*
+     * Each keyring gets its own empty app token cache, so tokens decoded
+     * with a previous keyring are never used.  Caching is an optimization,
+     * so carry on without it if the cache can't be created.
+     */
+    if (sconf->token_cache_size > 0) {
+        apr_status_t code;
+
+        code = mwa_token_cache_create(&snapshot->tokens,
+                                      sconf->token_cache_size, pool);
+        if (code != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, code, serv,
+                         "mod_webauth: cannot create app token cache");
+            snapshot->tokens = NULL;
+        }
+    }
+    mod_snapshot_publish(&sconf->keyring, &snapshot->snapshot,
+                         KEYRING_CHECK_INTERVAL);
     return status;
 }
 
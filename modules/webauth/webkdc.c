@@ -13,7 +13,10 @@
 #include <portable/apr.h>
 #include <portable/stdbool.h>
 
+#include <apr_allocator.h>
+#include <apr_atomic.h>
 #include <apr_base64.h>
+#include <apr_thread_proc.h>
 #include <apr_xml.h>
 #include <curl/curl.h>
 
@@ -247,22 +250,18 @@ post_to_webkdc(char *post_data, size_t post_data_len,
     if (post_data_len == 0)
         post_data_len = strlen(post_data);
 
-    curl = curl_easy_init();
-
+    /*
+     * Reuse a handle, and with it the connection to the WebKDC, if possible.
+     * The pool has already set the options common to all requests.
+     */
+    curl = mwa_curl_checkout(sconf->curl_pool);
     if (curl == NULL) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
-                     "mod_webauth: post_to_webkdc: curl_easy_init failed");
+                     "mod_webauth: post_to_webkdc: cannot get cURL handle");
         return NULL;
     }
 
     curl_easy_setopt(curl, CURLOPT_URL, sconf->webkdc_url);
-    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
-#ifdef CURLOPT_NOSIGNAL
-    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-    /* FIXME: probably need directives for these */
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 45);
-#endif
     curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_error_buff);
 
     if (sconf->webkdc_cert_file) {
@@ -296,6 +295,8 @@ post_to_webkdc(char *post_data, size_t post_data_len,
     curl_error_buff[0] = '\0';
     code = curl_easy_perform(curl); /* post away! */
 
+    /* Return the handle first, since it points to the header list. */
+    mwa_curl_checkin(sconf->curl_pool, curl, code == CURLE_OK);
     curl_slist_free_all(headers); /* free the header list */
 
     if (code != CURLE_OK) {
@@ -308,7 +309,6 @@ post_to_webkdc(char *post_data, size_t post_data_len,
     if (string.data) {
         string.data[string.size] = '\0';
     }
-    curl_easy_cleanup(curl);
     return string.data;
 }
 
@@ -551,14 +551,17 @@ request_service_token(struct webauth_context *ctx, server_rec *server,
  */
 static void
 set_app_state(struct webauth_context *ctx, server_rec *server,
-              struct server_config *sconf, MWA_SERVICE_TOKEN *token)
+              struct server_config *sconf, MWA_SERVICE_TOKEN *token,
+              apr_pool_t *pool)
 {
     struct webauth_token app;
+    struct mwa_keyring_snapshot *keyring;
     int status;
     const void *as;
     size_t length;
 
-    if (sconf->ring == NULL) {
+    keyring = mwa_keyring_acquire(sconf, pool);
+    if (keyring == NULL) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, server, "mod_webauth: cannot"
                      " create application state: no keyring available");
         return;
@@ -570,7 +573,8 @@ set_app_state(struct webauth_context *ctx, server_rec *server,
     app.token.app.session_key = token->key.data;
     app.token.app.session_key_len = token->key.length;
     app.token.app.expiration = token->expires;
-    status = webauth_token_encode_raw(ctx, &app, sconf->ring, &as, &length);
+    status = webauth_token_encode_raw(ctx, &app, keyring->ring, &as,
+                                      &length);
     if (status != WA_ERR_NONE)
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, server,
                      "mod_webauth: cannot encode state token: %s",
@@ -584,20 +588,22 @@ set_app_state(struct webauth_context *ctx, server_rec *server,
 
 
 /*
- * create a pool for the service token and copy the new
- * token into it. If the old_service_token is set, then destroy
- * its pool.
+ * Publish a new in-memory service token, copying it into a new snapshot
+ * pool.  The previous token is freed once the last request using it
+ * finishes.  Only called by the thread that claimed the refresh.
  */
 static void
 set_service_token(MWA_SERVICE_TOKEN *new_token,
                   struct server_config *sconf)
 {
     apr_pool_t *p;
+    struct mwa_service_token_snapshot *snapshot;
 
-    if (sconf->service_token)
-        apr_pool_destroy(sconf->service_token->pool);
     apr_pool_create(&p, NULL);
-    sconf->service_token = copy_service_token(p, new_token);
+    snapshot = apr_pcalloc(p, sizeof(struct mwa_service_token_snapshot));
+    mod_snapshot_init(&snapshot->snapshot, p, NULL);
+    snapshot->token = copy_service_token(p, new_token);
+    mod_snapshot_publish(&sconf->service_token, &snapshot->snapshot, 0);
     if (sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, NULL,
                      "mod_webauth: setting service token");
@@ -606,6 +612,37 @@ set_service_token(MWA_SERVICE_TOKEN *new_token,
 }
 
 
+/*
+ * Return the in-memory service token, or NULL if there isn't one yet.  This
+ * never blocks.  The token is shared with other requests and must not be
+ * modified, but it stays valid until the pool is cleared.
+ */
+static MWA_SERVICE_TOKEN *
+current_service_token(struct server_config *sconf, apr_pool_t *pool)
+{
+    struct mwa_service_token_snapshot *snapshot;
+
+    snapshot = mod_snapshot_acquire(&sconf->service_token, pool);
+    if (snapshot == NULL)
+        return NULL;
+    return snapshot->token;
+}
+
+
+/*
+ * Install a new service token as the in-memory token after a successful
+ * refresh.
+ */
+static void
+install_service_token(struct webauth_context *ctx, server_rec *server,
+                      struct server_config *sconf, MWA_SERVICE_TOKEN *token,
+                      apr_pool_t *pool)
+{
+    set_app_state(ctx, server, sconf, token, pool);
+    set_service_token(token, sconf);
+}
+
+
 /*
  * this function returns a service-token to use.
  *
@@ -616,6 +653,11 @@ set_service_token(MWA_SERVICE_TOKEN *new_token,
  * to request a new one while the current one is still active but nearing
  * expiration.
  *
+ * The in-memory token is read without locking.  Only one thread at a time
+ * refreshes it, and while the refresh is in progress other threads keep
+ * using the current token as long as it hasn't expired.  Only threads that
+ * have no usable token at all take sconf->mutex to wait for the refresh to
+ * finish.
  */
 MWA_SERVICE_TOKEN *
 mwa_get_service_token(server_rec *server, struct server_config *sconf,
@@ -623,28 +665,47 @@ mwa_get_service_token(server_rec *server, struct server_config *sconf,
 {
     struct webauth_context *ctx;
     MWA_SERVICE_TOKEN *token;
+    MWA_SERVICE_TOKEN *old;
     time_t curr = time(NULL);
     static const char *mwa_func = "mwa_get_service_token";
 
-    apr_thread_mutex_lock(sconf->mutex); /****** LOCKING! ************/
+    token = current_service_token(sconf, pool);
+    if (token != NULL && token->next_renewal_attempt > curr)
+        goto cached;
+    if (!mod_snapshot_renew_begin(&sconf->service_token)) {
+        if (token != NULL && token->expires > curr)
+            goto cached;
+        mod_snapshot_renew_wait(&sconf->service_token, sconf->mutex,
+                                sconf->service_token_cond);
+        token = current_service_token(sconf, pool);
+        if (token != NULL && token->next_renewal_attempt > time(NULL))
+            goto cached;
+
+        /*
+         * We waited on another thread's refresh and it failed, so don't
+         * immediately retry the WebKDC ourselves.  The next request after
+         * the retry interval will try again.
+         */
+        token = NULL;
+        goto done;
+    }
+
+    /*
+     * We're the refresher.  Another thread may have finished a refresh
+     * between our check and our claim, in which case there's nothing to do.
+     * Otherwise, remember the current token, if any, so that we can keep
+     * using it if it's still valid but renewal fails.
+     */
+    old = current_service_token(sconf, pool);
+    if (old != NULL && old->next_renewal_attempt > curr) {
+        token = old;
+        goto finish;
+    }
+    apr_atomic_inc32(&sconf->service_token_renewals);
 
     /* FIXME: Eventually this should be passed around everywhere. */
     webauth_context_init_apr(&ctx, pool);
 
-    if (sconf->service_token != NULL) {
-        /* return the current one, unless we should attempt a renewal */
-        if (sconf->service_token->next_renewal_attempt > curr) {
-            token = copy_service_token(pool, sconf->service_token);
-            if (sconf->debug) {
-                ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
-                             "mod_webauth: %s: using cached service token",
-                             mwa_func);
-            }
-            goto done;
-        }
-        /* else lets force a re-read, and maybe force a re-request */
-    }
-
     /* check file first to see if there is a (newer) token */
     token = read_service_token_cache(server, sconf, pool);
 
@@ -662,16 +723,14 @@ mwa_get_service_token(server_rec *server, struct server_config *sconf,
         if (token->next_renewal_attempt > curr) {
             /* app state is generated on read so it always uses
                the current keying */
-            set_app_state(ctx, server, sconf, token);
-            /* copy into its own pool for future use */
-            set_service_token(token, sconf);
-            goto done;
+            install_service_token(ctx, server, sconf, token, pool);
+            goto finish;
         }
     }
 
     /* still no token, or we are renewing our current one */
     if (local_cache_only)
-        goto done;
+        goto finish;
 
     token = request_service_token(ctx, server, sconf, pool, curr);
 
@@ -683,15 +742,18 @@ mwa_get_service_token(server_rec *server, struct server_config *sconf,
                      mwa_func);
 
         /* couldn't get a new one, lets update renewal_attempt times
-         * if we have a current token.
+         * if we have a current token, and keep using it while it's
+         * still valid.  The published token can't be modified, so
+         * publish a copy with the new times.
          */
-        if (sconf->service_token != NULL) {
-
-            /* update {last,next}_renewal_attempt */
-            sconf->service_token->last_renewal_attempt = curr;
-            sconf->service_token->next_renewal_attempt =
-                curr+TOKEN_RETRY_INTERVAL;
-            write_service_token_cache(server, sconf, sconf->service_token);
+        if (old != NULL) {
+            token = copy_service_token(pool, old);
+            token->last_renewal_attempt = curr;
+            token->next_renewal_attempt = curr + TOKEN_RETRY_INTERVAL;
+            set_service_token(token, sconf);
+            write_service_token_cache(server, sconf, token);
+            if (token->expires <= curr)
+                token = NULL;
         }
     } else {
 
@@ -703,20 +765,27 @@ mwa_get_service_token(server_rec *server, struct server_config *sconf,
 
         /* got a new one, lets right it out*/
         write_service_token_cache(server, sconf, token);
-        set_app_state(ctx, server, sconf, token);
-        set_service_token(token, sconf);
-        goto done;
+        install_service_token(ctx, server, sconf, token, pool);
     }
 
-done:
-    apr_thread_mutex_unlock(sconf->mutex); /****** UNLOCKING! ************/
+finish:
+    mod_snapshot_renew_end(&sconf->service_token, sconf->mutex,
+                           sconf->service_token_cond);
 
+done:
     if (token == NULL && !local_cache_only) {
         /* really complain! */
         ap_log_error(APLOG_MARK, APLOG_EMERG, 0, server,
                      "mod_webauth: mwa_get_service_token FAILD!!");
     }
     return token;
+
+cached:
+    if (sconf->debug)
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, server,
+                     "mod_webauth: %s: using cached service token",
+                     mwa_func);
+    return token;
 }
 
 
@@ -827,35 +896,21 @@ parse_get_creds_response(apr_xml_doc *xd,
 
 
 /*
- * request a service token from the WebKDC
+ * Build a getTokensRequest for all of the needed credentials of the type of
+ * the given proxy token, using that proxy token as the subject credential.
+ * Returns NULL if there are no such credentials or the request token could
+ * not be created.
  */
-int
-mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
-                          struct webauth_token_proxy *pt,
-                          apr_array_header_t *needed_creds,
-                          apr_array_header_t **acquired_creds)
+static char *
+make_get_creds_request(MWA_REQ_CTXT *rc, MWA_SERVICE_TOKEN *st,
+                       struct webauth_token_proxy *pt,
+                       apr_array_header_t *needed_creds)
 {
-    apr_xml_parser *xp;
-    apr_xml_doc *xd;
-    char *xml_request, *xml_response, *b64_pt;
+    char *b64_pt;
     size_t i;
-    static const char *mwa_func = "mwa_get_creds_from_webkdc";
-    apr_status_t astatus;
-    MWA_SERVICE_TOKEN *st;
     MWA_STRING cred_tokens;
     const char *request_token;
 
-    /* get service token first */
-    st = mwa_get_service_token(rc->r->server, rc->sconf, rc->r->pool, 0);
-
-    if (st == NULL)
-        return 0;
-
-    /* make a new request-token */
-    request_token = make_request_token(rc, st, "getTokensRequest");
-    if (request_token == NULL)
-        return 0;
-
     /* now build up all the cred tokens we need */
     init_string(&cred_tokens, rc->r->pool);
 
@@ -864,6 +919,8 @@ mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
         char *id = apr_psprintf(rc->r->pool, "%lu", (unsigned long) i);
 
         cred = &APR_ARRAY_IDX(needed_creds, i, MWA_WACRED);
+        if (strcmp(cred->type, pt->type) != 0)
+            continue;
         append_string(&cred_tokens,
                       apr_pstrcat(rc->r->pool,
                                   "<token type='cred' id='",id,"'>",
@@ -879,6 +936,13 @@ mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
                                   NULL),
                       0);
     }
+    if (cred_tokens.data == NULL)
+        return NULL;
+
+    /* make a new request-token */
+    request_token = make_request_token(rc, st, "getTokensRequest");
+    if (request_token == NULL)
+        return NULL;
 
     /* base64 encode the webkdc-proxy-token */
     b64_pt = apr_palloc(rc->r->pool,
@@ -886,41 +950,45 @@ mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
     apr_base64_encode(b64_pt, pt->webkdc_proxy, pt->webkdc_proxy_len);
 
     /* build the actual request */
-    xml_request = apr_pstrcat(rc->r->pool,
-                              "<getTokensRequest>"
-                              "<requesterCredential type='service'>",
-                              st->token, /* b64'd, don't need to quote */
-                              "</requesterCredential>"
-                              "<subjectCredential type='proxy'>",
-                              "<proxyToken>",
-                              b64_pt, /* b64'd, don't need to quote */
-                              "</proxyToken>",
-                              "</subjectCredential>",
-                              "<requestToken>",
-                              request_token,
-                              "</requestToken>",
-                              "<tokens>",
-                              cred_tokens.data,
-                              "</tokens>"
-                              "</getTokensRequest>",
-                              NULL);
-
-    if (rc->sconf->debug)
-        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
-                     "mod_webauth: xml_request(%s)", xml_request);
-
+    return apr_pstrcat(rc->r->pool,
+                       "<getTokensRequest>"
+                       "<requesterCredential type='service'>",
+                       st->token, /* b64'd, don't need to quote */
+                       "</requesterCredential>"
+                       "<subjectCredential type='proxy'>",
+                       "<proxyToken>",
+                       b64_pt, /* b64'd, don't need to quote */
+                       "</proxyToken>",
+                       "</subjectCredential>",
+                       "<requestToken>",
+                       request_token,
+                       "</requestToken>",
+                       "<tokens>",
+                       cred_tokens.data,
+                       "</tokens>"
+                       "</getTokensRequest>",
+                       NULL);
+}
 
-    xml_response = post_to_webkdc(xml_request, 0,
-                                  rc->r->server, rc->sconf, rc->r->pool);
 
-    if (xml_response == NULL)
-        return 0;
+/*
+ * Parse the WebKDC response to a getTokensRequest for credentials, adding
+ * the credentials to acquired_creds.  Returns 1 on success and 0 on failure.
+ */
+static int
+parse_get_creds_xml(MWA_REQ_CTXT *rc, MWA_SERVICE_TOKEN *st,
+                    const char *xml_response,
+                    apr_array_header_t **acquired_creds)
+{
+    apr_xml_parser *xp;
+    apr_xml_doc *xd;
+    apr_status_t astatus;
+    static const char *mwa_func = "mwa_get_creds_from_webkdc";
 
     if (rc->sconf->debug)
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
                      "mod_webauth: xml_response(%s)", xml_response);
 
-
     xp = apr_xml_parser_create(rc->r->pool);
     if (xp == NULL) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
@@ -952,3 +1020,161 @@ mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
 
     return parse_get_creds_response(xd, rc, st, acquired_creds);
 }
+
+
+/*
+ * A request to the WebKDC that may be sent from its own thread.  Each has its
+ * own pool, since APR pools can't be shared between threads.
+ */
+struct webkdc_post {
+    char *request;              /* The XML request. */
+    char *response;             /* The XML response, or NULL on failure. */
+    server_rec *server;
+    struct server_config *sconf;
+    apr_pool_t *pool;           /* Pool for the response. */
+};
+
+
+/*
+ * Create a pool for use by another thread.  A subpool normally shares its
+ * parent's allocator, which isn't thread-safe, so the new pool gets its own
+ * allocator.  It is still destroyed along with its parent.
+ */
+static apr_status_t
+create_thread_pool(apr_pool_t **pool, apr_pool_t *parent)
+{
+    apr_allocator_t *allocator;
+    apr_status_t status;
+
+    status = apr_allocator_create(&allocator);
+    if (status != APR_SUCCESS)
+        return status;
+    status = apr_pool_create_ex(pool, parent, NULL, allocator);
+    if (status != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return status;
+    }
+    apr_allocator_owner_set(allocator, *pool);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Thread body for sending one request to the WebKDC.
+ */
+static void * APR_THREAD_FUNC
+post_thread(apr_thread_t *thread, void *data)
+{
+    struct webkdc_post *post = data;
+
+    post->response = post_to_webkdc(post->request, 0, post->server,
+                                    post->sconf, post->pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Send several requests to the WebKDC at the same time, each in its own
+ * thread except the first, which is sent from the calling thread.  Each
+ * thread checks out its own cURL handle, so the requests go over separate
+ * connections and take about as long as the slowest one rather than the sum
+ * of all of them.  If a thread can't be created, that request is sent from
+ * the calling thread instead.
+ */
+static void
+post_all_to_webkdc(struct webkdc_post *posts, size_t count, apr_pool_t *pool)
+{
+    apr_thread_t **threads;
+    apr_status_t status;
+    size_t i;
+
+    threads = apr_pcalloc(pool, count * sizeof(apr_thread_t *));
+    for (i = 1; i < count; i++) {
+        status = apr_thread_create(&threads[i], NULL, post_thread, &posts[i],
+                                   posts[i].pool);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, status, posts[i].server,
+                         "mod_webauth: cannot create thread for WebKDC"
+                         " request, sending it serially");
+            threads[i] = NULL;
+        }
+    }
+    for (i = 0; i < count; i++)
+        if (i == 0 || threads[i] == NULL)
+            posts[i].response = post_to_webkdc(posts[i].request, 0,
+                                               posts[i].server,
+                                               posts[i].sconf, posts[i].pool);
+    for (i = 1; i < count; i++)
+        if (threads[i] != NULL)
+            apr_thread_join(&status, threads[i]);
+}
+
+
+/*
+ * Get the needed credentials from the WebKDC.  proxies holds a proxy token
+ * (struct webauth_token_proxy *) for each type of credential needed.  All the
+ * credentials of one type are requested in a single getTokensRequest, and
+ * the requests for different types are sent concurrently.  Any credentials
+ * obtained are added to acquired_creds, even if some of the requests fail.
+ * Returns 1 if all requests succeeded and 0 otherwise.
+ */
+int
+mwa_get_creds_from_webkdc(MWA_REQ_CTXT *rc,
+                          apr_array_header_t *proxies,
+                          apr_array_header_t *needed_creds,
+                          apr_array_header_t **acquired_creds)
+{
+    struct webkdc_post *posts;
+    struct webauth_token_proxy *pt;
+    size_t i, count = 0;
+    MWA_SERVICE_TOKEN *st;
+    int result = 1;
+
+    /* get service token first */
+    st = mwa_get_service_token(rc->r->server, rc->sconf, rc->r->pool, 0);
+
+    if (st == NULL)
+        return 0;
+
+    /* build a request for each proxy type */
+    posts = apr_pcalloc(rc->r->pool,
+                        proxies->nelts * sizeof(struct webkdc_post));
+    for (i = 0; i < (size_t) proxies->nelts; i++) {
+        pt = APR_ARRAY_IDX(proxies, i, struct webauth_token_proxy *);
+        posts[count].request = make_get_creds_request(rc, st, pt,
+                                                      needed_creds);
+        if (posts[count].request == NULL) {
+            result = 0;
+            continue;
+        }
+        if (rc->sconf->debug)
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
+                         "mod_webauth: xml_request(%s)",
+                         posts[count].request);
+        posts[count].server = rc->r->server;
+        posts[count].sconf = rc->sconf;
+        if (count == 0)
+            posts[count].pool = rc->r->pool;
+        else if (create_thread_pool(&posts[count].pool, rc->r->pool)
+                 != APR_SUCCESS) {
+            result = 0;
+            continue;
+        }
+        count++;
+    }
+    if (count == 0)
+        return 0;
+
+    post_all_to_webkdc(posts, count, rc->r->pool);
+
+    /* parse the responses in this thread, since they use the request pool */
+    for (i = 0; i < count; i++) {
+        if (posts[i].response == NULL)
+            result = 0;
+        else if (!parse_get_creds_xml(rc, st, posts[i].response,
+                                      acquired_creds))
+            result = 0;
+    }
+    return result;
+}
@@ -2,7 +2,7 @@
  * Token ACL file handling for the Apache WebKDC module.
  *
  * Written by Roland Schemers
- * Copyright 2002, 2003, 2006, 2009, 2012, 2013
+ * Copyright 2002, 2003, 2006, 2009, 2012, 2013, 2026
  *     The Board of Trustees of the Leland Stanford Junior University
  *
  * See LICENSE for licensing terms.
@@ -20,60 +20,199 @@ APLOG_USE_MODULE(webkdc);
 
 
 /*
- * used to hold the result of reading the acl file
- *
- * keys/values are of the form:
- *  id;{subject} => int*, int set to 1
- *  cred;{proxy-type};{subject} => apr_array_header_t*, array of creds
+ * A node in the trie of literal wildcard pattern prefixes.  Each pattern is
+ * split at its first wildcard character.  The part before the wildcard is
+ * the path from the root of the trie to the node that holds the pattern, and
+ * the rest of the pattern, starting with the wildcard, is stored in the node
+ * and matched against the rest of the subject with ap_strcmp_match.  Checking
+ * a subject therefore walks one path down the trie and only tries the
+ * patterns whose literal prefix matches the subject.
  *
+ * Children are kept in a sibling list rather than a table indexed by
+ * character to keep the nodes small.  Most ACLs share long prefixes like
+ * "krb5:webauth/", so most nodes have only one child.
+ */
+struct acl_node {
+    char c;                     /* Character leading to this node. */
+    struct acl_node *child;     /* First child. */
+    struct acl_node *sibling;   /* Next child of our parent. */
+    struct acl_pattern *patterns;
+};
+
+/* A wildcard pattern, stored in the node for its literal prefix. */
+struct acl_pattern {
+    const char *rest;           /* Pattern starting at the first wildcard. */
+    apr_array_header_t *creds;  /* Allowed creds, empty for id entries. */
+    struct acl_pattern *next;
+};
+
+/*
+ * The entries for one token type, either id tokens or one type of cred
+ * token.  exact maps subjects without wildcards to an array of allowed creds
+ * (always empty for id entries), and wild is the root of the trie of
+ * wildcard patterns.
+ */
+struct acl_index {
+    apr_hash_t *exact;
+    struct acl_node wild;
+};
+
+/*
+ * A loaded token ACL, published in the server configuration as a snapshot
+ * (see modules/snapshot.h) and never modified after publication.
+ */
+struct token_acl {
+    struct mod_snapshot snapshot;
+    struct acl_index id;                /* id entries. */
+    apr_hash_t *creds;                  /* cred type to struct acl_index. */
+};
+
+
+/*
+ * Return the index for the given entry type and proxy type, creating it if
+ * create is true and it doesn't exist.  Returns NULL if the index doesn't
+ * exist and create is false.
+ */
+static struct acl_index *
+get_index(struct token_acl *acl, const char *entry_type,
+          const char *proxy_type, bool create)
+{
+    struct acl_index *index;
+
+    if (strcmp(entry_type, "id") == 0)
+        return &acl->id;
+    index = apr_hash_get(acl->creds, proxy_type, APR_HASH_KEY_STRING);
+    if (index == NULL && create) {
+        index = apr_pcalloc(acl->snapshot.pool, sizeof(struct acl_index));
+        index->exact = apr_hash_make(acl->snapshot.pool);
+        apr_hash_set(acl->creds, apr_pstrdup(acl->snapshot.pool, proxy_type),
+                     APR_HASH_KEY_STRING, index);
+    }
+    return index;
+}
+
+
+/*
+ * Return the array of allowed creds for a subject in an index, creating the
+ * entry if it doesn't exist.  Wildcard subjects get a pattern in the trie,
+ * and duplicate patterns share an entry as duplicate subjects do.
+ */
+static apr_array_header_t *
+index_entry(apr_pool_t *pool, struct acl_index *index, const char *subject)
+{
+    struct acl_node *node, *child;
+    struct acl_pattern *pattern;
+    apr_array_header_t *creds;
+    const char *p, *rest;
+
+    if (!ap_is_matchexp(subject)) {
+        creds = apr_hash_get(index->exact, subject, APR_HASH_KEY_STRING);
+        if (creds == NULL) {
+            creds = apr_array_make(pool, 1, sizeof(char *));
+            apr_hash_set(index->exact, apr_pstrdup(pool, subject),
+                         APR_HASH_KEY_STRING, creds);
+        }
+        return creds;
+    }
+
+    /* Walk or build the path for the literal prefix. */
+    rest = subject + strcspn(subject, "*?");
+    node = &index->wild;
+    for (p = subject; p < rest; p++) {
+        for (child = node->child; child != NULL; child = child->sibling)
+            if (child->c == *p)
+                break;
+        if (child == NULL) {
+            child = apr_pcalloc(pool, sizeof(struct acl_node));
+            child->c = *p;
+            child->sibling = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+    for (pattern = node->patterns; pattern != NULL; pattern = pattern->next)
+        if (strcmp(pattern->rest, rest) == 0)
+            return pattern->creds;
+    pattern = apr_pcalloc(pool, sizeof(struct acl_pattern));
+    pattern->rest = apr_pstrdup(pool, rest);
+    pattern->creds = apr_array_make(pool, 1, sizeof(char *));
+    pattern->next = node->patterns;
+    node->patterns = pattern;
+    return pattern->creds;
+}
+
+
+/*
+ * Returns true if cred is NULL or is in the array of creds.
+ */
+static bool
+has_cred(const apr_array_header_t *creds, const char *cred)
+{
+    int i;
+
+    if (cred == NULL)
+        return true;
+    for (i = 0; i < creds->nelts; i++)
+        if (strcmp(APR_ARRAY_IDX(creds, i, const char *), cred) == 0)
+            return true;
+    return false;
+}
+
+
+/*
+ * Returns true if the subject matches an entry in the index, either exactly
+ * or via a wildcard pattern, and, if cred is not NULL, that entry allows that
+ * cred.  The trie walk consumes one character of the subject per step, so
+ * this takes time proportional to the length of the subject plus the number
+ * of patterns whose literal prefix matches it.
  */
-typedef struct {
-    apr_pool_t *pool;         /* pool to allocate new keys/values from */
-    apr_hash_t *wild_entries; /* entries with a wildcard */
-    apr_hash_t *entries;      /* entries without a wildcard */
-} MWK_ACL;
+static bool
+index_match(const struct acl_index *index, const char *subject,
+            const char *cred)
+{
+    const struct acl_node *node;
+    const struct acl_pattern *pattern;
+    const apr_array_header_t *creds;
+    const char *p;
+
+    creds = apr_hash_get(index->exact, subject, APR_HASH_KEY_STRING);
+    if (creds != NULL && has_cred(creds, cred))
+        return true;
+    node = &index->wild;
+    for (p = subject; node != NULL; p++) {
+        for (pattern = node->patterns; pattern != NULL;
+             pattern = pattern->next)
+            if (ap_strcmp_match(p, pattern->rest) == 0)
+                if (has_cred(pattern->creds, cred))
+                    return true;
+        if (*p == '\0')
+            break;
+        for (node = node->child; node != NULL; node = node->sibling)
+            if (node->c == *p)
+                break;
+    }
+    return false;
+}
+
 
 static int
-add_entry(MWK_REQ_CTXT *rc,
-          MWK_ACL *acl,
+add_entry(struct token_acl *acl,
           const char *subject,
           const char *entry_type,
           const char *proxy_type,
           const char *cred)
 {
-    apr_hash_t *hash;
-
-    hash = ap_is_matchexp(subject) ? acl->wild_entries : acl->entries;
+    struct acl_index *index;
+    apr_array_header_t *creds;
 
     if (strcmp(entry_type, "id") == 0) {
-        char *key = apr_pstrcat(rc->r->pool, "id;", subject, NULL);
-        void *p = apr_hash_get(hash, key, APR_HASH_KEY_STRING);
-        if (p == NULL) {
-            apr_hash_set(hash,
-                         apr_pstrdup(acl->pool, key),
-                         APR_HASH_KEY_STRING,
-                         apr_pstrdup(acl->pool, "1"));
-        }
+        index_entry(acl->snapshot.pool, &acl->id, subject);
         return 1;
     } else if (strcmp(entry_type, "cred") == 0) {
-        char *key = apr_pstrcat(rc->r->pool,
-                                "cred;",
-                                proxy_type,
-                                ";",
-                                subject, NULL);
-        apr_array_header_t *a =
-            apr_hash_get(hash, key, APR_HASH_KEY_STRING);
-        if (a == NULL) {
-            char **c;
-            a = apr_array_make(acl->pool, 5, sizeof(char*));
-            c = apr_array_push(a);
-            *c = (char*)apr_pstrdup(acl->pool, cred);
-            apr_hash_set(hash, apr_pstrdup(acl->pool, key),
-                         APR_HASH_KEY_STRING, a);
-        } else {
-            char **c = apr_array_push(a);
-            *c = (char*)apr_pstrdup(acl->pool, cred);
-        }
+        index = get_index(acl, entry_type, proxy_type, true);
+        creds = index_entry(acl->snapshot.pool, index, subject);
+        APR_ARRAY_PUSH(creds, const char *)
+            = apr_pstrdup(acl->snapshot.pool, cred);
         return 1;
     } else {
         return 0;
@@ -98,52 +237,32 @@ log_apr_error(MWK_REQ_CTXT *rc,
                  astatus);
 }
 
+
 /*
- * returns the cached ACL after checking to make its up to date.
- * returns NULL on error.
- *
- * Should only be called while holding the MWK_MUTEX_ACL mutex.
+ * Load the ACL file and publish it as the current ACL.  finfo is the result
+ * of a stat of the file taken before opening it, so that a change while we
+ * are reading it will be noticed by the next check.  On any error, logs it
+ * and leaves the current ACL, if any, in place.
  *
+ * Should only be called while holding the MWK_MUTEX_TOKENACL mutex.
  */
-static MWK_ACL *
-get_acl(MWK_REQ_CTXT *rc)
+static void
+load_acl(MWK_REQ_CTXT *rc, const apr_finfo_t *finfo, bool reload)
 {
-    static MWK_ACL *acl = NULL;
-    static apr_time_t acl_mtime = 0;
-    MWK_ACL *new_acl;
-    const char *mwk_func="get_acl";
+    struct token_acl *new_acl;
+    const char *mwk_func="load_acl";
     apr_status_t astatus;
     apr_file_t *acl_file;
     apr_pool_t *acl_pool;
     int lineno, error;
     char line[1024];
-    struct apr_finfo_t finfo;
     apr_int32_t flags;
 
-    if (acl != NULL) {
-        /* FIXME: stat and free current acl if out-of-date */
-        astatus = apr_stat(&finfo, rc->sconf->token_acl_path,
-                           APR_FINFO_MTIME, rc->r->pool);
-
-        if (astatus != APR_SUCCESS) {
-            log_apr_error(rc, astatus, mwk_func, "apr_file_open",
-                          rc->sconf->token_acl_path);
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                         "mod_webkdc: %s: couldn't stat acl file(%s), "
-                         "using previously cached acl",
-                         mwk_func, rc->sconf->token_acl_path);
-            return acl;
-        }
-        /* no change, return current acl */
-        if (finfo.mtime == acl_mtime)
-            return acl;
-    }
-
     if (rc->sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
                      "mod_webkdc: %s: %sloading acl file: %s",
                      mwk_func,
-                     acl == NULL ? "" : "re",
+                     reload ? "re" : "",
                      rc->sconf->token_acl_path);
     }
 
@@ -155,7 +274,7 @@ get_acl(MWK_REQ_CTXT *rc)
     if (astatus != APR_SUCCESS) {
         log_apr_error(rc, astatus, mwk_func, "apr_file_open",
                       rc->sconf->token_acl_path);
-        if (acl != NULL) {
+        if (reload) {
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
                          "mod_webkdc: %s: couldn't open new acl file, "
                          "using previously cached acl",
@@ -165,14 +284,21 @@ get_acl(MWK_REQ_CTXT *rc)
                          "mod_webkdc: %s: couldn't open acl file: %s",
                          mwk_func, rc->sconf->token_acl_path);
         }
-        return acl;
+        return;
     }
 
+    /*
+     * Each ACL gets its own pool so that it can be freed when the last
+     * request using it is done.
+     */
     apr_pool_create(&acl_pool, NULL);
-    new_acl = (MWK_ACL*) apr_pcalloc(acl_pool, sizeof(MWK_ACL));
-    new_acl->pool = acl_pool;
-    new_acl->wild_entries = apr_hash_make(new_acl->pool);
-    new_acl->entries = apr_hash_make(new_acl->pool);
+    new_acl = apr_pcalloc(acl_pool, sizeof(struct token_acl));
+    mod_snapshot_init(&new_acl->snapshot, acl_pool, NULL);
+    new_acl->snapshot.mtime = finfo->mtime;
+    if (finfo->valid & APR_FINFO_INODE)
+        new_acl->snapshot.inode = finfo->inode;
+    new_acl->id.exact = apr_hash_make(acl_pool);
+    new_acl->creds = apr_hash_make(acl_pool);
 
     error = 1;
 
@@ -185,16 +311,6 @@ get_acl(MWK_REQ_CTXT *rc)
 
         lineno++;
 
-#if 0
-        if (rc->sconf->debug) {
-            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
-                         "mod_webkdc: %s: read line: [%s] "
-                         "file %s, line %d", mwk_func,
-                         line,
-                         rc->sconf->token_acl_path, lineno);
-        }
-#endif
-
         /* make sure line ends with a \n, if not it was truncated  */
         if (line[strlen(line)-1] != '\n') {
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
@@ -254,7 +370,7 @@ get_acl(MWK_REQ_CTXT *rc)
                              mwk_func, subject, proxy_type, cred);
             }
 
-            add_entry(rc, new_acl, subject, type, proxy_type, cred);
+            add_entry(new_acl, subject, type, proxy_type, cred);
 
         } else if (strcmp(type, "id") == 0) {
             if (rc->sconf->debug) {
@@ -263,7 +379,7 @@ get_acl(MWK_REQ_CTXT *rc)
                              mwk_func, subject);
             }
 
-            add_entry(rc, new_acl, subject, type, NULL, NULL);
+            add_entry(new_acl, subject, type, NULL, NULL);
 
         } else {
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
@@ -286,22 +402,18 @@ get_acl(MWK_REQ_CTXT *rc)
 
     apr_file_close(acl_file);
 
-    /* if we had any errors, destroy new_acl, re-use old one if
-       it was set */
+    /* if we had any errors, destroy new_acl and keep the old one */
     if (error) {
-        apr_pool_destroy(new_acl->pool);
-        new_acl = NULL;
-        if (acl != NULL) {
+        apr_pool_destroy(new_acl->snapshot.pool);
+        if (reload) {
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
                          "mod_webkdc: %s: couldn't load new acl file, "
                          "using previously cached acl",
                          mwk_func);
         }
     } else {
-        /* free existing acl, set new one */
-        if (acl != NULL)
-            apr_pool_destroy(acl->pool);
-        acl = new_acl;
+        mod_snapshot_publish(&rc->sconf->token_acl, &new_acl->snapshot,
+                             TOKEN_ACL_CHECK_INTERVAL);
 
         if (rc->sconf->debug) {
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
@@ -310,8 +422,61 @@ get_acl(MWK_REQ_CTXT *rc)
                          rc->sconf->token_acl_path);
         }
     }
+}
+
+
+/*
+ * Returns the current ACL, holding a reference to it for the rest of the
+ * request, after loading it if it hasn't been loaded yet or reloading it if
+ * the file has changed.  Returns NULL on error.
+ *
+ * Only one request every TOKEN_ACL_CHECK_INTERVAL seconds stats the file, and
+ * the mutex is only taken if the ACL has to be loaded.  Other requests keep
+ * using the current ACL while it is being reloaded.
+ */
+static struct token_acl *
+get_acl(MWK_REQ_CTXT *rc)
+{
+    struct config *sconf = rc->sconf;
+    struct token_acl *acl;
+    const char *mwk_func="get_acl";
+    apr_status_t astatus;
+    apr_finfo_t finfo;
+    apr_int32_t wanted = APR_FINFO_MTIME | APR_FINFO_INODE;
+
+    acl = mod_snapshot_acquire(&sconf->token_acl, rc->r->pool);
+    if (acl != NULL && !mod_snapshot_check_due(&sconf->token_acl,
+                                               TOKEN_ACL_CHECK_INTERVAL))
+        return acl;
+
+    astatus = apr_stat(&finfo, sconf->token_acl_path, wanted, rc->r->pool);
+    if (astatus != APR_SUCCESS && acl == NULL) {
+        finfo.mtime = 0;
+        finfo.valid = 0;
+    } else if (astatus != APR_SUCCESS) {
+        log_apr_error(rc, astatus, mwk_func, "apr_stat",
+                      sconf->token_acl_path);
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webkdc: %s: couldn't stat acl file(%s), "
+                     "using previously cached acl",
+                     mwk_func, sconf->token_acl_path);
+        return acl;
+    }
+    if (acl != NULL && !mod_snapshot_changed(&acl->snapshot, &finfo))
+        return acl;
+
+    /*
+     * Load the file under the mutex, unless another thread already loaded a
+     * new version while we were waiting for it.  If the stat failed, there
+     * is no current ACL and loading will fail and log the error.
+     */
+    mwk_lock_mutex(rc, MWK_MUTEX_TOKENACL); /****** LOCKING! ************/
+    if (mod_snapshot_current(&sconf->token_acl) == acl)
+        load_acl(rc, &finfo, acl != NULL);
+    mwk_unlock_mutex(rc, MWK_MUTEX_TOKENACL); /****** UNLOCKING! ************/
 
-    return acl;
+    /* Use the new ACL if there is one.  The old reference is still safe. */
+    return mod_snapshot_acquire(&sconf->token_acl, rc->r->pool);
 }
 
 int
@@ -326,45 +491,11 @@ int
 mwk_has_id_access(MWK_REQ_CTXT *rc,
                   const char *subject)
 {
-    char *key = apr_pstrcat(rc->r->pool, "id;", subject, NULL);
-    apr_hash_index_t *hi;
-    void *p;
     int allowed;
-    MWK_ACL *acl;
-
-    allowed = 0;
-
-    mwk_lock_mutex(rc, MWK_MUTEX_TOKENACL); /****** LOCKING! ************/
+    struct token_acl *acl;
 
     acl = get_acl(rc);
-    if (acl == NULL)
-        goto done;
-
-    /* check non-wild first */
-    p = apr_hash_get(acl->entries, key, APR_HASH_KEY_STRING);
-    if (p != NULL) {
-        allowed = 1;
-        goto done;
-    }
-
-    /* enumerate through all the wild entries */
-    for (hi = apr_hash_first(rc->r->pool, acl->wild_entries); hi;
-         hi = apr_hash_next(hi)) {
-        const void *vhkey;
-        const char *hkey;
-
-        apr_hash_this(hi, &vhkey, NULL, &p);
-        hkey = vhkey;
-        if (strncmp(hkey, "id;", 3) == 0) {
-            if (ap_strcmp_match(subject, hkey+3) == 0) {
-                allowed = 1;
-                goto done;
-            }
-        }
-    }
-
- done:
-    mwk_unlock_mutex(rc, MWK_MUTEX_TOKENACL); /****** UNLOCKING! ************/
+    allowed = (acl != NULL && index_match(&acl->id, subject, NULL));
 
     if (rc->sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
@@ -380,50 +511,14 @@ mwk_has_proxy_access(MWK_REQ_CTXT *rc,
                      const char *subject,
                      const char *proxy_type)
 {
-    apr_hash_index_t *hi;
-    void *p;
-    char *prefix, *key;
-    int plen, allowed;
-    MWK_ACL *acl;
-
-    allowed = 0;
-
-    mwk_lock_mutex(rc, MWK_MUTEX_TOKENACL); /****** LOCKING! ************/
+    int allowed;
+    struct token_acl *acl;
+    const struct acl_index *index = NULL;
 
     acl = get_acl(rc);
-    if (acl == NULL)
-        goto done;
-
-    prefix = apr_pstrcat(rc->r->pool, "cred;", proxy_type, ";", NULL);
-    key = apr_pstrcat(rc->r->pool, prefix, subject, NULL);
-
-    /* check non-wild first */
-    p = apr_hash_get(acl->entries, key, APR_HASH_KEY_STRING);
-    if (p != NULL) {
-        allowed = 1;
-        goto done;
-    }
-
-    plen = strlen(prefix);
-
-    /* enumerate through all the wild entries */
-    for (hi = apr_hash_first(rc->r->pool, acl->wild_entries); hi;
-         hi = apr_hash_next(hi)) {
-        const void *vhkey;
-        const char *hkey;
-
-        apr_hash_this(hi, &vhkey, NULL, &p);
-        hkey = vhkey;
-        if (strncmp(hkey, prefix, plen) == 0) {
-            if (ap_strcmp_match(subject, hkey+plen) == 0) {
-                allowed = 1;
-                goto done;
-            }
-        }
-    }
-
- done:
-    mwk_unlock_mutex(rc, MWK_MUTEX_TOKENACL); /****** UNLOCKING! ************/
+    if (acl != NULL)
+        index = get_index(acl, "cred", proxy_type, false);
+    allowed = (index != NULL && index_match(index, subject, NULL));
 
     if (rc->sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
@@ -440,62 +535,14 @@ mwk_has_cred_access(MWK_REQ_CTXT *rc,
                     const char *cred_type,
                     const char *cred)
 {
-    apr_hash_index_t *hi;
-    void *va;
-    apr_array_header_t *a;
-    char *prefix, *key;
-    int plen, i, allowed;
-    MWK_ACL *acl;
-
-    allowed = 0;
-
-    mwk_lock_mutex(rc, MWK_MUTEX_TOKENACL); /****** LOCKING! ************/
+    int allowed;
+    struct token_acl *acl;
+    const struct acl_index *index = NULL;
 
     acl = get_acl(rc);
-    if (acl == NULL)
-        goto done;
-
-    prefix = apr_pstrcat(rc->r->pool, "cred;", cred_type, ";", NULL);
-    key = apr_pstrcat(rc->r->pool, prefix, subject, NULL);
-
-    /* check non-wild first */
-    a = apr_hash_get(acl->entries, key, APR_HASH_KEY_STRING);
-    if (a != NULL) {
-        char **p = (char**)a->elts;
-        for (i=0; i < a->nelts; i++) {
-            if (strcmp(p[i], cred) == 0) {
-                allowed = 1;
-                goto done;
-            }
-        }
-    }
-
-    plen = strlen(prefix);
-
-    /* enumerate through all the wild entries */
-    for (hi = apr_hash_first(rc->r->pool, acl->wild_entries); hi;
-         hi = apr_hash_next(hi)) {
-        const void *vhkey;
-        const char *hkey;
-
-        apr_hash_this(hi, &vhkey, NULL, &va);
-        hkey = vhkey;
-        a = va;
-        if (strncmp(hkey, prefix, plen) == 0) {
-            if (ap_strcmp_match(subject, hkey + plen) == 0) {
-                char **p = (char **) a->elts;
-                for (i = 0; i < a->nelts; i++) {
-                    if (strcmp(p[i], cred) == 0) {
-                        allowed = 1;
-                        goto done;
-                    }
-                }
-            }
-        }
-    }
-
- done:
-    mwk_unlock_mutex(rc, MWK_MUTEX_TOKENACL); /****** UNLOCKING! ************/
+    if (acl != NULL)
+        index = get_index(acl, "cred", cred_type, false);
+    allowed = (index != NULL && index_match(index, subject, cred));
 
     if (rc->sconf->debug) {
         ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, rc->r->server,
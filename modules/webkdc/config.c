@@ -18,6 +18,9 @@
 #include <portable/apache.h>
 #include <portable/apr.h>
 
+#include <errno.h>
+#include <stdlib.h>
+
 #include <modules/webkdc/mod_webkdc.h>
 #include <util/macros.h>
 #include <webauth/basic.h>
@@ -57,6 +60,8 @@ DIRN(LocalRealms,         "realms to strip, \"none\", or \"local\"")
 DIRD(LoginTimeLimit,      "time limit for completing login", int, 60 * 5)
 DIRN(PermittedRealms,     "list of realms permitted for authentication")
 DIRN(ProxyTokenLifetime,  "lifetime of webkdc-proxy tokens")
+DIRD(ServiceTokenCacheSize, "maximum number of decoded webkdc-service tokens",
+     int, 1000)
 DIRN(ServiceTokenLifetime,"lifetime of webkdc-service tokens")
 DIRN(TokenAcl,            "path to the token ACL file")
 DIRD(TokenMaxTTL,         "max lifetime of recent tokens", int, 60 * 5)
@@ -79,6 +84,7 @@ enum {
     E_LoginTimeLimit,
     E_PermittedRealms,
     E_ProxyTokenLifetime,
+    E_ServiceTokenCacheSize,
     E_ServiceTokenLifetime,
     E_TokenAcl,
     E_TokenMaxTTL,
@@ -141,6 +147,7 @@ webkdc_config_create(apr_pool_t *pool, server_rec *s UNUSED)
     sconf->keyring_auto_update = DF_KeyringAutoUpdate;
     sconf->key_lifetime        = DF_KeyringKeyLifetime;
     sconf->login_time_limit    = DF_LoginTimeLimit;
+    sconf->service_token_cache_size = DF_ServiceTokenCacheSize;
     sconf->token_max_ttl       = DF_TokenMaxTTL;
     sconf->userinfo_timeout    = DF_UserInfoTimeout;
     sconf->local_realms        = apr_array_make(pool, 0, sizeof(const char *));
@@ -184,6 +191,7 @@ webkdc_config_merge(apr_pool_t *pool, void *basev, void *overv)
     MERGE_SET(login_time_limit);
     MERGE_SET(proxy_lifetime);
     MERGE_INT(service_lifetime);
+    MERGE_SET(service_token_cache_size);
     MERGE_SET(token_max_ttl);
     MERGE_ARRAY(permitted_realms);
     MERGE_ARRAY(kerberos_factors);
@@ -253,6 +261,10 @@ webkdc_config_init(server_rec *server, struct config *bconf UNUSED,
         fprintf(stderr, "mod_webauth: fatal error: %s\n", msg);
         exit(1);
     }
+
+    /* Initialize the mutex used when loading the keyring. */
+    if (sconf->mutex == NULL)
+        apr_thread_mutex_create(&sconf->mutex, APR_THREAD_MUTEX_DEFAULT, p);
 }
 
 
@@ -273,6 +285,26 @@ parse_interval(cmd_parms *cmd, const char *arg, unsigned long *value)
 }
 
 
+/*
+ * Utility function for parsing a number.  Returns an error string or NULL
+ * on success.
+ */
+static const char *
+parse_number(cmd_parms *cmd, const char *arg, unsigned long *value)
+{
+    long result;
+    char *end;
+
+    errno = 0;
+    result = strtol(arg, &end, 10);
+    if (result < 0 || *end != '\0' || errno != 0)
+        return apr_psprintf(cmd->pool, "Invalid number \"%s\" for %s", arg,
+                            cmd->directive->directive);
+    *value = result;
+    return NULL;
+}
+
+
 /*
  * Utility function for parsing a user information service URL.  This also
  * does validation of the URL and the protocol to ensure that it represents a
@@ -372,6 +404,11 @@ cfg_str(cmd_parms *cmd, void *mconf UNUSED, const char *arg)
         if (err == NULL)
             sconf->proxy_lifetime_set = true;
         break;
+    case E_ServiceTokenCacheSize:
+        err = parse_number(cmd, arg, &sconf->service_token_cache_size);
+        if (err == NULL)
+            sconf->service_token_cache_size_set = true;
+        break;
     case E_ServiceTokenLifetime:
         err = parse_interval(cmd, arg, &sconf->service_lifetime);
         break;
@@ -495,6 +532,7 @@ const command_rec webkdc_cmds[] = {
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   LoginTimeLimit),
     DIRECTIVE(AP_INIT_ITERATE, cfg_str,   PermittedRealms),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   ProxyTokenLifetime),
+    DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   ServiceTokenCacheSize),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   ServiceTokenLifetime),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   TokenAcl),
     DIRECTIVE(AP_INIT_TAKE1,   cfg_str,   TokenMaxTTL),
@@ -31,24 +31,33 @@ APLOG_USE_MODULE(webkdc);
 
 /*
  * Called at any entry point where we may be doing WebKDC operations that need
- * a keyring.  Do lazy initialization of the in-memory keyring from the disk
- * file and store it in the virtual host context.  Returns true if the keyring
- * could be loaded correctly and false otherwise.
+ * a keyring.  Take a reference to the current keyring snapshot for the rest
+ * of the request and store the keyring in rc->ring, doing lazy
+ * initialization of the in-memory keyring from the disk file if it hasn't
+ * been loaded yet.  Only that initial load takes the per-virtual-host mutex.
+ * Returns true if the keyring could be loaded correctly and false otherwise.
  */
 static bool
 ensure_keyring_loaded(MWK_REQ_CTXT *rc)
 {
-    int s;
+    struct mwk_keyring_snapshot *snapshot;
 
-    /* FIXME: Should use a per-virtual-host mutex instead of a global one. */
-    mwk_lock_mutex(rc, MWK_MUTEX_KEYRING);
-    if (rc->sconf->ring != NULL) {
-        mwk_unlock_mutex(rc, MWK_MUTEX_KEYRING);
+    if (rc->ring != NULL)
         return true;
-    }
-    s = mwk_cache_keyring(rc->r->server, rc->sconf);
-    mwk_unlock_mutex(rc, MWK_MUTEX_KEYRING);
-    return (s == WA_ERR_NONE && rc->sconf->ring != NULL);
+    mwk_keyring_check(rc->r->server, rc->sconf, rc->r->pool);
+    snapshot = mwk_keyring_acquire(rc->sconf, rc->r->pool);
+    if (snapshot == NULL) {
+        apr_thread_mutex_lock(rc->sconf->mutex);
+        if (mod_snapshot_current(&rc->sconf->keyring) == NULL)
+            mwk_cache_keyring(rc->r->server, rc->sconf);
+        apr_thread_mutex_unlock(rc->sconf->mutex);
+        snapshot = mwk_keyring_acquire(rc->sconf, rc->r->pool);
+        if (snapshot == NULL)
+            return false;
+    }
+    rc->ring = snapshot->ring;
+    rc->services = snapshot->services;
+    return true;
 }
 
 
@@ -111,14 +120,13 @@ generate_errorResponse(MWK_REQ_CTXT *rc)
         rc->error_message ="<this shouldn't be happening!>";
     }
 
-    ap_rvputs(rc->r,
-              "<errorResponse><errorCode>",
-              ec_buff,
-              "</errorCode><errorMessage>",
-              apr_xml_quote_string(rc->r->pool, rc->error_message, 0),
-              "</errorMessage></errorResponse>",
-              NULL);
-    ap_rflush(rc->r);
+    mwk_rvputs(rc->out,
+               "<errorResponse><errorCode>",
+               ec_buff,
+               "</errorCode><errorMessage>",
+               apr_xml_quote_string(rc->r->pool, rc->error_message, 0),
+               "</errorMessage></errorResponse>",
+               NULL);
 
     if (rc->need_to_log) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
@@ -146,92 +154,35 @@ set_errorResponse(MWK_REQ_CTXT *rc, int ec, const char *message,
 
 
 /*
- * log information about a bad element in XML and generate errorResponse
+ * Generate an errorResponse for a required element that wasn't present.
  */
 static enum mwk_status
-unknown_element(MWK_REQ_CTXT *rc,
-                const char *mwk_func, const char *parent, const char *u)
+missing_element(MWK_REQ_CTXT *rc, const char *mwk_func, const char *parent,
+                const char *name)
 {
-    char *msg = apr_psprintf(rc->r->pool, "unknown element in <%s>: <%s>",
-                             parent, u);
+    char *msg = apr_psprintf(rc->r->pool, "can't find element in <%s>: %s",
+                             parent, name);
     return set_errorResponse(rc, WA_PEC_INVALID_REQUEST, msg, mwk_func, true);
 }
 
 
 /*
- * concat all the text pieces together and return data, or
- * NULL if an error occured.
- */
-static char *
-get_elem_text(MWK_REQ_CTXT *rc, apr_xml_elem *e, const char *mwk_func)
-{
-    MWK_STRING string;
-    mwk_init_string(&string, rc->r->pool);
-
-    if (e->first_cdata.first &&
-        e->first_cdata.first->text) {
-        apr_text *t;
-         for (t = e->first_cdata.first; t != NULL; t = t->next) {
-            mwk_append_string(&string, t->text, 0);
-        }
-    }
-
-    if (!string.data || string.data[0] == '\0') {
-        char *msg = apr_psprintf(rc->r->pool, "<%s> does not contain data",
-                                 e->name);
-        set_errorResponse(rc, WA_PEC_INVALID_REQUEST, msg, mwk_func, true);
-        return NULL;
-    }
-    return string.data;
-}
-
-/*
- * get an attr from an element. if required and not found, we
- * log an error and generate an errorResponse.
+ * Check that a credential element contained data.  The request parser
+ * checks other elements, but whether a credential needs data depends on its
+ * type, so we check once we know the type is valid.
  */
 static const char *
-get_attr_value(MWK_REQ_CTXT *rc,apr_xml_elem *e,
-               const char *name, int required, const char *mwk_func)
-{
-    apr_xml_attr *a;
-
-    for (a = e->attr; a != NULL; a = a->next) {
-        if (strcmp(a->name, name) == 0) {
-            return a->value;
-        }
-    }
-
-    if (required) {
-        char *msg = apr_psprintf(rc->r->pool, "can't find attr in <%s>: %s",
-                                 e->name, name);
-        set_errorResponse(rc, WA_PEC_INVALID_REQUEST, msg, mwk_func, true);
-    }
-    return NULL;
-}
-
-
-/*
- * find an element in the specified element. if required and not found, we
- * log an error and generate an errorResponse.
- */
-static apr_xml_elem *
-get_element(MWK_REQ_CTXT *rc,apr_xml_elem *e,
-            const char *name, int required, const char *mwk_func)
+credential_data(MWK_REQ_CTXT *rc, const struct mwk_credential *cred,
+                const char *name, const char *mwk_func)
 {
-    apr_xml_elem *child;
-
-    for (child = e->first_child; child != NULL; child = child->next) {
-        if (strcmp(child->name, name) == 0) {
-            return child;
-        }
-    }
+    char *msg;
 
-    if (required) {
-        char *msg = apr_psprintf(rc->r->pool, "can't find element in <%s>: %s",
-                                 e->name, name);
+    if (cred->data == NULL || cred->data[0] == '\0') {
+        msg = apr_psprintf(rc->r->pool, "<%s> does not contain data", name);
         set_errorResponse(rc, WA_PEC_INVALID_REQUEST, msg, mwk_func, true);
+        return NULL;
     }
-    return NULL;
+    return cred->data;
 }
 
 /*
@@ -264,36 +215,64 @@ find_proxy_token(MWK_REQ_CTXT *rc,
     return NULL;
 }
 
+
+/*
+ * Decode a webkdc-service token with the current keyring, which must already
+ * be loaded.  WASs reuse the same service token for hours, so a token that
+ * has already been decoded with this keyring is taken from the cache of the
+ * keyring snapshot and only new tokens are decrypted.  Returns a WebAuth
+ * status.
+ */
+static int
+decode_service_token(MWK_REQ_CTXT *rc, const char *token,
+                     struct webauth_token_webkdc_service **service)
+{
+    int status;
+    struct webauth_token *data;
+
+    if (rc->services != NULL) {
+        *service = mwk_token_cache_get(rc->services, token, rc->r->pool);
+        if (*service != NULL)
+            return WA_ERR_NONE;
+    }
+    status = webauth_token_decode(rc->ctx, WA_TOKEN_WEBKDC_SERVICE, token,
+                                  rc->ring, &data);
+    if (status != WA_ERR_NONE)
+        return status;
+    *service = &data->token.webkdc_service;
+    if (rc->services != NULL)
+        mwk_token_cache_set(rc->services, token, *service);
+    return WA_ERR_NONE;
+}
+
+
 /*
  */
 static enum mwk_status
-parse_requesterCredential(MWK_REQ_CTXT *rc, apr_xml_elem *e,
+parse_requesterCredential(MWK_REQ_CTXT *rc, const struct mwk_credential *cred,
                           MWK_REQUESTER_CREDENTIAL *req_cred,
                           const char **req_subject_out)
 {
     int status;
-    struct webauth_token *data;
+    struct webauth_token_webkdc_service *service;
     static const char*mwk_func = "parse_requesterCredential";
-    const char *at = get_attr_value(rc, e, "type",  1, mwk_func);
+    const char *at = cred->type;
 
     *req_subject_out = "<unknown>";
 
-    if (at == NULL) {
-        return MWK_ERROR;
-    }
-
-    req_cred->type = apr_pstrdup(rc->r->pool, at);
+    req_cred->type = at;
 
     if (strcmp(at, "service") == 0) {
-        char *token = get_elem_text(rc, e, mwk_func);
+        const char *token;
+
+        token = credential_data(rc, cred, "requesterCredential", mwk_func);
 
         if (token == NULL)
             return MWK_ERROR;
         if (!ensure_keyring_loaded(rc))
             return set_errorResponse(rc, WA_PEC_SERVER_FAILURE, "no keyring",
                                      mwk_func, true);
-        status = webauth_token_decode(rc->ctx, WA_TOKEN_WEBKDC_SERVICE, token,
-                                      rc->sconf->ring, &data);
+        status = decode_service_token(rc, token, &service);
         if (status != WA_ERR_NONE) {
             mwk_log_webauth_error(rc->ctx, rc->r->server, status, mwk_func,
                                   "webauth_token_decode", NULL);
@@ -312,7 +291,7 @@ parse_requesterCredential(MWK_REQ_CTXT *rc, apr_xml_elem *e,
             return MWK_ERROR;
         }
         /* pull out subject from service token */
-        req_cred->u.st = data->token.webkdc_service;
+        req_cred->u.st = *service;
         req_cred->subject = req_cred->u.st.subject;
     } else if (strcmp(at, "krb5") == 0) {
         const char *req;
@@ -327,7 +306,7 @@ parse_requesterCredential(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                                      "server failure", mwk_func, false);
         }
 
-        req = get_elem_text(rc, e, mwk_func);
+        req = credential_data(rc, cred, "requesterCredential", mwk_func);
         if (req == NULL) {
             return MWK_ERROR;
         }
@@ -374,7 +353,7 @@ parse_requesterCredential(MWK_REQ_CTXT *rc, apr_xml_elem *e,
  * logs all errors and generates errorResponse if need be.
  */
 static enum mwk_status
-parse_webkdc_proxy_token(MWK_REQ_CTXT *rc, char *token,
+parse_webkdc_proxy_token(MWK_REQ_CTXT *rc, const char *token,
                          struct webauth_token_webkdc_proxy *pt)
 {
     static const char *mwk_func = "parse_webkdc_proxy_token";
@@ -385,7 +364,7 @@ parse_webkdc_proxy_token(MWK_REQ_CTXT *rc, char *token,
         return set_errorResponse(rc, WA_PEC_SERVER_FAILURE, "no keyring",
                                  mwk_func, true);
     status = webauth_token_decode(rc->ctx, WA_TOKEN_WEBKDC_PROXY, token,
-                                  rc->sconf->ring, &data);
+                                  rc->ring, &data);
     if (status != WA_ERR_NONE) {
         mwk_log_webauth_error(rc->ctx, rc->r->server, status, mwk_func,
                               "webauth_token_decode", NULL);
@@ -408,7 +387,7 @@ parse_webkdc_proxy_token(MWK_REQ_CTXT *rc, char *token,
 
 
 static enum mwk_status
-parse_login_token(MWK_REQ_CTXT *rc, char *token,
+parse_login_token(MWK_REQ_CTXT *rc, const char *token,
                   struct webauth_token_login *lt)
 {
     static const char *mwk_func = "parse_login_token";
@@ -419,7 +398,7 @@ parse_login_token(MWK_REQ_CTXT *rc, char *token,
         return set_errorResponse(rc, WA_PEC_SERVER_FAILURE, "no keyring",
                                  mwk_func, true);
     status = webauth_token_decode(rc->ctx, WA_TOKEN_LOGIN, token,
-                                  rc->sconf->ring, &data);
+                                  rc->ring, &data);
     if (status != WA_ERR_NONE) {
         mwk_log_webauth_error(rc->ctx, rc->r->server, status, mwk_func,
                               "webauth_token_decode", NULL);
@@ -444,67 +423,34 @@ parse_login_token(MWK_REQ_CTXT *rc, char *token,
 /*
  */
 static enum mwk_status
-parse_subjectCredential(MWK_REQ_CTXT *rc, apr_xml_elem *e,
-                        MWK_SUBJECT_CREDENTIAL *sub_cred,
-                        size_t *num_proxy_tokens,
-                        MWK_RETURNED_PROXY_TOKEN *rptokens)
+parse_subjectCredential(MWK_REQ_CTXT *rc, const struct mwk_credential *cred,
+                        MWK_SUBJECT_CREDENTIAL *sub_cred)
 {
     static const char*mwk_func = "parse_subjectCredential";
+    const char *at = cred->type;
 
-    const char *at = get_attr_value(rc, e, "type",  1, mwk_func);
-
-    if (at == NULL) {
-        return MWK_ERROR;
-    }
-
-    sub_cred->type = apr_pstrdup(rc->r->pool, at);
+    sub_cred->type = at;
 
     if (strcmp(at, "proxy") == 0) {
-        int n  = 0;
-        apr_xml_elem *child;
+        int i;
+        struct webauth_webkdc_proxy_data *pd;
+
         /* attempt to parse each proxy token */
-        for (child = e->first_child; child; child = child->next) {
-            if (strcmp(child->name, "proxyToken") == 0) {
-                char *token = get_elem_text(rc, child, mwk_func);
-                if (token == NULL)
-                    return MWK_ERROR;
-                if (!parse_webkdc_proxy_token(rc, token,
-                                              &sub_cred->u.proxy.pt[n])) {
-                    if (rptokens != NULL) {
-                        /* caller wants us to accumulate bad proxy-tokens
-                           instead of bailing */
-                        const char *type = get_attr_value(rc, child, "type",
-                                                          0, mwk_func);
-                        if (type != NULL) {
-                            /* cause the front-end to nuke the cookie */
-                            rptokens[*num_proxy_tokens].token_data = "";
-                            rptokens[*num_proxy_tokens].type = type;
-                            *num_proxy_tokens = *num_proxy_tokens + 1;
-                        }
-                    } else {
-                        return MWK_ERROR;
-                    }
-                } else {
-                    n++;
-                }
-            } else {
-                unknown_element(rc, mwk_func, e->name, child->name);
+        for (i = 0; i < cred->proxies->nelts; i++) {
+            pd = &APR_ARRAY_IDX(cred->proxies, i,
+                                struct webauth_webkdc_proxy_data);
+            if (!parse_webkdc_proxy_token(rc, pd->token,
+                                          &sub_cred->u.proxy.pt[i]))
                 return MWK_ERROR;
-            }
         }
-        sub_cred->u.proxy.num_proxy_tokens = n;
+        sub_cred->u.proxy.num_proxy_tokens = i;
     } else if (strcmp(at, "login") == 0) {
-        char *token;
-        apr_xml_elem *login_token = get_element(rc, e,
-                                                "loginToken", 1, mwk_func);
-        if (login_token == NULL)
-            return MWK_ERROR;
-
-        token = get_elem_text(rc, login_token, mwk_func);
-        if (token == NULL) {
-            return MWK_ERROR;
-        }
+        const char *token;
 
+        if (cred->logins->nelts == 0)
+            return missing_element(rc, mwk_func, "subjectCredential",
+                                   "loginToken");
+        token = APR_ARRAY_IDX(cred->logins, 0, const char *);
         if (!parse_login_token(rc, token, &sub_cred->u.lt)) {
             return MWK_ERROR;
         }
@@ -527,7 +473,7 @@ make_token(MWK_REQ_CTXT *rc, struct webauth_token *data, const char **token,
     if (!ensure_keyring_loaded(rc))
         return set_errorResponse(rc, WA_PEC_SERVER_FAILURE,
                                  "no keyring", mwk_func, true);
-    status = webauth_token_encode(rc->ctx, data, rc->sconf->ring, token);
+    status = webauth_token_encode(rc->ctx, data, rc->ring, token);
     if (status != WA_ERR_NONE) {
         mwk_log_webauth_error(rc->ctx, rc->r->server, status, mwk_func,
                               "webauth_token_create", NULL);
@@ -814,7 +760,7 @@ create_id_token_from_req(MWK_REQ_CTXT *rc,
  */
 static enum mwk_status
 create_cred_token_from_req(MWK_REQ_CTXT *rc,
-                           apr_xml_elem *e,
+                           const struct mwk_token_request *treq,
                            MWK_REQUESTER_CREDENTIAL *req_cred,
                            MWK_SUBJECT_CREDENTIAL *sub_cred,
                            MWK_RETURNED_TOKEN *rtoken)
@@ -823,8 +769,7 @@ create_cred_token_from_req(MWK_REQ_CTXT *rc,
     size_t ticket_len;
     int status;
     time_t expiration, ticket_expiration;
-    apr_xml_elem *credential_type, *server_principal;
-    char *ct, *sp;
+    const char *ct, *sp;
     struct webauth_krb5 *kc;
     struct webauth_token_webkdc_proxy *sub_pt;
     struct webauth_token token;
@@ -847,18 +792,12 @@ create_cred_token_from_req(MWK_REQ_CTXT *rc,
                                  mwk_func, true);
     }
 
-    credential_type = get_element(rc, e, "credentialType", 1, mwk_func);
-    if (credential_type == NULL)
-        return MWK_ERROR;
-    ct = get_elem_text(rc, credential_type, mwk_func);
+    ct = treq->credential_type;
     if (ct == NULL)
-        return MWK_ERROR;
-    server_principal = get_element(rc, e, "serverPrincipal", 1, mwk_func);
-    if (server_principal == NULL)
-        return MWK_ERROR;
-    sp = get_elem_text(rc, server_principal, mwk_func);
+        return missing_element(rc, mwk_func, "token", "credentialType");
+    sp = treq->server_principal;
     if (sp == NULL)
-        return MWK_ERROR;
+        return missing_element(rc, mwk_func, "token", "serverPrincipal");
 
     /* check access */
     if (!mwk_has_cred_access(rc, req_cred->subject, ct, sp)) {
@@ -998,14 +937,13 @@ parse_request_token(MWK_REQ_CTXT *rc, const char *token,
 
 
 static enum mwk_status
-handle_getTokensRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
+handle_getTokensRequest(MWK_REQ_CTXT *rc, const struct mwk_request *request,
                         const char **req_subject_out,
                         const char **subject_out)
 {
-    apr_xml_elem *child, *tokens, *token;
+    const struct mwk_token_request *token;
     static const char *mwk_func="handle_getTokensRequest";
-    const char *mid = NULL;
-    char *request_token;
+    const char *request_token;
     struct webauth_token_request *req_token = NULL;
     MWK_REQUESTER_CREDENTIAL req_cred;
     MWK_SUBJECT_CREDENTIAL sub_cred;
@@ -1017,40 +955,25 @@ handle_getTokensRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
 
     *subject_out = "<unknown>";
     *req_subject_out = "<unknown>";
-    tokens = NULL;
-    request_token = NULL;
+    request_token = request->request_token;
     memset(&req_cred, 0, sizeof(req_cred));
     memset(&sub_cred, 0, sizeof(sub_cred));
 
-    /* walk through each child element in <getTokensRequest> */
-    for (child = e->first_child; child; child = child->next) {
-        if (strcmp(child->name, "requesterCredential") == 0) {
-            if (!parse_requesterCredential(rc, child, &req_cred,
-                                           req_subject_out))
-                return MWK_ERROR;
-            req_cred_parsed = 1;
-        } else if (strcmp(child->name, "subjectCredential") == 0) {
-            if (!parse_subjectCredential(rc, child, &sub_cred, NULL, NULL))
-                return MWK_ERROR;
-            sub_cred_parsed = 1;
-        } else if (strcmp(child->name, "messageId") == 0) {
-            mid = get_elem_text(rc, child, mwk_func);
-            if (mid == NULL)
-                return MWK_ERROR;
-        } else if (strcmp(child->name, "requestToken") == 0) {
-            request_token = get_elem_text(rc, child, mwk_func);
-            if (request_token == NULL)
-                return MWK_ERROR;
-        } else if (strcmp(child->name, "tokens") == 0) {
-            tokens = child;
-        } else {
-            unknown_element(rc, mwk_func, e->name, child->name);
+    /* decode the credentials from <getTokensRequest> */
+    if (request->requester.present) {
+        if (!parse_requesterCredential(rc, &request->requester, &req_cred,
+                                       req_subject_out))
             return MWK_ERROR;
-        }
+        req_cred_parsed = 1;
+    }
+    if (request->subject.present) {
+        if (!parse_subjectCredential(rc, &request->subject, &sub_cred))
+            return MWK_ERROR;
+        sub_cred_parsed = 1;
     }
 
     /* make sure we found some tokens */
-    if (tokens == NULL) {
+    if (!request->has_tokens) {
         return set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
                                  "missing <tokens> in getTokensRequest",
                                  mwk_func, true);
@@ -1094,32 +1017,21 @@ handle_getTokensRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
         }
     }
 
-    num_tokens = 0;
-    /* plow through each <token> in <tokens> */
-    for (token = tokens->first_child; token; token = token->next) {
+    /*
+     * plow through each <token> in <tokens>.  The parser has already
+     * rejected requests for more than MAX_TOKENS_RETURNED tokens.
+     */
+    for (num_tokens = 0; num_tokens < request->num_tokens; num_tokens++) {
         const char *tt;
 
-        if (strcmp(token->name, "token") != 0) {
-            unknown_element(rc, mwk_func, tokens->name, token->name);
-            return MWK_ERROR;
-        }
-
-        if (num_tokens == MAX_TOKENS_RETURNED) {
-            return set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
-                                     "too many tokens requested",
-                                     mwk_func, true);
-        }
-
+        token = &request->tokens[num_tokens];
         rtokens[num_tokens].session_key = NULL;
         rtokens[num_tokens].expires = NULL;
         rtokens[num_tokens].token_data = NULL;
         rtokens[num_tokens].subject = "<unknown>";
-        rtokens[num_tokens].id = get_attr_value(rc, token, "id", 0, mwk_func);
+        rtokens[num_tokens].id = token->id;
         rtokens[num_tokens].info = "";
-
-        tt = get_attr_value(rc, token, "type", 1, mwk_func);
-        if (tt == NULL)
-            return MWK_ERROR;
+        tt = token->type;
 
         /* make sure we found subjectCredential if requesting
          * a token type other then "sevice".
@@ -1139,14 +1051,15 @@ handle_getTokensRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
 
         } else if (strcmp(tt, "id") == 0) {
             const char *at;
-            apr_xml_elem *auth;
 
-            auth = get_element(rc, token, "authenticator", 1, mwk_func);
-            if (auth == NULL)
-                return MWK_ERROR;
-            at = get_attr_value(rc, auth, "type", 1, mwk_func);
+            if (!token->authenticator)
+                return missing_element(rc, mwk_func, "token",
+                                       "authenticator");
+            at = token->auth_type;
             if (at == NULL)
-                return MWK_ERROR;
+                return set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
+                                         "can't find attr in <authenticator>:"
+                                         " type", mwk_func, true);
 
             if (!create_id_token_from_req(rc, at, &req_cred, &sub_cred,
                                           &rtokens[num_tokens], NULL)) {
@@ -1163,35 +1076,34 @@ handle_getTokensRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
             return set_errorResponse(rc, WA_PEC_INVALID_REQUEST, msg,
                                      mwk_func, true);
         }
-        num_tokens++;
     }
 
     /* if we got here, we made it! */
-    ap_rvputs(rc->r, "<getTokensResponse><tokens>", NULL);
+    mwk_rvputs(rc->out, "<getTokensResponse><tokens>", NULL);
 
     for (i = 0; i < num_tokens; i++) {
         if (i==0)
             *subject_out = (char*)rtokens[0].subject;
 
         if (rtokens[i].id != NULL) {
-            ap_rprintf(rc->r, "<token id=\"%s\">",
-                        apr_xml_quote_string(rc->r->pool, rtokens[i].id, 1));
+            mwk_rprintf(rc->out, "<token id=\"%s\">",
+                         apr_xml_quote_string(rc->r->pool, rtokens[i].id, 1));
         } else {
-            ap_rvputs(rc->r, "<token>", NULL);
+            mwk_rvputs(rc->out, "<token>", NULL);
         }
         /* don't have to quote these, since they are base64'd data
            or numeric strings */
-        ap_rvputs(rc->r,"<tokenData>", rtokens[i].token_data,
-                  "</tokenData>", NULL);
+        mwk_rvputs(rc->out, "<tokenData>", rtokens[i].token_data,
+                   "</tokenData>", NULL);
         if (rtokens[i].session_key) {
-            ap_rvputs(rc->r,"<sessionKey>", rtokens[i].session_key,
-                  "</sessionKey>", NULL);
+            mwk_rvputs(rc->out, "<sessionKey>", rtokens[i].session_key,
+                       "</sessionKey>", NULL);
         }
         if (rtokens[i].expires) {
-            ap_rvputs(rc->r,"<expires>", rtokens[i].expires,
-                      "</expires>", NULL);
+            mwk_rvputs(rc->out, "<expires>", rtokens[i].expires,
+                       "</expires>", NULL);
         }
-        ap_rvputs(rc->r, "</token>", NULL);
+        mwk_rvputs(rc->out, "</token>", NULL);
 
 
         ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
@@ -1202,8 +1114,7 @@ handle_getTokensRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                      rtokens[i].subject,
                      rtokens[i].info);
     }
-    ap_rvputs(rc->r, "</tokens></getTokensResponse>", NULL);
-    ap_rflush(rc->r);
+    mwk_rvputs(rc->out, "</tokens></getTokensResponse>", NULL);
 
     return MWK_OK;
 }
@@ -1324,23 +1235,21 @@ get_subject(MWK_REQ_CTXT *rc, struct webauth_krb5 *kc,
  * parse_requesterCredential to support either service or krb5 credentials.
  */
 static enum mwk_status
-parse_service_token(MWK_REQ_CTXT *rc, apr_xml_elem *e,
+parse_service_token(MWK_REQ_CTXT *rc, const struct mwk_credential *cred,
                     struct webauth_webkdc_login_request *request,
                     struct webauth_token_webkdc_service **service)
 {
     static const char *mwk_func = "parse_service_token";
     int status;
-    struct webauth_token *data;
-    const char *at = get_attr_value(rc, e, "type", 1, mwk_func);
-    char *msg, *token;
+    const char *at = cred->type;
+    const char *token;
+    char *msg;
 
     if (!ensure_keyring_loaded(rc))
         return set_errorResponse(rc, WA_PEC_SERVER_FAILURE, "no keyring",
                                  mwk_func, true);
 
     /* Make sure that the provided token type is service. */
-    if (at == NULL)
-        return MWK_ERROR;
     if (strcmp(at, "service") != 0) {
         msg = apr_psprintf(rc->r->pool, "unknown <requesterCredential> type:"
                            " %s", at);
@@ -1348,11 +1257,10 @@ parse_service_token(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                                  true);
     }
 
-    token = get_elem_text(rc, e, mwk_func);
+    token = credential_data(rc, cred, "requesterCredential", mwk_func);
     if (token == NULL)
         return MWK_ERROR;
-    status = webauth_token_decode(rc->ctx, WA_TOKEN_WEBKDC_SERVICE, token,
-                                  rc->sconf->ring, &data);
+    status = decode_service_token(rc, token, service);
     if (status != WA_ERR_NONE) {
         mwk_log_webauth_error(rc->ctx, rc->r->server, status, mwk_func,
                               "webauth_token_decode", NULL);
@@ -1371,99 +1279,25 @@ parse_service_token(MWK_REQ_CTXT *rc, apr_xml_elem *e,
         return MWK_ERROR;
     }
     request->service = token;
-    *service = &data->token.webkdc_service;
     return MWK_OK;
 }
 
 
 /*
- * Parse a <subjectCredential> XML element passed in to <requestTokenRequest>
- * into a webauth_webkdc_login_request struct.  Use parse_subjectCredential
- * for <getTokens> for right now.
+ * Copy the <requestInfo> of a <requestTokenRequest> into the login request
+ * and make sure that it has either the remote user or all of the addresses.
  */
 static enum mwk_status
-parse_subject_credentials(MWK_REQ_CTXT *rc, apr_xml_elem *e,
-                         struct webauth_webkdc_login_request *request)
-{
-    static const char *mwk_func = "parse_subject_credentials";
-    apr_xml_elem *child;
-    apr_xml_attr *a;
-    char *data;
-    apr_array_header_t *wkproxies, *wkfactors, *logins;
-    struct webauth_webkdc_proxy_data *pd;
-    size_t size;
-
-    size = sizeof(struct webauth_webkdc_proxy_data);
-    wkproxies = apr_array_make(rc->r->pool, 1, size);
-    wkfactors = apr_array_make(rc->r->pool, 1, sizeof(const char *));
-    logins    = apr_array_make(rc->r->pool, 1, sizeof(const char *));
-    for (child = e->first_child; child != NULL; child = child->next) {
-        if (strcmp(child->name, "proxyToken") == 0) {
-            data = get_elem_text(rc, child, mwk_func);
-            if (data == NULL)
-                return MWK_ERROR;
-            pd = &APR_ARRAY_PUSH(wkproxies, struct webauth_webkdc_proxy_data);
-            pd->token = data;
-            for (a = child->attr; a != NULL; a = a->next)
-                if (strcmp(a->name, "source") == 0) {
-                    pd->source = a->value;
-                    break;
-                }
-        } else if (strcmp(child->name, "loginToken") == 0) {
-            data = get_elem_text(rc, child, mwk_func);
-            if (data == NULL)
-                return MWK_ERROR;
-            APR_ARRAY_PUSH(logins, const char *) = data;
-        } else if (strcmp(child->name, "factorToken") == 0) {
-            data = get_elem_text(rc, child, mwk_func);
-            if (data == NULL)
-                return MWK_ERROR;
-            APR_ARRAY_PUSH(wkfactors, const char *) = data;
-        } else {
-            unknown_element(rc, mwk_func, e->name, child->name);
-            return MWK_ERROR;
-        }
-    }
-    request->wkproxies = wkproxies;
-    request->wkfactors = wkfactors;
-    request->logins    = logins;
-    return MWK_OK;
-}
-
-
-static enum mwk_status
-parse_requestInfo(MWK_REQ_CTXT *rc, apr_xml_elem *e,
+parse_requestInfo(MWK_REQ_CTXT *rc, const struct mwk_request *info,
                   struct webauth_webkdc_login_request *request)
 {
     static const char *mwk_func = "parse_requestInfo";
-    apr_xml_elem *ie;
 
-    for (ie = e->first_child; ie; ie = ie->next) {
-        if (strcmp(ie->name, "localIpAddr") == 0) {
-            request->local_ip = get_elem_text(rc, ie, mwk_func);
-            if (request->local_ip == NULL)
-                return MWK_ERROR;
-        } else if (strcmp(ie->name, "localIpPort") == 0) {
-            request->local_port = get_elem_text(rc, ie, mwk_func);
-            if (request->local_port == NULL)
-                return MWK_ERROR;
-        } else if (strcmp(ie->name, "remoteIpAddr") == 0) {
-            request->remote_ip = get_elem_text(rc, ie, mwk_func);
-            if (request->remote_ip == NULL)
-                return MWK_ERROR;
-        } else if (strcmp(ie->name, "remoteIpPort") == 0) {
-            request->remote_port = get_elem_text(rc, ie, mwk_func);
-            if (request->remote_port == NULL)
-                return MWK_ERROR;
-        } else if (strcmp(ie->name, "remoteUser") == 0) {
-            request->remote_user = get_elem_text(rc, ie, mwk_func);
-            if (request->remote_user == NULL)
-                return MWK_ERROR;
-        } else {
-            unknown_element(rc, mwk_func, e->name, ie->name);
-            return MWK_ERROR;
-        }
-    }
+    request->local_ip    = info->local_ip;
+    request->local_port  = info->local_port;
+    request->remote_ip   = info->remote_ip;
+    request->remote_port = info->remote_port;
+    request->remote_user = info->remote_user;
     if (request->remote_user == NULL
         && (request->local_ip == NULL ||
             request->local_port == NULL ||
@@ -1495,17 +1329,17 @@ print_xml_array(MWK_REQ_CTXT *rc, const char *tag,
     for (i = 0; i < array->nelts; i++) {
         string = APR_ARRAY_IDX(array, i, const char *);
         string = apr_xml_quote_string(rc->r->pool, string, false);
-        ap_rprintf(rc->r, "<%s>%s</%s>", tag, string, tag);
+        mwk_rprintf(rc->out, "<%s>%s</%s>", tag, string, tag);
     }
 }
 
 
 static enum mwk_status
-handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
+handle_requestTokenRequest(MWK_REQ_CTXT *rc,
+                           const struct mwk_request *xml_request,
                            const char **req_subject_out,
                            const char **subject_out)
 {
-    apr_xml_elem *child;
     static const char *mwk_func="handle_requestTokenRequest";
     void *ls_data;
     int i, status;
@@ -1528,40 +1362,22 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
     memset(&request, 0, sizeof(request));
     request.client_ip = rc->r->useragent_ip;
 
-    /* walk through each child element in <requestTokenRequest> */
-    for (child = e->first_child; child; child = child->next) {
-        if (strcmp(child->name, "requesterCredential") == 0) {
-            if (!parse_service_token(rc, child, &request, &service))
-                return MWK_ERROR;
-        } else if (strcmp(child->name, "subjectCredential") == 0) {
-            if (!parse_subject_credentials(rc, child, &request))
-                return MWK_ERROR;
-        } else if (strcmp(child->name, "requestToken") == 0) {
-            request.request = get_elem_text(rc, child, mwk_func);
-            if (request.request == NULL)
-                return set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
-                                         "invalid <requestToken>", mwk_func,
-                                         true);
-        } else if (strcmp(child->name, "authzSubject") == 0) {
-            request.authz_subject = get_elem_text(rc, child, mwk_func);
-            if (request.authz_subject == NULL)
-                return set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
-                                         "invalid <authzSubject>", mwk_func,
-                                         true);
-        } else if (strcmp(child->name, "loginState") == 0) {
-            request.login_state = get_elem_text(rc, child, mwk_func);
-            if (request.login_state == NULL)
-                return set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
-                                         "invalid <loginState>", mwk_func,
-                                         true);
-        } else if (strcmp(child->name, "requestInfo") == 0) {
-            if (!parse_requestInfo(rc, child, &request))
-                return MWK_ERROR;
-        } else {
-            unknown_element(rc, mwk_func, e->name, child->name);
+    /* copy the contents of <requestTokenRequest> into the login request */
+    if (xml_request->requester.present)
+        if (!parse_service_token(rc, &xml_request->requester, &request,
+                                 &service))
+            return MWK_ERROR;
+    if (xml_request->subject.present) {
+        request.wkproxies = xml_request->subject.proxies;
+        request.wkfactors = xml_request->subject.factors;
+        request.logins    = xml_request->subject.logins;
+    }
+    request.request       = xml_request->request_token;
+    request.authz_subject = xml_request->authz_subject;
+    request.login_state   = xml_request->login_state;
+    if (xml_request->has_request_info)
+        if (!parse_requestInfo(rc, xml_request, &request))
             return MWK_ERROR;
-        }
-    }
 
     /* make sure we found requesterCredential */
     if (request.service == NULL || service == NULL)
@@ -1620,9 +1436,11 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
      *
      * Some error messages still return a full <requestTokenResponse> so that
      * we can carry additional information.  The rest send an <errorResponse>.
+     * Pass in the webkdc-service token we already decoded so that the
+     * library doesn't decrypt it again.
      */
-    status = webauth_webkdc_login(rc->ctx, &request, &response,
-                                  rc->sconf->ring);
+    status = webauth_webkdc_login_service(rc->ctx, &request, service,
+                                          &response, rc->ring);
     if (status != WA_ERR_NONE
         && status != WA_PEC_AUTH_REJECTED
         && status != WA_PEC_LOA_UNAVAILABLE
@@ -1635,19 +1453,18 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                                  mwk_func, true);
 
     /* Send the XML response. */
-    ap_rvputs(rc->r, "<requestTokenResponse>", NULL);
+    mwk_rvputs(rc->out, "<requestTokenResponse>", NULL);
 
     if (status != WA_ERR_NONE) {
-        ap_rprintf(rc->r, "<loginErrorCode>%d</loginErrorCode>", status);
-        ap_rprintf(rc->r, "<loginErrorMessage>%s</loginErrorMessage>",
-                   apr_xml_quote_string(rc->r->pool,
-                                        webauth_error_message(rc->ctx, status),
-                                        false));
+        mwk_rprintf(rc->out, "<loginErrorCode>%d</loginErrorCode>", status);
+        mwk_rprintf(rc->out, "<loginErrorMessage>%s</loginErrorMessage>",
+                    apr_xml_quote_string(rc->r->pool,
+                        webauth_error_message(rc->ctx, status), false));
     }
 
     if (response->user_message != NULL)
-        ap_rprintf(rc->r, "<userMessage><![CDATA[%s]]></userMessage>",
-                   response->user_message);
+        mwk_rprintf(rc->out, "<userMessage><![CDATA[%s]]></userMessage>",
+                    response->user_message);
 
     if (response->login_state != NULL) {
         char *out_login_state =
@@ -1655,9 +1472,9 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
                        apr_base64_encode_len(strlen(response->login_state)));
         apr_base64_encode(out_login_state, response->login_state,
                           strlen(response->login_state));
-        ap_rvputs(rc->r,
-                  "<loginState>", out_login_state , "</loginState>",
-                  NULL);
+        mwk_rvputs(rc->out,
+                   "<loginState>", out_login_state , "</loginState>",
+                   NULL);
     }
 
     if (response->factors_configured != NULL) {
@@ -1666,134 +1483,134 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
         wanted = webauth_factors_array(rc->ctx, response->factors_wanted);
         configured = webauth_factors_array(rc->ctx,
                                            response->factors_configured);
-        ap_rvputs(rc->r, "<multifactorRequired>", NULL);
+        mwk_rvputs(rc->out, "<multifactorRequired>", NULL);
         print_xml_array(rc, "factor", wanted);
         print_xml_array(rc, "configuredFactor", configured);
         if (response->default_device != NULL
             || response->default_factor != NULL) {
-            ap_rvputs(rc->r, "<defaultFactor>", NULL);
+            mwk_rvputs(rc->out, "<defaultFactor>", NULL);
             if (response->default_device != NULL)
-                ap_rprintf(rc->r, "<id>%s</id>",
-                           apr_xml_quote_string(rc->r->pool,
-                                                response->default_device,
-                                                false));
+                mwk_rprintf(rc->out, "<id>%s</id>",
+                            apr_xml_quote_string(rc->r->pool,
+                                                 response->default_device,
+                                                 false));
             if (response->default_factor != NULL)
-                ap_rprintf(rc->r, "<factor>%s</factor>",
-                           response->default_factor);
-            ap_rvputs(rc->r, "</defaultFactor>", NULL);
+                mwk_rprintf(rc->out, "<factor>%s</factor>",
+                            response->default_factor);
+            mwk_rvputs(rc->out, "</defaultFactor>", NULL);
         }
         if (response->devices != NULL) {
             apr_array_header_t *factors;
             const apr_array_header_t *devices = response->devices;
             struct webauth_device *device;
 
-            ap_rvputs(rc->r, "<devices>", NULL);
+            mwk_rvputs(rc->out, "<devices>", NULL);
             for (i = 0; i < response->devices->nelts; i++) {
                 device = &APR_ARRAY_IDX(devices, i, struct webauth_device);
-                ap_rvputs(rc->r, "<device>", NULL);
+                mwk_rvputs(rc->out, "<device>", NULL);
                 if (device->name != NULL)
-                    ap_rprintf(rc->r, "<name>%s</name>",
-                               apr_xml_quote_string(rc->r->pool, device->name,
-                                                    false));
+                    mwk_rprintf(rc->out, "<name>%s</name>",
+                                apr_xml_quote_string(rc->r->pool, device->name,
+                                                     false));
                 if (device->id != NULL)
-                    ap_rprintf(rc->r, "<id>%s</id>",
-                               apr_xml_quote_string(rc->r->pool, device->id,
-                                                    false));
+                    mwk_rprintf(rc->out, "<id>%s</id>",
+                                apr_xml_quote_string(rc->r->pool, device->id,
+                                                     false));
                 if (device->factors != NULL) {
                     factors = webauth_factors_array(rc->ctx, device->factors);
                     print_xml_array(rc, "factor", factors);
                 }
-                ap_rvputs(rc->r, "</device>", NULL);
+                mwk_rvputs(rc->out, "</device>", NULL);
             }
-            ap_rvputs(rc->r, "</devices>", NULL);
+            mwk_rvputs(rc->out, "</devices>", NULL);
         }
-        ap_rvputs(rc->r, "</multifactorRequired>", NULL);
+        mwk_rvputs(rc->out, "</multifactorRequired>", NULL);
     }
 
     if (response->proxies != NULL) {
         struct webauth_webkdc_proxy_data *data;
 
-        ap_rvputs(rc->r, "<proxyTokens>", NULL);
+        mwk_rvputs(rc->out, "<proxyTokens>", NULL);
         for (i = 0; i < response->proxies->nelts; i++) {
             data = &APR_ARRAY_IDX(response->proxies, i,
                                   struct webauth_webkdc_proxy_data);
-            ap_rvputs(rc->r, "<proxyToken type='", data->type, "'>",
-                      data->token, "</proxyToken>", NULL);
+            mwk_rvputs(rc->out, "<proxyToken type='", data->type, "'>",
+                       data->token, "</proxyToken>", NULL);
         }
-        ap_rvputs(rc->r, "</proxyTokens>", NULL);
+        mwk_rvputs(rc->out, "</proxyTokens>", NULL);
     }
 
     if (response->factor_tokens != NULL) {
         struct webauth_webkdc_factor_data *data;
 
-        ap_rvputs(rc->r, "<factorTokens>", NULL);
+        mwk_rvputs(rc->out, "<factorTokens>", NULL);
         for (i = 0; i < response->factor_tokens->nelts; i++) {
             data = &APR_ARRAY_IDX(response->factor_tokens, i,
                                   struct webauth_webkdc_factor_data);
-            ap_rprintf(rc->r, "<factorToken expires='%lu'>%s</factorToken>",
-                       (unsigned long) data->expiration, data->token);
+            mwk_rprintf(rc->out, "<factorToken expires='%lu'>%s</factorToken>",
+                        (unsigned long) data->expiration, data->token);
         }
-        ap_rvputs(rc->r, "</factorTokens>", NULL);
+        mwk_rvputs(rc->out, "</factorTokens>", NULL);
     }
 
     /* put out return-url */
-    ap_rvputs(rc->r,"<returnUrl>",
-              apr_xml_quote_string(rc->r->pool, response->return_url, 1),
-              "</returnUrl>", NULL);
+    mwk_rvputs(rc->out, "<returnUrl>",
+               apr_xml_quote_string(rc->r->pool, response->return_url, 1),
+               "</returnUrl>", NULL);
 
     /* requesterSubject */
-    ap_rvputs(rc->r,
-              "<requesterSubject>",
-              apr_xml_quote_string(rc->r->pool, response->requester, 1),
-              "</requesterSubject>", NULL);
+    mwk_rvputs(rc->out,
+               "<requesterSubject>",
+               apr_xml_quote_string(rc->r->pool, response->requester, 1),
+               "</requesterSubject>", NULL);
 
     /* subject (if present) */
     if (response->subject != NULL) {
-        ap_rvputs(rc->r,
-                  "<subject>",
-                  apr_xml_quote_string(rc->r->pool, response->subject, 1),
-                  "</subject>", NULL);
+        mwk_rvputs(rc->out,
+                   "<subject>",
+                   apr_xml_quote_string(rc->r->pool, response->subject, 1),
+                   "</subject>", NULL);
     }
 
     /* authzSubject (if present) */
     if (response->authz_subject != NULL) {
-        ap_rvputs(rc->r,
-                  "<authzSubject>",
-                  apr_xml_quote_string(rc->r->pool, response->authz_subject,
-                                       1),
-                  "</authzSubject>", NULL);
+        mwk_rvputs(rc->out,
+                   "<authzSubject>",
+                   apr_xml_quote_string(rc->r->pool, response->authz_subject,
+                                        1),
+                   "</authzSubject>", NULL);
     }
 
     /* permittedAuthzSubjects (if present) */
     if (response->permitted_authz != NULL) {
         const char *authz;
 
-        ap_rvputs(rc->r, "<permittedAuthzSubjects>", NULL);
+        mwk_rvputs(rc->out, "<permittedAuthzSubjects>", NULL);
         for (i = 0; i < response->permitted_authz->nelts; i++) {
             authz = APR_ARRAY_IDX(response->permitted_authz, i, const char *);
-            ap_rvputs(rc->r, "<authzSubject>",
-                      apr_xml_quote_string(rc->r->pool, authz, 1),
-                      "</authzSubject>", NULL);
+            mwk_rvputs(rc->out, "<authzSubject>",
+                       apr_xml_quote_string(rc->r->pool, authz, 1),
+                       "</authzSubject>", NULL);
         }
-        ap_rvputs(rc->r, "</permittedAuthzSubjects>", NULL);
+        mwk_rvputs(rc->out, "</permittedAuthzSubjects>", NULL);
     }
 
     /* requestedToken, don't need to quote */
     if (response->result != NULL) {
-        ap_rvputs(rc->r,
-                  "<requestedToken>",
-                  response->result,
-                  "</requestedToken>",
-                  NULL);
-        ap_rvputs(rc->r,
-                  "<requestedTokenType>",
-                  apr_xml_quote_string(rc->r->pool, response->result_type, 1),
-                  "</requestedTokenType>", NULL);
+        mwk_rvputs(rc->out,
+                   "<requestedToken>",
+                   response->result,
+                   "</requestedToken>",
+                   NULL);
+        mwk_rvputs(rc->out,
+                   "<requestedTokenType>",
+                   apr_xml_quote_string(rc->r->pool, response->result_type, 1),
+                   "</requestedTokenType>", NULL);
     }
 
     if (response->login_cancel != NULL) {
-        ap_rvputs(rc->r, "<loginCanceledToken>", response->login_cancel,
-                  "</loginCanceledToken>", NULL);
+        mwk_rvputs(rc->out, "<loginCanceledToken>", response->login_cancel,
+                   "</loginCanceledToken>", NULL);
     }
 
     /* appState, need to base64-encode */
@@ -1804,50 +1621,49 @@ handle_requestTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
         apr_base64_encode(out_state, response->app_state,
                           response->app_state_len);
         /*  don't need to quote */
-        ap_rvputs(rc->r,
-                  "<appState>", out_state , "</appState>",
-                  NULL);
+        mwk_rvputs(rc->out,
+                   "<appState>", out_state , "</appState>",
+                   NULL);
     }
 
     /* loginHistory (if present) */
     if (response->logins != NULL) {
         struct webauth_login *login;
 
-        ap_rvputs(rc->r, "<loginHistory>", NULL);
+        mwk_rvputs(rc->out, "<loginHistory>", NULL);
         for (i = 0; i < response->logins->nelts; i++) {
             login = &APR_ARRAY_IDX(response->logins, i, struct webauth_login);
-            ap_rvputs(rc->r, "<loginLocation", NULL);
+            mwk_rvputs(rc->out, "<loginLocation", NULL);
             if (login->hostname != NULL)
-                ap_rvputs(rc->r, " name=\"", login->hostname, "\"", NULL);
+                mwk_rvputs(rc->out, " name=\"", login->hostname, "\"", NULL);
             if (login->timestamp != 0)
-                ap_rprintf(rc->r, " time=\"%lu\"",
-                           (unsigned long) login->timestamp);
-            ap_rvputs(rc->r, ">", login->ip, "</loginLocation>", NULL);
+                mwk_rprintf(rc->out, " time=\"%lu\"",
+                            (unsigned long) login->timestamp);
+            mwk_rvputs(rc->out, ">", login->ip, "</loginLocation>", NULL);
         }
-        ap_rvputs(rc->r, "</loginHistory>", NULL);
+        mwk_rvputs(rc->out, "</loginHistory>", NULL);
     }
 
     /* passwordExpires (if present) */
     if (response->password_expires > 0)
-        ap_rprintf(rc->r, "<passwordExpires>%lu</passwordExpires>",
-                   (unsigned long) response->password_expires);
+        mwk_rprintf(rc->out, "<passwordExpires>%lu</passwordExpires>",
+                    (unsigned long) response->password_expires);
 
-    ap_rvputs(rc->r, "</requestTokenResponse>", NULL);
-    ap_rflush(rc->r);
+    mwk_rvputs(rc->out, "</requestTokenResponse>", NULL);
 
     return MWK_OK;
 }
 
 
 static enum mwk_status
-handle_webkdcProxyTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
+handle_webkdcProxyTokenRequest(MWK_REQ_CTXT *rc,
+                               const struct mwk_request *request,
                                char **subject_out)
 {
-    apr_xml_elem *child;
     static const char *mwk_func = "handle_webkdcProxyTokenRequest";
     enum mwk_status ms;
-    char *bsc_data = NULL;
-    char *bpd_data = NULL;
+    const char *bsc_data = NULL;
+    const char *bpd_data = NULL;
     void *sc_data, *pd_data, *dpd_data, *tgt;
     const char *token_data;
     size_t sc_len, pd_len, dpd_len, tgt_len;
@@ -1862,31 +1678,22 @@ handle_webkdcProxyTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
     client_principal = NULL;
     ms = MWK_ERROR;
 
-    /* walk through each child element in <requestTokenRequest> */
-    for (child = e->first_child; child; child = child->next) {
-        if (strcmp(child->name, "proxyData") == 0) {
-            bpd_data = get_elem_text(rc, child, mwk_func);
-            if (bpd_data == NULL)
-                return MWK_ERROR;
-        } else if (strcmp(child->name, "subjectCredential") == 0) {
-            const char *at = get_attr_value(rc, child, "type",  1, mwk_func);
-            if (at == NULL)
-                return MWK_ERROR;
+    /* check the <subjectCredential> of <webkdcProxyTokenRequest> */
+    bpd_data = request->proxy_data;
+    if (request->subject.present) {
+        const char *at = request->subject.type;
 
-            if (strcmp(at, "krb5") != 0) {
-                char *msg = apr_psprintf(rc->r->pool,
-                                        "unknown <subjectCredential> type: %s",
-                                         at);
-                return set_errorResponse(rc, WA_PEC_INVALID_REQUEST, msg,
-                                         mwk_func, true);
-            }
-            bsc_data = get_elem_text(rc, child, mwk_func);
-            if (bsc_data == NULL)
-                return MWK_ERROR;
-        } else {
-            unknown_element(rc, mwk_func, e->name, child->name);
-            return MWK_ERROR;
+        if (strcmp(at, "krb5") != 0) {
+            char *msg = apr_psprintf(rc->r->pool,
+                                     "unknown <subjectCredential> type: %s",
+                                     at);
+            return set_errorResponse(rc, WA_PEC_INVALID_REQUEST, msg,
+                                     mwk_func, true);
         }
+        bsc_data = credential_data(rc, &request->subject,
+                                   "subjectCredential", mwk_func);
+        if (bsc_data == NULL)
+            return MWK_ERROR;
     }
 
     /* make sure we found proxyData */
@@ -2022,24 +1829,23 @@ handle_webkdcProxyTokenRequest(MWK_REQ_CTXT *rc, apr_xml_elem *e,
     if (ms != MWK_OK)
         goto cleanup;
 
-    ap_rvputs(rc->r, "<webkdcProxyTokenResponse>", NULL);
+    mwk_rvputs(rc->out, "<webkdcProxyTokenResponse>", NULL);
 
-    ap_rvputs(rc->r,
-              "<webkdcProxyToken>",
-              token_data,
-              "</webkdcProxyToken>",
-              NULL);
+    mwk_rvputs(rc->out,
+               "<webkdcProxyToken>",
+               token_data,
+               "</webkdcProxyToken>",
+               NULL);
 
     /* subject */
     if (*subject_out != NULL) {
-        ap_rvputs(rc->r,
-                  "<subject>",
-                  apr_xml_quote_string(rc->r->pool, *subject_out, 1),
-                  "</subject>", NULL);
+        mwk_rvputs(rc->out,
+                   "<subject>",
+                   apr_xml_quote_string(rc->r->pool, *subject_out, 1),
+                   "</subject>", NULL);
     }
 
-    ap_rvputs(rc->r, "</webkdcProxyTokenResponse>", NULL);
-    ap_rflush(rc->r);
+    mwk_rvputs(rc->out, "</webkdcProxyTokenResponse>", NULL);
 
     ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                  "mod_webkdc: event=webkdcProxyToken from=%s user=%s",
@@ -2054,30 +1860,17 @@ cleanup:
 
 static enum mwk_status
 handle_webkdcProxyTokenInfoRequest(MWK_REQ_CTXT *rc,
-                                   apr_xml_elem *e,
+                                   const struct mwk_request *request,
                                    const char **subject_out)
 {
-    apr_xml_elem *child;
     static const char *mwk_func="handle_webkdcProxyTokenInfoRequest";
     enum mwk_status ms;
     struct webauth_token_webkdc_proxy pt;
-    char *pt_data;
+    const char *pt_data;
 
-    pt_data = NULL;
+    pt_data = request->proxy_token;
     *subject_out = "<unknown>";
 
-    /* walk through each child element in <requestTokenRequest> */
-    for (child = e->first_child; child; child = child->next) {
-        if (strcmp(child->name, "webkdcProxyToken") == 0) {
-            pt_data = get_elem_text(rc, child, mwk_func);
-            if (pt_data == NULL)
-                return MWK_ERROR;
-        } else {
-            unknown_element(rc, mwk_func, e->name, child->name);
-            return MWK_ERROR;
-        }
-    }
-
     /* make sure we found token */
     if (pt_data == NULL) {
         return set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
@@ -2088,24 +1881,24 @@ handle_webkdcProxyTokenInfoRequest(MWK_REQ_CTXT *rc,
     if (!parse_webkdc_proxy_token(rc, pt_data, &pt))
         return MWK_ERROR;
 
-    ap_rvputs(rc->r, "<webkdcProxyTokenInfoResponse>", NULL);
+    mwk_rvputs(rc->out, "<webkdcProxyTokenInfoResponse>", NULL);
 
     /* subject */
-    ap_rvputs(rc->r,
-             "<subject>",
-             apr_xml_quote_string(rc->r->pool, pt.subject, 1),
-             "</subject>", NULL);
+    mwk_rvputs(rc->out,
+               "<subject>",
+               apr_xml_quote_string(rc->r->pool, pt.subject, 1),
+               "</subject>", NULL);
 
-    ap_rvputs(rc->r,
-             "<proxyType>",
-             apr_xml_quote_string(rc->r->pool, pt.proxy_type, 1),
-             "</proxyType>", NULL);
+    mwk_rvputs(rc->out,
+               "<proxyType>",
+               apr_xml_quote_string(rc->r->pool, pt.proxy_type, 1),
+               "</proxyType>", NULL);
 
-    ap_rprintf(rc->r, "<creationTime>%d</creationTime>", (int)pt.creation);
-    ap_rprintf(rc->r, "<expirationTime>%d</expirationTime>", (int)pt.expiration);
+    mwk_rprintf(rc->out, "<creationTime>%d</creationTime>", (int)pt.creation);
+    mwk_rprintf(rc->out, "<expirationTime>%d</expirationTime>",
+                (int)pt.expiration);
 
-    ap_rvputs(rc->r, "</webkdcProxyTokenInfoResponse>", NULL);
-    ap_rflush(rc->r);
+    mwk_rvputs(rc->out, "</webkdcProxyTokenInfoResponse>", NULL);
 
     *subject_out = pt.subject;
     ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
@@ -2123,16 +1916,25 @@ parse_request(MWK_REQ_CTXT *rc)
     int s;
     ssize_t num_read;
     char buff[8192];
-    apr_xml_parser *xp;
-    apr_xml_doc *xd;
-    apr_status_t astatus;
+    struct mwk_parser *parser;
+    struct mwk_request request;
+    apr_size_t limit;
+    bool ok;
+    int code;
+    const char *message;
     const char *mwk_func = "parse_request";
 
-    xp = apr_xml_parser_create(rc->r->pool);
-    if (xp == NULL) {
+    /*
+     * The request is parsed as it is read, so a request that is too large or
+     * doesn't match the schema is rejected without reading the rest of it.
+     * LimitXMLRequestBody sets the largest request body we'll accept.
+     */
+    limit = ap_get_limit_xml_body(rc->r);
+    parser = mwk_parser_create(rc->r->pool, &request, limit);
+    if (parser == NULL) {
         ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
                      "mod_webkdc: %s: "
-                     "apr_xml_parser_create failed", mwk_func);
+                     "mwk_parser_create failed", mwk_func);
         set_errorResponse(rc, WA_PEC_SERVER_FAILURE,
                           "server failure", mwk_func, false);
         generate_errorResponse(rc);
@@ -2143,45 +1945,58 @@ parse_request(MWK_REQ_CTXT *rc)
     if (s!= OK)
         return s;
 
-    astatus = APR_SUCCESS;
-    num_read = 0;
+    /* If we know the length up front, don't bother reading a large body. */
+    if (limit > 0 && rc->r->remaining > (apr_off_t) limit) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webkdc: %s: request body too large (from %s)",
+                     mwk_func, rc->r->useragent_ip);
+        set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
+                          "request body too large", mwk_func, false);
+        generate_errorResponse(rc);
+        return OK;
+    }
 
-    while (astatus == APR_SUCCESS &&
+    ok = true;
+    num_read = 0;
+    while (ok &&
            ((num_read = ap_get_client_block(rc->r, buff, sizeof(buff))) > 0)) {
-        astatus = apr_xml_parser_feed(xp, buff, num_read);
+        ok = mwk_parser_feed(parser, buff, num_read);
     }
+    if (ok && num_read < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
+                     "mod_webkdc: %s: ap_get_client_block error", mwk_func);
+        set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
+                          "read error while parsing", mwk_func, false);
+        generate_errorResponse(rc);
+        return OK;
+    }
+    if (ok)
+        ok = mwk_parser_done(parser);
 
-    if (num_read == 0 && astatus == APR_SUCCESS)
-        astatus = apr_xml_parser_done(xp, &xd);
-
-    if ((num_read < 0) || astatus != APR_SUCCESS) {
-        if (astatus != APR_SUCCESS) {
-            char errbuff[1024] = "";
-            apr_xml_parser_geterror(xp, errbuff, sizeof(errbuff));
-            ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                         "mod_webkdc: %s: "
-                         "apr_xml_parser_feed failed: %s (%d)",
-                         mwk_func,
-                         errbuff,
-                         astatus);
-            set_errorResponse(rc, WA_PEC_INVALID_REQUEST, errbuff,
-                              mwk_func, false);
-            generate_errorResponse(rc);
-            return OK;
-        } else {
+    /*
+     * If the request was rejected before we knew what command it was, such
+     * as for malformed XML or an unknown command, log and return the error
+     * here.  Otherwise, report it the same way as an error from the handler
+     * for that command.
+     */
+    if (!ok) {
+        code = mwk_parser_error(parser, &message);
+        if (request.command == MWK_CMD_NONE) {
             ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                       "mod_webkdc: %s: ap_get_client_block error", mwk_func);
-            set_errorResponse(rc, WA_PEC_INVALID_REQUEST,
-                              "read error while parsing", mwk_func, false);
+                         "mod_webkdc: %s: %s (from %s)", mwk_func, message,
+                         rc->r->useragent_ip);
+            set_errorResponse(rc, code, message, mwk_func, false);
             generate_errorResponse(rc);
             return OK;
         }
+        set_errorResponse(rc, code, message, mwk_func, true);
     }
 
-    if (strcmp(xd->root->name, "getTokensRequest") == 0) {
-        const char *req, *sub;
+    if (request.command == MWK_CMD_GET_TOKENS) {
+        const char *req = "<unknown>";
+        const char *sub = "<unknown>";
 
-        if (!handle_getTokensRequest(rc, xd->root, &req, &sub)) {
+        if (!ok || !handle_getTokensRequest(rc, &request, &req, &sub)) {
             generate_errorResponse(rc);
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                          "mod_webkdc: event=getTokens from=%s "
@@ -2197,10 +2012,11 @@ parse_request(MWK_REQ_CTXT *rc)
                                       log_escape(rc, rc->error_message))
                          );
         }
-    } else if (strcmp(xd->root->name, "requestTokenRequest") == 0) {
-        const char *req, *sub;
+    } else if (request.command == MWK_CMD_REQUEST_TOKEN) {
+        const char *req = "<unknown>";
+        const char *sub = "<unknown>";
 
-        if (!handle_requestTokenRequest(rc, xd->root, &req, &sub)) {
+        if (!ok || !handle_requestTokenRequest(rc, &request, &req, &sub)) {
             generate_errorResponse(rc);
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                          "mod_webkdc: event=requestToken from=%s "
@@ -2216,10 +2032,10 @@ parse_request(MWK_REQ_CTXT *rc)
                                       log_escape(rc, rc->error_message))
                          );
         }
-    } else if (strcmp(xd->root->name, "webkdcProxyTokenRequest") == 0) {
-        char *sub;
+    } else if (request.command == MWK_CMD_PROXY_TOKEN) {
+        char *sub = apr_pstrdup(rc->r->pool, "<unknown>");
 
-        if (!handle_webkdcProxyTokenRequest(rc, xd->root, &sub)) {
+        if (!ok || !handle_webkdcProxyTokenRequest(rc, &request, &sub)) {
             generate_errorResponse(rc);
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                          "mod_webkdc: event=webkdcProxyToken from=%s "
@@ -2234,10 +2050,10 @@ parse_request(MWK_REQ_CTXT *rc)
                                       log_escape(rc, rc->error_message))
                          );
         }
-    } else if (strcmp(xd->root->name, "webkdcProxyTokenInfoRequest") == 0) {
-        const char *sub;
+    } else if (request.command == MWK_CMD_PROXY_TOKEN_INFO) {
+        const char *sub = "<unknown>";
 
-        if (!handle_webkdcProxyTokenInfoRequest(rc, xd->root, &sub)) {
+        if (!ok || !handle_webkdcProxyTokenInfoRequest(rc, &request, &sub)) {
             generate_errorResponse(rc);
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, rc->r->server,
                          "mod_webkdc: event=webkdcProxyTokenInfo from=%s "
@@ -2252,15 +2068,6 @@ parse_request(MWK_REQ_CTXT *rc)
                                       log_escape(rc, rc->error_message))
                          );
         }
-    } else {
-        char *m = apr_psprintf(rc->r->pool, "invalid command: %s",
-                               xd->root->name);
-        ap_log_error(APLOG_MARK, APLOG_ERR, 0, rc->r->server,
-                     "mod_webkdc: %s: %s (from %s)", mwk_func, m,
-                     rc->r->useragent_ip);
-        set_errorResponse(rc, WA_PEC_INVALID_REQUEST, m, mwk_func, false);
-        generate_errorResponse(rc);
-        return OK;
     }
     return OK;
 }
@@ -2344,8 +2151,21 @@ handler_hook(request_rec *r)
     /* Our response will also be text/xml. */
     ap_set_content_type(r, "text/xml");
 
-    /* All the real work happens in parse_request. */
-    return parse_request(&rc);
+    /*
+     * All the real work happens in parse_request, which builds the response
+     * in a brigade.  Send it down the filter chain in one pass.
+     */
+    rc.out = apr_brigade_create(r->pool, r->connection->bucket_alloc);
+    status = parse_request(&rc);
+    if (status != OK)
+        return status;
+    APR_BRIGADE_INSERT_TAIL(rc.out,
+        apr_bucket_flush_create(r->connection->bucket_alloc));
+    if (ap_pass_brigade(r->output_filters, rc.out) != APR_SUCCESS)
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, r->server,
+                     "mod_webkdc: error sending response to %s",
+                     r->useragent_ip);
+    return OK;
 }
 
 
@@ -15,15 +15,23 @@
 #include <portable/stdbool.h>
 
 #include <httpd.h>
+#include <apr_atomic.h>
+#include <apr_buckets.h>
 #include <apr_pools.h>
 #include <apr_tables.h>
+#include <apr_thread_mutex.h>
 #include <sys/types.h>
 
+#include <modules/snapshot.h>
 #include <webauth/tokens.h>
+#include <webauth/webkdc.h>
 
 struct webauth_context;
 struct webauth_keyring;
 
+/* Cache of decoded webkdc-service tokens, defined in cache.c. */
+struct mwk_token_cache;
+
 /* defines for config directives */
 
 /* max number of <token>'s we will return. 64 is overkill */
@@ -34,10 +42,15 @@ struct webauth_keyring;
 #define MAX_PROXY_TOKENS_ACCEPTED 64
 #define MAX_PROXY_TOKENS_RETURNED 64
 
+/* How often (in seconds) to check whether the keyring file has changed. */
+#define KEYRING_CHECK_INTERVAL 60
+
+/* How often (in seconds) to check whether the token ACL has changed. */
+#define TOKEN_ACL_CHECK_INTERVAL 1
+
 /* enum for mutexes */
 enum mwk_mutex_type {
     MWK_MUTEX_TOKENACL,
-    MWK_MUTEX_KEYRING,
     MWK_MUTEX_MAX /* MUST BE LAST! */
 };
 
@@ -47,9 +60,28 @@ enum mwk_status {
     MWK_OK = 1
 };
 
+/* Commands understood by the WebKDC, named by the root element. */
+enum mwk_command {
+    MWK_CMD_NONE = 0,
+    MWK_CMD_GET_TOKENS,         /* <getTokensRequest> */
+    MWK_CMD_REQUEST_TOKEN,      /* <requestTokenRequest> */
+    MWK_CMD_PROXY_TOKEN,        /* <webkdcProxyTokenRequest> */
+    MWK_CMD_PROXY_TOKEN_INFO    /* <webkdcProxyTokenInfoRequest> */
+};
+
 /* Command table provided by the configuration handling code. */
 extern const command_rec webkdc_cmds[];
 
+/*
+ * A loaded keyring, published in the server configuration as a snapshot (see
+ * modules/snapshot.h) and never modified after publication.
+ */
+struct mwk_keyring_snapshot {
+    struct mod_snapshot snapshot;
+    struct webauth_keyring *ring;
+    struct mwk_token_cache *services;   /* Service tokens decoded with ring. */
+};
+
 /*
  * Server configuration.  For parameters where there's no obvious designated
  * value for when the directive hasn't been set, there's a corresponding _set
@@ -73,6 +105,7 @@ struct config {
     unsigned long login_time_limit;
     unsigned long proxy_lifetime;
     unsigned long service_lifetime;
+    unsigned long service_token_cache_size;
     unsigned long token_max_ttl;
     apr_array_header_t *local_realms;           /* Array of const char * */
     apr_array_header_t *permitted_realms;       /* Array of const char * */
@@ -87,6 +120,7 @@ struct config {
     bool key_lifetime_set;
     bool login_time_limit_set;
     bool proxy_lifetime_set;
+    bool service_token_cache_size_set;
     bool token_max_ttl_set;
 
     /*
@@ -95,9 +129,81 @@ struct config {
      * to be reset when the module is reloaded, so we store them here.
      */
     struct webauth_context *ctx;
-    struct webauth_keyring *ring;
+
+    /*
+     * The current keyring (struct mwk_keyring_snapshot) and the number of
+     * times the keyring has been reloaded since it was first loaded, which is
+     * updated atomically.
+     */
+    struct mod_snapshot_slot keyring;
+    volatile apr_uint32_t keyring_reloads;
+
+    /* The current token ACL, private to acl.c. */
+    struct mod_snapshot_slot token_acl;
+
+    /* Mutex to hold when loading the keyring for this virtual host. */
+    apr_thread_mutex_t *mutex;
 };
 
+/*
+ * A <requesterCredential> or <subjectCredential> from a request.  data is
+ * the text content, used for service and krb5 credentials.  The arrays hold
+ * the contained <proxyToken> (as struct webauth_webkdc_proxy_data),
+ * <loginToken>, and <factorToken> elements (as const char *).
+ */
+struct mwk_credential {
+    bool present;
+    const char *type;
+    const char *data;
+    apr_array_header_t *proxies;
+    apr_array_header_t *logins;
+    apr_array_header_t *factors;
+};
+
+/* A <token> from the <tokens> list of a <getTokensRequest>. */
+struct mwk_token_request {
+    const char *type;
+    const char *id;                     /* May be NULL. */
+    bool authenticator;                 /* Whether <authenticator> was seen. */
+    const char *auth_type;              /* Type of <authenticator>. */
+    const char *credential_type;
+    const char *server_principal;
+};
+
+/*
+ * A request to the WebKDC as read by the streaming request parser.  Only the
+ * fields for the request's command are set, and any element that wasn't
+ * present is NULL.  Elements that must contain data have already been
+ * checked to be non-empty.
+ */
+struct mwk_request {
+    enum mwk_command command;
+    struct mwk_credential requester;
+    struct mwk_credential subject;
+    const char *message_id;
+    const char *request_token;
+    const char *authz_subject;
+    const char *login_state;
+    const char *proxy_data;
+    const char *proxy_token;
+
+    /* <tokens> of <getTokensRequest>. */
+    bool has_tokens;
+    struct mwk_token_request tokens[MAX_TOKENS_RETURNED];
+    size_t num_tokens;
+
+    /* <requestInfo> of <requestTokenRequest>. */
+    bool has_request_info;
+    const char *local_ip;
+    const char *local_port;
+    const char *remote_ip;
+    const char *remote_port;
+    const char *remote_user;
+};
+
+/* Streaming request parser, private to request.c. */
+struct mwk_parser;
+
 /* requestInfo */
 typedef struct {
     char *local_addr;
@@ -166,10 +272,13 @@ typedef struct {
     request_rec *r;
     struct config *sconf;
     struct webauth_context *ctx;
+    struct webauth_keyring *ring; /* set by ensure_keyring_loaded */
+    struct mwk_token_cache *services; /* set by ensure_keyring_loaded */
     int error_code; /* set if an error happened */
     const char *error_message;
     const char *mwk_func; /* function error occured in */
     bool need_to_log; /* set if we need to log error  */
+    apr_bucket_brigade *out; /* response, sent when the request is done */
 } MWK_REQ_CTXT;
 
 BEGIN_DECLS
@@ -202,6 +311,26 @@ mwk_has_cred_access(MWK_REQ_CTXT *rc,
                     const char *cred);
 
 
+/* cache.c */
+
+/* Create an empty cache of at most the given number of service tokens. */
+apr_status_t mwk_token_cache_create(struct mwk_token_cache **, size_t max,
+                                    apr_pool_t *);
+
+/*
+ * Look up a webkdc-service token by its encoded form, returning a copy of the
+ * decoded token allocated from the pool, or NULL if it isn't cached or has
+ * expired.
+ */
+struct webauth_token_webkdc_service *
+    mwk_token_cache_get(struct mwk_token_cache *, const char *token,
+                        apr_pool_t *);
+
+/* Store a decoded and validated service token under its encoded form. */
+void mwk_token_cache_set(struct mwk_token_cache *, const char *token,
+                         const struct webauth_token_webkdc_service *);
+
+
 /* config.c */
 
 /* Create a new server configuration, used in the module hooks. */
@@ -223,6 +352,42 @@ void mwk_log_notice(struct webauth_context *ctx, void *, const char *);
 void mwk_log_warning(struct webauth_context *ctx, void *, const char *);
 
 
+/* request.c */
+
+/*
+ * Create a streaming parser that fills in the given request from the request
+ * body, rejecting bodies larger than limit bytes (0 for no limit).  Strings
+ * in the request are allocated from the pool.  Returns NULL on allocation
+ * failure.
+ */
+struct mwk_parser *mwk_parser_create(apr_pool_t *, struct mwk_request *,
+                                     apr_size_t limit);
+
+/*
+ * Feed the next chunk of request body to the parser, or tell it that the body
+ * is complete.  Both return false as soon as the request has been rejected.
+ */
+bool mwk_parser_feed(struct mwk_parser *, const char *, size_t);
+bool mwk_parser_done(struct mwk_parser *);
+
+/*
+ * Return the WebAuth protocol error code for a rejected request, or 0 if it
+ * hasn't been rejected, and set the error message.
+ */
+int mwk_parser_error(struct mwk_parser *, const char **message);
+
+
+/* response.c */
+
+/*
+ * Append to a response being built in a brigade, like ap_rvputs (with a
+ * NULL-terminated list of strings) and ap_rprintf.
+ */
+void mwk_rvputs(apr_bucket_brigade *, ...);
+void mwk_rprintf(apr_bucket_brigade *, const char *, ...)
+    __attribute__((__format__(printf, 2, 3)));
+
+
 /* util.c */
 
 /*
@@ -284,7 +449,29 @@ mwk_init_string(MWK_STRING *string, apr_pool_t *pool);
 void
 mwk_append_string(MWK_STRING *string, const char *in_data, size_t in_size);
 
+/*
+ * Load the keyring from disk, updating it if configured to do so, and publish
+ * it as the current keyring snapshot.  Must be called with sconf->mutex held.
+ */
 int
 mwk_cache_keyring(server_rec *serv, struct config *sconf);
 
+/*
+ * Return the current keyring snapshot without locking, holding a reference
+ * to it that is released when the given pool is cleared or destroyed.
+ * Returns NULL if no keyring has been loaded yet.
+ */
+struct mwk_keyring_snapshot *
+mwk_keyring_acquire(struct config *sconf, apr_pool_t *pool);
+
+/*
+ * Reload the keyring if the file has changed on disk since it was loaded, or
+ * if it needs a new key and automatic updates are enabled.  Only one request
+ * every KEYRING_CHECK_INTERVAL seconds does the check; for all others this
+ * returns immediately without a system call or lock.
+ */
+void
+mwk_keyring_check(server_rec *serv, struct config *sconf,
+                  apr_pool_t *pool);
+
 #endif
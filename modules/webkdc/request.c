@@ -0,0 +1,700 @@
+/*
+ * Streaming parser for WebKDC XML requests.
+ *
+ * Requests to the WebKDC are small XML documents with a fixed schema.  This
+ * parser feeds the request body to expat as it arrives and fills in a
+ * struct mwk_request directly from the parser callbacks, rather than
+ * building a DOM tree for the whole document and walking it afterwards.
+ * Element and attribute names are only copied when they're needed for an
+ * error message, and text is only kept for the elements whose contents the
+ * WebKDC uses.
+ *
+ * Because the request is checked against the schema as it is parsed, bad
+ * requests are rejected as soon as the offending element is seen: unknown
+ * elements, missing attributes, empty elements that must contain data, a
+ * <tokens> list asking for more tokens than the WebKDC will return, and
+ * request bodies larger than the configured limit.  Nothing after the error
+ * is read into memory.
+ *
+ * This file makes no calls into Apache so that it can be benchmarked outside
+ * the server.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_strings.h>
+#include <expat.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+#include <util/macros.h>
+#include <webauth/basic.h>
+
+/*
+ * The elements we know about.  The same element name may map to different
+ * identifiers depending on where it appears, since <subjectCredential>, for
+ * example, means something different in each request.
+ */
+enum element {
+    E_DOCUMENT = 0,
+
+    /* <getTokensRequest> */
+    E_GT,
+    E_GT_REQUESTER,
+    E_GT_SUBJECT,
+    E_GT_PROXY_TOKEN,
+    E_GT_LOGIN_TOKEN,
+    E_GT_MESSAGE_ID,
+    E_GT_REQUEST_TOKEN,
+    E_GT_TOKENS,
+    E_GT_TOKEN,
+    E_GT_AUTHENTICATOR,
+    E_GT_CREDENTIAL_TYPE,
+    E_GT_SERVER_PRINCIPAL,
+
+    /* <requestTokenRequest> */
+    E_RT,
+    E_RT_REQUESTER,
+    E_RT_SUBJECT,
+    E_RT_PROXY_TOKEN,
+    E_RT_LOGIN_TOKEN,
+    E_RT_FACTOR_TOKEN,
+    E_RT_REQUEST_TOKEN,
+    E_RT_AUTHZ_SUBJECT,
+    E_RT_LOGIN_STATE,
+    E_RT_REQUEST_INFO,
+    E_RT_LOCAL_IP,
+    E_RT_LOCAL_PORT,
+    E_RT_REMOTE_IP,
+    E_RT_REMOTE_PORT,
+    E_RT_REMOTE_USER,
+
+    /* <webkdcProxyTokenRequest> */
+    E_PT,
+    E_PT_PROXY_DATA,
+    E_PT_SUBJECT,
+
+    /* <webkdcProxyTokenInfoRequest> */
+    E_PTI,
+    E_PTI_TOKEN
+};
+
+/* Flags for elements in the schema. */
+#define F_STRICT    0x1         /* Unknown children are an error. */
+#define F_TEXT      0x2         /* Keep the text content. */
+#define F_REQUIRED  0x4         /* Text content must not be empty. */
+
+/*
+ * The schema.  Each entry maps an element name inside a parent element to
+ * the identifier for that element.  Elements without F_STRICT silently skip
+ * any unknown children, which matches what the WebKDC has always accepted.
+ * If error is set, it's used as the error message for an empty element
+ * instead of the default.
+ */
+struct schema {
+    enum element parent;
+    const char *name;
+    enum element id;
+    unsigned int flags;
+    const char *error;
+};
+
+#define TEXT (F_TEXT | F_REQUIRED)
+
+static const struct schema schema[] = {
+    { E_DOCUMENT, "getTokensRequest",            E_GT,    F_STRICT, NULL },
+    { E_DOCUMENT, "requestTokenRequest",         E_RT,    F_STRICT, NULL },
+    { E_DOCUMENT, "webkdcProxyTokenRequest",     E_PT,    F_STRICT, NULL },
+    { E_DOCUMENT, "webkdcProxyTokenInfoRequest", E_PTI,   F_STRICT, NULL },
+
+    { E_GT, "requesterCredential", E_GT_REQUESTER,        F_TEXT,   NULL },
+    { E_GT, "subjectCredential",   E_GT_SUBJECT,          0,        NULL },
+    { E_GT, "messageId",           E_GT_MESSAGE_ID,       TEXT,     NULL },
+    { E_GT, "requestToken",        E_GT_REQUEST_TOKEN,    TEXT,     NULL },
+    { E_GT, "tokens",              E_GT_TOKENS,           F_STRICT, NULL },
+    { E_GT_SUBJECT, "proxyToken",  E_GT_PROXY_TOKEN,      TEXT,     NULL },
+    { E_GT_SUBJECT, "loginToken",  E_GT_LOGIN_TOKEN,      TEXT,     NULL },
+    { E_GT_TOKENS, "token",        E_GT_TOKEN,            0,        NULL },
+    { E_GT_TOKEN, "authenticator", E_GT_AUTHENTICATOR,    0,        NULL },
+    { E_GT_TOKEN, "credentialType", E_GT_CREDENTIAL_TYPE, TEXT,     NULL },
+    { E_GT_TOKEN, "serverPrincipal", E_GT_SERVER_PRINCIPAL, TEXT,   NULL },
+
+    { E_RT, "requesterCredential", E_RT_REQUESTER,        F_TEXT,   NULL },
+    { E_RT, "subjectCredential",   E_RT_SUBJECT,          F_STRICT, NULL },
+    { E_RT, "requestToken",        E_RT_REQUEST_TOKEN,    TEXT,
+      "invalid <requestToken>" },
+    { E_RT, "authzSubject",        E_RT_AUTHZ_SUBJECT,    TEXT,
+      "invalid <authzSubject>" },
+    { E_RT, "loginState",          E_RT_LOGIN_STATE,      TEXT,
+      "invalid <loginState>" },
+    { E_RT, "requestInfo",         E_RT_REQUEST_INFO,     F_STRICT, NULL },
+    { E_RT_SUBJECT, "proxyToken",  E_RT_PROXY_TOKEN,      TEXT,     NULL },
+    { E_RT_SUBJECT, "loginToken",  E_RT_LOGIN_TOKEN,      TEXT,     NULL },
+    { E_RT_SUBJECT, "factorToken", E_RT_FACTOR_TOKEN,     TEXT,     NULL },
+    { E_RT_REQUEST_INFO, "localIpAddr",  E_RT_LOCAL_IP,   TEXT,     NULL },
+    { E_RT_REQUEST_INFO, "localIpPort",  E_RT_LOCAL_PORT, TEXT,     NULL },
+    { E_RT_REQUEST_INFO, "remoteIpAddr", E_RT_REMOTE_IP,  TEXT,     NULL },
+    { E_RT_REQUEST_INFO, "remoteIpPort", E_RT_REMOTE_PORT, TEXT,    NULL },
+    { E_RT_REQUEST_INFO, "remoteUser",   E_RT_REMOTE_USER, TEXT,    NULL },
+
+    { E_PT, "proxyData",           E_PT_PROXY_DATA,       TEXT,     NULL },
+    { E_PT, "subjectCredential",   E_PT_SUBJECT,          F_TEXT,   NULL },
+
+    { E_PTI, "webkdcProxyToken",   E_PTI_TOKEN,           TEXT,     NULL },
+
+    { E_DOCUMENT, NULL, E_DOCUMENT, 0, NULL }
+};
+
+/* The root pseudo-element, which only allows the command elements. */
+static const struct schema document = {
+    E_DOCUMENT, "document", E_DOCUMENT, F_STRICT, NULL
+};
+
+/*
+ * Maximum depth of known elements.  Unknown elements that are being skipped
+ * don't use the stack, so this only has to cover the schema.
+ */
+#define MAX_DEPTH 8
+
+/* A known element that's currently open. */
+struct frame {
+    const struct schema *element;
+    bool strict;
+};
+
+/* The parser state. */
+struct mwk_parser {
+    XML_Parser xp;
+    apr_pool_t *pool;
+    struct mwk_request *request;
+    apr_size_t limit;           /* Maximum body size, or 0 for no limit. */
+    apr_size_t seen;            /* Bytes of body seen so far. */
+
+    /* Stack of open known elements, with stack[0] for the document. */
+    struct frame stack[MAX_DEPTH];
+    size_t depth;
+    unsigned long skip;         /* Depth inside a skipped element. */
+
+    /* Text of the current element, if it's an F_TEXT element. */
+    char *text;
+    size_t text_len;
+    size_t text_size;
+
+    /* The credential and requested token currently being parsed, if any. */
+    struct mwk_credential *credential;
+    struct mwk_token_request *token;
+
+    /* Set if an error occurred. */
+    int error;
+    const char *message;
+};
+
+
+/*
+ * Record an error and stop parsing.  Only the first error is kept, since
+ * expat may make more callbacks after being asked to stop.
+ */
+static void
+parse_error(struct mwk_parser *parser, int code, const char *format, ...)
+{
+    va_list args;
+
+    if (parser->error != 0)
+        return;
+    parser->error = code;
+    va_start(args, format);
+    parser->message = apr_pvsprintf(parser->pool, format, args);
+    va_end(args);
+    XML_StopParser(parser->xp, XML_FALSE);
+}
+
+
+/*
+ * Find an attribute in the expat attribute list and return a copy of its
+ * value, or NULL if it's not present.
+ */
+static const char *
+find_attr(struct mwk_parser *parser, const XML_Char **attrs, const char *name)
+{
+    size_t i;
+
+    for (i = 0; attrs[i] != NULL; i += 2)
+        if (strcmp(attrs[i], name) == 0)
+            return apr_pstrdup(parser->pool, attrs[i + 1]);
+    return NULL;
+}
+
+
+/*
+ * Like find_attr, but the attribute is required and its absence is an
+ * error.
+ */
+static const char *
+require_attr(struct mwk_parser *parser, const XML_Char **attrs,
+             const struct schema *element, const char *name)
+{
+    const char *value;
+
+    value = find_attr(parser, attrs, name);
+    if (value == NULL)
+        parse_error(parser, WA_PEC_INVALID_REQUEST,
+                    "can't find attr in <%s>: %s", element->name, name);
+    return value;
+}
+
+
+/*
+ * Start a new credential, replacing any earlier one of the same kind.  As
+ * with the DOM parser this replaced, the last element wins if one is
+ * repeated.
+ */
+static struct mwk_credential *
+start_credential(struct mwk_parser *parser, struct mwk_credential *cred,
+                 const char *type)
+{
+    memset(cred, 0, sizeof(*cred));
+    cred->present = true;
+    cred->type = type;
+    cred->proxies = apr_array_make(parser->pool, 1,
+                                   sizeof(struct webauth_webkdc_proxy_data));
+    cred->logins = apr_array_make(parser->pool, 1, sizeof(const char *));
+    cred->factors = apr_array_make(parser->pool, 1, sizeof(const char *));
+    return cred;
+}
+
+
+/*
+ * Handle the start of a known element, checking its attributes and setting
+ * up any state needed for its children.  The new frame has already been
+ * pushed and may be modified.
+ */
+static void
+start_known(struct mwk_parser *parser, struct frame *frame,
+            const XML_Char **attrs)
+{
+    struct mwk_request *request = parser->request;
+    const struct schema *element = frame->element;
+    struct webauth_webkdc_proxy_data *pd;
+    const char *type;
+
+    switch (element->id) {
+    case E_GT:
+        request->command = MWK_CMD_GET_TOKENS;
+        break;
+    case E_RT:
+        request->command = MWK_CMD_REQUEST_TOKEN;
+        break;
+    case E_PT:
+        request->command = MWK_CMD_PROXY_TOKEN;
+        break;
+    case E_PTI:
+        request->command = MWK_CMD_PROXY_TOKEN_INFO;
+        break;
+
+    case E_GT_REQUESTER:
+    case E_RT_REQUESTER:
+        type = require_attr(parser, attrs, element, "type");
+        if (type != NULL)
+            parser->credential
+                = start_credential(parser, &request->requester, type);
+        break;
+    case E_GT_SUBJECT:
+    case E_PT_SUBJECT:
+        type = require_attr(parser, attrs, element, "type");
+        if (type == NULL)
+            break;
+        parser->credential
+            = start_credential(parser, &request->subject, type);
+
+        /*
+         * A proxy credential for <getTokensRequest> may only contain proxy
+         * tokens.  Other types are checked by the handler.
+         */
+        if (element->id == E_GT_SUBJECT && strcmp(type, "proxy") == 0)
+            frame->strict = true;
+        break;
+    case E_RT_SUBJECT:
+        parser->credential
+            = start_credential(parser, &request->subject, NULL);
+        break;
+    case E_GT_PROXY_TOKEN:
+    case E_RT_PROXY_TOKEN:
+        if (parser->credential->proxies->nelts >= MAX_PROXY_TOKENS_ACCEPTED) {
+            parse_error(parser, WA_PEC_INVALID_REQUEST,
+                        "too many proxy tokens");
+            break;
+        }
+        pd = &APR_ARRAY_PUSH(parser->credential->proxies,
+                             struct webauth_webkdc_proxy_data);
+        pd->source = find_attr(parser, attrs, "source");
+        break;
+
+    case E_GT_TOKENS:
+        request->has_tokens = true;
+        request->num_tokens = 0;
+        break;
+    case E_GT_TOKEN:
+        if (request->num_tokens == MAX_TOKENS_RETURNED) {
+            parse_error(parser, WA_PEC_INVALID_REQUEST,
+                        "too many tokens requested");
+            break;
+        }
+        parser->token = &request->tokens[request->num_tokens];
+        memset(parser->token, 0, sizeof(*parser->token));
+        parser->token->id = find_attr(parser, attrs, "id");
+        parser->token->type = require_attr(parser, attrs, element, "type");
+        request->num_tokens++;
+        break;
+    case E_GT_AUTHENTICATOR:
+        parser->token->authenticator = true;
+        parser->token->auth_type = find_attr(parser, attrs, "type");
+        break;
+
+    case E_RT_REQUEST_INFO:
+        request->has_request_info = true;
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+/*
+ * Handle the end of a known element, storing its text if it has any.  text
+ * is NULL for elements that don't collect text.
+ */
+static void
+end_known(struct mwk_parser *parser, const struct schema *element,
+          const char *text)
+{
+    struct mwk_request *request = parser->request;
+    struct webauth_webkdc_proxy_data *pd;
+    apr_array_header_t *proxies;
+
+    switch (element->id) {
+    case E_GT_REQUESTER:
+    case E_RT_REQUESTER:
+    case E_PT_SUBJECT:
+        if (parser->credential != NULL)
+            parser->credential->data = text;
+        parser->credential = NULL;
+        break;
+    case E_GT_SUBJECT:
+    case E_RT_SUBJECT:
+        parser->credential = NULL;
+        break;
+    case E_GT_PROXY_TOKEN:
+    case E_RT_PROXY_TOKEN:
+        proxies = parser->credential->proxies;
+        pd = &APR_ARRAY_IDX(proxies, proxies->nelts - 1,
+                            struct webauth_webkdc_proxy_data);
+        pd->token = text;
+        break;
+    case E_GT_LOGIN_TOKEN:
+    case E_RT_LOGIN_TOKEN:
+        APR_ARRAY_PUSH(parser->credential->logins, const char *) = text;
+        break;
+    case E_RT_FACTOR_TOKEN:
+        APR_ARRAY_PUSH(parser->credential->factors, const char *) = text;
+        break;
+
+    case E_GT_MESSAGE_ID:       request->message_id = text;       break;
+    case E_GT_REQUEST_TOKEN:    request->request_token = text;    break;
+    case E_RT_REQUEST_TOKEN:    request->request_token = text;    break;
+    case E_RT_AUTHZ_SUBJECT:    request->authz_subject = text;    break;
+    case E_RT_LOGIN_STATE:      request->login_state = text;      break;
+    case E_RT_LOCAL_IP:         request->local_ip = text;         break;
+    case E_RT_LOCAL_PORT:       request->local_port = text;       break;
+    case E_RT_REMOTE_IP:        request->remote_ip = text;        break;
+    case E_RT_REMOTE_PORT:      request->remote_port = text;      break;
+    case E_RT_REMOTE_USER:      request->remote_user = text;      break;
+    case E_PT_PROXY_DATA:       request->proxy_data = text;       break;
+    case E_PTI_TOKEN:           request->proxy_token = text;      break;
+
+    case E_GT_TOKEN:
+        parser->token = NULL;
+        break;
+    case E_GT_CREDENTIAL_TYPE:
+        parser->token->credential_type = text;
+        break;
+    case E_GT_SERVER_PRINCIPAL:
+        parser->token->server_principal = text;
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+/*
+ * expat callback for the start of an element.  Look the element up in the
+ * schema under its parent, and then either push it on the stack, start
+ * skipping it, or reject it.
+ */
+static void
+start_element(void *data, const XML_Char *name, const XML_Char **attrs)
+{
+    struct mwk_parser *parser = data;
+    struct frame *parent, *frame;
+    const struct schema *entry;
+
+    if (parser->error != 0)
+        return;
+    if (parser->skip > 0) {
+        parser->skip++;
+        return;
+    }
+    parent = &parser->stack[parser->depth];
+    for (entry = schema; entry->name != NULL; entry++)
+        if (entry->parent == parent->element->id
+            && strcmp(entry->name, name) == 0)
+            break;
+
+    /* A login token in a proxy <subjectCredential> is also unknown. */
+    if (entry->id == E_GT_LOGIN_TOKEN && parent->strict)
+        entry = NULL;
+
+    /* Handle unknown elements. */
+    if (entry == NULL || entry->name == NULL) {
+        if (parser->depth == 0)
+            parse_error(parser, WA_PEC_INVALID_REQUEST,
+                        "invalid command: %s", name);
+        else if (parent->strict)
+            parse_error(parser, WA_PEC_INVALID_REQUEST,
+                        "unknown element in <%s>: <%s>",
+                        parent->element->name, name);
+        else
+            parser->skip = 1;
+        return;
+    }
+
+    /* Push the element on the stack and handle its attributes. */
+    if (parser->depth + 1 >= MAX_DEPTH) {
+        parse_error(parser, WA_PEC_INVALID_REQUEST, "request nested too deep");
+        return;
+    }
+    parser->depth++;
+    frame = &parser->stack[parser->depth];
+    frame->element = entry;
+    frame->strict = (entry->flags & F_STRICT) != 0;
+    parser->text_len = 0;
+    start_known(parser, frame, attrs);
+}
+
+
+/*
+ * expat callback for the end of an element.
+ */
+static void
+end_element(void *data, const XML_Char *name UNUSED)
+{
+    struct mwk_parser *parser = data;
+    const struct schema *element;
+    const char *text = NULL;
+
+    if (parser->error != 0)
+        return;
+    if (parser->skip > 0) {
+        parser->skip--;
+        return;
+    }
+    element = parser->stack[parser->depth].element;
+    if (element->flags & F_TEXT) {
+        if (parser->text_len > 0)
+            text = apr_pstrmemdup(parser->pool, parser->text,
+                                  parser->text_len);
+        else if (element->flags & F_REQUIRED) {
+            if (element->error != NULL)
+                parse_error(parser, WA_PEC_INVALID_REQUEST, "%s",
+                            element->error);
+            else
+                parse_error(parser, WA_PEC_INVALID_REQUEST,
+                            "<%s> does not contain data", element->name);
+            return;
+        }
+        parser->text_len = 0;
+    }
+    end_known(parser, element, text);
+    parser->depth--;
+}
+
+
+/*
+ * expat callback for character data.  Only text directly inside the current
+ * known element is kept, and only if that element wants it.
+ */
+static void
+character_data(void *data, const XML_Char *s, int len)
+{
+    struct mwk_parser *parser = data;
+    const struct schema *element;
+    size_t size;
+    char *text;
+
+    if (parser->error != 0 || parser->skip > 0 || len <= 0)
+        return;
+    element = parser->stack[parser->depth].element;
+    if (!(element->flags & F_TEXT))
+        return;
+    if (parser->text_len + len + 1 > parser->text_size) {
+        size = parser->text_size * 2;
+        while (size < parser->text_len + len + 1)
+            size *= 2;
+        text = realloc(parser->text, size);
+        if (text == NULL) {
+            parse_error(parser, WA_PEC_SERVER_FAILURE, "server failure");
+            return;
+        }
+        parser->text = text;
+        parser->text_size = size;
+    }
+    memcpy(parser->text + parser->text_len, s, len);
+    parser->text_len += len;
+}
+
+
+/*
+ * expat callback for a document type declaration.  Requests never have one,
+ * and refusing them means we never have to deal with entity definitions.
+ */
+static void
+start_doctype(void *data, const XML_Char *name UNUSED,
+              const XML_Char *sysid UNUSED, const XML_Char *pubid UNUSED,
+              int has_internal_subset UNUSED)
+{
+    struct mwk_parser *parser = data;
+
+    parse_error(parser, WA_PEC_INVALID_REQUEST, "DOCTYPE not allowed");
+}
+
+
+/*
+ * Free the expat parser and the text buffer.  Registered as a cleanup on the
+ * pool used to create the parser.
+ */
+static apr_status_t
+parser_free(void *data)
+{
+    struct mwk_parser *parser = data;
+
+    if (parser->xp != NULL)
+        XML_ParserFree(parser->xp);
+    free(parser->text);
+    parser->xp = NULL;
+    parser->text = NULL;
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create a new streaming parser that will fill in the given request, which
+ * is cleared.  Any strings stored in the request are allocated from the
+ * given pool.  limit is the maximum number of bytes of request body
+ * accepted, or 0 for no limit.  Returns NULL if memory could not be
+ * allocated.
+ */
+struct mwk_parser *
+mwk_parser_create(apr_pool_t *pool, struct mwk_request *request,
+                  apr_size_t limit)
+{
+    struct mwk_parser *parser;
+
+    parser = apr_pcalloc(pool, sizeof(struct mwk_parser));
+    parser->pool = pool;
+    parser->request = request;
+    parser->limit = limit;
+    parser->stack[0].element = &document;
+    parser->stack[0].strict = true;
+    parser->text_size = 1024;
+    parser->text = malloc(parser->text_size);
+    parser->xp = XML_ParserCreate(NULL);
+    apr_pool_cleanup_register(pool, parser, parser_free,
+                              apr_pool_cleanup_null);
+    if (parser->xp == NULL || parser->text == NULL)
+        return NULL;
+    memset(request, 0, sizeof(*request));
+    XML_SetUserData(parser->xp, parser);
+    XML_SetElementHandler(parser->xp, start_element, end_element);
+    XML_SetCharacterDataHandler(parser->xp, character_data);
+    XML_SetStartDoctypeDeclHandler(parser->xp, start_doctype);
+    return parser;
+}
+
+
+/*
+ * Record an expat error, unless we stopped the parser ourselves, in which
+ * case the error is already set.
+ */
+static void
+expat_error(struct mwk_parser *parser)
+{
+    enum XML_Error code;
+
+    if (parser->error != 0)
+        return;
+    code = XML_GetErrorCode(parser->xp);
+    parse_error(parser, WA_PEC_INVALID_REQUEST,
+                "XML parser error: %s at line %lu", XML_ErrorString(code),
+                (unsigned long) XML_GetCurrentLineNumber(parser->xp));
+}
+
+
+/*
+ * Feed the next chunk of the request body to the parser.  Returns false if
+ * the request has been rejected, in which case the error can be retrieved
+ * with mwk_parser_error and no more data should be fed.
+ */
+bool
+mwk_parser_feed(struct mwk_parser *parser, const char *data, size_t length)
+{
+    if (parser->error != 0)
+        return false;
+    parser->seen += length;
+    if (parser->limit > 0 && parser->seen > parser->limit) {
+        parse_error(parser, WA_PEC_INVALID_REQUEST,
+                    "request body too large");
+        return false;
+    }
+    if (XML_Parse(parser->xp, data, length, 0) != XML_STATUS_OK)
+        expat_error(parser);
+    return parser->error == 0;
+}
+
+
+/*
+ * Tell the parser that the request body is complete.  Returns true if the
+ * request was a complete and valid document and false otherwise.
+ */
+bool
+mwk_parser_done(struct mwk_parser *parser)
+{
+    if (parser->error != 0)
+        return false;
+    if (XML_Parse(parser->xp, NULL, 0, 1) != XML_STATUS_OK)
+        expat_error(parser);
+    return parser->error == 0;
+}
+
+
+/*
+ * Return the WebAuth protocol error code for a rejected request, or 0 if
+ * there was no error, and set message to the error message.
+ */
+int
+mwk_parser_error(struct mwk_parser *parser, const char **message)
+{
+    *message = parser->message;
+    return parser->error;
+}
@@ -0,0 +1,63 @@
+/*
+ * Buffered output of WebKDC XML responses.
+ *
+ * Responses used to be written with a separate ap_rvputs or ap_rprintf call
+ * for each element, each of which goes through Apache's output filter
+ * handling on its own, and were then flushed.  Instead, each handler
+ * appends its response to a bucket brigade in the request context, which
+ * packs the response into as few heap buckets as possible, and the handler
+ * hook sends the whole brigade down the filter chain in a single pass once
+ * the request has been handled.
+ *
+ * The token data in a response is copied into the brigade rather than
+ * referenced with a pool bucket.  A pool bucket in the middle of the brigade
+ * would force a new heap bucket for the markup that follows it, and the
+ * tokens are small enough that copying them costs less than that.
+ *
+ * This file makes no calls into Apache so that it can be benchmarked outside
+ * the server.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+
+#include <apr_buckets.h>
+#include <stdarg.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+
+
+/*
+ * Append a NULL-terminated list of strings to the response, like
+ * ap_rvputs.
+ */
+void
+mwk_rvputs(apr_bucket_brigade *bb, ...)
+{
+    va_list args;
+
+    va_start(args, bb);
+    apr_brigade_vputstrs(bb, NULL, NULL, args);
+    va_end(args);
+}
+
+
+/*
+ * Append a formatted string to the response, like ap_rprintf.  The format
+ * is interpreted by the APR formatter, just as it is for ap_rprintf.
+ */
+void
+mwk_rprintf(apr_bucket_brigade *bb, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    apr_brigade_vprintf(bb, NULL, NULL, format, args);
+    va_end(args);
+}
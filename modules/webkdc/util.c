@@ -12,6 +12,7 @@
 #include <portable/apache.h>
 #include <portable/apr.h>
 
+#include <apr_atomic.h>
 #include <apr_errno.h>
 #include <apr_thread_mutex.h>
 #include <stdlib.h>
@@ -228,6 +229,50 @@ mwk_log_webauth_error(struct webauth_context *ctx, server_rec *serv,
 }
 
 
+/*
+ * Take a reference to the current keyring snapshot.  This never blocks.
+ */
+struct mwk_keyring_snapshot *
+mwk_keyring_acquire(struct config *sconf, apr_pool_t *pool)
+{
+    return mod_snapshot_acquire(&sconf->keyring, pool);
+}
+
+
+/*
+ * Check whether the keyring needs to be reloaded.  Only one thread per
+ * interval does the check, and the mutex is only taken if a reload is
+ * actually needed.  Other threads keep using the current snapshot while we
+ * reload.
+ */
+void
+mwk_keyring_check(server_rec *serv, struct config *sconf,
+                  apr_pool_t *pool)
+{
+    struct mwk_keyring_snapshot *snapshot;
+    unsigned long lifetime;
+
+    if (!mod_snapshot_check_due(&sconf->keyring, KEYRING_CHECK_INTERVAL))
+        return;
+    snapshot = mwk_keyring_acquire(sconf, pool);
+    if (snapshot == NULL)
+        return;
+    lifetime = sconf->keyring_auto_update ? sconf->key_lifetime : 0;
+    if (!mod_keyring_changed(&snapshot->snapshot, snapshot->ring,
+                             sconf->keyring_path, lifetime, pool))
+        return;
+
+    apr_thread_mutex_lock(sconf->mutex);
+    if (mwk_cache_keyring(serv, sconf) == WA_ERR_NONE) {
+        apr_atomic_inc32(&sconf->keyring_reloads);
+        ap_log_error(APLOG_MARK, APLOG_INFO, 0, serv,
+                     "mod_webkdc: reloaded changed key ring: %s",
+                     sconf->keyring_path);
+    }
+    apr_thread_mutex_unlock(sconf->mutex);
+}
+
+
 /*
  * Update the keyring for the WebKDC server, returning a WebAuth keyring
  * status code and logging the results.  This also takes care of setting
@@ -239,14 +284,36 @@ mwk_cache_keyring(server_rec *serv, struct config *sconf)
     int status;
     enum webauth_kau_status kau_status;
     int update_status;
+    apr_pool_t *pool;
+    struct webauth_context *ctx;
+    struct webauth_keyring *ring;
+    struct mwk_keyring_snapshot *snapshot;
     static const char *mwk_func = "mwk_init_keyring";
 
-    status = webauth_keyring_auto_update(sconf->ctx, sconf->keyring_path,
+    /*
+     * Each snapshot gets its own pool so that it can be freed when the last
+     * request using it is done.
+     */
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        return WA_ERR_APR;
+    status = webauth_context_init_apr(&ctx, pool);
+    if (status != WA_ERR_NONE) {
+        apr_pool_destroy(pool);
+        return status;
+    }
+
+    /*
+     * Stat the file before reading it so that if it changes while we're
+     * reading it, the next check will notice.
+     */
+    snapshot = apr_pcalloc(pool, sizeof(struct mwk_keyring_snapshot));
+    mod_snapshot_init(&snapshot->snapshot, pool, sconf->keyring_path);
+    status = webauth_keyring_auto_update(ctx, sconf->keyring_path,
                  sconf->keyring_auto_update,
                  sconf->keyring_auto_update ? sconf->key_lifetime : 0,
-                 &sconf->ring, &kau_status, &update_status);
+                 &ring, &kau_status, &update_status);
     if (status != WA_ERR_NONE) {
-        mwk_log_webauth_error(sconf->ctx, serv, status, mwk_func,
+        mwk_log_webauth_error(ctx, serv, status, mwk_func,
                               "webauth_keyring_auto_update",
                               sconf->keyring_path);
     } else {
@@ -261,7 +328,7 @@ mwk_cache_keyring(server_rec *serv, struct config *sconf)
                              mwk_func, sconf->keyring_path);
     }
     if (kau_status == WA_KAU_UPDATE && update_status != WA_ERR_NONE) {
-        mwk_log_webauth_error(sconf->ctx, serv, status, mwk_func,
+        mwk_log_webauth_error(ctx, serv, status, mwk_func,
                                   "webauth_keyring_auto_update",
                                   sconf->keyring_path);
             ap_log_error(APLOG_MARK, APLOG_WARNING, 0, serv,
@@ -288,5 +355,32 @@ mwk_cache_keyring(server_rec *serv, struct config *sconf)
                      "mod_webkdc: %s key ring: %s", msg, sconf->keyring_path);
     }
 
+    /* Publish the new keyring, or throw it away on failure. */
+    if (status != WA_ERR_NONE) {
+        apr_pool_destroy(pool);
+        return status;
+    }
+    snapshot->ring = ring;
+    if (kau_status != WA_KAU_NONE)
+        mod_snapshot_init(&snapshot->snapshot, pool, sconf->keyring_path);
+
+    /*
+     * Each keyring gets its own empty webkdc-service token cache, so tokens
+     * decoded with a previous keyring are never used.  Caching is an
+     * optimization, so carry on without it if the cache can't be created.
+     */
+    if (sconf->service_token_cache_size > 0) {
+        apr_status_t code;
+
+        code = mwk_token_cache_create(&snapshot->services,
+                                      sconf->service_token_cache_size, pool);
+        if (code != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, code, serv,
+                         "mod_webkdc: cannot create service token cache");
+            snapshot->services = NULL;
+        }
+    }
+    mod_snapshot_publish(&sconf->keyring, &snapshot->snapshot,
+                         KEYRING_CHECK_INTERVAL);
     return status;
 }
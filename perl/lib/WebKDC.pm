@@ -84,12 +84,77 @@ our %pec_mapping = (
     &WA_PEC_LOGIN_TIMEOUT               => WK_ERR_LOGIN_TIMEOUT,
 );
 
-# Get a keyring from the configured WebLogin keyring path.  This used to
-# cache, but we have to tie the lifetime to the WebAuth context, so it's not
-# easy to cache.
+# The user agent used to talk to the WebKDC and the time it was created.
+# Under FastCGI, a process handles many requests, so the user agent is kept
+# for the life of the process and its keep-alive connection is reused.
+my ($USER_AGENT, $USER_AGENT_CREATED);
+
+# The keyring read from the WebLogin keyring path, the WebAuth context that
+# owns it, and a string identifying the file that it was read from.
+my ($KEYRING, $KEYRING_WA, $KEYRING_ID);
+
+# Get a keyring from the configured WebLogin keyring path.  The keyring is
+# cached and only read again when the path, inode, size, or modification time
+# of the file changes.  A keyring doesn't keep its WebAuth context alive, so
+# the cached keyring is read with its own context that lives as long as the
+# cache does.  If the file can't be found, read it anyway with the caller's
+# context so that the caller gets the usual exception.
 sub get_keyring {
     my ($wa) = @_;
-    return WebAuth::Keyring->read ($wa, $WebKDC::Config::KEYRING_PATH);
+    my $path = $WebKDC::Config::KEYRING_PATH;
+    my @stat = stat $path;
+    if (!@stat) {
+        return WebAuth::Keyring->read ($wa, $path);
+    }
+    my $id = join (':', $path, @stat[0, 1, 7, 9]);
+    if (!defined ($KEYRING_ID) || $KEYRING_ID ne $id) {
+        my $keyring_wa = WebAuth->new;
+        my $keyring = WebAuth::Keyring->read ($keyring_wa, $path);
+        ($KEYRING, $KEYRING_WA, $KEYRING_ID) = ($keyring, $keyring_wa, $id);
+    }
+    return $KEYRING;
+}
+
+# Return the user agent to use to talk to the WebKDC, creating it if needed.
+# Keep-alive is enabled so that each request doesn't have to make a new
+# connection (and, normally, do a new TLS handshake) to the WebKDC.  If
+# $WEBKDC_CONNECTION_LIFETIME is set, the user agent and its connection are
+# replaced once they are older than that many seconds.
+sub user_agent {
+    my $lifetime = $WebKDC::Config::WEBKDC_CONNECTION_LIFETIME;
+    if ($USER_AGENT && $lifetime && time >= $USER_AGENT_CREATED + $lifetime) {
+        undef $USER_AGENT;
+    }
+    if (!$USER_AGENT) {
+        $USER_AGENT = LWP::UserAgent->new (keep_alive => 1);
+        $USER_AGENT_CREATED = time;
+    }
+    return $USER_AGENT;
+}
+
+# Post an XML document to the WebKDC and return the HTTP::Response.  If this
+# fails, drop the kept-alive connection, since the WebKDC may have closed it,
+# and retry once.  It's also common for this to fail due to EINTR because the
+# FastCGI process manager is trying to shut down the login.fcgi process, in
+# which case it should only fail once and the second try should succeed.
+# Throws an exception if the second try fails as well.
+sub post_to_webkdc {
+    my ($xml) = @_;
+    my $ua = user_agent;
+    my $http_req = HTTP::Request->new (POST => $WebKDC::Config::URL);
+    $http_req->content_type ('text/xml');
+    $http_req->content ($xml);
+    my $http_res = $ua->request ($http_req);
+    if (!$http_res->is_success) {
+        $ua->conn_cache->drop;
+        $http_res = $ua->request ($http_req);
+    }
+    if (!$http_res->is_success) {
+        my $error = 'post to WebKDC failed: ' . $http_res->status_line;
+        warn "$error\n";
+        throw (WK_ERR_UNRECOVERABLE_ERROR, $error);
+    }
+    return $http_res;
 }
 
 # Throw a WebKDCException with the given error code and error message and
@@ -160,19 +225,8 @@ sub proxy_token_request {
     $webkdc_doc->start ('proxyData', undef, $tgt)->end;
     $webkdc_doc->end ('webkdcProxyTokenRequest');
 
-    # Send the request to the WebKDC.
-    my $ua = LWP::UserAgent->new;
-    my $http_req = HTTP::Request->new (POST => $WebKDC::Config::URL);
-    $http_req->content_type ('text/xml');
-    $http_req->content ($webkdc_doc->root->to_string);
-
-    # Get the response.
-    my $http_res = $ua->request ($http_req);
-    if (!$http_res->is_success) {
-        my $error = 'post to WebKDC failed: ' . $http_res->status_line;
-        warn "$error\n";
-        throw (WK_ERR_UNRECOVERABLE_ERROR, $error);
-    }
+    # Send the request to the WebKDC and get the response.
+    my $http_res = post_to_webkdc ($webkdc_doc->root->to_string);
     my $root = eval { WebKDC::XmlElement->new ($http_res->content) };
     if ($@) {
         my $error = $@;
@@ -277,24 +331,8 @@ sub request_token_request {
     }
     $webkdc_doc->end ('requestTokenRequest');
 
-    # Send the request to the WebKDC.  If this fails, retry once.  It's common
-    # for this to fail due to EINTR because the FastCGI process manager is
-    # trying to shut down the login.fcgi process, in which case it should only
-    # fail once and the second try should succeed.
-    my $xml = $webkdc_doc->root->to_string (1);
-    my $ua = LWP::UserAgent->new;
-    my $http_req = HTTP::Request->new (POST => $WebKDC::Config::URL);
-    $http_req->content_type ('text/xml');
-    $http_req->content ($webkdc_doc->root->to_string);
-    my $http_res = $ua->request ($http_req);
-    if (!$http_res->is_success) {
-        $http_res = $ua->request ($http_req);
-    }
-    if (!$http_res->is_success) {
-        my $error = 'post to WebKDC failed: ' . $http_res->status_line;
-        warn "$error\n";
-        throw (WK_ERR_UNRECOVERABLE_ERROR, $error);
-    }
+    # Send the request to the WebKDC.
+    my $http_res = post_to_webkdc ($webkdc_doc->root->to_string);
 
     # XML::Parser will choke on all non-ASCII that isn't UTF-8.  This causes
     # problems when users enter usernames that contain ISO 8859-1 characters
@@ -571,7 +609,26 @@ any failure, we throw an exception with a specific error code.
 
 =item get_keyring (WA)
 
-Returns a keyring object from the configured WebLogin keyring path.
+Returns a keyring object from the configured WebLogin keyring path.  The
+keyring is cached for the life of the process and read again only when
+the keyring file changes.  The cached keyring uses its own WebAuth
+context, so it may be used with any WA, but the returned object should
+not be kept past the next call to get_keyring.
+
+=item user_agent ()
+
+Returns the LWP::UserAgent used to talk to the WebKDC.  It is kept for the
+life of the process with keep-alive enabled so that requests reuse the
+same connection, and is replaced once it is older than
+$WEBKDC_CONNECTION_LIFETIME seconds if that WebKDC::Config setting is
+set.
+
+=item post_to_webkdc (XML)
+
+Posts the XML document XML to the WebKDC and returns the HTTP::Response.
+If the post fails, the connection is dropped and the post is tried once
+more.  If that fails as well, we throw an exception of type
+WK_ERR_UNRECOVERABLE_ERROR.
 
 =item get_child_value (ELEMENT, NAME, OPT)
 
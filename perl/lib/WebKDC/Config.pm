@@ -41,6 +41,7 @@ our $KEYRING_PATH = "../conf/webkdc/keyring";
 our $TEMPLATE_PATH = "/usr/local/share/weblogin/generic/templates";
 our $TEMPLATE_COMPILE_PATH = "/usr/local/share/weblogin/generic/templates/ttc";
 our $URL = "https://localhost/webkdc-service/";
+our $WEBKDC_CONNECTION_LIFETIME = 5 * 60;
 
 our $BYPASS_CONFIRM;
 our $DEFAULT_REALM;
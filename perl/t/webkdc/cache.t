@@ -0,0 +1,80 @@
+#!/usr/bin/perl
+#
+# Tests for the keyring and user agent kept across requests by WebKDC.
+#
+# Written by agent <agent@local>
+# Copyright 2026
+#     The Board of Trustees of the Leland Stanford Junior University
+#
+# See LICENSE for licensing terms.
+
+use strict;
+use warnings;
+
+use Test::More tests => 12;
+
+use lib ('t/lib', 'lib', 'blib/arch');
+use WebAuth qw(:const);
+use WebAuth::Keyring;
+
+BEGIN {
+    use_ok ('WebKDC');
+}
+
+# Write a keyring with a new key to the given path, replacing it by rename
+# the way that wa_keyring does.
+sub write_keyring {
+    my ($wa, $path) = @_;
+    my $key = $wa->key_create (WA_KEY_AES, WA_AES_128);
+    my $keyring = $wa->keyring_new ($key);
+    $keyring->write ("$path.new");
+    rename ("$path.new", $path) or die "cannot rename $path.new: $!\n";
+    return $key;
+}
+
+# Return the key data of the first key in a keyring.
+sub key_data {
+    my ($keyring) = @_;
+    my @entries = $keyring->entries;
+    return $entries[0]->key->data;
+}
+
+# Set up a keyring for the tests.
+my $wa = WebAuth->new;
+my $path = 'webkdc_keyring';
+my $key = write_keyring ($wa, $path);
+$WebKDC::Config::KEYRING_PATH = $path;
+
+# The keyring should be read once and then returned from the cache.
+my $keyring = WebKDC::get_keyring ($wa);
+isa_ok ($keyring, 'WebAuth::Keyring');
+is (key_data ($keyring), $key->data, '... with the right key');
+my $again = WebKDC::get_keyring ($wa);
+is ($again, $keyring, 'Second call returns the cached keyring');
+undef $wa;
+$wa = WebAuth->new;
+is (key_data (WebKDC::get_keyring ($wa)), $key->data,
+    '... which outlives the WebAuth context used to get it');
+
+# Replacing the keyring file should cause it to be read again.
+my $new_key = write_keyring ($wa, $path);
+$keyring = WebKDC::get_keyring ($wa);
+isnt ($keyring, $again, 'Replaced keyring is read again');
+is (key_data ($keyring), $new_key->data, '... and has the new key');
+
+# A missing keyring should throw an exception.
+unlink $path;
+$keyring = eval { WebKDC::get_keyring ($wa) };
+ok ($@, 'Missing keyring throws an exception');
+ok (!defined $keyring, '... and returns no keyring');
+
+# The user agent should be reused until it is older than the lifetime.
+$WebKDC::Config::WEBKDC_CONNECTION_LIFETIME = 0;
+my $ua = WebKDC::user_agent;
+isa_ok ($ua, 'LWP::UserAgent');
+is (WebKDC::user_agent, $ua, 'User agent is reused');
+$WebKDC::Config::WEBKDC_CONNECTION_LIFETIME = -1;
+isnt (WebKDC::user_agent, $ua, '... and replaced once it is too old');
+
+# Clean up.
+unlink ("$path.new");
@@ -0,0 +1,182 @@
+/*
+ * Benchmark base64 and hex encoding and decoding.
+ *
+ * Times each implementation the processor supports on data of the sizes of
+ * typical tokens, from a short app token to a large proxy token, and reports
+ * the throughput in MB/s of raw (decoded) data.  The apr rows are the APR
+ * base64 functions that were used to encode and decode tokens before, and
+ * the portable rows are the code used when no SIMD instructions are
+ * available.
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <apr_base64.h>
+#include <sys/time.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+
+/* Bytes of raw data to process for each measurement. */
+#define TOTAL (64 * 1024 * 1024)
+
+/* Sizes of the raw data to encode and decode. */
+static const size_t sizes[] = { 100, 256, 1024, 4096, 8192 };
+#define SIZE_COUNT 5
+#define MAX_SIZE   8192
+
+/* The codecs and operations that can be timed. */
+enum operation {
+    BASE64_ENCODE,
+    BASE64_DECODE,
+    HEX_ENCODE,
+    HEX_DECODE
+};
+static const char *const operation_names[] = {
+    "base64 encode", "base64 decode", "hex encode", "hex decode"
+};
+
+/* Names of the implementations, indexed by enum wai_simd, then APR. */
+#define IMPL_APR 4
+static const char *const impl_names[] = {
+    "portable", "sse2", "ssse3", "avx2", "apr"
+};
+
+/* Data used for the measurements. */
+static unsigned char raw[MAX_SIZE];
+static char base64[MAX_SIZE * 2];
+static char hex[MAX_SIZE * 2];
+static char output[MAX_SIZE * 2 + 1];
+
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static double
+now_nsec(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+        sysbail("cannot get time of day");
+    return (double) tv.tv_sec * 1e9 + (double) tv.tv_usec * 1e3;
+}
+
+
+/*
+ * Perform one operation on size bytes of raw data with the given
+ * implementation.  Returns a byte of the output so that the work can't be
+ * optimized away.
+ */
+static int
+run(enum operation op, int impl, size_t size)
+{
+    size_t length;
+    char saved;
+    enum wai_simd simd = (enum wai_simd) impl;
+
+    switch (op) {
+    case BASE64_ENCODE:
+        if (impl == IMPL_APR)
+            apr_base64_encode(output, (const char *) raw, (int) size);
+        else
+            wai_base64_encode_simd(simd, output, raw, size,
+                                   WAI_BASE64_STANDARD);
+        break;
+    case BASE64_DECODE:
+        length = wai_base64_encoded_length(size);
+        if (impl == IMPL_APR) {
+            saved = base64[length];
+            base64[length] = '\0';
+            apr_base64_decode_binary((unsigned char *) output, base64);
+            base64[length] = saved;
+        } else
+            wai_base64_decode_simd(simd, output, base64, length,
+                                   WAI_BASE64_STANDARD);
+        break;
+    case HEX_ENCODE:
+        wai_hex_encode_simd(simd, (const char *) raw, size, output, &length,
+                            sizeof(output));
+        break;
+    case HEX_DECODE:
+        wai_hex_decode_simd(simd, hex, size * 2, output, &length,
+                            sizeof(output));
+        break;
+    }
+    return output[size / 2];
+}
+
+
+/*
+ * Time an operation on each data size with one implementation and print a
+ * line of results.
+ */
+static void
+time_impl(enum operation op, int impl)
+{
+    size_t i, n, count;
+    double start, elapsed;
+    int result = 0;
+
+    printf("%-14s %-9s", operation_names[op], impl_names[impl]);
+    for (i = 0; i < SIZE_COUNT; i++) {
+        count = TOTAL / sizes[i];
+        start = now_nsec();
+        for (n = 0; n < count; n++)
+            result += run(op, impl, sizes[i]);
+        elapsed = now_nsec() - start;
+        printf(" %8.0f", (double) count * sizes[i] / elapsed * 1e3);
+    }
+    printf("\n");
+    if (result == 1)
+        fflush(stdout);
+}
+
+
+int
+main(void)
+{
+    size_t i, length;
+    enum wai_simd available;
+    int impl;
+
+    /* Generate the data. */
+    for (i = 0; i < MAX_SIZE; i++)
+        raw[i] = (unsigned char) (i * 37);
+    wai_base64_encode(base64, raw, MAX_SIZE, WAI_BASE64_STANDARD);
+    wai_hex_encode((const char *) raw, MAX_SIZE, hex, &length, sizeof(hex));
+
+    printf("Throughput in MB/s of decoded data\n\n");
+    printf("%-24s", "");
+    for (i = 0; i < SIZE_COUNT; i++)
+        printf(" %8lu", (unsigned long) sizes[i]);
+    printf("\n");
+
+    /* SSE2 alone isn't used for base64 and is the only level for hex. */
+    available = wai_simd_available();
+    time_impl(BASE64_ENCODE, IMPL_APR);
+    for (impl = WAI_SIMD_NONE; impl <= (int) available; impl++)
+        if (impl != WAI_SIMD_SSE2)
+            time_impl(BASE64_ENCODE, impl);
+    time_impl(BASE64_DECODE, IMPL_APR);
+    for (impl = WAI_SIMD_NONE; impl <= (int) available; impl++)
+        if (impl != WAI_SIMD_SSE2)
+            time_impl(BASE64_DECODE, impl);
+    time_impl(HEX_ENCODE, WAI_SIMD_NONE);
+    if (available >= WAI_SIMD_SSE2)
+        time_impl(HEX_ENCODE, WAI_SIMD_SSE2);
+    time_impl(HEX_DECODE, WAI_SIMD_NONE);
+    if (available >= WAI_SIMD_SSE2)
+        time_impl(HEX_DECODE, WAI_SIMD_SSE2);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * Benchmark identity ACL lookups for ACLs of various sizes.
+ *
+ * Generates identity ACL files of 10 to 100,000 lines and times lookups in
+ * each.  The parse column is the cost of reading and indexing the whole
+ * file, which is roughly what every login paid when the file was scanned
+ * for each lookup.  The hit and miss columns are lookups against the cached
+ * index for a user with an entry in the middle of the file and a user with
+ * no entries, which should not depend on the size of the file.
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <sys/time.h>
+#include <time.h>
+#include <utime.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <webauth/basic.h>
+
+/* Number of iterations of each timed lookup. */
+#define ITERATIONS 100000
+
+/* Number of times to parse each file. */
+#define PARSES 10
+
+/* The target site used for every line. */
+#define SITE "krb5:webauth/example.com@EXAMPLE.COM"
+
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static double
+now_nsec(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+        sysbail("cannot get time of day");
+    return (double) tv.tv_sec * 1e9 + (double) tv.tv_usec * 1e3;
+}
+
+
+/*
+ * Write an identity ACL file with the given number of lines, each allowing a
+ * different user to assert one other identity, with a modification time of
+ * the given number of seconds in the past so that each rewrite is seen as a
+ * change.
+ */
+static void
+write_acl(const char *path, unsigned long lines, time_t age)
+{
+    FILE *file;
+    struct utimbuf times;
+    unsigned long i;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    for (i = 0; i < lines; i++)
+        fprintf(file, "user%lu %s other%lu\n", i, SITE, i);
+    if (fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+    times.actime = time(NULL) - age;
+    times.modtime = times.actime;
+    if (utime(path, &times) < 0)
+        sysbail("cannot set modification time of %s", path);
+}
+
+
+/*
+ * Time parsing a file of the given size by rewriting it with a new
+ * modification time before each lookup, and return the average time per
+ * parse in nanoseconds.
+ */
+static double
+time_parse(struct webauth_context *ctx, const char *path,
+           unsigned long lines)
+{
+    const apr_array_header_t *result;
+    double total = 0;
+    double start;
+    int i, s;
+
+    for (i = 0; i < PARSES; i++) {
+        write_acl(path, lines, PARSES * 2 - i);
+        start = now_nsec();
+        s = wai_id_acl_lookup(ctx, path, "user0", SITE, &result);
+        total += now_nsec() - start;
+        if (s != WA_ERR_NONE)
+            bail("lookup failed: %s", webauth_error_message(ctx, s));
+    }
+    return total / PARSES;
+}
+
+
+/*
+ * Time cached lookups for the given user, checking whether the user has any
+ * identities, and return the average time per lookup in nanoseconds.  Uses
+ * a subpool that is cleared on each iteration.
+ */
+static double
+time_lookup(apr_pool_t *pool, const char *path, const char *user, bool found)
+{
+    struct webauth_context *ctx;
+    const apr_array_header_t *result;
+    apr_pool_t *sub;
+    double start;
+    int i, s;
+
+    if (apr_pool_create(&sub, pool) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    start = now_nsec();
+    for (i = 0; i < ITERATIONS; i++) {
+        if (webauth_context_init_apr(&ctx, sub) != WA_ERR_NONE)
+            bail("cannot initialize WebAuth context");
+        s = wai_id_acl_lookup(ctx, path, user, SITE, &result);
+        if (s != WA_ERR_NONE)
+            bail("lookup failed: %s", webauth_error_message(ctx, s));
+        if ((result != NULL) != found)
+            bail("unexpected lookup result for %s", user);
+        apr_pool_clear(sub);
+    }
+    start = (now_nsec() - start) / ITERATIONS;
+    apr_pool_destroy(sub);
+    return start;
+}
+
+
+int
+main(void)
+{
+    struct webauth_context *ctx;
+    apr_pool_t *pool;
+    char *tmpdir, *path, *user;
+    unsigned long lines;
+
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    tmpdir = test_tmpdir();
+    basprintf(&path, "%s/id.acl", tmpdir);
+
+    printf("Times in nanoseconds per operation (%d lookups)\n\n",
+           ITERATIONS);
+    printf("%7s %12s %9s %9s\n", "lines", "parse", "hit", "miss");
+    for (lines = 10; lines <= 100000; lines *= 10) {
+        basprintf(&user, "user%lu", lines / 2);
+        printf("%7lu %12.0f", lines, time_parse(ctx, path, lines));
+        printf(" %9.0f", time_lookup(pool, path, user, true));
+        printf(" %9.0f\n", time_lookup(pool, path, "nobody", false));
+        free(user);
+    }
+
+    unlink(path);
+    free(path);
+    test_tmpdir_free(tmpdir);
+    apr_pool_destroy(pool);
+    webauth_context_free(ctx);
+    return 0;
+}
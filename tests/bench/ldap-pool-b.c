@@ -0,0 +1,396 @@
+/*
+ * Load test of the mod_webauthldap connection pool.
+ *
+ * Runs a stand-in for the directory server on a local port that answers
+ * every search with one entry after a fixed delay, simulating the round trip
+ * to a real LDAP server, and then times a fixed number of searches spread
+ * across increasing numbers of threads.  Each search checks out a connection
+ * from the same pool that mod_webauthldap uses, binding a new connection if
+ * none is idle, and returns it afterwards.
+ *
+ * For comparison, the same searches are also timed with every search done
+ * while holding a single mutex, which is how mod_webauthldap serialized all
+ * directory access before the pool allowed concurrent searches.  With the
+ * pool, throughput should scale with the number of threads up to the size of
+ * the pool; with the global mutex, it should stay flat.
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+
+#include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ldap.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <modules/ldap/mod_webauthldap.h>
+#include <tests/tap/basic.h>
+
+/* Total number of searches timed for each number of threads. */
+#define SEARCHES 2000
+
+/* Simulated directory server latency for each search in microseconds. */
+#define LATENCY 500
+
+/* Numbers of client threads to time. */
+static const int thread_counts[] = { 1, 2, 4, 8, 16, 32 };
+
+/*
+ * Canned LDAP protocol operations sent by the stand-in server, following the
+ * message ID in each response: a successful bind result, a search result
+ * entry with no attributes, and a successful search result done.
+ */
+static const unsigned char bind_response[] = {
+    0x61, 0x07, 0x0a, 0x01, 0x00, 0x04, 0x00, 0x04, 0x00
+};
+static const unsigned char search_entry[] = {
+    0x64, 0x0c, 0x04, 0x08, 'u', 'i', 'd', '=', 'u', 's', 'e', 'r',
+    0x30, 0x00
+};
+static const unsigned char search_done[] = {
+    0x65, 0x07, 0x0a, 0x01, 0x00, 0x04, 0x00, 0x04, 0x00
+};
+
+/* State shared by the client threads. */
+struct load {
+    struct mwl_pool *pool;              /* Connection pool. */
+    apr_thread_mutex_t *global;         /* Global mutex, or NULL. */
+    const char *url;                    /* URL of the stand-in server. */
+    int searches;                       /* Searches for each thread. */
+};
+
+
+/*
+ * Read exactly length bytes from a socket.  Returns false on end of file or
+ * error.
+ */
+static bool
+read_all(int fd, unsigned char *buffer, size_t length)
+{
+    ssize_t status;
+    size_t done = 0;
+
+    while (done < length) {
+        status = read(fd, buffer + done, length - done);
+        if (status < 0 && errno == EINTR)
+            continue;
+        if (status <= 0)
+            return false;
+        done += (size_t) status;
+    }
+    return true;
+}
+
+
+/*
+ * Format an LDAP message with the given message ID (the complete BER
+ * integer) and protocol operation into output, which must be large enough,
+ * and return its length.  Both are short enough that the length always fits
+ * in the short form.
+ */
+static size_t
+format_message(unsigned char *output, const unsigned char *id, size_t idlen,
+               const unsigned char *op, size_t oplen)
+{
+    output[0] = 0x30;
+    output[1] = (unsigned char) (idlen + oplen);
+    memcpy(output + 2, id, idlen);
+    memcpy(output + 2 + idlen, op, oplen);
+    return idlen + oplen + 2;
+}
+
+
+/*
+ * Serve one client connection for the stand-in directory server.  Reads
+ * each LDAP message, answers binds immediately and searches after the
+ * simulated latency, and returns on an unbind or when the client goes away.
+ */
+static void * APR_THREAD_FUNC
+serve_client(apr_thread_t *thread, void *data)
+{
+    int fd = (int) (intptr_t) data;
+    unsigned char header[2], buffer[BUFSIZ], reply[128];
+    size_t length, idlen, size, i;
+
+    while (read_all(fd, header, sizeof(header))) {
+        if (header[0] != 0x30)
+            break;
+
+        /* Decode the message length, which may be in long form. */
+        if (header[1] < 0x80)
+            length = header[1];
+        else {
+            unsigned char bytes[4];
+
+            if ((header[1] & 0x7f) > sizeof(bytes))
+                break;
+            if (!read_all(fd, bytes, header[1] & 0x7f))
+                break;
+            for (length = 0, i = 0; i < (header[1] & 0x7fU); i++)
+                length = (length << 8) | bytes[i];
+        }
+        if (length > sizeof(buffer) || !read_all(fd, buffer, length))
+            break;
+
+        /*
+         * The message ID is an integer, followed by the operation tag.  The
+         * reply to a search is sent in a single write so that the client
+         * isn't left waiting on a delayed ACK for the second message.
+         */
+        if (length < 3 || buffer[0] != 0x02)
+            break;
+        idlen = 2 + buffer[1];
+        if (idlen >= length || idlen > 8)
+            break;
+        switch (buffer[idlen]) {
+        case 0x60:      /* bindRequest */
+            size = format_message(reply, buffer, idlen, bind_response,
+                                  sizeof(bind_response));
+            break;
+        case 0x63:      /* searchRequest */
+            apr_sleep(LATENCY);
+            size = format_message(reply, buffer, idlen, search_entry,
+                                  sizeof(search_entry));
+            size += format_message(reply + size, buffer, idlen, search_done,
+                                   sizeof(search_done));
+            break;
+        default:        /* unbindRequest or anything else */
+            goto done;
+        }
+        if (write(fd, reply, size) != (ssize_t) size)
+            sysdiag("stand-in server write failed");
+    }
+
+done:
+    close(fd);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Accept connections for the stand-in directory server, starting a thread
+ * for each.  Runs until the process exits.
+ */
+static void * APR_THREAD_FUNC
+serve(apr_thread_t *thread UNUSED, void *data)
+{
+    int listener = (int) (intptr_t) data;
+    int fd;
+    apr_pool_t *pool;
+    apr_thread_t *child;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    while ((fd = accept(listener, NULL, NULL)) >= 0)
+        if (apr_thread_create(&child, NULL, serve_client,
+                              (void *) (intptr_t) fd, pool) != APR_SUCCESS)
+            bail("cannot create server thread");
+    sysbail("stand-in server accept failed");
+    return NULL;
+}
+
+
+/*
+ * Start the stand-in server on an arbitrary local port and return the URL
+ * for connecting to it.
+ */
+static const char *
+start_server(apr_pool_t *pool)
+{
+    struct sockaddr_in sin;
+    socklen_t size;
+    int fd;
+    apr_thread_t *thread;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        sysbail("cannot create socket");
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        sysbail("cannot bind socket");
+    if (listen(fd, 64) < 0)
+        sysbail("cannot listen on socket");
+    size = sizeof(sin);
+    if (getsockname(fd, (struct sockaddr *) &sin, &size) < 0)
+        sysbail("cannot get socket address");
+    if (apr_thread_create(&thread, NULL, serve, (void *) (intptr_t) fd, pool)
+        != APR_SUCCESS)
+        bail("cannot create server thread");
+    return apr_psprintf(pool, "ldap://127.0.0.1:%d", ntohs(sin.sin_port));
+}
+
+
+/*
+ * Open and bind a new connection to the stand-in server, as
+ * webauthldap_managedbind does for the real directory server (but with an
+ * anonymous simple bind rather than GSSAPI).
+ */
+static LDAP *
+open_connection(const char *url)
+{
+    LDAP *ld;
+    int version = LDAP_VERSION3;
+    struct berval cred = { 0, NULL };
+    int rc;
+
+    if (ldap_initialize(&ld, url) != LDAP_SUCCESS)
+        bail("ldap_initialize failed for %s", url);
+    ldap_set_option(ld, LDAP_OPT_PROTOCOL_VERSION, &version);
+    rc = ldap_sasl_bind_s(ld, NULL, LDAP_SASL_SIMPLE, &cred, NULL, NULL,
+                          NULL);
+    if (rc != LDAP_SUCCESS)
+        bail("bind failed: %s", ldap_err2string(rc));
+    return ld;
+}
+
+
+/*
+ * Search for the user, the same way as webauthldap_dosearch, and check that
+ * the entry is returned.
+ */
+static void
+search(LDAP *ld)
+{
+    LDAPMessage *res;
+    int msgid, rc;
+
+    rc = ldap_search_ext(ld, "dc=example,dc=com", LDAP_SCOPE_SUBTREE,
+                         "(uid=user)", NULL, 0, NULL, NULL, NULL,
+                         LDAP_SIZELIMIT, &msgid);
+    if (rc != LDAP_SUCCESS)
+        bail("ldap_search_ext failed: %s", ldap_err2string(rc));
+    if (ldap_result(ld, msgid, LDAP_MSG_ALL, NULL, &res) <= 0)
+        bail("ldap_result failed");
+    if (ldap_count_entries(ld, res) != 1)
+        bail("search did not return one entry");
+    ldap_msgfree(res);
+}
+
+
+/*
+ * The body of each client thread.  Does its share of the searches, checking
+ * out a connection for each one.
+ */
+static void * APR_THREAD_FUNC
+client(apr_thread_t *thread, void *data)
+{
+    struct load *load = data;
+    LDAP *ld;
+    int i;
+
+    for (i = 0; i < load->searches; i++) {
+        if (load->global != NULL)
+            apr_thread_mutex_lock(load->global);
+        ld = mwl_pool_checkout(load->pool, NULL);
+        if (ld == NULL)
+            ld = open_connection(load->url);
+        search(ld);
+        mwl_pool_checkin(load->pool, ld, NULL);
+        if (load->global != NULL)
+            apr_thread_mutex_unlock(load->global);
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Time SEARCHES searches split among the given number of threads, with or
+ * without a global mutex, and return the throughput in searches per second.
+ * A new connection pool is used for each run, so the time includes binding
+ * the connections.
+ */
+static double
+time_searches(apr_pool_t *parent, const char *url, int threads, bool global)
+{
+    apr_pool_t *pool;
+    apr_thread_t **workers;
+    apr_status_t status;
+    apr_time_t start;
+    struct load load;
+    LDAP *ld;
+    size_t idle;
+    int i;
+
+    if (apr_pool_create(&pool, parent) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    memset(&load, 0, sizeof(load));
+    load.url = url;
+    load.searches = SEARCHES / threads;
+    if (mwl_pool_create(&load.pool, MAX_LDAP_CONN, pool) != APR_SUCCESS)
+        bail("cannot create connection pool");
+    if (global)
+        if (apr_thread_mutex_create(&load.global, APR_THREAD_MUTEX_DEFAULT,
+                                    pool) != APR_SUCCESS)
+            bail("cannot create mutex");
+    workers = apr_pcalloc(pool, threads * sizeof(apr_thread_t *));
+
+    start = apr_time_now();
+    for (i = 0; i < threads; i++)
+        if (apr_thread_create(&workers[i], NULL, client, &load, pool)
+            != APR_SUCCESS)
+            bail("cannot create client thread");
+    for (i = 0; i < threads; i++)
+        apr_thread_join(&status, workers[i]);
+    start = apr_time_now() - start;
+
+    /*
+     * Close the pooled connections.  Stop once the last idle one has been
+     * checked out, since checking out another from a full pool would wait.
+     */
+    do {
+        ld = mwl_pool_checkout(load.pool, &idle);
+        if (ld != NULL)
+            ldap_unbind_ext(ld, NULL, NULL);
+    } while (idle > 0);
+    apr_pool_destroy(pool);
+    return (double) load.searches * threads * APR_USEC_PER_SEC / start;
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool;
+    const char *url;
+    double global, pooled;
+    size_t i;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    url = start_server(pool);
+
+    printf("Searches per second with %dus simulated directory latency and"
+           " a pool of %d\n\n", LATENCY, MAX_LDAP_CONN);
+    printf("%7s %9s %9s\n", "threads", "global", "pool");
+    for (i = 0; i < ARRAY_SIZE(thread_counts); i++) {
+        global = time_searches(pool, url, thread_counts[i], true);
+        pooled = time_searches(pool, url, thread_counts[i], false);
+        printf("%7d %9.0f %9.0f\n", thread_counts[i], global, pooled);
+    }
+
+    apr_terminate();
+    return 0;
+}
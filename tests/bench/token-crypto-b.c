@@ -0,0 +1,297 @@
+/*
+ * Benchmark token decryption against keyrings of various sizes.
+ *
+ * Measures the cost of finding the best key in a keyring and of decrypting
+ * tokens in both the key hint and key identifier formats for keyrings of 1
+ * to 64 keys.  For each format, two cases are timed: a token encrypted with
+ * the newest key on the ring, and a token encrypted with a key that isn't on
+ * the ring at all (such as a forged token or one from another server), which
+ * is where trial decryption with every key is most expensive.
+ *
+ * It also compares the per-token cost of encryption and decryption with a
+ * keyring that is reused, so that the precomputed key schedules are used,
+ * against a keyring built for each token, which pays the cost of setting up
+ * the AES key schedules and HMAC state every time as all tokens did before
+ * the key schedules were cached.  The cost with a reused keyring is given
+ * for both the AES-CBC and HMAC-SHA1 formats and the AES-GCM format, both
+ * for a round trip and for decryption alone (the cost of reading a cookie).
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/system.h>
+
+#include <apr_pools.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+#include <webauth/basic.h>
+#include <webauth/keys.h>
+#include <webauth/tokens.h>
+
+/* Number of iterations of each timed operation. */
+#define ITERATIONS 20000
+
+/* Sample token payload, similar in size to an app token. */
+static const char payload[] =
+    "t=app;s=testuser;lt=N\2]\312;ia=p;san=c;loa=\0\0\0\1;ct=N\2]\254;"
+    "et=\177\377\377\320;";
+
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static double
+now_nsec(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+        sysbail("cannot get time of day");
+    return (double) tv.tv_sec * 1e9 + (double) tv.tv_usec * 1e3;
+}
+
+
+/*
+ * Build a keyring of the given size with one key per hour, the newest of
+ * which became valid an hour ago.
+ */
+static struct webauth_keyring *
+make_ring(struct webauth_context *ctx, size_t size)
+{
+    struct webauth_keyring *ring;
+    struct webauth_key *key;
+    time_t now, valid;
+    size_t i;
+    int s;
+
+    now = time(NULL);
+    ring = webauth_keyring_new(ctx, size);
+    for (i = 0; i < size; i++) {
+        s = webauth_key_create(ctx, WA_KEY_AES, WA_AES_128, NULL, &key);
+        if (s != WA_ERR_NONE)
+            bail("cannot create key: %s", webauth_error_message(ctx, s));
+        valid = now - (time_t) (size - i) * 3600;
+        webauth_keyring_add(ctx, ring, now, valid, key);
+    }
+    return ring;
+}
+
+
+/*
+ * Encrypt the payload in the given format with the given keyring.
+ */
+static void
+make_token(struct webauth_context *ctx, enum webauth_token_format format,
+           const struct webauth_keyring *ring, void **token, size_t *length)
+{
+    int s;
+
+    webauth_token_set_format(ctx, format);
+    s = webauth_token_encrypt(ctx, payload, sizeof(payload) - 1, token,
+                              length, ring);
+    if (s != WA_ERR_NONE)
+        bail("cannot encrypt token: %s", webauth_error_message(ctx, s));
+}
+
+
+/*
+ * Time decryption of a token with a keyring, checking that it returns the
+ * expected status, and return the average time per operation in
+ * nanoseconds.  Uses a subpool that is cleared on each iteration.
+ */
+static double
+time_decrypt(apr_pool_t *pool, const void *token, size_t length,
+             const struct webauth_keyring *ring, int expected)
+{
+    struct webauth_context *ctx;
+    apr_pool_t *sub;
+    void *out;
+    size_t outlen;
+    double start;
+    int i, s;
+
+    if (apr_pool_create(&sub, pool) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    start = now_nsec();
+    for (i = 0; i < ITERATIONS; i++) {
+        if (webauth_context_init_apr(&ctx, sub) != WA_ERR_NONE)
+            bail("cannot initialize WebAuth context");
+        s = webauth_token_decrypt(ctx, token, length, &out, &outlen, ring);
+        if (s != expected)
+            bail("unexpected decryption status %d", s);
+        apr_pool_clear(sub);
+    }
+    start = (now_nsec() - start) / ITERATIONS;
+    apr_pool_destroy(sub);
+    return start;
+}
+
+
+/*
+ * Time finding the best decryption key for the current time and return the
+ * average time per operation in nanoseconds.
+ */
+static double
+time_best_key(struct webauth_context *ctx, const struct webauth_keyring *ring)
+{
+    const struct webauth_key *key;
+    time_t now;
+    double start;
+    int i;
+
+    now = time(NULL);
+    start = now_nsec();
+    for (i = 0; i < ITERATIONS * 10; i++)
+        if (webauth_keyring_best_key(ctx, ring, WA_KEY_DECRYPT, now, &key)
+            != WA_ERR_NONE)
+            bail("cannot find best key");
+    return (now_nsec() - start) / (ITERATIONS * 10);
+}
+
+
+/*
+ * Time encrypting and then decrypting the payload with a single key in the
+ * given format and return the average time per token in nanoseconds.  If
+ * cold is true, a new keyring is created from the key for each token, so the
+ * key schedule is computed each time; otherwise, one keyring is reused.  If
+ * decrypt_only is true, one token is encrypted up front and only decryption
+ * is timed.
+ */
+static double
+time_round_trip(apr_pool_t *pool, const struct webauth_key *key,
+                enum webauth_token_format format, bool cold,
+                bool decrypt_only)
+{
+    struct webauth_context *ctx;
+    struct webauth_keyring *ring = NULL;
+    apr_pool_t *sub;
+    void *token, *out;
+    size_t length, outlen;
+    double start;
+    int i, s;
+
+    if (apr_pool_create(&sub, pool) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    ring = webauth_keyring_from_key(ctx, key);
+    make_token(ctx, format, ring, &token, &length);
+    start = now_nsec();
+    for (i = 0; i < ITERATIONS; i++) {
+        if (webauth_context_init_apr(&ctx, sub) != WA_ERR_NONE)
+            bail("cannot initialize WebAuth context");
+        if (cold)
+            ring = webauth_keyring_from_key(ctx, key);
+        s = WA_ERR_NONE;
+        if (!decrypt_only) {
+            webauth_token_set_format(ctx, format);
+            s = webauth_token_encrypt(ctx, payload, sizeof(payload) - 1,
+                                      &token, &length, ring);
+        }
+        if (s == WA_ERR_NONE)
+            s = webauth_token_decrypt(ctx, token, length, &out, &outlen,
+                                      ring);
+        if (s != WA_ERR_NONE)
+            bail("token round trip failed: %s",
+                 webauth_error_message(ctx, s));
+        apr_pool_clear(sub);
+    }
+    start = (now_nsec() - start) / ITERATIONS;
+    apr_pool_destroy(sub);
+    return start;
+}
+
+
+int
+main(void)
+{
+    struct webauth_context *ctx;
+    struct webauth_keyring *ring, *foreign;
+    apr_pool_t *pool;
+    void *hint_good, *hint_bad, *id_good, *id_bad;
+    size_t hint_len, id_len;
+    size_t size, i;
+    struct webauth_key *key;
+    int s;
+    bool gcm;
+    const enum webauth_key_size sizes[] = {
+        WA_AES_128, WA_AES_192, WA_AES_256
+    };
+
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    foreign = make_ring(ctx, 1);
+
+    printf("Times in nanoseconds per operation (%d iterations)\n\n",
+           ITERATIONS);
+    printf("%4s %9s %9s %9s %9s %9s\n", "keys", "best-key", "hint-ok",
+           "hint-bad", "keyid-ok", "keyid-bad");
+    for (size = 1; size <= 64; size *= 2) {
+        ring = make_ring(ctx, size);
+        make_token(ctx, WA_TOKEN_FORMAT_HINT, ring, &hint_good, &hint_len);
+        make_token(ctx, WA_TOKEN_FORMAT_HINT, foreign, &hint_bad, &hint_len);
+        make_token(ctx, WA_TOKEN_FORMAT_KEY_ID, ring, &id_good, &id_len);
+        make_token(ctx, WA_TOKEN_FORMAT_KEY_ID, foreign, &id_bad, &id_len);
+        printf("%4lu %9.0f %9.0f %9.0f %9.0f %9.0f\n", (unsigned long) size,
+               time_best_key(ctx, ring),
+               time_decrypt(pool, hint_good, hint_len, ring,
+                            WA_ERR_NONE),
+               time_decrypt(pool, hint_bad, hint_len, ring,
+                            WA_ERR_BAD_HMAC),
+               time_decrypt(pool, id_good, id_len, ring,
+                            WA_ERR_NONE),
+               time_decrypt(pool, id_bad, id_len, ring,
+                            WA_ERR_BAD_HMAC));
+    }
+
+
+    /*
+     * Compare cached and uncached key schedules and the CBC and GCM formats
+     * for each key size.
+     */
+    printf("\nNanoseconds per token for each key size\n\n");
+    printf("%4s %9s %9s %9s %9s %9s\n", "bits", "uncached", "cbc", "gcm",
+           "cbc-dec", "gcm-dec");
+    gcm = (webauth_token_set_format(ctx, WA_TOKEN_FORMAT_AES_GCM)
+           == WA_ERR_NONE);
+    for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+        s = webauth_key_create(ctx, WA_KEY_AES, sizes[i], NULL, &key);
+        if (s != WA_ERR_NONE)
+            bail("cannot create key: %s", webauth_error_message(ctx, s));
+        printf("%4d %9.0f %9.0f", sizes[i] * 8,
+               time_round_trip(pool, key, WA_TOKEN_FORMAT_KEY_ID, true,
+                               false),
+               time_round_trip(pool, key, WA_TOKEN_FORMAT_KEY_ID, false,
+                               false));
+        if (gcm)
+            printf(" %9.0f", time_round_trip(pool, key,
+                                             WA_TOKEN_FORMAT_AES_GCM, false,
+                                             false));
+        else
+            printf(" %9s", "n/a");
+        printf(" %9.0f", time_round_trip(pool, key, WA_TOKEN_FORMAT_KEY_ID,
+                                         false, true));
+        if (gcm)
+            printf(" %9.0f\n", time_round_trip(pool, key,
+                                               WA_TOKEN_FORMAT_AES_GCM,
+                                               false, true));
+        else
+            printf(" %9s\n", "n/a");
+    }
+
+    apr_pool_destroy(pool);
+    webauth_context_free(ctx);
+    return 0;
+}
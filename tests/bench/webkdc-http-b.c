@@ -0,0 +1,475 @@
+/*
+ * Load test of the mod_webauth pool of cURL handles for the WebKDC.
+ *
+ * Runs a stand-in for the WebKDC on a local port that speaks HTTPS with
+ * keep-alive and answers every POST with a short XML document, counting the
+ * TCP connections it accepts and the full TLS handshakes it performs (ones
+ * that didn't resume a session).  It then sends a fixed number of requests
+ * spread across increasing numbers of threads, the way post_to_webkdc does.
+ *
+ * For comparison, the same requests are also sent with a new cURL handle for
+ * each request, which is how mod_webauth talked to the WebKDC before the
+ * pool.  Every request then pays for a new connection and a full handshake.
+ * With the pool, connections and handshakes per request should be close to
+ * zero once each thread has a handle.
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/stdbool.h>
+
+#include <apr_general.h>
+#include <apr_pools.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+#include <arpa/inet.h>
+#include <curl/curl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <modules/webauth/mod_webauth.h>
+#include <tests/tap/basic.h>
+
+/* Total number of requests sent for each number of threads. */
+#define REQUESTS 1000
+
+/* Numbers of client threads to time. */
+static const int thread_counts[] = { 1, 4, 16 };
+
+/* The request body, a stand-in for a requestTokenRequest. */
+static const char request_body[] =
+    "<requestTokenRequest><requesterCredential type=\"service\">"
+    "c2VydmljZSB0b2tlbg==</requesterCredential></requestTokenRequest>";
+
+/* The response body returned by the stand-in WebKDC. */
+static const char response_body[] =
+    "<requestTokenResponse><requestToken>cmVxdWVzdCB0b2tlbg=="
+    "</requestToken></requestTokenResponse>";
+
+/* State for the stand-in WebKDC. */
+struct server {
+    SSL_CTX *ctx;                       /* TLS configuration. */
+    int listener;                       /* Listening socket. */
+    apr_thread_mutex_t *mutex;          /* Protects the counters. */
+    unsigned long connections;          /* TCP connections accepted. */
+    unsigned long handshakes;           /* Full TLS handshakes. */
+};
+
+/* A connection to the stand-in WebKDC. */
+struct connection {
+    struct server *server;              /* The server state. */
+    int fd;                             /* The accepted socket. */
+};
+
+/* State shared by the client threads. */
+struct load {
+    struct mwa_curl_pool *pool;         /* Handle pool, or NULL. */
+    const char *url;                    /* URL of the stand-in WebKDC. */
+    int requests;                       /* Requests for each thread. */
+};
+
+/* Counts for one run. */
+struct result {
+    double rate;                        /* Requests per second. */
+    double connections;                 /* TCP connections per request. */
+    double handshakes;                  /* Full TLS handshakes per request. */
+};
+
+
+/*
+ * Create the TLS configuration for the stand-in WebKDC, with a new
+ * self-signed certificate so that the benchmark needs no files.  The client
+ * doesn't verify the certificate, as with WebKdcSSLCertCheck off.
+ */
+static SSL_CTX *
+make_context(void)
+{
+    SSL_CTX *ctx;
+    EVP_PKEY_CTX *kctx;
+    EVP_PKEY *key = NULL;
+    X509 *cert;
+    X509_NAME *name;
+    static const unsigned char sid[] = "webkdc-http-b";
+
+    kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+    if (kctx == NULL || EVP_PKEY_keygen_init(kctx) <= 0)
+        bail("cannot initialize key generation");
+    if (EVP_PKEY_CTX_set_rsa_keygen_bits(kctx, 2048) <= 0)
+        bail("cannot set key size");
+    if (EVP_PKEY_keygen(kctx, &key) <= 0)
+        bail("cannot generate key");
+    EVP_PKEY_CTX_free(kctx);
+
+    cert = X509_new();
+    if (cert == NULL)
+        bail("cannot create certificate");
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_get_notBefore(cert), 0);
+    X509_gmtime_adj(X509_get_notAfter(cert), 60 * 60);
+    X509_set_pubkey(cert, key);
+    name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               (const unsigned char *) "127.0.0.1", -1, -1,
+                               0);
+    X509_set_issuer_name(cert, name);
+    if (X509_sign(cert, key, EVP_sha256()) == 0)
+        bail("cannot sign certificate");
+
+    ctx = SSL_CTX_new(SSLv23_server_method());
+    if (ctx == NULL)
+        bail("cannot create TLS context");
+    if (SSL_CTX_use_certificate(ctx, cert) != 1)
+        bail("cannot use certificate");
+    if (SSL_CTX_use_PrivateKey(ctx, key) != 1)
+        bail("cannot use private key");
+    SSL_CTX_set_session_id_context(ctx, sid, sizeof(sid) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ctx;
+}
+
+
+/*
+ * Read one HTTP request from a TLS connection into buffer, which must be
+ * large enough for the headers and body.  Only Content-Length is understood,
+ * which is all cURL sends for a POST of a fixed buffer.  Returns false on end
+ * of file or error.
+ */
+static bool
+read_request(SSL *ssl, char *buffer, size_t size)
+{
+    size_t done = 0, want = 0;
+    char *end, *length;
+    int status;
+
+    while (want == 0 || done < want) {
+        if (done >= size - 1)
+            return false;
+        status = SSL_read(ssl, buffer + done, (int) (size - 1 - done));
+        if (status <= 0)
+            return false;
+        done += (size_t) status;
+        buffer[done] = '\0';
+        if (want == 0) {
+            end = strstr(buffer, "\r\n\r\n");
+            if (end == NULL)
+                continue;
+            want = (size_t) (end + 4 - buffer);
+            length = strstr(buffer, "Content-Length:");
+            if (length != NULL && length < end)
+                want += strtoul(length + strlen("Content-Length:"), NULL, 10);
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Serve one client connection for the stand-in WebKDC.  Does the TLS
+ * handshake, counting it if it was a full one, and then answers requests on
+ * the connection until the client closes it.
+ */
+static void * APR_THREAD_FUNC
+serve_client(apr_thread_t *thread, void *data)
+{
+    struct connection *conn = data;
+    struct server *server = conn->server;
+    SSL *ssl;
+    char buffer[8192], reply[512];
+    int length;
+
+    ssl = SSL_new(server->ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, conn->fd) != 1)
+        bail("cannot create TLS connection");
+    if (SSL_accept(ssl) != 1)
+        goto done;
+    if (!SSL_session_reused(ssl)) {
+        apr_thread_mutex_lock(server->mutex);
+        server->handshakes++;
+        apr_thread_mutex_unlock(server->mutex);
+    }
+    length = snprintf(reply, sizeof(reply),
+                      "HTTP/1.1 200 OK\r\n"
+                      "Content-Type: text/xml\r\n"
+                      "Content-Length: %lu\r\n\r\n%s",
+                      (unsigned long) strlen(response_body), response_body);
+    while (read_request(ssl, buffer, sizeof(buffer)))
+        if (SSL_write(ssl, reply, length) != length)
+            break;
+
+done:
+    SSL_free(ssl);
+    close(conn->fd);
+    free(conn);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Accept connections for the stand-in WebKDC, counting them and starting a
+ * thread for each.  Runs until the process exits.
+ */
+static void * APR_THREAD_FUNC
+serve(apr_thread_t *thread UNUSED, void *data)
+{
+    struct server *server = data;
+    struct connection *conn;
+    apr_pool_t *pool;
+    apr_thread_t *child;
+    int fd, flag = 1;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    while ((fd = accept(server->listener, NULL, NULL)) >= 0) {
+        /*
+         * The TLS handshake is several small writes, so turn off Nagle so
+         * that new connections aren't penalized by delayed ACKs.
+         */
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        apr_thread_mutex_lock(server->mutex);
+        server->connections++;
+        apr_thread_mutex_unlock(server->mutex);
+        conn = bmalloc(sizeof(struct connection));
+        conn->server = server;
+        conn->fd = fd;
+        if (apr_thread_create(&child, NULL, serve_client, conn, pool)
+            != APR_SUCCESS)
+            bail("cannot create server thread");
+    }
+    sysbail("stand-in server accept failed");
+    return NULL;
+}
+
+
+/*
+ * Start the stand-in WebKDC on an arbitrary local port and return the URL
+ * for connecting to it.
+ */
+static const char *
+start_server(struct server *server, apr_pool_t *pool)
+{
+    struct sockaddr_in sin;
+    socklen_t size;
+    apr_thread_t *thread;
+
+    memset(server, 0, sizeof(*server));
+    server->ctx = make_context();
+    if (apr_thread_mutex_create(&server->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                pool) != APR_SUCCESS)
+        bail("cannot create mutex");
+    server->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listener < 0)
+        sysbail("cannot create socket");
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(server->listener, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+        sysbail("cannot bind socket");
+    if (listen(server->listener, 64) < 0)
+        sysbail("cannot listen on socket");
+    size = sizeof(sin);
+    if (getsockname(server->listener, (struct sockaddr *) &sin, &size) < 0)
+        sysbail("cannot get socket address");
+    if (apr_thread_create(&thread, NULL, serve, server, pool) != APR_SUCCESS)
+        bail("cannot create server thread");
+    return apr_psprintf(pool, "https://127.0.0.1:%d/webkdc-service/",
+                        ntohs(sin.sin_port));
+}
+
+
+/*
+ * cURL write callback that discards the response after checking that there
+ * is one.
+ */
+static size_t
+discard(void *data UNUSED, size_t size, size_t nmemb, void *userp)
+{
+    size_t *total = userp;
+
+    *total += size * nmemb;
+    return size * nmemb;
+}
+
+
+/*
+ * Send one request the same way as post_to_webkdc, using a handle from the
+ * pool if there is one and otherwise a new handle that is set up the way
+ * mod_webauth used to set up each handle.
+ */
+static void
+post(struct load *load)
+{
+    CURL *curl;
+    CURLcode code;
+    struct curl_slist *headers = NULL;
+    char errbuf[CURL_ERROR_SIZE + 1];
+    size_t total = 0;
+
+    if (load->pool != NULL)
+        curl = mwa_curl_checkout(load->pool);
+    else {
+        curl = curl_easy_init();
+        if (curl != NULL) {
+            curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1L);
+            curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+            curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15L);
+            curl_easy_setopt(curl, CURLOPT_TIMEOUT, 45L);
+        }
+    }
+    if (curl == NULL)
+        bail("cannot create cURL handle");
+    curl_easy_setopt(curl, CURLOPT_URL, load->url);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &total);
+    headers = curl_slist_append(headers, "Content-Type: text/xml");
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request_body);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE,
+                     (long) strlen(request_body));
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    errbuf[0] = '\0';
+    code = curl_easy_perform(curl);
+    if (code != CURLE_OK)
+        bail("request failed: %s", errbuf);
+    if (total != strlen(response_body))
+        bail("short response (%lu bytes)", (unsigned long) total);
+    if (load->pool != NULL)
+        mwa_curl_checkin(load->pool, curl, true);
+    else
+        curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+}
+
+
+/*
+ * The body of each client thread.  Sends its share of the requests.
+ */
+static void * APR_THREAD_FUNC
+client(apr_thread_t *thread, void *data)
+{
+    struct load *load = data;
+    int i;
+
+    for (i = 0; i < load->requests; i++)
+        post(load);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Send REQUESTS requests split among the given number of threads, with or
+ * without a handle pool, and return the throughput and the number of new
+ * connections and full handshakes per request.  A new handle pool is used
+ * for each run, so the counts include the first connection of each handle.
+ */
+static struct result
+time_requests(apr_pool_t *parent, struct server *server, const char *url,
+              int threads, bool pooled)
+{
+    apr_pool_t *pool;
+    apr_thread_t **workers;
+    apr_status_t status;
+    apr_time_t start;
+    struct load load;
+    struct result result;
+    unsigned long connections, handshakes, total;
+    int i;
+
+    if (apr_pool_create(&pool, parent) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    memset(&load, 0, sizeof(load));
+    load.url = url;
+    load.requests = REQUESTS / threads;
+    if (pooled)
+        if (mwa_curl_pool_create(&load.pool, pool) != APR_SUCCESS)
+            bail("cannot create cURL handle pool");
+    workers = apr_pcalloc(pool, threads * sizeof(apr_thread_t *));
+
+    apr_thread_mutex_lock(server->mutex);
+    connections = server->connections;
+    handshakes = server->handshakes;
+    apr_thread_mutex_unlock(server->mutex);
+    start = apr_time_now();
+    for (i = 0; i < threads; i++)
+        if (apr_thread_create(&workers[i], NULL, client, &load, pool)
+            != APR_SUCCESS)
+            bail("cannot create client thread");
+    for (i = 0; i < threads; i++)
+        apr_thread_join(&status, workers[i]);
+    start = apr_time_now() - start;
+    apr_thread_mutex_lock(server->mutex);
+    connections = server->connections - connections;
+    handshakes = server->handshakes - handshakes;
+    apr_thread_mutex_unlock(server->mutex);
+
+    /* Destroying the pool closes the pooled connections. */
+    apr_pool_destroy(pool);
+    total = (unsigned long) load.requests * threads;
+    result.rate = (double) total * APR_USEC_PER_SEC / start;
+    result.connections = (double) connections / total;
+    result.handshakes = (double) handshakes / total;
+    return result;
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool;
+    struct server server;
+    struct result fresh, pooled;
+    const char *url;
+    size_t i;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (curl_global_init(CURL_GLOBAL_ALL) != CURLE_OK)
+        bail("cannot initialize cURL");
+    url = start_server(&server, pool);
+
+    printf("Requests to a local HTTPS WebKDC, %d per run\n\n", REQUESTS);
+    printf("%7s %23s %23s\n", "", "new handle per request",
+           "pooled handles");
+    printf("%7s %7s %7s %7s %7s %7s %7s\n", "threads", "req/s", "conns",
+           "hshakes", "req/s", "conns", "hshakes");
+    for (i = 0; i < ARRAY_SIZE(thread_counts); i++) {
+        fresh = time_requests(pool, &server, url, thread_counts[i], false);
+        pooled = time_requests(pool, &server, url, thread_counts[i], true);
+        printf("%7d %7.0f %7.3f %7.3f %7.0f %7.3f %7.3f\n", thread_counts[i],
+               fresh.rate, fresh.connections, fresh.handshakes, pooled.rate,
+               pooled.connections, pooled.handshakes);
+    }
+    printf("\n(conns and hshakes are TCP connections and full TLS"
+           " handshakes per request)\n");
+
+    curl_global_cleanup();
+    apr_terminate();
+    return 0;
+}
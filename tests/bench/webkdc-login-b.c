@@ -0,0 +1,827 @@
+/*
+ * Benchmark of the WebKDC login path.
+ *
+ * Drives webauth_webkdc_login, which decrypts the request tokens, processes
+ * any logins, merges the resulting webkdc-proxy and webkdc-factor tokens,
+ * calls the user information service, and encodes the response, with a mix
+ * of the four kinds of login that the WebKDC sees: password logins, OTP
+ * logins on top of an earlier password login, single sign-on with a
+ * webkdc-proxy token plus a webkdc-factor token, and single sign-on with a
+ * Kerberos webkdc-proxy token for a site that wants a Kerberos
+ * authenticator.
+ *
+ * Kerberos and the remctl call to the user information service are replaced
+ * by stubs in this file that return canned responses: the Kerberos stubs
+ * hand out fixed tickets for the users of the realm described by the
+ * kerberos_config below, and the remctl stub returns the same XML documents
+ * from data/xml that the fake user information service in data/cmd-webkdc
+ * returns to the test suite.  Everything else is the real library code, so
+ * this measures the cost of the WebKDC itself without a KDC or a user
+ * information service.
+ *
+ * Each login is done with a new WebAuth context in a new pool, configured
+ * the way mod_webkdc configures it for each request.  The results are the
+ * logins per second, the median and 99th percentile latency of a login, and
+ * the heap memory used by the pool of a login of each kind (measured only
+ * with the GNU C library).
+ *
+ * Usage: webkdc-login-b [-n logins] [-t threads] [-m mix]
+ *
+ * where mix is a comma-separated list of weights for each kind of login,
+ * such as password=4,otp=1,factor=2,proxy=3 (the default).  Kinds not
+ * listed get a weight of zero.  Without -t, the logins are timed with 1, 4,
+ * and 16 threads.
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <apr_atomic.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+#include <errno.h>
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif
+#include <time.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/kerberos.h>
+#include <tests/tap/string.h>
+#include <util/macros.h>
+#include <webauth/basic.h>
+#include <webauth/keys.h>
+#include <webauth/krb5.h>
+#include <webauth/tokens.h>
+#include <webauth/webkdc.h>
+
+/* Default total number of logins for each number of threads. */
+#define LOGINS 2000
+
+/* Numbers of threads to time if none was given. */
+static const int thread_counts[] = { 1, 4, 16 };
+
+/* Lifetime of all tokens, long enough that none expire during a run. */
+#define LIFETIME (24 * 60 * 60)
+
+/* The WAS requesting authentication. */
+#define SERVICE "krb5:webauth/example.com@EXAMPLE.COM"
+
+/* The OTP code and device accepted by the canned validate response. */
+#define OTP_CODE   "123456"
+#define OTP_DEVICE "DEVICEID"
+
+/* The user that does OTP logins, who has a validate response in data/xml. */
+#define OTP_USER "full"
+
+/*
+ * The Kerberos realm seen by the stubs.  This takes the place of the
+ * configuration that kerberos_setup would load from tests/config, so the
+ * keytab is never opened and the password is the only one the stub accepts.
+ * The user has a user information response in data/xml.
+ */
+static struct kerberos_config krbconf = {
+    (char *) "stub.keytab",
+    (char *) "service/webkdc@EXAMPLE.ORG",
+    NULL,
+    (char *) "normal@EXAMPLE.ORG",
+    (char *) "normal",
+    (char *) "EXAMPLE.ORG",
+    (char *) "s3cr3t"
+};
+
+/* Sizes of the canned ticket and authenticator, typical of real ones. */
+#define TICKET_SIZE        1024
+#define AUTHENTICATOR_SIZE 600
+
+/* The kinds of login. */
+enum login_type {
+    LOGIN_PASSWORD,
+    LOGIN_OTP,
+    LOGIN_FACTOR,
+    LOGIN_PROXY,
+    LOGIN_MAX
+};
+static const char *const login_names[LOGIN_MAX] = {
+    "password", "otp", "factor", "proxy"
+};
+
+/* The canned user information service responses from data/xml. */
+struct canned {
+    const char *command;
+    const char *user;
+    char *data;
+    size_t length;
+};
+static struct canned canned[] = {
+    { "webkdc-userinfo", "normal", NULL, 0 },
+    { "webkdc-userinfo", "full",   NULL, 0 },
+    { "webkdc-validate", "full",   NULL, 0 },
+};
+
+/* Configuration shared by every login. */
+struct config {
+    apr_array_header_t *realms;
+    const struct webauth_keyring *ring;
+    struct webauth_webkdc_login_request requests[LOGIN_MAX];
+};
+
+/* State shared by the login threads. */
+struct load {
+    const struct config *config;
+    const enum login_type *schedule;    /* Kind of each login. */
+    apr_interval_time_t *latencies;     /* Time of each login. */
+    int logins;                         /* Total logins. */
+    int threads;                        /* Number of threads. */
+    volatile apr_uint32_t next;         /* Thread number to hand out. */
+};
+
+/* The stub Kerberos context, which only knows its principal. */
+struct webauth_krb5 {
+    const char *principal;
+};
+
+
+/*
+ * Stub Kerberos functions.  These stand in for lib/krb5.c with the subset of
+ * the API that the WebKDC login code and the user information service code
+ * use, returning canned tickets and authenticators.  A ticket starts with
+ * the nul-terminated principal it's for, so that importing it recovers the
+ * principal.
+ */
+int
+webauth_krb5_new(struct webauth_context *ctx, struct webauth_krb5 **kc)
+{
+    *kc = apr_pcalloc(ctx->pool, sizeof(struct webauth_krb5));
+    return WA_ERR_NONE;
+}
+
+void
+webauth_krb5_free(struct webauth_context *ctx UNUSED,
+                  struct webauth_krb5 *kc UNUSED)
+{
+}
+
+int
+webauth_krb5_set_fast_armor_path(struct webauth_context *ctx UNUSED,
+                                 struct webauth_krb5 *kc UNUSED,
+                                 const char *path UNUSED)
+{
+    return WA_ERR_NONE;
+}
+
+int
+webauth_krb5_init_via_keytab(struct webauth_context *ctx,
+                             struct webauth_krb5 *kc,
+                             const char *keytab UNUSED,
+                             const char *server_principal,
+                             const char *cache UNUSED)
+{
+    if (server_principal == NULL)
+        server_principal = krbconf.principal;
+    kc->principal = apr_pstrdup(ctx->pool, server_principal);
+    return WA_ERR_NONE;
+}
+
+int
+webauth_krb5_init_via_password(struct webauth_context *ctx,
+                               struct webauth_krb5 *kc,
+                               const char *username, const char *password,
+                               const char *get_principal UNUSED,
+                               const char *keytab,
+                               const char *server_principal,
+                               const char *cache UNUSED,
+                               char **server_principal_out)
+{
+    if (strcmp(username, krbconf.username) != 0
+        || strcmp(password, krbconf.password) != 0)
+        return wai_error_set(ctx, WA_PEC_LOGIN_FAILED, NULL);
+    kc->principal = apr_pstrdup(ctx->pool, krbconf.userprinc);
+    if (keytab != NULL && server_principal_out != NULL)
+        *server_principal_out = apr_pstrdup(ctx->pool, server_principal);
+    return WA_ERR_NONE;
+}
+
+int
+webauth_krb5_export_cred(struct webauth_context *ctx,
+                         struct webauth_krb5 *kc, const char *principal UNUSED,
+                         void **cred, size_t *cred_len, time_t *expiration)
+{
+    char *ticket;
+
+    ticket = apr_pcalloc(ctx->pool, TICKET_SIZE);
+    strlcpy(ticket, kc->principal, TICKET_SIZE);
+    *cred = ticket;
+    *cred_len = TICKET_SIZE;
+    if (expiration != NULL)
+        *expiration = time(NULL) + LIFETIME;
+    return WA_ERR_NONE;
+}
+
+int
+webauth_krb5_import_cred(struct webauth_context *ctx, struct webauth_krb5 *kc,
+                         const void *cred, size_t cred_len,
+                         const char *cache UNUSED)
+{
+    if (cred_len != TICKET_SIZE || memchr(cred, '\0', cred_len) == NULL)
+        return wai_error_set(ctx, WA_ERR_KRB5, "invalid canned ticket");
+    kc->principal = apr_pstrdup(ctx->pool, cred);
+    return WA_ERR_NONE;
+}
+
+int
+webauth_krb5_get_principal(struct webauth_context *ctx,
+                           struct webauth_krb5 *kc, char **principal,
+                           enum webauth_krb5_canon canon)
+{
+    const char *realm;
+
+    realm = strchr(kc->principal, '@');
+    if (canon == WA_KRB5_CANON_NONE || realm == NULL)
+        *principal = apr_pstrdup(ctx->pool, kc->principal);
+    else
+        *principal = apr_pstrmemdup(ctx->pool, kc->principal,
+                                    realm - kc->principal);
+    return WA_ERR_NONE;
+}
+
+int
+webauth_krb5_get_realm(struct webauth_context *ctx, struct webauth_krb5 *kc,
+                       char **realm)
+{
+    const char *p;
+
+    p = strchr(kc->principal, '@');
+    *realm = apr_pstrdup(ctx->pool, p == NULL ? krbconf.realm : p + 1);
+    return WA_ERR_NONE;
+}
+
+int
+webauth_krb5_get_cache(struct webauth_context *ctx,
+                       struct webauth_krb5 *kc UNUSED, char **cache)
+{
+    *cache = apr_pstrdup(ctx->pool, "MEMORY:webkdc-login-b");
+    return WA_ERR_NONE;
+}
+
+int
+webauth_krb5_make_auth(struct webauth_context *ctx,
+                       struct webauth_krb5 *kc UNUSED,
+                       const char *server_principal UNUSED, void **req,
+                       size_t *length)
+{
+    *req = apr_pcalloc(ctx->pool, AUTHENTICATOR_SIZE);
+    *length = AUTHENTICATOR_SIZE;
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Stub remctl call to the user information service, standing in for
+ * lib/userinfo-remctl.c.  Returns the canned XML for the command and user.
+ */
+int
+wai_user_remctl(struct webauth_context *ctx, const char **command,
+                struct wai_buffer *output)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(canned); i++)
+        if (strcmp(command[1], canned[i].command) == 0
+            && strcmp(command[2], canned[i].user) == 0) {
+            wai_buffer_set(output, canned[i].data, canned[i].length);
+            return WA_ERR_NONE;
+        }
+    return wai_error_set(ctx, WA_ERR_REMOTE_FAILURE, "unknown user %s",
+                         command[2]);
+}
+
+
+/*
+ * Load the canned user information service responses from data/xml.
+ */
+static void
+load_canned(void)
+{
+    char *file, *path;
+    FILE *input;
+    size_t i, size;
+
+    for (i = 0; i < ARRAY_SIZE(canned); i++) {
+        basprintf(&file, "data/xml/%s/%s.xml",
+                  strcmp(canned[i].command, "webkdc-validate") == 0
+                      ? "validate" : "info",
+                  canned[i].user);
+        path = test_file_path(file);
+        if (path == NULL)
+            bail("cannot find %s (is SOURCE set?)", file);
+        input = fopen(path, "r");
+        if (input == NULL)
+            sysbail("cannot open %s", path);
+        size = BUFSIZ;
+        canned[i].data = bmalloc(size);
+        canned[i].length = fread(canned[i].data, 1, size, input);
+        if (ferror(input) || !feof(input))
+            bail("cannot read %s or too large", path);
+        fclose(input);
+        test_file_path_free(path);
+        free(file);
+    }
+}
+
+
+/*
+ * Encode a token with the given keyring and return the encoded form,
+ * calling bail on any failure.
+ */
+static const char *
+encode(struct webauth_context *ctx, const struct webauth_token *token,
+       const struct webauth_keyring *ring)
+{
+    const char *encoded;
+    int s;
+
+    s = webauth_token_encode(ctx, token, ring, &encoded);
+    if (s != WA_ERR_NONE)
+        bail("cannot encode token: %s", webauth_error_message(ctx, s));
+    return encoded;
+}
+
+
+/*
+ * Encode a webkdc-proxy token and add it to an array of proxy data with the
+ * given session factors as its source.
+ */
+static void
+add_wkproxy(struct webauth_context *ctx, apr_array_header_t *wkproxies,
+            const struct webauth_token_webkdc_proxy *wkproxy,
+            const char *source, const struct webauth_keyring *ring)
+{
+    struct webauth_webkdc_proxy_data *pd;
+    struct webauth_token token;
+
+    token.type = WA_TOKEN_WEBKDC_PROXY;
+    token.token.webkdc_proxy = *wkproxy;
+    pd = &APR_ARRAY_PUSH(wkproxies, struct webauth_webkdc_proxy_data);
+    pd->type = wkproxy->proxy_type;
+    pd->token = encode(ctx, &token, ring);
+    pd->source = source;
+}
+
+
+/*
+ * Build the encrypted request for one kind of login.  Each starts with a
+ * webkdc-service token for the WAS and a request token for an id token, and
+ * then adds the login tokens, webkdc-proxy tokens, and webkdc-factor tokens
+ * that WebLogin would send for that kind of login.  The tokens are the same
+ * as the ones in the webkdc-login and webkdc-mf tests for these cases.
+ */
+static void
+build_request(struct webauth_context *ctx, enum login_type type,
+              const struct webauth_keyring *ring,
+              struct webauth_webkdc_login_request *request)
+{
+    struct webauth_key *key;
+    struct webauth_keyring *session;
+    struct webauth_token token;
+    struct webauth_token_webkdc_proxy wkproxy;
+    struct webauth_krb5 kc;
+    apr_array_header_t *tokens, *wkproxies;
+    void *tgt;
+    size_t tgt_len;
+    time_t now;
+    int s;
+
+    now = time(NULL);
+    memset(request, 0, sizeof(*request));
+    wkproxies = apr_array_make(ctx->pool, 1,
+                               sizeof(struct webauth_webkdc_proxy_data));
+    request->wkproxies = wkproxies;
+    request->remote_ip = "127.0.0.1";
+
+    /* The webkdc-service token, whose session key encrypts the request. */
+    s = webauth_key_create(ctx, WA_KEY_AES, WA_AES_128, NULL, &key);
+    if (s != WA_ERR_NONE)
+        bail("cannot create key: %s", webauth_error_message(ctx, s));
+    session = webauth_keyring_from_key(ctx, key);
+    memset(&token, 0, sizeof(token));
+    token.type = WA_TOKEN_WEBKDC_SERVICE;
+    token.token.webkdc_service.subject = SERVICE;
+    token.token.webkdc_service.session_key = key->data;
+    token.token.webkdc_service.session_key_len = key->length;
+    token.token.webkdc_service.creation = now;
+    token.token.webkdc_service.expiration = now + LIFETIME;
+    request->service = encode(ctx, &token, ring);
+
+    /* The request token, asking for a Kerberos authenticator for proxy. */
+    memset(&token, 0, sizeof(token));
+    token.type = WA_TOKEN_REQUEST;
+    token.token.request.type = "id";
+    token.token.request.auth = (type == LOGIN_PROXY) ? "krb5" : "webkdc";
+    token.token.request.return_url = "https://example.com/";
+    if (type == LOGIN_OTP)
+        token.token.request.initial_factors = "m";
+    token.token.request.creation = now;
+    request->request = encode(ctx, &token, session);
+
+    /* Tokens for the kind of login. */
+    memset(&token, 0, sizeof(token));
+    memset(&wkproxy, 0, sizeof(wkproxy));
+    wkproxy.creation = now;
+    wkproxy.expiration = now + LIFETIME;
+    switch (type) {
+    case LOGIN_PASSWORD:
+        token.type = WA_TOKEN_LOGIN;
+        token.token.login.username = krbconf.username;
+        token.token.login.password = krbconf.password;
+        token.token.login.creation = now;
+        tokens = apr_array_make(ctx->pool, 1, sizeof(const char *));
+        APR_ARRAY_PUSH(tokens, const char *) = encode(ctx, &token, ring);
+        request->logins = tokens;
+        break;
+    case LOGIN_OTP:
+        token.type = WA_TOKEN_LOGIN;
+        token.token.login.username = OTP_USER;
+        token.token.login.otp = OTP_CODE;
+        token.token.login.device_id = OTP_DEVICE;
+        token.token.login.creation = now;
+        tokens = apr_array_make(ctx->pool, 1, sizeof(const char *));
+        APR_ARRAY_PUSH(tokens, const char *) = encode(ctx, &token, ring);
+        request->logins = tokens;
+        wkproxy.subject = OTP_USER;
+        wkproxy.proxy_type = "remuser";
+        wkproxy.proxy_subject = "WEBKDC:remuser";
+        wkproxy.data = OTP_USER;
+        wkproxy.data_len = strlen(OTP_USER);
+        wkproxy.initial_factors = "p";
+        wkproxy.loa = 3;
+        add_wkproxy(ctx, wkproxies, &wkproxy, "c", ring);
+        break;
+    case LOGIN_FACTOR:
+        token.type = WA_TOKEN_WEBKDC_FACTOR;
+        token.token.webkdc_factor.subject = krbconf.username;
+        token.token.webkdc_factor.factors = "d";
+        token.token.webkdc_factor.creation = now;
+        token.token.webkdc_factor.expiration = now + LIFETIME;
+        tokens = apr_array_make(ctx->pool, 1, sizeof(const char *));
+        APR_ARRAY_PUSH(tokens, const char *) = encode(ctx, &token, ring);
+        request->wkfactors = tokens;
+        wkproxy.subject = krbconf.username;
+        wkproxy.proxy_type = "remuser";
+        wkproxy.proxy_subject = "WEBKDC:remuser";
+        wkproxy.data = krbconf.username;
+        wkproxy.data_len = strlen(krbconf.username);
+        wkproxy.initial_factors = "p";
+        wkproxy.loa = 1;
+        add_wkproxy(ctx, wkproxies, &wkproxy, "c", ring);
+        break;
+    case LOGIN_PROXY:
+        kc.principal = krbconf.userprinc;
+        webauth_krb5_export_cred(ctx, &kc, NULL, &tgt, &tgt_len, NULL);
+        wkproxy.subject = krbconf.username;
+        wkproxy.proxy_type = "krb5";
+        wkproxy.proxy_subject = apr_pstrcat(ctx->pool, "WEBKDC:krb5:",
+                                            krbconf.principal, (char *) 0);
+        wkproxy.data = tgt;
+        wkproxy.data_len = tgt_len;
+        wkproxy.initial_factors = "p";
+        wkproxy.loa = 1;
+        add_wkproxy(ctx, wkproxies, &wkproxy, "c", ring);
+        break;
+    case LOGIN_MAX:
+    default:
+        bail("unknown login type %d", (int) type);
+    }
+}
+
+
+/*
+ * Do one login of the given kind in a new WebAuth context allocated from the
+ * given pool, configured as mod_webkdc configures it for each request, and
+ * call bail if it fails.
+ */
+static void
+do_login(const struct config *config, enum login_type type, apr_pool_t *pool)
+{
+    struct webauth_context *ctx;
+    struct webauth_webkdc_config webkdc;
+    struct webauth_user_config user;
+    struct webauth_webkdc_login_response *response;
+    int s;
+
+    if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    memset(&webkdc, 0, sizeof(webkdc));
+    webkdc.keytab_path      = krbconf.keytab;
+    webkdc.principal        = krbconf.principal;
+    webkdc.login_time_limit = LIFETIME;
+    webkdc.local_realms     = config->realms;
+    webkdc.permitted_realms = config->realms;
+    s = webauth_webkdc_config(ctx, &webkdc);
+    if (s != WA_ERR_NONE)
+        bail("cannot configure WebKDC: %s", webauth_error_message(ctx, s));
+    memset(&user, 0, sizeof(user));
+    user.protocol  = WA_PROTOCOL_REMCTL;
+    user.host      = "localhost";
+    user.command   = "webkdc";
+    user.keytab    = krbconf.keytab;
+    user.principal = krbconf.principal;
+    s = webauth_user_config(ctx, &user);
+    if (s != WA_ERR_NONE)
+        bail("cannot configure user information service: %s",
+             webauth_error_message(ctx, s));
+
+    s = webauth_webkdc_login(ctx, &config->requests[type], &response,
+                             config->ring);
+    if (s != WA_ERR_NONE)
+        bail("%s login failed: %s", login_names[type],
+             webauth_error_message(ctx, s));
+    if (response->result == NULL)
+        bail("%s login returned no result token", login_names[type]);
+}
+
+
+/*
+ * Return the bytes of heap in use, or 0 if there's no way to tell.
+ */
+static size_t
+heap_bytes(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+    return (size_t) mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * Return the heap memory used by the pool of a login of the given kind.  The
+ * pool gets its own allocator so that all of its memory comes from malloc
+ * rather than from memory freed by earlier pools, and the login is done
+ * once first so that one-time setup isn't counted.
+ */
+static size_t
+pool_bytes(const struct config *config, enum login_type type)
+{
+    apr_allocator_t *allocator;
+    apr_pool_t *pool;
+    size_t before, after;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    do_login(config, type, pool);
+    apr_pool_destroy(pool);
+    if (apr_allocator_create(&allocator) != APR_SUCCESS)
+        bail("cannot create allocator");
+    if (apr_pool_create_ex(&pool, NULL, NULL, allocator) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    apr_allocator_owner_set(allocator, pool);
+    before = heap_bytes();
+    do_login(config, type, pool);
+    after = heap_bytes();
+    apr_pool_destroy(pool);
+    return after > before ? after - before : 0;
+}
+
+
+/*
+ * The body of a login thread.  Does every login in the schedule whose index
+ * is the thread number modulo the number of threads, recording the latency
+ * of each.
+ */
+static void * APR_THREAD_FUNC
+worker(apr_thread_t *thread, void *data)
+{
+    struct load *load = data;
+    apr_pool_t *pool, *sub;
+    apr_time_t start;
+    int i;
+
+    i = (int) apr_atomic_inc32(&load->next);
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    for (; i < load->logins; i += load->threads) {
+        if (apr_pool_create(&sub, pool) != APR_SUCCESS)
+            bail("cannot create memory pool");
+        start = apr_time_now();
+        do_login(load->config, load->schedule[i], sub);
+        load->latencies[i] = apr_time_now() - start;
+        apr_pool_destroy(sub);
+    }
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Compare two latencies for qsort.
+ */
+static int
+compare_latency(const void *a, const void *b)
+{
+    const apr_interval_time_t *x = a;
+    const apr_interval_time_t *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+
+/*
+ * Do all the logins in the schedule spread across the given number of
+ * threads and print a line of results.
+ */
+static void
+time_logins(const struct config *config, const enum login_type *schedule,
+            int logins, int threads, apr_pool_t *parent)
+{
+    apr_pool_t *pool;
+    apr_thread_t **workers;
+    apr_status_t status;
+    apr_time_t start;
+    struct load load;
+    double p50, p99;
+    int i;
+
+    if (apr_pool_create(&pool, parent) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    memset(&load, 0, sizeof(load));
+    load.config = config;
+    load.schedule = schedule;
+    load.logins = logins;
+    load.threads = threads;
+    load.latencies = apr_pcalloc(pool, logins * sizeof(apr_interval_time_t));
+    workers = apr_pcalloc(pool, threads * sizeof(apr_thread_t *));
+
+    start = apr_time_now();
+    for (i = 0; i < threads; i++)
+        if (apr_thread_create(&workers[i], NULL, worker, &load, pool)
+            != APR_SUCCESS)
+            bail("cannot create login thread");
+    for (i = 0; i < threads; i++)
+        apr_thread_join(&status, workers[i]);
+    start = apr_time_now() - start;
+
+    qsort(load.latencies, logins, sizeof(apr_interval_time_t),
+          compare_latency);
+    p50 = load.latencies[(logins - 1) / 2];
+    p99 = load.latencies[(logins - 1) * 99 / 100];
+    printf("%7d %9.0f %9.0f %9.0f\n", threads,
+           (double) logins * APR_USEC_PER_SEC / start, p50, p99);
+    apr_pool_destroy(pool);
+}
+
+
+/*
+ * Parse a mix of the form password=4,otp=1 into weights for each kind of
+ * login, calling bail on syntax errors.
+ */
+static void
+parse_mix(const char *mix, unsigned long weights[LOGIN_MAX])
+{
+    char *copy, *word, *value, *end, *last;
+    int i;
+
+    memset(weights, 0, LOGIN_MAX * sizeof(unsigned long));
+    copy = bstrdup(mix);
+    for (word = strtok_r(copy, ",", &last); word != NULL;
+         word = strtok_r(NULL, ",", &last)) {
+        value = strchr(word, '=');
+        if (value == NULL)
+            bail("invalid mix element %s", word);
+        *value++ = '\0';
+        for (i = 0; i < LOGIN_MAX; i++)
+            if (strcmp(word, login_names[i]) == 0)
+                break;
+        if (i == LOGIN_MAX)
+            bail("unknown kind of login %s", word);
+        errno = 0;
+        weights[i] = strtoul(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || errno != 0)
+            bail("invalid weight %s for %s", value, word);
+    }
+    free(copy);
+}
+
+
+/*
+ * Build the schedule of kinds of login, with each kind in proportion to its
+ * weight and the kinds interleaved with a fixed shuffle so that every run
+ * does the same logins in the same order.
+ */
+static enum login_type *
+build_schedule(const unsigned long weights[LOGIN_MAX], int logins,
+               apr_pool_t *pool)
+{
+    enum login_type *schedule, swap;
+    unsigned long total = 0, seed = 1;
+    int i, j, n;
+
+    for (i = 0; i < LOGIN_MAX; i++)
+        total += weights[i];
+    if (total == 0)
+        bail("no logins in the mix");
+    schedule = apr_palloc(pool, logins * sizeof(enum login_type));
+    for (n = 0, i = 0; i < LOGIN_MAX; i++)
+        for (j = 0; j < (int) (logins * weights[i] / total); j++)
+            schedule[n++] = i;
+    for (i = 0; n < logins; i = (i + 1) % LOGIN_MAX)
+        if (weights[i] > 0)
+            schedule[n++] = i;
+    for (i = logins - 1; i > 0; i--) {
+        seed = seed * 1103515245 + 12345;
+        j = (int) ((seed >> 16) % (unsigned long) (i + 1));
+        swap = schedule[i];
+        schedule[i] = schedule[j];
+        schedule[j] = swap;
+    }
+    return schedule;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct webauth_context *ctx;
+    struct webauth_keyring *ring;
+    struct config config;
+    apr_pool_t *pool;
+    enum login_type *schedule;
+    unsigned long weights[LOGIN_MAX];
+    const char *mix = "password=4,otp=1,factor=2,proxy=3";
+    char *path;
+    int logins = LOGINS;
+    int threads = 0;
+    int option, s;
+    size_t i;
+
+    while ((option = getopt(argc, argv, "m:n:t:")) != EOF) {
+        switch (option) {
+        case 'm': mix = optarg;             break;
+        case 'n': logins = atoi(optarg);    break;
+        case 't': threads = atoi(optarg);   break;
+        default:
+            bail("usage: webkdc-login-b [-n logins] [-t threads] [-m mix]");
+        }
+    }
+    if (logins <= 0 || threads < 0)
+        bail("number of logins and threads must be positive");
+    parse_mix(mix, weights);
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (webauth_context_init_apr(&ctx, pool) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    load_canned();
+
+    /* Load the WebKDC keyring and build one request of each kind. */
+    path = test_file_path("data/keyring");
+    if (path == NULL)
+        bail("cannot find data/keyring (is SOURCE set?)");
+    s = webauth_keyring_read(ctx, path, &ring);
+    if (s != WA_ERR_NONE)
+        bail("cannot read %s: %s", path, webauth_error_message(ctx, s));
+    test_file_path_free(path);
+    memset(&config, 0, sizeof(config));
+    config.ring = ring;
+    config.realms = apr_array_make(pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(config.realms, const char *) = krbconf.realm;
+    for (i = 0; i < LOGIN_MAX; i++)
+        build_request(ctx, i, ring, &config.requests[i]);
+    schedule = build_schedule(weights, logins, pool);
+
+    printf("Pool bytes per login\n\n");
+    for (i = 0; i < LOGIN_MAX; i++)
+        printf("%9s %9lu\n", login_names[i],
+               (unsigned long) pool_bytes(&config, i));
+
+    printf("\nLogins per second and latency in microseconds (%d logins,"
+           " %s)\n\n", logins, mix);
+    printf("%7s %9s %9s %9s\n", "threads", "logins/s", "p50", "p99");
+    if (threads > 0)
+        time_logins(&config, schedule, logins, threads, pool);
+    else
+        for (i = 0; i < ARRAY_SIZE(thread_counts); i++)
+            time_logins(&config, schedule, logins, thread_counts[i], pool);
+
+    for (i = 0; i < ARRAY_SIZE(canned); i++)
+        free(canned[i].data);
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * Benchmark sending WebKDC XML responses.
+ *
+ * Compares the way mod_webkdc used to send responses, with a separate
+ * ap_rvputs or ap_rprintf call for every piece of the response followed by a
+ * flush, with building the response in a brigade and passing it down the
+ * filter chain once.  The responses are an <errorResponse>, a
+ * <getTokensResponse> with one id token, one with the most tokens the WebKDC
+ * will return, and a <requestTokenResponse> like the ones WebLogin gets for
+ * a user with single sign-on cookies.
+ *
+ * Apache isn't available to a benchmark, so the old calls are modeled the
+ * way Apache implements them when another filter is in front of the
+ * old-write buffer: each string passed to ap_rvputs and each ap_rprintf
+ * becomes its own brigade with one transient bucket, passed down the chain.
+ * The end of the chain is a sink that writes each brigade it's given with
+ * one writev to /dev/null, so the write counts are an upper bound on the
+ * system calls Apache would make.  Apache's own buffering can merge some of
+ * the old writes, but never fewer than one per response.
+ *
+ * For each response, reports the brigade passes and writes per response and
+ * the CPU time per response in microseconds, before and after.
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_buckets.h>
+#include <apr_general.h>
+#include <apr_strings.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+#include <tests/tap/basic.h>
+
+/* Number of times each response is sent. */
+#define ITERATIONS 20000
+
+/* Length of the base64 token data in each response. */
+#define ID_LENGTH       300
+#define PROXY_LENGTH    600
+#define FACTOR_LENGTH   300
+#define KEY_LENGTH      24
+
+/* Maximum iovecs in one writev, a safe value for IOV_MAX. */
+#define MAX_IOVEC 16
+
+/* The kinds of responses. */
+enum response_type {
+    RESPONSE_ERROR,
+    RESPONSE_GET_ID,
+    RESPONSE_GET_MAX,
+    RESPONSE_LOGIN
+};
+static const char *const response_names[] = {
+    "error", "getTokens id", "getTokens 64", "requestToken"
+};
+#define RESPONSE_COUNT 4
+
+/*
+ * Where a response is sent.  bb is set when building the response in a
+ * brigade, as mod_webkdc now does, and is NULL to model the old calls, which
+ * pass tmp for each piece of the response.
+ */
+struct output {
+    apr_bucket_brigade *bb;
+    apr_bucket_brigade *tmp;
+    apr_bucket_alloc_t *alloc;
+    int fd;
+    unsigned long passes;
+    unsigned long writes;
+};
+
+/* Append to the response either way, with the mod_webkdc calling syntax. */
+#define RVPUTS(o, ...)                                  \
+    ((o)->bb != NULL ? mwk_rvputs((o)->bb, __VA_ARGS__) \
+                     : old_rvputs((o), __VA_ARGS__))
+#define RPRINTF(o, ...)                                  \
+    ((o)->bb != NULL ? mwk_rprintf((o)->bb, __VA_ARGS__) \
+                     : old_rprintf((o), __VA_ARGS__))
+
+/* Token data used in the responses. */
+static const char *id_token;
+static const char *proxy_token;
+static const char *factor_token;
+static const char *session_key;
+
+
+/*
+ * Return the CPU time used so far in microseconds.
+ */
+static double
+cpu_usec(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0)
+        sysbail("cannot get resource usage");
+    return (double) usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec
+        + (double) usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+}
+
+
+/*
+ * Return a string of fake base64 token data of the given length, allocated
+ * from the pool.
+ */
+static const char *
+token_data(apr_pool_t *pool, size_t length)
+{
+    static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *data;
+    size_t i;
+
+    data = apr_palloc(pool, length + 1);
+    for (i = 0; i < length; i++)
+        data[i] = base64[(i * 7 + 3) % 64];
+    data[length] = '\0';
+    return data;
+}
+
+
+/*
+ * The end of the filter chain.  Writes the data in the brigade with as few
+ * calls to writev as possible and empties the brigade.
+ */
+static void
+sink_pass(struct output *out, apr_bucket_brigade *bb)
+{
+    struct iovec iov[MAX_IOVEC];
+    apr_bucket *b;
+    const char *data;
+    apr_size_t length;
+    int n = 0;
+
+    out->passes++;
+    for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb);
+         b = APR_BUCKET_NEXT(b)) {
+        if (APR_BUCKET_IS_METADATA(b))
+            continue;
+        if (apr_bucket_read(b, &data, &length, APR_BLOCK_READ) != APR_SUCCESS)
+            bail("cannot read bucket");
+        if (length == 0)
+            continue;
+        if (n == MAX_IOVEC) {
+            if (writev(out->fd, iov, n) < 0)
+                sysbail("cannot write response");
+            out->writes++;
+            n = 0;
+        }
+        iov[n].iov_base = (void *) data;
+        iov[n].iov_len = length;
+        n++;
+    }
+    if (n > 0) {
+        if (writev(out->fd, iov, n) < 0)
+            sysbail("cannot write response");
+        out->writes++;
+    }
+    apr_brigade_cleanup(bb);
+}
+
+
+/*
+ * Pass one piece of a response down the filter chain by itself, as the old
+ * calls did.
+ */
+static void
+old_write(struct output *out, const char *data, apr_size_t length)
+{
+    apr_bucket *b;
+
+    if (length == 0)
+        return;
+    b = apr_bucket_transient_create(data, length, out->alloc);
+    APR_BRIGADE_INSERT_TAIL(out->tmp, b);
+    sink_pass(out, out->tmp);
+}
+
+
+/*
+ * Model of ap_rvputs, which writes each of its strings separately.
+ */
+static void
+old_rvputs(struct output *out, ...)
+{
+    va_list args;
+    const char *s;
+
+    va_start(args, out);
+    while ((s = va_arg(args, const char *)) != NULL)
+        old_write(out, s, strlen(s));
+    va_end(args);
+}
+
+
+/*
+ * Model of ap_rprintf, which formats into a stack buffer and writes that.
+ */
+static void
+old_rprintf(struct output *out, const char *format, ...)
+{
+    va_list args;
+    char buffer[8192];
+    int length;
+
+    va_start(args, format);
+    length = apr_vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    old_write(out, buffer, length);
+}
+
+
+/*
+ * Model of the old ap_rflush or the final pass of the new brigade, sending
+ * whatever is in the given brigade followed by a flush bucket.
+ */
+static void
+send_flush(struct output *out, apr_bucket_brigade *bb)
+{
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_flush_create(out->alloc));
+    sink_pass(out, bb);
+}
+
+
+/*
+ * Send a response, written with the same calls as mod_webkdc makes.
+ */
+static void
+send_response(struct output *out, enum response_type type)
+{
+    size_t i, count;
+
+    switch (type) {
+    case RESPONSE_ERROR:
+        RVPUTS(out, "<errorResponse><errorCode>", "11",
+               "</errorCode><errorMessage>",
+               "request token was stale", "</errorMessage></errorResponse>",
+               NULL);
+        break;
+    case RESPONSE_GET_ID:
+    case RESPONSE_GET_MAX:
+        count = (type == RESPONSE_GET_ID) ? 1 : MAX_TOKENS_RETURNED;
+        RVPUTS(out, "<getTokensResponse><tokens>", NULL);
+        for (i = 0; i < count; i++) {
+            RPRINTF(out, "<token id=\"%lu\">", (unsigned long) i);
+            RVPUTS(out, "<tokenData>", id_token, "</tokenData>", NULL);
+            RVPUTS(out, "<sessionKey>", session_key, "</sessionKey>", NULL);
+            RVPUTS(out, "<expires>", "1418256000", "</expires>", NULL);
+            RVPUTS(out, "</token>", NULL);
+        }
+        RVPUTS(out, "</tokens></getTokensResponse>", NULL);
+        break;
+    case RESPONSE_LOGIN:
+        RVPUTS(out, "<requestTokenResponse>", NULL);
+        RVPUTS(out, "<proxyTokens>", NULL);
+        RVPUTS(out, "<proxyToken type='", "krb5", "'>", proxy_token,
+               "</proxyToken>", NULL);
+        RVPUTS(out, "<proxyToken type='", "remuser", "'>", proxy_token,
+               "</proxyToken>", NULL);
+        RVPUTS(out, "</proxyTokens>", NULL);
+        RVPUTS(out, "<factorTokens>", NULL);
+        RPRINTF(out, "<factorToken expires='%lu'>%s</factorToken>",
+                1418256000UL, factor_token);
+        RVPUTS(out, "</factorTokens>", NULL);
+        RVPUTS(out, "<returnUrl>", "https://www.example.com/private/",
+               "</returnUrl>", NULL);
+        RVPUTS(out, "<requesterSubject>",
+               "krb5:webauth/www.example.com@EXAMPLE.COM",
+               "</requesterSubject>", NULL);
+        RVPUTS(out, "<subject>", "testuser", "</subject>", NULL);
+        RVPUTS(out, "<requestedToken>", id_token, "</requestedToken>", NULL);
+        RVPUTS(out, "<requestedTokenType>", "id", "</requestedTokenType>",
+               NULL);
+        RVPUTS(out, "<loginHistory>", NULL);
+        for (i = 0; i < 2; i++) {
+            RVPUTS(out, "<loginLocation", NULL);
+            RVPUTS(out, " name=\"", "host.example.com", "\"", NULL);
+            RPRINTF(out, " time=\"%lu\"", 1418250000UL + i);
+            RVPUTS(out, ">", "192.0.2.7", "</loginLocation>", NULL);
+        }
+        RVPUTS(out, "</loginHistory>", NULL);
+        RVPUTS(out, "</requestTokenResponse>", NULL);
+        break;
+    }
+
+    /* Both versions flush at the end of the response. */
+    send_flush(out, out->bb != NULL ? out->bb : out->tmp);
+}
+
+
+/*
+ * Send a response ITERATIONS times, either the old way or in a brigade, and
+ * report the passes and writes per response and the CPU time per response.
+ * Uses a subpool that is cleared after each response, like the request pool
+ * in Apache.
+ */
+static void
+time_response(enum response_type type, bool brigade, int fd,
+              apr_pool_t *pool)
+{
+    struct output out;
+    apr_pool_t *sub;
+    double start;
+    int i;
+
+    if (apr_pool_create(&sub, pool) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    memset(&out, 0, sizeof(out));
+    out.alloc = apr_bucket_alloc_create(pool);
+    out.fd = fd;
+    start = cpu_usec();
+    for (i = 0; i < ITERATIONS; i++) {
+        out.tmp = apr_brigade_create(sub, out.alloc);
+        out.bb = brigade ? apr_brigade_create(sub, out.alloc) : NULL;
+        send_response(&out, type);
+        apr_pool_clear(sub);
+    }
+    start = (cpu_usec() - start) / ITERATIONS;
+    apr_pool_destroy(sub);
+    printf(" %7lu %7lu %8.2f", out.passes / ITERATIONS,
+           out.writes / ITERATIONS, start);
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool;
+    int fd, i;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+        sysbail("cannot open /dev/null");
+    id_token = token_data(pool, ID_LENGTH);
+    proxy_token = token_data(pool, PROXY_LENGTH);
+    factor_token = token_data(pool, FACTOR_LENGTH);
+    session_key = token_data(pool, KEY_LENGTH);
+
+    printf("Passes, writes, and CPU usec per response (%d responses)\n\n",
+           ITERATIONS);
+    printf("%-13s %24s %24s\n", "", "before", "after");
+    printf("%-13s %7s %7s %8s %7s %7s %8s\n", "response", "passes",
+           "writes", "cpu", "passes", "writes", "cpu");
+    for (i = 0; i < RESPONSE_COUNT; i++) {
+        printf("%-13s", response_names[i]);
+        time_response(i, false, fd, pool);
+        time_response(i, true, fd, pool);
+        printf("\n");
+    }
+
+    close(fd);
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * Benchmark parsing of WebKDC XML requests.
+ *
+ * Compares the streaming request parser in mod_webkdc with the APR XML DOM
+ * parser that mod_webkdc used before, on a <getTokensRequest> for an id
+ * token, a <requestTokenRequest> like the ones WebLogin sends for a user with
+ * single sign-on cookies, a <getTokensRequest> asking for the most tokens
+ * the WebKDC will return, and a <getTokensRequest> asking for far too many,
+ * which the WebKDC rejects.  The DOM parse includes a walk of the tree that
+ * collects the text of each element the way the old handlers did, since
+ * that was part of the cost of each request.
+ *
+ * For each request, reports the parses per second and the heap memory used
+ * by the pool of one parse (measured only with the GNU C library).
+ *
+ * This is not part of the test suite.  Run it with make bench.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_general.h>
+#include <apr_strings.h>
+#include <apr_xml.h>
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <modules/webkdc/mod_webkdc.h>
+#include <tests/tap/basic.h>
+
+/* Number of times each request is parsed. */
+#define ITERATIONS 20000
+
+/* Size of the chunks fed to the parser, as read from the client. */
+#define CHUNK 8192
+
+/* Length of the base64 token data in each request. */
+#define SERVICE_LENGTH  300
+#define PROXY_LENGTH    600
+#define REQUEST_LENGTH  400
+
+/* The kinds of requests. */
+enum request_type {
+    REQUEST_GET_ID,
+    REQUEST_LOGIN,
+    REQUEST_GET_MAX,
+    REQUEST_GET_TOO_MANY
+};
+static const char *const request_names[] = {
+    "getTokens id", "requestToken", "getTokens 64", "getTokens 1000"
+};
+#define REQUEST_COUNT 4
+
+/* Function that parses a request in a pool, used to time either parser. */
+typedef void (*parse_func)(const char *, size_t, apr_pool_t *);
+
+
+/*
+ * Return the current time in nanoseconds.
+ */
+static double
+now_nsec(void)
+{
+    struct timeval tv;
+
+    if (gettimeofday(&tv, NULL) < 0)
+        sysbail("cannot get time of day");
+    return (double) tv.tv_sec * 1e9 + (double) tv.tv_usec * 1e3;
+}
+
+
+/*
+ * Return a string of fake base64 token data of the given length, allocated
+ * from the pool.
+ */
+static const char *
+token_data(apr_pool_t *pool, size_t length)
+{
+    static const char base64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char *data;
+    size_t i;
+
+    data = apr_palloc(pool, length + 1);
+    for (i = 0; i < length; i++)
+        data[i] = base64[(i * 7 + 3) % 64];
+    data[length] = '\0';
+    return data;
+}
+
+
+/*
+ * Build a <getTokensRequest> for the given number of id tokens.
+ */
+static const char *
+build_get_tokens(apr_pool_t *pool, size_t count)
+{
+    const char *request;
+    size_t i;
+
+    request = apr_pstrcat(pool,
+        "<getTokensRequest>"
+        "<requesterCredential type=\"service\">",
+        token_data(pool, SERVICE_LENGTH),
+        "</requesterCredential>"
+        "<subjectCredential type=\"proxy\"><proxyToken>",
+        token_data(pool, PROXY_LENGTH),
+        "</proxyToken></subjectCredential>"
+        "<requestToken>", token_data(pool, REQUEST_LENGTH), "</requestToken>"
+        "<tokens>", (char *) NULL);
+    for (i = 0; i < count; i++)
+        request = apr_psprintf(pool, "%s<token type=\"id\" id=\"%lu\">"
+                               "<authenticator type=\"webkdc\"/></token>",
+                               request, (unsigned long) i);
+    return apr_pstrcat(pool, request, "</tokens></getTokensRequest>",
+                       (char *) NULL);
+}
+
+
+/*
+ * Build a <requestTokenRequest> with two webkdc-proxy tokens, a
+ * webkdc-factor token, and the request information WebLogin sends.
+ */
+static const char *
+build_login(apr_pool_t *pool)
+{
+    return apr_pstrcat(pool,
+        "<requestTokenRequest>"
+        "<requesterCredential type=\"service\">",
+        token_data(pool, SERVICE_LENGTH),
+        "</requesterCredential>"
+        "<subjectCredential>"
+        "<proxyToken source=\"remuser\">", token_data(pool, PROXY_LENGTH),
+        "</proxyToken>"
+        "<proxyToken>", token_data(pool, PROXY_LENGTH), "</proxyToken>"
+        "<factorToken>", token_data(pool, SERVICE_LENGTH), "</factorToken>"
+        "</subjectCredential>"
+        "<requestToken>", token_data(pool, REQUEST_LENGTH), "</requestToken>"
+        "<requestInfo>"
+        "<localIpAddr>192.0.2.1</localIpAddr>"
+        "<localIpPort>443</localIpPort>"
+        "<remoteIpAddr>198.51.100.7</remoteIpAddr>"
+        "<remoteIpPort>53412</remoteIpPort>"
+        "</requestInfo>"
+        "</requestTokenRequest>", (char *) NULL);
+}
+
+
+/*
+ * Walk the DOM tree, collecting the text of every element and the type
+ * attribute of every element the way the old request handlers did.  Returns
+ * the total length of what was collected.
+ */
+static size_t
+dom_walk(apr_xml_elem *e, apr_pool_t *pool)
+{
+    apr_xml_elem *child;
+    apr_xml_attr *a;
+    apr_text *t;
+    const char *text = "";
+    size_t size;
+
+    for (t = e->first_cdata.first; t != NULL; t = t->next)
+        text = apr_pstrcat(pool, text, t->text, (char *) NULL);
+    size = strlen(text);
+    for (a = e->attr; a != NULL; a = a->next)
+        if (strcmp(a->name, "type") == 0)
+            size += strlen(a->value);
+    for (child = e->first_child; child != NULL; child = child->next)
+        size += dom_walk(child, pool);
+    return size;
+}
+
+
+/*
+ * Parse a request with the APR XML DOM parser.
+ */
+static void
+parse_dom(const char *request, size_t length, apr_pool_t *pool)
+{
+    apr_xml_parser *xp;
+    apr_xml_doc *doc;
+    size_t offset, chunk;
+    apr_status_t status = APR_SUCCESS;
+
+    xp = apr_xml_parser_create(pool);
+    for (offset = 0; offset < length && status == APR_SUCCESS;
+         offset += chunk) {
+        chunk = length - offset > CHUNK ? CHUNK : length - offset;
+        status = apr_xml_parser_feed(xp, request + offset, chunk);
+    }
+    if (status == APR_SUCCESS)
+        status = apr_xml_parser_done(xp, &doc);
+    if (status != APR_SUCCESS)
+        bail("apr_xml parse failed");
+    if (dom_walk(doc->root, pool) == 0)
+        bail("apr_xml parse found no data");
+}
+
+
+/*
+ * Parse a request with the streaming parser.  Requests for too many tokens
+ * are expected to be rejected.
+ */
+static void
+parse_stream(const char *request, size_t length, apr_pool_t *pool)
+{
+    struct mwk_request parsed;
+    struct mwk_parser *parser;
+    size_t offset, chunk;
+    const char *message;
+    bool ok = true;
+
+    parser = mwk_parser_create(pool, &parsed, 0);
+    if (parser == NULL)
+        bail("cannot create parser");
+    for (offset = 0; offset < length && ok; offset += chunk) {
+        chunk = length - offset > CHUNK ? CHUNK : length - offset;
+        ok = mwk_parser_feed(parser, request + offset, chunk);
+    }
+    if (ok)
+        ok = mwk_parser_done(parser);
+    if (!ok && parsed.num_tokens < MAX_TOKENS_RETURNED) {
+        mwk_parser_error(parser, &message);
+        bail("streaming parse failed: %s", message);
+    }
+}
+
+
+/*
+ * Return the bytes of heap in use, or 0 if there's no way to tell.
+ */
+static size_t
+heap_bytes(void)
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+    return (size_t) mallinfo().uordblks;
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * Return the heap memory used by the pool of one parse.  The pool gets its
+ * own allocator so that all of its memory comes from malloc rather than from
+ * memory freed by earlier pools.  Memory malloc'd by the parser itself is
+ * included, since it's only freed when the pool is destroyed.
+ */
+static size_t
+pool_bytes(parse_func parse, const char *request, size_t length)
+{
+    apr_allocator_t *allocator;
+    apr_pool_t *pool;
+    size_t before, after;
+
+    if (apr_allocator_create(&allocator) != APR_SUCCESS)
+        bail("cannot create allocator");
+    if (apr_pool_create_ex(&pool, NULL, NULL, allocator) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    apr_allocator_owner_set(allocator, pool);
+    before = heap_bytes();
+    parse(request, length, pool);
+    after = heap_bytes();
+    apr_pool_destroy(pool);
+    return after > before ? after - before : 0;
+}
+
+
+/*
+ * Time parsing a request and return the parses per second.  Uses a subpool
+ * that is cleared after each parse, like the request pool in Apache.
+ */
+static double
+time_parse(parse_func parse, const char *request, size_t length,
+           apr_pool_t *pool)
+{
+    apr_pool_t *sub;
+    double start;
+    int i;
+
+    if (apr_pool_create(&sub, pool) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    start = now_nsec();
+    for (i = 0; i < ITERATIONS; i++) {
+        parse(request, length, sub);
+        apr_pool_clear(sub);
+    }
+    start = now_nsec() - start;
+    apr_pool_destroy(sub);
+    return ITERATIONS / (start / 1e9);
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool;
+    const char *requests[REQUEST_COUNT];
+    size_t length;
+    int i;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    requests[REQUEST_GET_ID] = build_get_tokens(pool, 1);
+    requests[REQUEST_LOGIN] = build_login(pool);
+    requests[REQUEST_GET_MAX] = build_get_tokens(pool, MAX_TOKENS_RETURNED);
+    requests[REQUEST_GET_TOO_MANY] = build_get_tokens(pool, 1000);
+
+    printf("Parses per second and pool bytes per parse (%d parses)\n\n",
+           ITERATIONS);
+    printf("%-15s %7s %10s %10s %10s %10s\n", "request", "bytes", "dom/s",
+           "stream/s", "dom mem", "stream mem");
+    for (i = 0; i < REQUEST_COUNT; i++) {
+        length = strlen(requests[i]);
+        printf("%-15s %7lu", request_names[i], (unsigned long) length);
+        printf(" %10.0f", time_parse(parse_dom, requests[i], length, pool));
+        printf(" %10.0f",
+               time_parse(parse_stream, requests[i], length, pool));
+        printf(" %10lu",
+               (unsigned long) pool_bytes(parse_dom, requests[i], length));
+        printf(" %10lu\n",
+               (unsigned long) pool_bytes(parse_stream, requests[i], length));
+    }
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}
@@ -0,0 +1,845 @@
+/*
+ * Differential test for attribute decoding.
+ *
+ * Checks the rule-indexed attribute decoder against the original decoder,
+ * which built a hash table of the attributes in each encoding and looked up
+ * each rule in it.  A copy of the original decoder is included here as the
+ * reference.  Valid encodings of tokens, Kerberos credentials, and keyrings
+ * are mutated at random, and both decoders must return the same status, the
+ * same error message, and the same decoded data.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <apr_hash.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+#include <util/macros.h>
+#include <webauth/basic.h>
+#include <webauth/tokens.h>
+
+/* Number of mutations of each sample encoding to try. */
+#define MUTATIONS 2000
+
+/* Stores metadata about a particular attribute for the reference decoder. */
+struct value {
+    void *data;
+    size_t length;
+};
+
+/*
+ * Macros used to resolve a void * pointer to a struct and an offset into a
+ * pointer to the appropriate type.
+ */
+#define LOC_DATA(d, o)   (void **)         (void *)((char *) (d) + (o))
+#define LOC_INT32(d, o)  (int32_t *)       (void *)((char *) (d) + (o))
+#define LOC_STRING(d, o) (char **)         (void *)((char *) (d) + (o))
+#define LOC_SIZE(d, o)   (size_t *)        (void *)((char *) (d) + (o))
+#define LOC_TIME(d, o)   (time_t *)        (void *)((char *) (d) + (o))
+#define LOC_UINT32(d, o) (uint32_t *)      (void *)((char *) (d) + (o))
+#define LOC_ULONG(d, o)  (unsigned long *) (void *)((char *) (d) + (o))
+
+/* Storage for anything that either decoder may decode into. */
+union decoded {
+    struct webauth_token token;
+    struct wai_krb5_cred cred;
+    struct wai_keyring keyring;
+};
+
+/* Build a sample encoding and its length from a string literal. */
+#define SAMPLE(s) { (s), sizeof(s) - 1 }
+
+/* The required attributes of a Kerberos credential, for hand-written cases. */
+#define CRED_BASE                                                       \
+    "K=\0\0\0\1;k=x;ta=\0\0\0\1;ts=\0\0\0\1;te=\0\0\0\1;tr=\0\0\0\1;"     \
+    "i=\0\0\0\0;f=\0\0\0\0;"
+
+/* Characters that are likely to make interesting mutations. */
+static const char mutation_chars[] = "=;;;0129atAaDdnkvs";
+
+/* State of the pseudorandom number generator, seeded for repeatability. */
+static uint32_t rng_state = 2463534242U;
+
+
+/*
+ * The reference decoder: the original implementation of attribute decoding,
+ * renamed with a ref_ prefix.  The only change is that ref_repeat_size caps
+ * the size of the array allocated for repeated elements, since a corrupt
+ * count could otherwise make the original allocate an enormous array before
+ * failing.  Every decoded element with a required rule consumes at least one
+ * attribute, so no more than one element past the number of attributes can
+ * be written to.
+ */
+static size_t
+ref_repeat_size(const struct wai_encoding *rules, apr_hash_t *attrs,
+                uint32_t count)
+{
+    const struct wai_encoding *rule;
+
+    for (rule = rules; rule->attr != NULL; rule++)
+        if (!rule->optional && count > apr_hash_count(attrs))
+            return apr_hash_count(attrs) + 1;
+    return count;
+}
+
+
+/*
+ * Report an error while encoding an attribute.  Takes the WebAuth context,
+ * status, description, context (for repeated elements), and element number
+ * (for repeated elements).
+ */
+static void
+ref_decode_error_set(struct webauth_context *ctx, int s, const char *desc,
+                     const char *context, size_t element)
+{
+    if (context != NULL && element != 0)
+        wai_error_set(ctx, s, "decoding %s %s %lu", context, desc,
+                      (unsigned long) element);
+    else
+        wai_error_set(ctx, s, "decoding %s", desc);
+}
+
+
+/*
+ * Convert the attribute-encoded data to a hash table of attribute names to
+ * values, where values are represented by struct value.  This destructively
+ * modifies the encoded form in place to avoid having to make another copy of
+ * the data.  Returns a WebAuth status code.
+ */
+static int
+ref_decode_attrs(struct webauth_context *ctx, void *data, size_t length,
+                 apr_hash_t **output)
+{
+    apr_hash_t *attrs;
+    struct value *values;
+    size_t i, n, offset;
+    char *name, *value;
+    size_t attr_count = 0;
+    char *in = data;
+
+    /*
+     * First pass: count how many attributes there are.  Don't do any syntax
+     * checking at this point.  Just count = signs that could be separators
+     * between an attribute name and its value.
+     */
+    for (i = 0; i < length; i++) {
+        if (in[i] == '=') {
+            attr_count++;
+            i++;
+            while (i < length - 1) {
+                if (in[i] == ';') {
+                    if (in[i + 1] != ';')
+                        break;
+                    i++;
+                }
+                i++;
+            }
+        }
+    }
+
+    /*
+     * We know roughly how many attributes there are.  Allocate data
+     * structures.
+     */
+    attrs = apr_hash_make(ctx->pool);
+    values = apr_pcalloc(ctx->pool, attr_count * sizeof(struct value));
+
+    /*
+     * Now, do the decoding.  As we go, we'll make two transformations:
+     * nul-terminate the attribute name by replacing the = with a nul
+     * character, and rewrite the value to unescape any semicolons.  When we
+     * find the end of an attribute, we store it in the table.  This is where
+     * we do all the syntax checking.
+     */
+    i = 0;
+    n = 0;
+    while (i < length) {
+        name = in + i;
+
+        /* Find the end of the attribute name. */
+        while (i < length && in[i] != '=')
+            i++;
+        if (name == in + i || i >= length)
+            goto corrupt;       /* no attribute name */
+        in[i] = '\0';
+        i++;
+
+        /*
+         * Find the end of the value, unescaping semicolons.  offset is how
+         * much we have to shift each octet because of escaped semicolons
+         * we've removed.
+         */
+        value = in + i;
+        offset = 0;
+        while (i < length) {
+            if (in[i] == ';') {
+                if (i < length - 1 && in[i + 1] == ';')
+                    offset++;
+                else
+                    break;
+                i++;
+            }
+            if (offset > 0)
+                in[i - offset] = in[i];
+            i++;
+        }
+        if (i >= length || in[i] != ';')
+            goto corrupt;
+
+        /* Check whether we have a duplicate. */
+        if (apr_hash_get(attrs, name, strlen(name)) != NULL) {
+            wai_error_set(ctx, WA_ERR_CORRUPT, "duplicate attribute %s", name);
+            return WA_ERR_CORRUPT;
+        }
+
+        /*
+         * We have a valid key/value pair.  Store it in the table and
+         * nul-terminate in case it's a number encoded as a string to save us
+         * some effort later.
+         */
+        in[i - offset] = '\0';
+        values[n].data = value;
+        values[n].length = (in + i) - value - offset;
+        apr_hash_set(attrs, name, strlen(name), (const void *) &values[n]);
+        n++;
+        i++;
+    }
+
+    /* Success.  Store the table in our output variable and return. */
+    *output = attrs;
+    return WA_ERR_NONE;
+
+corrupt:
+    return wai_error_set(ctx, WA_ERR_CORRUPT, "invalid attribute data");
+}
+
+
+/*
+ * Decode attribute data, possibly hex-encoded.  Takes the WebAuth context,
+ * the value, the memory location to which to write the data, the memory
+ * location to which to write the length, and a flag saying whether the value
+ * is hex-encoded.  Returns a WebAuth error code.
+ */
+static int
+ref_decode_data(struct webauth_context *ctx, struct value *value,
+                void **output, size_t *size, bool ascii)
+{
+    int s;
+    size_t length;
+
+    if (ascii) {
+        s = wai_hex_decoded_length(value->length, &length);
+        if (s != WA_ERR_NONE)
+            return wai_error_set(ctx, s, "invalid hex-encoded data");
+        *output = apr_pcalloc(ctx->pool, length);
+        s = wai_hex_decode(value->data, value->length, *output, size, length);
+        if (s != WA_ERR_NONE)
+            return wai_error_set(ctx, s, "invalid hex-encoded data");
+    } else {
+        *output = apr_pmemdup(ctx->pool, value->data, value->length);
+        *size = value->length;
+    }
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Decode an attribute value as a string.  This is very similar to the
+ * non-ascii case of ref_decode_data, except that we nul-terminate the result.
+ * Takes the WebAuth context, the value, and the location to which to write
+ * the string.
+ */
+static void
+ref_decode_string(struct webauth_context *ctx, struct value *value,
+                  char **output)
+{
+    *output = apr_palloc(ctx->pool, value->length + 1);
+    memcpy(*output, value->data, value->length);
+    (*output)[value->length] = '\0';
+}
+
+
+/*
+ * Decode an attribute value as a number.  All numbers are either encoded as
+ * an ASCII string representing the number or as a network-byte-order 32-bit
+ * unsigned number.  Signed results are by interpretation.  Therefore, takes
+ * the WebAuth context, the value, a place to write the 32-bit unsigned value,
+ * and a flag saying whether it was encoded as a string.
+ */
+static int
+ref_decode_number(struct webauth_context *ctx, struct value *value,
+                  uint32_t *output, bool ascii)
+{
+    char *end;
+    uint32_t data;
+    unsigned long n;
+
+    if (ascii) {
+        errno = 0;
+        n = strtoul(value->data, &end, 10);
+        if (*end != '\0' || (n == ULONG_MAX && errno != 0))
+            goto corrupt;
+        *output = n;
+    } else {
+        if (value->length != sizeof(uint32_t))
+            goto corrupt;
+        memcpy(&data, value->data, sizeof(uint32_t));
+        *output = ntohl(data);
+    }
+    return WA_ERR_NONE;
+
+corrupt:
+    return wai_error_set(ctx, WA_ERR_CORRUPT, "invalid encoded number");
+}
+
+
+/*
+ * Given an encoding specification, an attribute list, and a data structure,
+ * decode attributes into that data structure.  Takes a separate pool to use
+ * rather than using the normal WebAuth context pool.  Context is a string to
+ * prepend to the description for error reporting.  If element is non-zero, we
+ * are handling a repeated attribute encoding, and the element number is
+ * appended to the attribute name when decoding it.
+ *
+ * This is an internal helper function used by ref_decode.
+ */
+static int
+ref_decode_by_rule(struct webauth_context *ctx,
+                   const struct wai_encoding *rules, apr_hash_t *attrs,
+                   const void *result, const char *context,
+                   unsigned long element)
+{
+    const struct wai_encoding *rule;
+    const char *attr;
+    struct value *value;
+    size_t size;
+    unsigned long i;
+    int s;
+    void *data;
+    void **repeat;
+    uint32_t uint32;
+
+    for (rule = rules; rule->attr != NULL; rule++) {
+        if (context == NULL)
+            attr = rule->attr;
+        else
+            attr = apr_psprintf(ctx->pool, "%s%lu", rule->attr, element);
+        value = apr_hash_get(attrs, attr, strlen(attr));
+        s = WA_ERR_NONE;
+
+        /* If this attribute isn't optional, missing data is an error. */
+        if (value == NULL) {
+            if (rule->optional)
+                continue;
+            s = WA_ERR_CORRUPT;
+            ref_decode_error_set(ctx, s, rule->desc, context, element);
+            return s;
+        }
+
+        /* Otherwise, interpret the value by data type. */
+        switch (rule->type) {
+        case WA_TYPE_DATA:
+            s = ref_decode_data(ctx, value, LOC_DATA(result, rule->offset),
+                            LOC_SIZE(result, rule->len_offset), rule->ascii);
+            break;
+        case WA_TYPE_STRING:
+            ref_decode_string(ctx, value, LOC_STRING(result, rule->offset));
+            break;
+        case WA_TYPE_INT32:
+            s = ref_decode_number(ctx, value, &uint32, rule->ascii);
+            if (s == WA_ERR_NONE)
+                *LOC_INT32(result, rule->offset) = (int32_t) uint32;
+            break;
+        case WA_TYPE_UINT32:
+            s = ref_decode_number(ctx, value, &uint32, rule->ascii);
+            if (s == WA_ERR_NONE)
+                *LOC_UINT32(result, rule->offset) = uint32;
+            break;
+        case WA_TYPE_ULONG:
+            s = ref_decode_number(ctx, value, &uint32, rule->ascii);
+            if (s == WA_ERR_NONE)
+                *LOC_ULONG(result, rule->offset) = uint32;
+            break;
+        case WA_TYPE_TIME:
+            s = ref_decode_number(ctx, value, &uint32, rule->ascii);
+            if (s == WA_ERR_NONE)
+                *LOC_TIME(result, rule->offset) = (time_t) uint32;
+            break;
+        case WA_TYPE_REPEAT:
+            s = ref_decode_number(ctx, value, &uint32, rule->ascii);
+            if (s != WA_ERR_NONE)
+                break;
+            *LOC_UINT32(result, rule->len_offset) = uint32;
+            repeat = LOC_DATA(result, rule->offset);
+            size = ref_repeat_size(rule->repeat, attrs, uint32);
+            *repeat = apr_palloc(ctx->pool, rule->size * size);
+            for (i = 0; i < uint32; i++) {
+                data = (char *) *repeat + i * rule->size;
+                s = ref_decode_by_rule(ctx, rule->repeat, attrs, data, attr,
+                                       i);
+                if (s != WA_ERR_NONE)
+                    return s;
+            }
+            break;
+        }
+        if (s != WA_ERR_NONE)
+            return s;
+    }
+    return WA_ERR_NONE;
+}
+
+
+/*
+ * Given an encoding specification, attribute-encoded data, and a data
+ * structure, decode that data into the data structure as newly-allocated pool
+ * memory.
+ */
+static int
+ref_decode(struct webauth_context *ctx, const struct wai_encoding *rules,
+           const void *input, size_t length, void *data)
+{
+    apr_hash_t *attrs;
+    int s;
+    void *buf;
+
+    buf = apr_pmemdup(ctx->pool, input, length);
+    s = ref_decode_attrs(ctx, buf, length, &attrs);
+    if (s != WA_ERR_NONE)
+        return s;
+    return ref_decode_by_rule(ctx, rules, attrs, data, NULL, 0);
+}
+
+
+/*
+ * Similar to ref_decode, but decodes a WebAuth token, including handling the
+ * determination of the type of the token from the attributes.  This does not
+ * perform any sanity checking on the token data; that must be done by
+ * higher-level code.
+ */
+static int
+ref_decode_token(struct webauth_context *ctx, const void *input,
+                 size_t length, struct webauth_token *token)
+{
+    apr_hash_t *attrs;
+    int s;
+    void *buf, *data;
+    struct value *value;
+    char *type;
+    const struct wai_encoding *rules;
+
+    memset(token, 0, sizeof(*token));
+    buf = apr_pmemdup(ctx->pool, input, length);
+    s = ref_decode_attrs(ctx, buf, length, &attrs);
+    if (s != WA_ERR_NONE)
+        return s;
+    value = apr_hash_get(attrs, "t", strlen("t"));
+    if (value == NULL)
+        return wai_error_set(ctx, WA_ERR_CORRUPT, "no token type attribute");
+    ref_decode_string(ctx, value, &type);
+    token->type = webauth_token_type_code(type);
+    if (token->type == WA_TOKEN_UNKNOWN) {
+        wai_error_set(ctx, WA_ERR_CORRUPT, "unknown token type %s", type);
+        return WA_ERR_CORRUPT;
+    }
+    s = wai_token_encoding(ctx, token, &rules, (const void **) &data);
+    if (s != WA_ERR_NONE)
+        return s;
+    return ref_decode_by_rule(ctx, rules, attrs, data, NULL, 0);
+}
+
+
+/*
+ * Return the next pseudorandom number.  This is a simple xorshift generator
+ * so that the test is repeatable on every platform.
+ */
+static uint32_t
+rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+
+/*
+ * Return a newly allocated copy of the input with between one and three
+ * random mutations: changing, inserting, or deleting a byte, duplicating an
+ * attribute, or truncating the data.  The length of the result is stored in
+ * length, which is initially the length of the input.
+ */
+static char *
+mutate(const char *input, size_t *length)
+{
+    char *out;
+    size_t len, pos, start, end, i, n;
+
+    len = *length;
+    out = bmalloc(len * 2 + 8);
+    memcpy(out, input, len);
+    n = 1 + rng() % 3;
+    for (i = 0; i < n; i++) {
+        pos = (len == 0) ? 0 : rng() % len;
+        switch (rng() % 6) {
+        case 0:
+            if (len > 0)
+                out[pos] = mutation_chars[rng() % strlen(mutation_chars)];
+            break;
+        case 1:
+            if (len > 0)
+                out[pos] = (char) (rng() & 0xff);
+            break;
+        case 2:
+            memmove(out + pos + 1, out + pos, len - pos);
+            out[pos] = mutation_chars[rng() % strlen(mutation_chars)];
+            len++;
+            break;
+        case 3:
+            if (len > 0) {
+                memmove(out + pos, out + pos + 1, len - pos - 1);
+                len--;
+            }
+            break;
+        case 4:
+            /* Duplicate the attribute that starts after a semicolon. */
+            for (start = pos; start > 0 && out[start - 1] != ';'; start--)
+                ;
+            for (end = start; end < len && out[end] != ';'; end++)
+                ;
+            if (end < len && len + (end - start + 1) <= *length * 2 + 8) {
+                end++;
+                memmove(out + end + (end - start), out + end, len - end);
+                memcpy(out + end, out + start, end - start);
+                len += end - start;
+            }
+            break;
+        default:
+            len = pos;
+            break;
+        }
+    }
+    *length = len;
+    return out;
+}
+
+
+/*
+ * Compare two structs decoded with the same rules, returning true if they are
+ * the same.
+ */
+static bool
+compare_rules(const struct wai_encoding *rules, const void *a, const void *b)
+{
+    const struct wai_encoding *rule;
+    const char *sa, *sb;
+    const void *da, *db;
+    size_t size;
+    uint32_t i, count;
+
+    for (rule = rules; rule->attr != NULL; rule++)
+        switch (rule->type) {
+        case WA_TYPE_DATA:
+            size = *LOC_SIZE(a, rule->len_offset);
+            if (size != *LOC_SIZE(b, rule->len_offset))
+                return false;
+            da = *LOC_DATA(a, rule->offset);
+            db = *LOC_DATA(b, rule->offset);
+            if (size > 0 && memcmp(da, db, size) != 0)
+                return false;
+            break;
+        case WA_TYPE_STRING:
+            sa = *LOC_STRING(a, rule->offset);
+            sb = *LOC_STRING(b, rule->offset);
+            if (sa == NULL || sb == NULL) {
+                if (sa != sb)
+                    return false;
+            } else if (strcmp(sa, sb) != 0)
+                return false;
+            break;
+        case WA_TYPE_INT32:
+        case WA_TYPE_UINT32:
+            if (*LOC_UINT32(a, rule->offset) != *LOC_UINT32(b, rule->offset))
+                return false;
+            break;
+        case WA_TYPE_ULONG:
+            if (*LOC_ULONG(a, rule->offset) != *LOC_ULONG(b, rule->offset))
+                return false;
+            break;
+        case WA_TYPE_TIME:
+            if (*LOC_TIME(a, rule->offset) != *LOC_TIME(b, rule->offset))
+                return false;
+            break;
+        case WA_TYPE_REPEAT:
+            count = *LOC_UINT32(a, rule->len_offset);
+            if (count != *LOC_UINT32(b, rule->len_offset))
+                return false;
+            da = *LOC_DATA(a, rule->offset);
+            db = *LOC_DATA(b, rule->offset);
+            for (i = 0; i < count; i++)
+                if (!compare_rules(rule->repeat,
+                                   (const char *) da + i * rule->size,
+                                   (const char *) db + i * rule->size))
+                    return false;
+            break;
+        }
+    return true;
+}
+
+
+/*
+ * Report some encoded data as a diagnostic, with non-printable characters
+ * escaped in octal.
+ */
+static void
+diag_data(const void *input, size_t length)
+{
+    const unsigned char *data = input;
+    char *buffer, *p;
+    size_t i;
+
+    buffer = bmalloc(length * 4 + 1);
+    for (p = buffer, i = 0; i < length; i++)
+        if (isprint(data[i]) && data[i] != '\\')
+            *p++ = (char) data[i];
+        else
+            p += sprintf(p, "\\%03o", data[i]);
+    *p = '\0';
+    diag("  %s", buffer);
+    free(buffer);
+}
+
+
+/*
+ * Decode the input with both decoders, using the given rules or as a token
+ * if rules is NULL, and return true if they agree on the status, the error
+ * message, and the decoded data.
+ */
+static bool
+same_decode(const struct wai_encoding *rules, const void *input, size_t length)
+{
+    struct webauth_context *ctx, *ref;
+    union decoded *result, *expected;
+    const struct wai_encoding *token_rules;
+    const void *da, *db;
+    int s, s_ref;
+    bool same;
+
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    if (webauth_context_init(&ref, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    result = bcalloc(1, sizeof(union decoded));
+    expected = bcalloc(1, sizeof(union decoded));
+    if (rules == NULL) {
+        s = wai_decode_token(ctx, input, length, &result->token);
+        s_ref = ref_decode_token(ref, input, length, &expected->token);
+    } else {
+        s = wai_decode(ctx, rules, input, length, result);
+        s_ref = ref_decode(ref, rules, input, length, expected);
+    }
+
+    /* Compare the results. */
+    same = (s == s_ref);
+    if (same && s != WA_ERR_NONE)
+        same = (strcmp(webauth_error_message(ctx, s),
+                       webauth_error_message(ref, s_ref)) == 0);
+    else if (same && rules == NULL) {
+        same = (result->token.type == expected->token.type);
+        if (same) {
+            wai_token_encoding(ctx, &result->token, &token_rules, &da);
+            wai_token_encoding(ref, &expected->token, &token_rules, &db);
+            same = compare_rules(token_rules, da, db);
+        }
+    } else if (same)
+        same = compare_rules(rules, result, expected);
+    if (!same) {
+        diag("decoders disagree: %d (%s) and %d (%s) on:", s,
+             webauth_error_message(ctx, s), s_ref,
+             webauth_error_message(ref, s_ref));
+        diag_data(input, length);
+    }
+
+    free(result);
+    free(expected);
+    webauth_context_free(ctx);
+    webauth_context_free(ref);
+    return same;
+}
+
+
+/*
+ * Encode a sample with the given rules, or as a token if rules is NULL, and
+ * then check that both decoders agree on it and on random mutations of it.
+ */
+static void
+test_sample(const char *name, const struct wai_encoding *rules,
+            const void *data)
+{
+    struct webauth_context *ctx;
+    void *encoded;
+    char *mutated;
+    size_t length, mutated_len;
+    size_t i, failures;
+    int s;
+
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+    if (rules == NULL)
+        s = wai_encode_token(ctx, data, &encoded, &length);
+    else
+        s = wai_encode(ctx, rules, data, &encoded, &length);
+    if (s != WA_ERR_NONE)
+        bail("cannot encode %s: %s", name, webauth_error_message(ctx, s));
+    ok(same_decode(rules, encoded, length), "%s decodes the same", name);
+    failures = 0;
+    for (i = 0; i < MUTATIONS; i++) {
+        mutated_len = length;
+        mutated = mutate(encoded, &mutated_len);
+        if (!same_decode(rules, mutated, mutated_len))
+            failures++;
+        free(mutated);
+    }
+    is_int(0, failures, "...and so do %d mutations", MUTATIONS);
+    webauth_context_free(ctx);
+}
+
+
+int
+main(void)
+{
+    struct webauth_token app, request;
+    struct wai_krb5_cred cred;
+    struct wai_krb5_cred_address address[2];
+    struct wai_krb5_cred_authdata authdata;
+    struct wai_keyring keyring;
+    struct wai_keyring_entry entry[3];
+    size_t i, failures;
+    char key[] = "0123456789abcdef";
+
+    /* Hand-written encodings with duplicate, unknown, or odd attributes. */
+    static const struct {
+        const char *data;
+        size_t length;
+    } tokens[] = {
+        SAMPLE("t=app;et=\0\0\0\1;"),
+        SAMPLE("t=app;et=\0\0\0\1;et=\0\0\0\2;"),
+        SAMPLE("t=app;x=1;x=2;et=\0\0\0\1;"),
+        SAMPLE("t=app;t=app;et=\0\0\0\1;"),
+        SAMPLE("et=\0\0\0\1;et=\0\0\0\1;"),
+        SAMPLE("x=1;x=1;bad"),
+        SAMPLE("x=1;x=1;t=app;"),
+        SAMPLE("t=bogus;t=bogus;"),
+        SAMPLE("s=a;;b;t=app;et=\0\0\0\1;"),
+        SAMPLE("t=app;et=\0\0\0\1;;"),
+        SAMPLE("t=app;=x;"),
+        SAMPLE("")
+    }, creds[] = {
+        SAMPLE(CRED_BASE "na=\0\0\0\1;A0=\0\0\0\2;a0=x;A0=\0\0\0\2;"),
+        SAMPLE(CRED_BASE "na=\0\0\0\1;A00=\0\0\0\2;A0=\0\0\0\2;a0=x;"),
+        SAMPLE(CRED_BASE "na=\0\0\0\2;A0=\0\0\0\2;a0=x;a1=y;"),
+        SAMPLE(CRED_BASE "na=\0\0\0\1;A1=\0\0\0\2;a1=x;"),
+        SAMPLE(CRED_BASE "A5=\0\0\0\2;A5=\0\0\0\2;"),
+        SAMPLE(CRED_BASE "nd=\0\0\0\1;D0=\0\0\0\1;d0=x;A0=\0\0\0\1;")
+    };
+
+    plan(10);
+
+    /* An app token with every attribute set. */
+    memset(&app, 0, sizeof(app));
+    app.type = WA_TOKEN_APP;
+    app.token.app.subject = "testuser";
+    app.token.app.authz_subject = "otheruser";
+    app.token.app.last_used = 1308777930;
+    app.token.app.session_key = key;
+    app.token.app.session_key_len = sizeof(key) - 1;
+    app.token.app.initial_factors = "p,o,o3";
+    app.token.app.session_factors = "c";
+    app.token.app.loa = 3;
+    app.token.app.creation = 1308777900;
+    app.token.app.expiration = 1308871632;
+    test_sample("app token", NULL, &app);
+
+    /* A request token, which has the most rules. */
+    memset(&request, 0, sizeof(request));
+    request.type = WA_TOKEN_REQUEST;
+    request.token.request.type = "id";
+    request.token.request.auth = "webkdc";
+    request.token.request.state = "s;;tate";
+    request.token.request.state_len = 7;
+    request.token.request.return_url = "https://example.com/";
+    request.token.request.options = "fa";
+    request.token.request.initial_factors = "p";
+    request.token.request.session_factors = "p";
+    request.token.request.loa = 1;
+    request.token.request.creation = 1308777900;
+    test_sample("request token", NULL, &request);
+
+    /* A Kerberos credential with repeated addresses and authdata. */
+    memset(&cred, 0, sizeof(cred));
+    cred.client_principal = "user@EXAMPLE.COM";
+    cred.server_principal = "krbtgt/EXAMPLE.COM@EXAMPLE.COM";
+    cred.keyblock_enctype = 17;
+    cred.keyblock_data = key;
+    cred.keyblock_data_len = sizeof(key) - 1;
+    cred.auth_time = 1308777900;
+    cred.start_time = 1308777900;
+    cred.end_time = 1308871632;
+    cred.renew_until = 1308871632;
+    cred.flags = 0x40e00000;
+    address[0].type = 2;
+    address[0].data = "\177\0\0\1";
+    address[0].data_len = 4;
+    address[1].type = 2;
+    address[1].data = "\300\250\0\1";
+    address[1].data_len = 4;
+    cred.address_count = 2;
+    cred.address = address;
+    cred.ticket = key;
+    cred.ticket_len = sizeof(key) - 1;
+    authdata.type = 1;
+    authdata.data = key;
+    authdata.data_len = sizeof(key) - 1;
+    cred.authdata_count = 1;
+    cred.authdata = &authdata;
+    test_sample("Kerberos credential", wai_krb5_cred_encoding, &cred);
+
+    /* A keyring with three keys, which uses ASCII numbers and hex. */
+    for (i = 0; i < ARRAY_SIZE(entry); i++) {
+        entry[i].creation = 1308777900 + i;
+        entry[i].valid_after = 1308777900 + i * 3600;
+        entry[i].key_type = WA_KEY_AES;
+        entry[i].key = key;
+        entry[i].key_len = sizeof(key) - 1;
+    }
+    keyring.version = 1;
+    keyring.entry_count = ARRAY_SIZE(entry);
+    keyring.entry = entry;
+    test_sample("keyring", wai_keyring_encoding, &keyring);
+
+    /* Check the hand-written cases. */
+    failures = 0;
+    for (i = 0; i < ARRAY_SIZE(tokens); i++)
+        if (!same_decode(NULL, tokens[i].data, tokens[i].length))
+            failures++;
+    is_int(0, failures, "Hand-written tokens decode the same");
+    failures = 0;
+    for (i = 0; i < ARRAY_SIZE(creds); i++)
+        if (!same_decode(wai_krb5_cred_encoding, creds[i].data,
+                         creds[i].length))
+            failures++;
+    is_int(0, failures, "Hand-written credentials decode the same");
+
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Test suite for libwebauth base64 encoding and decoding.
+ *
+ * Checks every implementation the processor supports against the APR base64
+ * functions that were used before, including for invalid data, and checks
+ * the URL-safe alphabet against the standard one.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <apr_base64.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+
+/* Longest data to encode and decode. */
+#define MAX_LENGTH 300
+
+/* Size of the buffers, with room for in-place encoding. */
+#define BUFSIZE 1024
+
+/* Names of the implementations for test descriptions. */
+static const char *const simd_names[] = {
+    "portable", "sse2", "ssse3", "avx2"
+};
+
+/* Bytes to insert into encoded data to check handling of invalid data. */
+static const char invalid[] = { '=', '!', ' ', '\n', '-', '_', '\0', '\x80',
+                                '\xff' };
+
+
+/*
+ * Fill a buffer with data that has every byte value and differs by length.
+ */
+static void
+fill(unsigned char *data, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        data[i] = (unsigned char) (i * 37 + length);
+}
+
+
+/*
+ * Translate a standard base64 encoding to the URL-safe alphabet in place.
+ */
+static void
+to_url(char *data, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < length; i++)
+        if (data[i] == '+')
+            data[i] = '-';
+        else if (data[i] == '/')
+            data[i] = '_';
+}
+
+
+/*
+ * Check encoding and decoding of data of every length up to MAX_LENGTH with
+ * the given implementation against APR, in both alphabets.  Each kind of
+ * check is reported as a single test, with a diagnostic for the first
+ * failure.
+ */
+static void
+check_lengths(enum wai_simd simd)
+{
+    unsigned char data[BUFSIZE], decoded[BUFSIZE];
+    char expected[BUFSIZE], seen[BUFSIZE];
+    size_t length, elen, dlen, offset;
+    bool encode_ok = true, url_ok = true, decode_ok = true, place_ok = true;
+    const char *name = simd_names[simd];
+
+    for (length = 0; length <= MAX_LENGTH; length++) {
+        fill(data, length);
+        elen = wai_base64_encoded_length(length);
+        apr_base64_encode(expected, (const char *) data, (int) length);
+
+        /* Standard alphabet against APR. */
+        memset(seen, 'x', sizeof(seen));
+        wai_base64_encode_simd(simd, seen, data, length, WAI_BASE64_STANDARD);
+        if (encode_ok && (strlen(seen) != elen || strcmp(expected, seen))) {
+            diag("%s encoding of length %lu: %s", name,
+                 (unsigned long) length, seen);
+            encode_ok = false;
+        }
+        memset(decoded, 0, sizeof(decoded));
+        dlen = wai_base64_decode_simd(simd, decoded, expected, elen,
+                                      WAI_BASE64_STANDARD);
+        if (decode_ok && (dlen != length || memcmp(decoded, data, length))) {
+            diag("%s decoding of length %lu", name, (unsigned long) length);
+            decode_ok = false;
+        }
+
+        /* URL-safe alphabet against translated APR output. */
+        to_url(expected, elen);
+        wai_base64_encode_simd(simd, seen, data, length, WAI_BASE64_URL);
+        dlen = wai_base64_decode_simd(simd, decoded, expected, elen,
+                                      WAI_BASE64_URL);
+        if (url_ok && (strcmp(expected, seen) || dlen != length
+                       || memcmp(decoded, data, length))) {
+            diag("%s URL-safe encoding of length %lu", name,
+                 (unsigned long) length);
+            url_ok = false;
+        }
+
+        /*
+         * In-place encoding with the data at the end of the buffer, as done
+         * for tokens.
+         */
+        offset = elen + 1 - length;
+        fill((unsigned char *) seen + offset, length);
+        wai_base64_encode_simd(simd, seen, seen + offset, length,
+                               WAI_BASE64_URL);
+        if (place_ok && strcmp(expected, seen)) {
+            diag("%s in-place encoding of length %lu", name,
+                 (unsigned long) length);
+            place_ok = false;
+        }
+    }
+    ok(encode_ok, "%s encoding matches APR", name);
+    ok(decode_ok, "%s decoding matches APR", name);
+    ok(url_ok, "%s URL-safe encoding and decoding", name);
+    ok(place_ok, "%s in-place encoding", name);
+}
+
+
+/*
+ * Check decoding of encoded data with an invalid byte at every position, and
+ * of every byte value in the middle of a block, against APR.
+ */
+static void
+check_invalid(enum wai_simd simd)
+{
+    unsigned char data[BUFSIZE], expected[BUFSIZE], seen[BUFSIZE];
+    char encoded[BUFSIZE], modified[BUFSIZE];
+    size_t elen, i, j, wanted, dlen;
+    bool invalid_ok = true, bytes_ok = true;
+    const char *name = simd_names[simd];
+
+    fill(data, 200);
+    apr_base64_encode(encoded, (const char *) data, 200);
+    elen = strlen(encoded);
+    for (i = 0; i < elen; i++)
+        for (j = 0; j < sizeof(invalid); j++) {
+            memcpy(modified, encoded, elen + 1);
+            modified[i] = invalid[j];
+            wanted = apr_base64_decode_binary(expected, modified);
+            dlen = wai_base64_decode_simd(simd, seen, modified, elen,
+                                          WAI_BASE64_STANDARD);
+            if (invalid_ok && (dlen != wanted
+                               || memcmp(expected, seen, wanted) != 0)) {
+                diag("%s decoding with 0x%02x at %lu", name,
+                     (unsigned int) (unsigned char) invalid[j],
+                     (unsigned long) i);
+                invalid_ok = false;
+            }
+        }
+    ok(invalid_ok, "%s decoding stops at invalid bytes like APR", name);
+
+    for (i = 0; i < 256; i++) {
+        memset(modified, 'Q', 64);
+        modified[64] = '\0';
+        modified[21] = (char) i;
+        wanted = apr_base64_decode_binary(expected, modified);
+        dlen = wai_base64_decode_simd(simd, seen, modified, 64,
+                                      WAI_BASE64_STANDARD);
+        if (bytes_ok && (dlen != wanted
+                         || memcmp(expected, seen, wanted) != 0)) {
+            diag("%s decoding with byte 0x%02x", name, (unsigned int) i);
+            bytes_ok = false;
+        }
+    }
+    ok(bytes_ok, "%s decoding of every byte value matches APR", name);
+}
+
+
+int
+main(void)
+{
+    enum wai_simd simd, available;
+
+    plan(3 * 6 + 1);
+
+    /*
+     * Check each base64 implementation.  SSE2 alone isn't used for base64, so
+     * that level is the same as the portable implementation and is skipped.
+     */
+    available = wai_simd_available();
+    for (simd = WAI_SIMD_NONE; simd <= WAI_SIMD_AVX2; simd++) {
+        if (simd == WAI_SIMD_SSE2)
+            continue;
+        if (simd > available) {
+            skip_block(6, "%s not supported", simd_names[simd]);
+            continue;
+        }
+        check_lengths(simd);
+        check_invalid(simd);
+    }
+
+    /* Space allocated for decoding is rounded up to whole blocks. */
+    is_int(15, wai_base64_decoded_length(17), "Decoded length rounds up");
+    return 0;
+}
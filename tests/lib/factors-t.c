@@ -25,7 +25,7 @@ main(void)
     struct webauth_factors *one, *two, *result;
     apr_array_header_t *factors;
 
-    plan(49);
+    plan(60);
 
     if (apr_initialize() != APR_SUCCESS)
         bail("cannot initialize APR");
@@ -210,6 +210,40 @@ main(void)
     is_string(NULL, webauth_factors_string(ctx, result),
               "Subtracting m from rm results in the empty set");
 
+    /* Duplicates and empty factors are dropped when parsing. */
+    one = webauth_factors_parse(ctx, "p,,p,o1,o1,");
+    is_string("p,o1,m", webauth_factors_string(ctx, one),
+              "Parsed p,,p,o1,o1, into p,o1,m");
+
+    /* Factors that aren't interned are kept as strings. */
+    one = webauth_factors_parse(ctx, "p,o10,foo");
+    is_string("p,o10,foo,m", webauth_factors_string(ctx, one),
+              "Parsed p,o10,foo into p,o10,foo,m");
+    is_int(1, webauth_factors_contains(ctx, one, "o10"),
+           "...and contains o10");
+    is_int(0, webauth_factors_contains(ctx, one, "o1"),
+           "...and does not contain o1");
+    is_int(0, webauth_factors_contains(ctx, one, "fo"),
+           "...or a prefix of foo");
+    two = webauth_factors_parse(ctx, "foo,p");
+    is_int(1, webauth_factors_satisfies(ctx, one, two),
+           "p,o10,foo,m satisfies foo,p");
+    two = webauth_factors_parse(ctx, "bar,p");
+    is_int(0, webauth_factors_satisfies(ctx, one, two),
+           "p,o10,foo,m does not satisfy bar,p");
+    two = webauth_factors_parse(ctx, "foo,m");
+    result = webauth_factors_subtract(ctx, one, two);
+    is_string("p,o10", webauth_factors_string(ctx, result),
+              "Subtracting foo,m from p,o10,foo,m returns p,o10");
+    one = webauth_factors_union(ctx, webauth_factors_parse(ctx, "x12"),
+                                webauth_factors_parse(ctx, "bar,x12,p"));
+    is_string("x12,bar,p,m", webauth_factors_string(ctx, one),
+              "Merging x12 and bar,x12,p synthesizes multifactor");
+    factors = webauth_factors_array(ctx, one);
+    is_int(4, factors->nelts, "webauth_factors_array returns four elements");
+    is_string("bar", APR_ARRAY_IDX(factors, 1, const char *),
+              "...second is correct");
+
     /* Clean up. */
     apr_terminate();
     return 0;
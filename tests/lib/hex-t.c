@@ -10,10 +10,9 @@
  */
 
 #include <config.h>
+#include <portable/system.h>
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+#include <ctype.h>
 
 #include <lib/internal.h>
 #include <tests/tap/basic.h>
@@ -22,6 +21,90 @@
 #define BUFSIZE 2048
 
 
+/*
+ * Check the SSE2 implementation against the portable implementation for all
+ * lengths up to 512, including uppercase and invalid input and encoding and
+ * decoding in place.  Each kind of check is reported as a single test, with a
+ * diagnostic for the first failure.
+ */
+static void
+check_simd(void)
+{
+    char orig[BUFSIZE], expected[BUFSIZE], seen[BUFSIZE], work[BUFSIZE];
+    size_t i, j, elen, slen;
+    int s1, s2;
+    bool encode_ok = true, decode_ok = true, invalid_ok = true;
+    bool place_ok = true;
+
+    for (i = 0; i < 512; i++) {
+        for (j = 0; j < i; j++)
+            orig[j] = (char) (j * 37 + i);
+
+        /* Encoding, with and without enough space. */
+        s1 = wai_hex_encode_simd(WAI_SIMD_NONE, orig, i, expected, &elen,
+                                 BUFSIZE);
+        s2 = wai_hex_encode_simd(WAI_SIMD_SSE2, orig, i, seen, &slen,
+                                 BUFSIZE);
+        if (encode_ok && (s1 != s2 || elen != slen
+                          || memcmp(expected, seen, elen) != 0)) {
+            diag("sse2 encoding of length %lu", (unsigned long) i);
+            encode_ok = false;
+        }
+        s2 = wai_hex_encode_simd(WAI_SIMD_SSE2, orig, i, seen, &slen,
+                                 elen > 0 ? elen - 1 : 0);
+        if (encode_ok && elen > 0 && s2 != WA_ERR_NO_ROOM) {
+            diag("sse2 encoding of length %lu without room",
+                 (unsigned long) i);
+            encode_ok = false;
+        }
+
+        /* Decoding of lowercase and mixed-case data. */
+        for (j = 0; j < elen; j += 3)
+            expected[j] = toupper((unsigned char) expected[j]);
+        memcpy(work, expected, elen);
+        s1 = wai_hex_decode_simd(WAI_SIMD_NONE, expected, elen, seen, &slen,
+                                 BUFSIZE);
+        s2 = wai_hex_decode_simd(WAI_SIMD_SSE2, work, elen, work, &slen,
+                                 BUFSIZE);
+        if (decode_ok && (s1 != WA_ERR_NONE || s2 != WA_ERR_NONE || slen != i
+                          || memcmp(seen, orig, i) != 0
+                          || memcmp(work, orig, i) != 0)) {
+            diag("sse2 decoding of length %lu", (unsigned long) i);
+            decode_ok = false;
+        }
+
+        /* Encoding in place with the data at the start of the buffer. */
+        memcpy(work, orig, i);
+        s2 = wai_hex_encode_simd(WAI_SIMD_SSE2, work, i, work, &slen,
+                                 BUFSIZE);
+        s1 = wai_hex_encode_simd(WAI_SIMD_NONE, orig, i, expected, &elen,
+                                 BUFSIZE);
+        if (place_ok && (s2 != WA_ERR_NONE || slen != elen
+                         || memcmp(work, expected, elen) != 0)) {
+            diag("sse2 in-place encoding of length %lu", (unsigned long) i);
+            place_ok = false;
+        }
+
+        /* Invalid characters at a position that depends on the length. */
+        if (elen > 0) {
+            memcpy(work, expected, elen);
+            work[(i * 7) % elen] = (i % 2) ? 'g' : '/';
+            s2 = wai_hex_decode_simd(WAI_SIMD_SSE2, work, elen, seen, &slen,
+                                     BUFSIZE);
+            if (invalid_ok && s2 != WA_ERR_CORRUPT) {
+                diag("sse2 decoding of invalid length %lu",
+                     (unsigned long) i);
+                invalid_ok = false;
+            }
+        }
+    }
+    ok(encode_ok, "sse2 encoding matches portable encoding");
+    ok(decode_ok, "sse2 decoding matches portable decoding");
+    ok(place_ok, "sse2 in-place encoding");
+    ok(invalid_ok, "sse2 decoding rejects invalid characters");
+}
+
+
 int
 main(void)
 {
@@ -32,7 +115,7 @@ main(void)
     int s;
     size_t elen, rlen, dlen, dlen2;
 
-    plan(7 * 512);
+    plan(7 * 512 + 4);
 
     for (i = 0; i < 512; i++) {
         for (j = 0; j < i; j++)
@@ -54,5 +137,10 @@ main(void)
         ok(memcmp(decoded_buffer, orig_buffer, i) == 0, "...and data");
     }
 
+    /* Check the SSE2 implementation if the processor supports it. */
+    if (wai_simd_available() >= WAI_SIMD_SSE2)
+        check_simd();
+    else
+        skip_block(4, "SSE2 not supported");
     return 0;
 }
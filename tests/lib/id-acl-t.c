@@ -0,0 +1,184 @@
+/*
+ * Tests for the compiled identity ACL index.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config.h>
+#include <portable/apr.h>
+#include <portable/system.h>
+
+#include <time.h>
+#include <utime.h>
+
+#include <lib/internal.h>
+#include <tests/tap/basic.h>
+#include <tests/tap/string.h>
+#include <webauth/basic.h>
+
+/* Targets used in the test identity ACL. */
+#define SITE     "krb5:webauth/example.com@EXAMPLE.COM"
+#define FOO_SITE "krb5:webauth/foo.example.com@EXAMPLE.COM"
+
+
+/*
+ * Write the given contents to a file and set its modification time, so that
+ * rewrites within the same second are still seen as changes.
+ */
+static void
+write_acl(const char *path, const char *contents, time_t mtime)
+{
+    FILE *file;
+    struct utimbuf times;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fputs(contents, file) == EOF || fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+    times.actime = mtime;
+    times.modtime = mtime;
+    if (utime(path, &times) < 0)
+        sysbail("cannot set modification time of %s", path);
+}
+
+
+/*
+ * Look up an authenticated identity and target and check that the result is
+ * the given space-separated list of identities, or NULL for no identities.
+ */
+static void
+is_identities(struct webauth_context *ctx, const char *path,
+              const char *authn, const char *target, const char *expected,
+              const char *message)
+{
+    const apr_array_header_t *result;
+    char *seen = NULL;
+    char *old;
+    int i, s;
+
+    s = wai_id_acl_lookup(ctx, path, authn, target, &result);
+    if (s != WA_ERR_NONE)
+        diag("lookup failed: %s", webauth_error_message(ctx, s));
+    if (result != NULL)
+        for (i = 0; i < result->nelts; i++) {
+            old = seen;
+            if (old == NULL)
+                seen = bstrdup(APR_ARRAY_IDX(result, i, const char *));
+            else {
+                basprintf(&seen, "%s %s", old,
+                          APR_ARRAY_IDX(result, i, const char *));
+                free(old);
+            }
+        }
+    is_string(expected, seen, "%s", message);
+    free(seen);
+}
+
+
+int
+main(void)
+{
+    struct webauth_context *ctx;
+    const apr_array_header_t *result;
+    char *path, *tmpdir, *acl, *expected;
+    time_t now;
+    int s;
+
+    if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
+        bail("cannot initialize WebAuth context");
+
+    plan(20);
+
+    /* Lookups in the test identity ACL. */
+    path = test_file_path("data/id.acl");
+    if (path == NULL)
+        bail("cannot find data/id.acl");
+    is_identities(ctx, path, "testuser", SITE, "otheruser bar",
+                  "Identities for testuser");
+    is_identities(ctx, path, "testuser", FOO_SITE, "foo",
+                  "Identities for testuser to another site");
+    is_identities(ctx, path, "other", SITE, "test", "Identities for other");
+    is_identities(ctx, path, "other", FOO_SITE, NULL,
+                  "No identities for other to another site");
+    is_identities(ctx, path, "unknown", SITE, NULL,
+                  "No identities for unknown user");
+    is_identities(ctx, path, "testuser", SITE, "otheruser bar",
+                  "Identities for testuser again from the cache");
+    test_file_path_free(path);
+
+    /* A missing file is an error. */
+    tmpdir = test_tmpdir();
+    basprintf(&acl, "%s/id.acl", tmpdir);
+    s = wai_id_acl_lookup(ctx, acl, "testuser", SITE, &result);
+    is_int(WA_ERR_FILE_OPENREAD, s, "Lookup in a missing file fails");
+
+    /* The index is rebuilt when the file changes. */
+    now = time(NULL);
+    write_acl(acl, "testuser " SITE " one\n", now - 10);
+    is_identities(ctx, acl, "testuser", SITE, "one", "Identities from file");
+    write_acl(acl, "testuser " SITE " two\n", now - 5);
+    is_identities(ctx, acl, "testuser", SITE, "two",
+                  "...and after the file changes");
+    write_acl(acl, "testuser " SITE " one\ntestuser " SITE " two\n", now);
+    is_identities(ctx, acl, "testuser", SITE, "one two",
+                  "...and after it changes again");
+
+    /*
+     * Errors only affect lookups that would have seen them in a linear scan
+     * of the file, and the earliest error wins.
+     */
+    write_acl(acl,
+              "# Comment\n"
+              "\n"
+              "baduser\n"
+              "testuser " SITE "\n"
+              "testuser " FOO_SITE " foo\n"
+              "baduser " SITE " bar\n", now - 10);
+    is_identities(ctx, acl, "testuser", FOO_SITE, "foo",
+                  "Lookup unaffected by errors for other lines");
+    is_identities(ctx, acl, "other", SITE, NULL,
+                  "...and for a user with no entries");
+    s = wai_id_acl_lookup(ctx, acl, "baduser", SITE, &result);
+    is_int(WA_ERR_FILE_READ, s, "Lookup for user with missing target fails");
+    basprintf(&expected, "error reading from file (missing target on"
+              " identity ACL %s line 3)", acl);
+    is_string(expected, webauth_error_message(ctx, s), "...with right error");
+    free(expected);
+    s = wai_id_acl_lookup(ctx, acl, "testuser", SITE, &result);
+    is_int(WA_ERR_FILE_READ, s, "Lookup for missing identity fails");
+    basprintf(&expected, "error reading from file (missing identity on"
+              " identity ACL %s line 4)", acl);
+    is_string(expected, webauth_error_message(ctx, s), "...with right error");
+    free(expected);
+
+    /* A line that's too long is an error for every lookup. */
+    path = bmalloc(BUFSIZ + 2);
+    memset(path, 'a', BUFSIZ + 1);
+    path[BUFSIZ + 1] = '\0';
+    write_acl(acl, "testuser " SITE " one\n", now - 5);
+    is_identities(ctx, acl, "testuser", SITE, "one", "Identities from file");
+    basprintf(&expected, "testuser %s one\n%s\n", SITE, path);
+    write_acl(acl, expected, now);
+    free(expected);
+    free(path);
+    s = wai_id_acl_lookup(ctx, acl, "testuser", SITE, &result);
+    is_int(WA_ERR_FILE_READ, s, "Lookup in file with long line fails");
+    basprintf(&expected, "error reading from file (identity ACL %s line 2"
+              " too long)", acl);
+    is_string(expected, webauth_error_message(ctx, s), "...with right error");
+    free(expected);
+    s = wai_id_acl_lookup(ctx, acl, "other", SITE, &result);
+    is_int(WA_ERR_FILE_READ, s, "...even for other users");
+
+    /* Clean up. */
+    unlink(acl);
+    free(acl);
+    test_tmpdir_free(tmpdir);
+    webauth_context_free(ctx);
+    return 0;
+}
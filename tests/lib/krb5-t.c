@@ -89,6 +89,24 @@ check_change(struct webauth_context *ctx, int s, const char *message,
 }
 
 
+/*
+ * Write a krb5.conf fragment that sets only the default realm.  Used to check
+ * that pooled Kerberos contexts pick up configuration changes.
+ */
+static void
+write_realm_config(const char *path, const char *realm)
+{
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL)
+        sysbail("cannot create %s", path);
+    if (fprintf(file, "[libdefaults]\n    default_realm = %s\n", realm) < 0
+        || fclose(file) == EOF)
+        sysbail("cannot write to %s", path);
+}
+
+
 /*
  * Obtain Kerberos credentials from the configured keytab, but set addresses
  * on the ticket.  This tests encoding of tickets with addresses (which has
@@ -186,11 +204,12 @@ main(void)
     char *cprinc = NULL;
     char *crealm = NULL;
     char *ccache = NULL;
+    char *old_config, *new_config, *realm_config;
 
     /* Read the configuration information. */
     config = kerberos_setup(TAP_KRB_NEEDS_BOTH);
     
-    plan(53);
+    plan(61);
 
     if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
         bail("cannot initialize WebAuth context");
@@ -359,6 +378,67 @@ main(void)
     webauth_krb5_free(ctx, kc);
     ok(access(cache, F_OK) < 0, "...and the cache is destroyed on free");
 
+    /*
+     * Kerberos library contexts are pooled and reused.  Check that a context
+     * reused after a failed authentication still works.
+     */
+    s = webauth_krb5_new(ctx, &kc);
+    CHECK(ctx, s, "Creating a new context");
+    s = webauth_krb5_init_via_password(ctx, kc, config->userprinc, "bad",
+                                       NULL, NULL, NULL, NULL, NULL);
+    is_int(WA_PEC_LOGIN_FAILED, s, "Authentication with a bad password");
+    webauth_krb5_free(ctx, kc);
+    s = webauth_krb5_new(ctx, &kc);
+    is_int(WA_ERR_NONE, s, "...and reusing the context");
+    s = webauth_krb5_init_via_password(ctx, kc, config->userprinc,
+                                       config->password, NULL, NULL, NULL,
+                                       NULL, NULL);
+    CHECK(ctx, s, "...and a reused context then authenticates");
+    webauth_krb5_free(ctx, kc);
+
+    /*
+     * Pooled contexts are discarded when the Kerberos configuration changes.
+     * Prepend a file that sets the default realm, and authenticate with the
+     * bare username so that the result depends on which configuration the
+     * context was created with.  Then change the default realm to one that
+     * doesn't exist, which should make the same authentication fail.  The
+     * configuration is checked at most once a second, so wait before each
+     * authentication.
+     */
+    old_config = getenv("KRB5_CONFIG");
+    if (old_config == NULL)
+        skip_block(4, "KRB5_CONFIG not set");
+    else {
+        basprintf(&realm_config, "%s/krb5-realm.conf", tmpdir);
+        basprintf(&new_config, "KRB5_CONFIG=%s:%s", realm_config,
+                  old_config);
+        basprintf(&old_config, "KRB5_CONFIG=%s", old_config);
+        write_realm_config(realm_config, config->realm);
+        putenv(new_config);
+        sleep(2);
+        s = webauth_krb5_new(ctx, &kc);
+        is_int(WA_ERR_NONE, s, "Creating a context after a configuration"
+               " change");
+        s = webauth_krb5_init_via_password(ctx, kc, config->username,
+                                           config->password, NULL, NULL, NULL,
+                                           NULL, NULL);
+        CHECK(ctx, s, "...and authentication uses the new default realm");
+        webauth_krb5_free(ctx, kc);
+        write_realm_config(realm_config, "WEBAUTH.INVALID");
+        sleep(2);
+        s = webauth_krb5_new(ctx, &kc);
+        is_int(WA_ERR_NONE, s, "Creating a context after changing the realm");
+        s = webauth_krb5_init_via_password(ctx, kc, config->username,
+                                           config->password, NULL, NULL, NULL,
+                                           NULL, NULL);
+        ok(s != WA_ERR_NONE, "...and authentication now fails");
+        webauth_krb5_free(ctx, kc);
+        putenv(old_config);
+        unlink(realm_config);
+        free(realm_config);
+        sleep(2);
+    }
+
     /*
      * Test password change.
      *
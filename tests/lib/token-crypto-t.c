@@ -52,7 +52,8 @@ int
 main(void)
 {
     struct webauth_context *ctx;
-    struct webauth_keyring *ring;
+    struct webauth_keyring *ring, *other;
+    struct webauth_key *key;
     char *keyring;
     int s;
     void *data, *out, *token;
@@ -62,7 +63,7 @@ main(void)
         "t=app;s=testuser;lt=N\2]\312;ia=p;san=c;loa=\0\0\0\1;ct=N\2]\254;"
         "et=\177\377\377\320;";
 
-    plan(10);
+    plan(27);
 
     if (webauth_context_init(&ctx, NULL) != WA_ERR_NONE)
         bail("cannot initialize WebAuth context");
@@ -115,6 +116,77 @@ main(void)
     ok(memcmp(app_raw, out, sizeof(app_raw) - 1) == 0,
        "...and output data is correct");
 
+    /* Switch to the key identifier format and check that it round-trips. */
+    s = webauth_token_set_format(ctx, 42);
+    is_int(WA_ERR_INVALID, s, "Setting an unknown token format fails");
+    s = webauth_token_set_format(ctx, WA_TOKEN_FORMAT_KEY_ID);
+    is_int(WA_ERR_NONE, s, "Setting the key identifier format works");
+    s = webauth_token_encrypt(ctx, raw_data, sizeof(raw_data), &data, &length,
+                              ring);
+    if (s != WA_ERR_NONE)
+        diag("error: %s", webauth_error_message(ctx, s));
+    is_int(WA_ERR_NONE, s, "Key identifier token encryption works");
+    ok(((unsigned char *) data)[0] == 0 && ((unsigned char *) data)[1] == 2,
+       "...and the token has the key identifier header");
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, ring);
+    if (s != WA_ERR_NONE)
+        diag("error: %s", webauth_error_message(ctx, s));
+    is_int(WA_ERR_NONE, s, "Key identifier token decryption works");
+    is_int(sizeof(raw_data), outlen, "...and output length is correct");
+    if (out == NULL)
+        ok(false, "...and output data is correct");
+    else
+        ok(memcmp(raw_data, out, sizeof(raw_data)) == 0,
+           "...and output data is correct");
+
+    /*
+     * A keyring without the encryption key should reject the token, as
+     * should a keyring containing it once the key identifier is damaged.
+     */
+    s = webauth_key_create(ctx, WA_KEY_AES, WA_AES_128, NULL, &key);
+    if (s != WA_ERR_NONE)
+        bail("cannot create key: %s", webauth_error_message(ctx, s));
+    other = webauth_keyring_from_key(ctx, key);
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, other);
+    is_int(WA_ERR_BAD_HMAC, s, "Decryption with the wrong key fails");
+    ((unsigned char *) data)[2] ^= 0xff;
+    s = webauth_token_decrypt(ctx, data, length, &out, &outlen, ring);
+    is_int(WA_ERR_BAD_HMAC, s, "...as does a damaged key identifier");
+
+    /*
+     * Switch to the AES-GCM format if OpenSSL supports it and check that it
+     * round-trips and that any modification of the token is detected.
+     */
+    s = webauth_token_set_format(ctx, WA_TOKEN_FORMAT_AES_GCM);
+    if (s == WA_ERR_UNIMPLEMENTED)
+        skip_block(8, "AES-GCM not supported");
+    else {
+        is_int(WA_ERR_NONE, s, "Setting the AES-GCM format works");
+        s = webauth_token_encrypt(ctx, raw_data, sizeof(raw_data), &data,
+                                  &length, ring);
+        if (s != WA_ERR_NONE)
+            diag("error: %s", webauth_error_message(ctx, s));
+        is_int(WA_ERR_NONE, s, "AES-GCM token encryption works");
+        ok(((unsigned char *) data)[0] == 0
+           && ((unsigned char *) data)[1] == 3,
+           "...and the token has the AES-GCM header");
+        s = webauth_token_decrypt(ctx, data, length, &out, &outlen, ring);
+        if (s != WA_ERR_NONE)
+            diag("error: %s", webauth_error_message(ctx, s));
+        is_int(WA_ERR_NONE, s, "AES-GCM token decryption works");
+        is_int(sizeof(raw_data), outlen, "...and output length is correct");
+        if (out == NULL)
+            ok(false, "...and output data is correct");
+        else
+            ok(memcmp(raw_data, out, sizeof(raw_data)) == 0,
+               "...and output data is correct");
+        s = webauth_token_decrypt(ctx, data, length, &out, &outlen, other);
+        is_int(WA_ERR_BAD_HMAC, s, "Decryption with the wrong key fails");
+        ((unsigned char *) data)[length - 20] ^= 1;
+        s = webauth_token_decrypt(ctx, data, length, &out, &outlen, ring);
+        is_int(WA_ERR_BAD_HMAC, s, "...as does a modified token");
+    }
+
     /* Clean up. */
     free(token);
     webauth_context_free(ctx);
@@ -20,6 +20,7 @@
 #include <tests/tap/webauth.h>
 #include <webauth/basic.h>
 #include <webauth/keys.h>
+#include <webauth/tokens.h>
 #include <webauth/webkdc.h>
 
 /* Test cases to run without an identity file. */
@@ -623,6 +624,60 @@ static const struct wat_login_test tests_id_acl[] = {
 };
 
 
+/*
+ * Check that webauth_webkdc_login_service uses the webkdc-service token it is
+ * given rather than decrypting the one in the request, which here is garbage.
+ */
+static void
+test_login_service(struct webauth_context *ctx, apr_pool_t *pool,
+                   const struct webauth_keyring *ring)
+{
+    struct webauth_token_webkdc_service service;
+    struct webauth_token token;
+    struct webauth_webkdc_login_request request;
+    struct webauth_webkdc_login_response *response;
+    struct webauth_key *key;
+    struct webauth_keyring *session;
+    time_t now = time(NULL);
+    size_t size;
+    int s;
+
+    /* Build a webkdc-service token and a request token encrypted with it. */
+    s = webauth_key_create(ctx, WA_KEY_AES, WA_AES_128, NULL, &key);
+    if (s != WA_ERR_NONE)
+        bail("cannot create key: %s", webauth_error_message(ctx, s));
+    memset(&service, 0, sizeof(service));
+    service.subject = "krb5:webauth/example.com@EXAMPLE.COM";
+    service.session_key = key->data;
+    service.session_key_len = key->length;
+    service.creation = now;
+    service.expiration = now + 60 * 60;
+    memset(&token, 0, sizeof(token));
+    token.type = WA_TOKEN_REQUEST;
+    token.token.request.type = "id";
+    token.token.request.auth = "webkdc";
+    token.token.request.return_url = "https://example.com/";
+    token.token.request.creation = now;
+    session = webauth_keyring_from_key(ctx, key);
+    memset(&request, 0, sizeof(request));
+    s = webauth_token_encode(ctx, &token, session, &request.request);
+    if (s != WA_ERR_NONE)
+        bail("cannot encode request token: %s", webauth_error_message(ctx, s));
+    request.service = "invalid";
+    request.logins = apr_array_make(pool, 1, sizeof(const char *));
+    size = sizeof(struct webauth_webkdc_proxy_data);
+    request.wkproxies = apr_array_make(pool, 1, size);
+    request.wkfactors = apr_array_make(pool, 1, sizeof(const char *));
+
+    /* With the decoded token, we should get as far as needing a proxy. */
+    s = webauth_webkdc_login_service(ctx, &request, &service, &response, ring);
+    is_int(WA_PEC_PROXY_TOKEN_REQUIRED, s,
+           "Login with a decoded webkdc-service token");
+    s = webauth_webkdc_login(ctx, &request, &response, ring);
+    is_int(WA_PEC_SERVICE_TOKEN_INVALID, s, "...but not without it");
+}
+
+
 int
 main(void)
 {
@@ -691,6 +746,9 @@ main(void)
     for (i = 0; i < ARRAY_SIZE(tests_id_acl); i++)
         run_login_test(ctx, &tests_id_acl[i], ring, NULL);
 
+    /* Pass in an already decoded webkdc-service token. */
+    test_login_service(ctx, pool, ring);
+
     /* Clean up. */
     apr_terminate();
     test_file_path_free((char *) config.id_acl_path);
@@ -0,0 +1,371 @@
+/*
+ * Test suite for the reference-counted snapshots used by the modules.
+ *
+ * Besides the basic operations, runs several threads that read the current
+ * snapshot while they take turns renewing it, the way that requests use the
+ * mod_webauth service token, and checks that no thread ever sees a snapshot
+ * that has been freed or that is older than one it has already seen.  Then
+ * has one thread take a second to renew the snapshot, standing in for a slow
+ * WebKDC, and checks that reads by the other threads stay fast meanwhile.
+ *
+ * Written by agent <agent@local>
+ * Copyright 2026
+ *     The Board of Trustees of the Leland Stanford Junior University
+ *
+ * See LICENSE for licensing terms.
+ */
+
+#include <config-mod.h>
+#include <portable/apr.h>
+#include <portable/stdbool.h>
+
+#include <apr_atomic.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+#include <string.h>
+
+#include <modules/snapshot.h>
+#include <tests/tap/basic.h>
+
+/* Number of reader threads and the number of reads done by each. */
+#define THREADS 8
+#define READS   20000
+
+/* Every how many reads a thread tries to renew the snapshot. */
+#define RENEW_EVERY 50
+
+/*
+ * Number of threads reading while one thread does a slow renewal, how long
+ * that renewal takes (the stand-in for a slow WebKDC), the pause between
+ * reads, and the longest that any one read may take, all in microseconds.
+ */
+#define SLOW_THREADS    4
+#define SLOW_RENEWAL    (1000 * 1000)
+#define SLOW_PAUSE      100
+#define SLOW_MAX_READ   (10 * 1000)
+
+/* Stored in each live snapshot and cleared when it is freed. */
+#define MAGIC 0x736e6170UL
+
+/* A test snapshot. */
+struct test_snapshot {
+    struct mod_snapshot snapshot;
+    unsigned long magic;
+    apr_uint32_t generation;
+};
+
+/* Shared state for the threads. */
+struct test_state {
+    struct mod_snapshot_slot slot;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    volatile apr_uint32_t generation;   /* Last generation published. */
+    volatile apr_uint32_t renewers;     /* Threads publishing right now. */
+    volatile apr_uint32_t renewals;     /* Total snapshots published. */
+    volatile apr_uint32_t errors;       /* Problems seen by any thread. */
+    volatile apr_uint32_t done;         /* Set when the slow renewal ends. */
+};
+
+/* Per-thread results for the slow renewal test. */
+struct slow_reader {
+    struct test_state *state;
+    apr_interval_time_t worst;          /* Longest single read. */
+    unsigned long during;               /* Reads done during the renewal. */
+};
+
+/* Counts of snapshots created and freed. */
+static volatile apr_uint32_t created = 0;
+static volatile apr_uint32_t freed = 0;
+
+
+/*
+ * Pool cleanup for a snapshot pool that marks the snapshot as freed.
+ */
+static apr_status_t
+snapshot_freed(void *data)
+{
+    struct test_snapshot *snapshot = data;
+
+    snapshot->magic = 0;
+    apr_atomic_inc32(&freed);
+    return APR_SUCCESS;
+}
+
+
+/*
+ * Create a new snapshot with the given generation.
+ */
+static struct test_snapshot *
+snapshot_new(apr_uint32_t generation)
+{
+    apr_pool_t *pool;
+    struct test_snapshot *snapshot;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        sysbail("cannot create snapshot pool");
+    snapshot = apr_pcalloc(pool, sizeof(struct test_snapshot));
+    mod_snapshot_init(&snapshot->snapshot, pool, NULL);
+    snapshot->magic = MAGIC;
+    snapshot->generation = generation;
+    apr_pool_cleanup_register(pool, snapshot, snapshot_freed,
+                              apr_pool_cleanup_null);
+    apr_atomic_inc32(&created);
+    return snapshot;
+}
+
+
+/*
+ * Publish the next generation of the snapshot, which must be called by the
+ * thread that claimed the renewal.  Counts an error if any other thread is
+ * publishing at the same time.
+ */
+static void
+renew(struct test_state *state)
+{
+    struct test_snapshot *snapshot;
+    apr_uint32_t generation;
+
+    if (apr_atomic_inc32(&state->renewers) != 0)
+        apr_atomic_inc32(&state->errors);
+    generation = apr_atomic_read32(&state->generation) + 1;
+    snapshot = snapshot_new(generation);
+    apr_thread_yield();
+    mod_snapshot_publish(&state->slot, &snapshot->snapshot, 0);
+    apr_atomic_set32(&state->generation, generation);
+    apr_atomic_inc32(&state->renewals);
+    apr_atomic_dec32(&state->renewers);
+}
+
+
+/*
+ * The body of each thread.  Acquires the current snapshot over and over
+ * with a fresh reference each time, like a series of requests, and
+ * periodically either renews it or, if another thread is already doing so,
+ * waits for that renewal.
+ */
+static void * APR_THREAD_FUNC
+reader(apr_thread_t *thread, void *data)
+{
+    struct test_state *state = data;
+    struct test_snapshot *snapshot;
+    apr_pool_t *pool;
+    apr_uint32_t last = 0;
+    int i;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        sysbail("cannot create thread pool");
+    for (i = 0; i < READS; i++) {
+        apr_pool_clear(pool);
+        snapshot = mod_snapshot_acquire(&state->slot, pool);
+        if (snapshot == NULL || snapshot->magic != MAGIC
+            || snapshot->generation < last) {
+            apr_atomic_inc32(&state->errors);
+            continue;
+        }
+        last = snapshot->generation;
+        if (i % RENEW_EVERY != 0)
+            continue;
+        if (mod_snapshot_renew_begin(&state->slot)) {
+            renew(state);
+            mod_snapshot_renew_end(&state->slot, state->mutex, state->cond);
+        } else {
+            mod_snapshot_renew_wait(&state->slot, state->mutex, state->cond);
+        }
+
+        /* The snapshot we hold must survive any renewal. */
+        if (snapshot->magic != MAGIC)
+            apr_atomic_inc32(&state->errors);
+    }
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Claim the renewal, then take SLOW_RENEWAL microseconds to build the new
+ * snapshot, the way that mod_webauth does while waiting for a slow WebKDC to
+ * return a new service token.
+ */
+static void * APR_THREAD_FUNC
+slow_renewer(apr_thread_t *thread, void *data)
+{
+    struct test_state *state = data;
+
+    if (!mod_snapshot_renew_begin(&state->slot))
+        apr_atomic_inc32(&state->errors);
+    else {
+        apr_sleep(SLOW_RENEWAL);
+        renew(state);
+        mod_snapshot_renew_end(&state->slot, state->mutex, state->cond);
+    }
+    apr_atomic_set32(&state->done, 1);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+/*
+ * Acquire the current snapshot over and over until the slow renewal is done,
+ * as requests do with the service token while it is being renewed, and
+ * record the longest time any one read took.
+ */
+static void * APR_THREAD_FUNC
+slow_reader(apr_thread_t *thread, void *data)
+{
+    struct slow_reader *reader = data;
+    struct test_state *state = reader->state;
+    struct test_snapshot *snapshot;
+    apr_pool_t *pool;
+    apr_time_t start;
+    apr_interval_time_t elapsed;
+    bool renewing;
+
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        sysbail("cannot create thread pool");
+    while (apr_atomic_read32(&state->done) == 0) {
+        start = apr_time_now();
+        apr_pool_clear(pool);
+        snapshot = mod_snapshot_acquire(&state->slot, pool);
+        renewing = mod_snapshot_renewing(&state->slot);
+        elapsed = apr_time_now() - start;
+        if (snapshot == NULL || snapshot->magic != MAGIC)
+            apr_atomic_inc32(&state->errors);
+        if (elapsed > reader->worst)
+            reader->worst = elapsed;
+        if (renewing)
+            reader->during++;
+        apr_sleep(SLOW_PAUSE);
+    }
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+
+int
+main(void)
+{
+    apr_pool_t *pool, *request;
+    apr_thread_t *threads[THREADS];
+    apr_thread_t *renewer;
+    struct slow_reader slow[SLOW_THREADS];
+    apr_interval_time_t worst;
+    unsigned long during;
+    apr_status_t status;
+    apr_finfo_t finfo;
+    struct test_state state;
+    struct test_snapshot *first, *second, *snapshot;
+    int i;
+
+    if (apr_initialize() != APR_SUCCESS)
+        bail("cannot initialize APR");
+    if (apr_pool_create(&pool, NULL) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    if (apr_pool_create(&request, pool) != APR_SUCCESS)
+        bail("cannot create memory pool");
+    memset(&state, 0, sizeof(state));
+    if (apr_thread_mutex_create(&state.mutex, APR_THREAD_MUTEX_DEFAULT, pool)
+        != APR_SUCCESS)
+        bail("cannot create mutex");
+    if (apr_thread_cond_create(&state.cond, pool) != APR_SUCCESS)
+        bail("cannot create condition variable");
+
+    plan(25);
+
+    /* Nothing is published to start with. */
+    ok(mod_snapshot_acquire(&state.slot, request) == NULL,
+       "Nothing to acquire before publication");
+    ok(mod_snapshot_current(&state.slot) == NULL, "...and no current");
+
+    /* Publish and acquire a snapshot. */
+    first = snapshot_new(1);
+    mod_snapshot_publish(&state.slot, &first->snapshot, 60);
+    ok(mod_snapshot_current(&state.slot) == first, "Published snapshot");
+    snapshot = mod_snapshot_acquire(&state.slot, request);
+    ok(snapshot == first, "...and acquired it");
+    is_int(2, first->snapshot.refcount, "...which took a reference");
+    ok(!mod_snapshot_check_due(&state.slot, 60), "...and no check is due");
+
+    /* Replacing it keeps the old one until the request is done. */
+    second = snapshot_new(2);
+    mod_snapshot_publish(&state.slot, &second->snapshot, 0);
+    ok(mod_snapshot_current(&state.slot) == second, "Published replacement");
+    ok(first->magic == MAGIC, "...and old one is still valid");
+    is_int(0, freed, "...and not freed");
+    apr_pool_clear(request);
+    is_int(1, freed, "Old snapshot freed when the request is done");
+    is_int(1, second->snapshot.refcount, "...and new one only published");
+
+    /* Only one caller claims a due check. */
+    ok(mod_snapshot_check_due(&state.slot, 60), "Check is due");
+    ok(!mod_snapshot_check_due(&state.slot, 60), "...but only once");
+
+    /* Only one caller claims a renewal. */
+    ok(!mod_snapshot_renewing(&state.slot), "Not renewing");
+    ok(mod_snapshot_renew_begin(&state.slot), "Claimed renewal");
+    ok(mod_snapshot_renewing(&state.slot), "...and now renewing");
+    ok(!mod_snapshot_renew_begin(&state.slot), "...and can't claim again");
+    mod_snapshot_renew_end(&state.slot, state.mutex, state.cond);
+    mod_snapshot_renew_wait(&state.slot, state.mutex, state.cond);
+    ok(!mod_snapshot_renewing(&state.slot), "...until the renewal ended");
+
+    /* Change detection. */
+    finfo.valid = APR_FINFO_MTIME | APR_FINFO_INODE;
+    finfo.mtime = second->snapshot.mtime;
+    finfo.inode = second->snapshot.inode;
+    ok(!mod_snapshot_changed(&second->snapshot, &finfo), "Unchanged file");
+    finfo.inode++;
+    ok(mod_snapshot_changed(&second->snapshot, &finfo), "Replaced file");
+
+    /* Now read and renew from multiple threads at once. */
+    state.generation = 2;
+    for (i = 0; i < THREADS; i++)
+        if (apr_thread_create(&threads[i], NULL, reader, &state, pool)
+            != APR_SUCCESS)
+            sysbail("cannot create thread");
+    for (i = 0; i < THREADS; i++)
+        apr_thread_join(&status, threads[i]);
+    is_int(0, state.errors, "No errors from %d threads with %lu renewals",
+           THREADS, (unsigned long) state.renewals);
+
+    /*
+     * While one thread takes a second to renew the snapshot, reads from other
+     * threads should neither block nor slow down.
+     */
+    for (i = 0; i < SLOW_THREADS; i++) {
+        slow[i].state = &state;
+        slow[i].worst = 0;
+        slow[i].during = 0;
+        if (apr_thread_create(&threads[i], NULL, slow_reader, &slow[i], pool)
+            != APR_SUCCESS)
+            sysbail("cannot create thread");
+    }
+    if (apr_thread_create(&renewer, NULL, slow_renewer, &state, pool)
+        != APR_SUCCESS)
+        sysbail("cannot create thread");
+    apr_thread_join(&status, renewer);
+    worst = 0;
+    during = 0;
+    for (i = 0; i < SLOW_THREADS; i++) {
+        apr_thread_join(&status, threads[i]);
+        if (slow[i].worst > worst)
+            worst = slow[i].worst;
+        during += slow[i].during;
+    }
+    is_int(0, state.errors, "No errors during a slow renewal");
+    ok(during >= SLOW_THREADS, "...with %lu reads during the renewal",
+       during);
+    ok(worst < SLOW_MAX_READ, "...and the slowest read took %lu us",
+       (unsigned long) worst);
+
+    /* Dropping the published snapshot should free everything. */
+    mod_snapshot_publish(&state.slot, NULL, 0);
+    is_int(created, freed, "All %lu snapshots freed", (unsigned long) created);
+
+    apr_pool_destroy(pool);
+    apr_terminate();
+    return 0;
+}